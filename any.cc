@@ -16,6 +16,7 @@
 #include "combat.h"
 #include <vector>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <errno.h>
 
@@ -62,6 +63,9 @@ private:
   Tcl_Obj * ex_Union    (DynamicAny::DynAny_ptr, CORBA::TypeCode_ptr);
   Tcl_Obj * ex_Value    (DynamicAny::DynAny_ptr, CORBA::TypeCode_ptr);
   Tcl_Obj * ex_ValueBox (DynamicAny::DynAny_ptr, CORBA::TypeCode_ptr);
+  Tcl_Obj * ex_Numbers  (DynamicAny::DynAny_ptr, CORBA::TCKind,
+			 CORBA::ULong);
+  Tcl_Obj * ex_Flat     (DynamicAny::DynAny_ptr, CORBA::TypeCode_ptr);
 
   Tcl_Interp * interp;
   Combat::Context * ctx;
@@ -119,6 +123,11 @@ private:
 		      DynamicAny::DynAny_ptr);
   bool pack_ValueBox (Tcl_Obj *, const CORBA::TypeCode_ptr,
 		      DynamicAny::DynAny_ptr);
+  bool pack_Numbers  (const void *, CORBA::ULong,
+		      const CORBA::TypeCode_ptr, CORBA::TCKind,
+		      DynamicAny::DynAny_ptr);
+  bool pack_Flat     (Tcl_Obj *, const CORBA::TypeCode_ptr,
+		      DynamicAny::DynAny_ptr);
 
   Tcl_Interp * interp;
   Combat::Context * ctx;
@@ -130,50 +139,176 @@ private:
  * ----------------------------------------------------------------------
  */
 
+/*
+ * The Any value is kept as received, and a DynAny for it is only
+ * created once a script looks into the value (or if we got the value
+ * as a DynAny in the first place). At least one of both is set, unless
+ * the object has been turned into a string.
+ *
+ * The value itself is never modified, so duplicates of an Any object
+ * share it rather than copying it.
+ */
+
+struct TclAnyValue {
+  TclAnyValue (CORBA::Any *);
+  ~TclAnyValue ();
+
+  int refs;
+  CORBA::Any * value;
+};
+
+TclAnyValue::TclAnyValue (CORBA::Any * _v)
+{
+  refs = 1;
+  value = _v;
+}
+
+TclAnyValue::~TclAnyValue ()
+{
+  delete value;
+}
+
 struct TclAnyData {
+  TclAnyData (Tcl_Interp *, Combat::Context *, CORBA::Any *);
   TclAnyData (Tcl_Interp *, Combat::Context *, DynamicAny::DynAny_ptr);
-  TclAnyData (const TclAnyData &);
+  TclAnyData (TclAnyData &);
   ~TclAnyData ();
 
+  bool empty ();
+  CORBA::TypeCode_ptr type ();
+  const CORBA::Any & any ();
+  DynamicAny::DynAny_ptr dynany ();
+  void release ();
+
   Tcl_Interp * interp;
   Combat::Context * ctx;
-  DynamicAny::DynAny_var any;
+  TclAnyValue * shared;
+  DynamicAny::DynAny_var dyn;
   Tcl_Obj * unrolled;
 };
 
+TclAnyData::TclAnyData (Tcl_Interp * _i, Combat::Context * _c,
+			CORBA::Any * _a)
+{
+  interp = _i;
+  ctx = _c;
+  shared = new TclAnyValue (_a);
+  dyn = DynamicAny::DynAny::_nil ();
+  unrolled = NULL;
+}
+
 TclAnyData::TclAnyData (Tcl_Interp * _i, Combat::Context * _c,
 			DynamicAny::DynAny_ptr _a)
 {
   interp = _i;
   ctx = _c;
-  any = _a;
+  shared = NULL;
+  dyn = _a;
   unrolled = NULL;
 }
 
-TclAnyData::TclAnyData (const TclAnyData & other)
+/*
+ * Share the other object's value, extracting it from its DynAny first
+ * if necessary
+ */
+
+TclAnyData::TclAnyData (TclAnyData & other)
 {
   interp = other.interp;
   ctx = other.ctx;
-  if (!CORBA::is_nil (other.any.in())) {
-    any = other.any->copy();
-    assert (!CORBA::is_nil (any));
-  }
-  else {
-    any = DynamicAny::DynAny::_nil ();
-  }
+  shared = NULL;
+  dyn = DynamicAny::DynAny::_nil ();
   unrolled = NULL;
+
+  if (!other.empty ()) {
+    other.any ();
+    shared = other.shared;
+    shared->refs++;
+    Combat::GetStats()->anycopiesavoided++;
+  }
 }
 
 TclAnyData::~TclAnyData ()
 {
-  if (!CORBA::is_nil (any)) {
-    any->destroy ();
-  }
+  release ();
   if (unrolled) {
     Tcl_DecrRefCount (unrolled);
   }
 }
 
+bool
+TclAnyData::empty ()
+{
+  return shared == NULL && CORBA::is_nil (dyn);
+}
+
+CORBA::TypeCode_ptr
+TclAnyData::type ()
+{
+  assert (!empty ());
+  return shared ? shared->value->type () : dyn->type ();
+}
+
+const CORBA::Any &
+TclAnyData::any ()
+{
+  assert (!empty ());
+  if (shared == NULL) {
+    shared = new TclAnyValue (dyn->to_any ());
+  }
+  return *shared->value;
+}
+
+DynamicAny::DynAny_ptr
+TclAnyData::dynany ()
+{
+  assert (!empty ());
+  if (CORBA::is_nil (dyn)) {
+    dyn = Combat::GlobalData->daf->create_dyn_any (*shared->value);
+  }
+  return dyn.in();
+}
+
+void
+TclAnyData::release ()
+{
+  if (!CORBA::is_nil (dyn)) {
+    dyn->destroy ();
+    dyn = DynamicAny::DynAny::_nil ();
+  }
+  if (shared && --shared->refs == 0) {
+    delete shared;
+  }
+  shared = NULL;
+}
+
+/*
+ * Unroll an Any object, using its marshalling plan if possible. This
+ * works on the Any value directly, so that the DynAny is only created
+ * if there is no usable plan.
+ */
+
+static Tcl_Obj *
+UnrollAny (TclAnyData * objInf, bool recurse)
+{
+  CORBA::TypeCode_var tc = objInf->type ();
+  Combat::MarshalPlan * plan = Combat::MarshalPlan::Lookup (tc.in(), true);
+  Tcl_Obj * res = NULL;
+
+  if (plan->usable ()) {
+    res = plan->Unpack (objInf->interp, objInf->ctx, objInf->any());
+  }
+
+  plan->deref ();
+
+  if (res == NULL) {
+    Combat_Extractor ex (objInf->interp, objInf->ctx, recurse);
+    res = ex.Extract (objInf->dynany());
+  }
+
+  return res;
+}
+
 extern "C" {
 
 /*
@@ -211,9 +346,7 @@ Combat_ListFromAny (Tcl_Interp * interp, Tcl_Obj * obj)
     objInf->unrolled = NULL;
   }
   else {
-    assert (!CORBA::is_nil (objInf->any));
-    Combat_Extractor ex (objInf->interp, objInf->ctx);
-    res = ex.Extract (objInf->any);
+    res = UnrollAny (objInf, false);
   }
   assert (res->refCount == 0);
 
@@ -280,9 +413,7 @@ TclAny_UpdateString (Tcl_Obj * obj)
    */
 
   if (!objInf->unrolled) {
-    assert (!CORBA::is_nil (objInf->any));
-    Combat_Extractor ex (objInf->interp, objInf->ctx, true);
-    objInf->unrolled = ex.Extract (objInf->any);
+    objInf->unrolled = UnrollAny (objInf, true);
   }
 
   /*
@@ -295,13 +426,10 @@ TclAny_UpdateString (Tcl_Obj * obj)
 
   /*
    * If we're being used as a string, we probably don't need the Any data
-   * anymore, so release the DynAny
+   * anymore, so release the value and the DynAny
    */
 
-  if (!CORBA::is_nil (objInf->any)) {
-    objInf->any->destroy ();
-    objInf->any = DynamicAny::DynAny::_nil ();
-  }
+  objInf->release ();
 
   /*
    * Steal the string rep
@@ -364,6 +492,20 @@ Tcl_ObjType Combat::AnyType = {
 };
 #endif
 
+/*
+ * Whether a plan is for an unbounded octet or char sequence, which is
+ * kept in a shared buffer
+ */
+
+static bool
+IsOctetSeqPlan (Combat::MarshalPlan * plan)
+{
+  return (plan->kind() == CORBA::tk_sequence && plan->described() &&
+	  plan->length() == 0 &&
+	  (plan->content_kind() == CORBA::tk_octet ||
+	   plan->content_kind() == CORBA::tk_char));
+}
+
 /*
  * Create a new Any object. The Any is not consumed
  *
@@ -373,120 +515,54 @@ Tcl_ObjType Combat::AnyType = {
  * representation, loosing our CmdType information.
  */
 
-static bool
-ContainsAnyObjectReference (CORBA::TypeCode_ptr tc)
-{
-  CORBA::TypeCode_var ctc;
-  static std::vector<void*> recursion;
-
-  switch (tc->kind()) {
-  case CORBA::tk_objref:
-    return true;
-  case CORBA::tk_struct:
-  case CORBA::tk_except:
-  case CORBA::tk_union:
-  case CORBA::tk_value:
-    {
-      for (CORBA::ULong idx=0; idx<recursion.size(); idx++) {
-	if ((void *) tc == recursion[idx]) {
-	  return false;
-	}
-      }
-
-      recursion.push_back ((void *) tc);
-
-      CORBA::ULong len = tc->member_count();
-      for (CORBA::ULong i=0; i<len; i++) {
-	ctc = tc->member_type (i);
-
-	if (ContainsAnyObjectReference (ctc.in())) {
-	  recursion.pop_back ();
-	  return true;
-	}
-	else if (ctc->kind() == CORBA::tk_objref) {
-	  recursion.pop_back ();
-	  return true;
-	}
-      }
-      recursion.pop_back ();
-    }
-    break;
-  case CORBA::tk_sequence:
-  case CORBA::tk_array:
-  case CORBA::tk_value_box:
-    ctc = tc->content_type ();
-    return ContainsAnyObjectReference (ctc.in());
-  case CORBA::tk_alias:
-    ctc = tc->content_type ();
-    return ContainsAnyObjectReference (ctc.in());
-  }
-  return false;
-}
-
 Tcl_Obj *
 Combat::NewAnyObj (Tcl_Interp * interp, Context * ctx,
 		   const CORBA::Any & any)
 {
   CORBA::TypeCode_var tc = any.type ();
+  MarshalPlan * plan = MarshalPlan::Lookup (tc.in(), true);
+  Tcl_Obj * res = NewAnyObj (interp, ctx, any, plan);
+  plan->deref ();
+  return res;
+}
+
+/*
+ * Same as above, with the plan for the Any's type at hand
+ */
 
+Tcl_Obj *
+Combat::NewAnyObj (Tcl_Interp * interp, Context * ctx,
+		   const CORBA::Any & any, MarshalPlan * plan)
+{
   /*
    * Shortcut for sequence<octet> to avoid all the conversions between
    * Any and DynAny. For the moment, this only works with MICO, which
-   * provides Any insertion and extraction for CORBA::OctetSeq
+   * provides Any extraction for CORBA::OctetSeq. The value is kept in
+   * a shared buffer rather than copied into a byte array.
    */
 
-#if !defined(COMBAT_USE_ORBACUS) && !defined(COMBAT_USE_ORBIX)
-  CORBA::TypeCode_var uatc = CORBA::TypeCode::_duplicate (tc);
-  while (uatc->kind() == CORBA::tk_alias)
-    uatc = uatc->content_type ();
-
-  if (uatc->kind() == CORBA::tk_sequence && uatc->length() == 0) {
-    CORBA::TypeCode_var ctc = uatc->content_type ();
-    while (ctc->kind() == CORBA::tk_alias)
-      ctc = ctc->content_type ();
-
-    if (ctc->kind() == CORBA::tk_octet || ctc->kind() == CORBA::tk_char) {
-      CORBA::OctetSeq os;
-      CORBA::CharSeq cs;
-      CORBA::Octet * buf;
-      CORBA::ULong len;
-      CORBA::Boolean r;
-
-      switch (ctc->kind()) {
-      case CORBA::tk_octet:
-	{
-	  r = (any >>= os);
-	  assert (r);
-	  len = os.length ();
-	  buf = len ? os.get_buffer() : NULL;
-	}
-	break;
-      case CORBA::tk_char:
-	{
-	  r = (any >>= cs);
-	  assert (r);
-	  len = cs.length ();
-	  buf = (CORBA::Octet *) (len ? cs.get_buffer() : NULL);
-	}
-	break;
-      }
-#if TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION == 0
-      return Tcl_NewStringObj ((char *) buf, len);
-#else
-      return Tcl_NewByteArrayObj ((unsigned char *) buf, len);
-#endif
+  if (IsOctetSeqPlan (plan)) {
+    Tcl_Obj * res = NewOctetSeqObj (any, plan->content_kind());
+    if (res) {
+      return res;
     }
   }
-#endif
 
   /*
-   * Create a CORBA::Any object
+   * Values with object references are unrolled right away, preferably
+   * by their marshalling plan
    */
 
-  DynamicAny::DynAny_ptr dynany =
-    Combat::GlobalData->daf->create_dyn_any (any);
+  if (plan->has_objref ()) {
+    Tcl_Obj * res = plan->Unpack (interp, ctx, any);
+    if (res) {
+      return res;
+    }
+  }
 
-  if (ContainsAnyObjectReference (tc.in())) {
+  if (plan->has_objref ()) {
+    DynamicAny::DynAny_ptr dynany =
+      Combat::GlobalData->daf->create_dyn_any (any);
     Combat_Extractor ex (interp, ctx);
     Tcl_Obj * res = ex.Extract (dynany);
     dynany->destroy ();
@@ -494,8 +570,13 @@ Combat::NewAnyObj (Tcl_Interp * interp, Context * ctx,
     return res;
   }
 
+  /*
+   * Create a CORBA::Any object. It just holds a copy of the value; a
+   * DynAny is only made if the value is looked into.
+   */
+
   Tcl_Obj * obj = Tcl_NewObj ();
-  TclAnyData * objInf = new TclAnyData (interp, ctx, dynany);
+  TclAnyData * objInf = new TclAnyData (interp, ctx, new CORBA::Any (any));
 
   assert (obj && objInf);
 
@@ -507,12 +588,117 @@ Combat::NewAnyObj (Tcl_Interp * interp, Context * ctx,
   return obj;
 }
 
+/*
+ * Same as above, for the value of a request's argument or result. An
+ * octet or char sequence is not copied out of the request's Any, but
+ * the Any is kept with the object.
+ */
+
+Tcl_Obj *
+Combat::NewAnyObj (Tcl_Interp * interp, Context * ctx,
+		   CORBA::NamedValue_ptr nv)
+{
+  CORBA::TypeCode_var tc = nv->value()->type ();
+  MarshalPlan * plan = MarshalPlan::Lookup (tc.in(), true);
+  Tcl_Obj * res = NewAnyObj (interp, ctx, nv, plan);
+  plan->deref ();
+  return res;
+}
+
+Tcl_Obj *
+Combat::NewAnyObj (Tcl_Interp * interp, Context * ctx,
+		   CORBA::NamedValue_ptr nv, MarshalPlan * plan)
+{
+  if (IsOctetSeqPlan (plan)) {
+    Tcl_Obj * res = NewOctetSeqObj (nv, plan->content_kind());
+    if (res) {
+      return res;
+    }
+  }
+
+  return NewAnyObj (interp, ctx, *nv->value(), plan);
+}
+
 Tcl_Obj *
 Combat::NewAnyObj (const CORBA::Any & any)
 {
   return NewAnyObj (NULL, NULL, any);
 }
 
+/*
+ * If data holds an Any of the requested type, return its internal rep
+ */
+
+static TclAnyData *
+FindAnyRep (Tcl_Obj * data, const CORBA::TypeCode_ptr tc)
+{
+  if (data->typePtr != &Combat::AnyType) {
+    return NULL;
+  }
+
+  TclAnyData * objInf = (TclAnyData *) data->internalRep.otherValuePtr;
+
+  if (objInf->empty ()) {
+    return NULL;
+  }
+
+  CORBA::TypeCode_var objtc = objInf->type ();
+
+  if (!tc->equal (objtc)) {
+    return NULL;
+  }
+
+  return objInf;
+}
+
+/*
+ * If data holds an Any of the requested type, return that value. It
+ * remains owned by data, and is valid as long as data's internal rep
+ * is not changed.
+ */
+
+const CORBA::Any *
+Combat::GetAnyRef (Tcl_Obj * data, const CORBA::TypeCode_ptr tc)
+{
+  const CORBA::Any * src = GetOctetSeqAny (data, tc);
+
+  if (src) {
+    return src;
+  }
+
+  TclAnyData * objInf = FindAnyRep (data, tc);
+
+  if (objInf == NULL) {
+    return NULL;
+  }
+
+  GetStats()->anycopiesavoided++;
+  return &objInf->any ();
+}
+
+/*
+ * Same as above, but return a copy of the value, for the ORB interfaces
+ * that take ownership of an Any
+ */
+
+CORBA::Any *
+Combat::GetAnyRep (Tcl_Obj * data, const CORBA::TypeCode_ptr tc)
+{
+  const CORBA::Any * src = GetOctetSeqAny (data, tc);
+
+  if (src) {
+    return new CORBA::Any (*src);
+  }
+
+  TclAnyData * objInf = FindAnyRep (data, tc);
+
+  if (objInf == NULL) {
+    return NULL;
+  }
+
+  return new CORBA::Any (objInf->any ());
+}
+
 /*
  * Get an Any value from a Tcl_Obj. Either use our tclAnyType internal
  * representation, or try to convert the string to an any
@@ -523,7 +709,24 @@ Combat::GetAnyFromObj (Tcl_Interp * interp,
 		       Context * ctx, Tcl_Obj * data,
 		       const CORBA::TypeCode_ptr tc)
 {
+  MarshalPlan * plan = MarshalPlan::Lookup (tc);
+  CORBA::Any * res = GetAnyFromObj (interp, ctx, data, plan);
+  plan->deref ();
+  return res;
+}
+
+/*
+ * Same as above, with the plan for the requested type at hand
+ */
+
+CORBA::Any *
+Combat::GetAnyFromObj (Tcl_Interp * interp,
+		       Context * ctx, Tcl_Obj * data,
+		       MarshalPlan * plan)
+{
+  CORBA::TypeCode_ptr tc = plan->typecode ();
   TclAnyData * objInf;
+  CORBA::Any * res;
 
   /*
    * If data is already an any object, and the typecodes match,
@@ -533,15 +736,8 @@ Combat::GetAnyFromObj (Tcl_Interp * interp,
    * the requested type
    */
 
-  if (data->typePtr == &AnyType) {
-    objInf = (TclAnyData *) data->internalRep.otherValuePtr;
-    if (!CORBA::is_nil (objInf->any)) {
-      CORBA::TypeCode_var objtc = objInf->any->type ();
-
-      if (tc->equal (objtc)) {
-	return objInf->any->to_any ();
-      }
-    }
+  if ((res = GetAnyRep (data, tc)) != NULL) {
+    return res;
   }
 
   /*
@@ -549,42 +745,40 @@ Combat::GetAnyFromObj (Tcl_Interp * interp,
    */
 
 #if !defined(COMBAT_USE_ORBACUS) && !defined(COMBAT_USE_ORBIX)
-  CORBA::TypeCode_var uatc = CORBA::TypeCode::_duplicate (tc);
-  while (uatc->kind() == CORBA::tk_alias)
-    uatc = uatc->content_type ();
-
-  if (uatc->kind() == CORBA::tk_sequence && uatc->length() == 0) {
-    CORBA::TypeCode_var ctc = uatc->content_type ();
-    while (ctc->kind() == CORBA::tk_alias)
-      ctc = ctc->content_type ();
-
-    if (ctc->kind() == CORBA::tk_octet || ctc->kind() == CORBA::tk_char) {
-      CORBA::Octet * buf;
-      int llen;
-#if TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION == 0
-      buf = (CORBA::Octet *) Tcl_GetStringFromObj (data, &llen);
-#else
-      buf = (CORBA::Octet *) Tcl_GetByteArrayFromObj (data, &llen);
-#endif
-      CORBA::Any * any = new CORBA::Any;
-      switch (ctc->kind()) {
-      case CORBA::tk_octet:
-	{
-	  CORBA::OctetSeq os (llen, llen, buf);
-	  *any <<= os;
-	}
-	break;
-      case CORBA::tk_char:
-	{
-	  CORBA::CharSeq cs (llen, llen, (CORBA::Char *) buf);
-	  *any <<= cs;
-	}
+  if (plan->kind() == CORBA::tk_sequence && plan->described() &&
+      plan->length() == 0 &&
+      (plan->content_kind() == CORBA::tk_octet ||
+       plan->content_kind() == CORBA::tk_char)) {
+    int llen;
+    CORBA::Octet * buf = (CORBA::Octet *) GetOctetsFromObj (data, &llen);
+    CORBA::Any * any = new CORBA::Any;
+    switch (plan->content_kind()) {
+    case CORBA::tk_octet:
+      {
+	CORBA::OctetSeq os (llen, llen, buf);
+	*any <<= os;
+      }
+      break;
+    default:
+      {
+	CORBA::CharSeq cs (llen, llen, (CORBA::Char *) buf);
+	*any <<= cs;
       }
-      return any;
     }
+    return any;
   }
 #endif
 
+  /*
+   * Use the compiled marshalling plan for this type, if possible. If
+   * that fails, the DynAny packer below tries again and reports the
+   * error.
+   */
+
+  if ((res = plan->Pack (interp, ctx, data)) != NULL) {
+    return res;
+  }
+
   /*
    * Try to convert it to an any value
    */
@@ -600,8 +794,8 @@ Combat::GetAnyFromObj (Tcl_Interp * interp,
    * Never convert handles
    */
 
-  if (data->typePtr == CmdTypePtr) {
-    CORBA::Any * res = val->to_any ();
+  if (data->typePtr == CmdTypePtr || data->typePtr == &ObjrefType) {
+    res = val->to_any ();
     val->destroy ();
     CORBA::release (val);
     return res;
@@ -626,6 +820,48 @@ Combat::GetAnyFromObj (Tcl_Interp * interp,
   return val->to_any ();
 }
 
+/*
+ * ----------------------------------------------------------------------
+ * Typed sequences of numbers
+ * ----------------------------------------------------------------------
+ *
+ * MICO has Any operators for the sequences of primitive types, which
+ * let us move unbounded sequences of numbers in and out of a DynAny as
+ * a whole. T is one of CORBA::ShortSeq, CORBA::DoubleSeq etc.
+ */
+
+#if defined(COMBAT_USE_MICO)
+
+template<class T>
+static Tcl_Obj *
+ExtractNumbers (Combat::Context * ctx, CORBA::TCKind kind,
+		const CORBA::Any & any)
+{
+  const T * seq;
+
+  if (!(any >>= seq)) {
+    return NULL;
+  }
+
+  return Combat::NewNumbersObj (ctx, kind, seq->get_buffer(),
+				seq->length(), false);
+}
+
+template<class T>
+static void
+InsertNumbers (CORBA::Any & any, const void * buf, CORBA::ULong len,
+	       CORBA::ULong size)
+{
+  T seq (len);
+  seq.length (len);
+  if (len) {
+    memcpy (seq.get_buffer(), buf, len * size);
+  }
+  any <<= seq;
+}
+
+#endif
+
 /*
  * ----------------------------------------------------------------------
  * Extract a potentially complex type to a Tcl object
@@ -845,7 +1081,7 @@ Combat_Extractor::ex_Objref (DynamicAny::DynAny_ptr any, CORBA::TypeCode_ptr tc)
   Tcl_Obj * res;
 
   /*
-   * Map nil references to `0', incarnate others into a handle
+   * Map nil references to `0', others to a combat::objref
    */
 
   CORBA::Object_ptr obj = any->get_reference ();
@@ -855,20 +1091,7 @@ Combat_Extractor::ex_Objref (DynamicAny::DynAny_ptr any, CORBA::TypeCode_ptr tc)
   }
   else {
     assert (ctx);
-    if ((res = Combat::InstantiateObj (interp, ctx, obj)) == NULL) {
-      CORBA::release (obj);
-    }
-    else {
-      /*
-       * Update type info to the type we've seen in the TypeCode
-       */
-
-      const char * objName = Tcl_GetStringFromObj (res, NULL);
-      Combat::Context::ActiveObjTable::iterator ait =
-	ctx->active.find (objName);
-      assert (ait != ctx->active.end());
-      (*ait).second->UpdateType (tc->id());
-    }
+    res = Combat::NewObjrefObj (interp, ctx, obj, tc->id());
   }
 
   return res;
@@ -946,7 +1169,6 @@ Combat_Extractor::ex_Sequence (DynamicAny::DynAny_ptr any, CORBA::TypeCode_ptr t
 
   if (uatc->kind() == CORBA::tk_octet || uatc->kind() == CORBA::tk_char) {
     CORBA::OctetSeq os;
-    CORBA::CharSeq cs;
     CORBA::Octet * buf;
     CORBA::ULong len;
 
@@ -956,74 +1178,95 @@ Combat_Extractor::ex_Sequence (DynamicAny::DynAny_ptr any, CORBA::TypeCode_ptr t
      * typecodes with a different length aren't equivalent, and av>>=os
      * would fail with BAD_TYPECODE. Bummer.
      * And ORBacus does not have an Any extraction operator for OctetSeq.
+     *
+     * The marshalling plan gets around this, if the ORB has a Codec, by
+     * reading the octets from the encoding of the whole sequence.
      */
 
 #if defined(COMBAT_USE_MICO)
-    if (tc->length()) {
+    if (!tc->length()) {
+      res = Combat::NewOctetSeqObj (ds->to_any (), uatc->kind());
+      assert (res);
+      return res;
+    }
 #endif
-      len = ds->get_length();
-      os.length (len);
-      buf = os.get_buffer ();
-      switch (uatc->kind()) {
-      case CORBA::tk_octet:
-	{
-	  for (CORBA::ULong idx=0; idx<len; idx++) {
-	    buf[idx] = ds->get_octet ();
-	    ds->next ();
-	  }
+
+    if ((res = ex_Flat (any, tc)) != NULL) {
+      return res;
+    }
+
+    len = ds->get_length();
+    os.length (len);
+    buf = os.get_buffer ();
+    switch (uatc->kind()) {
+    case CORBA::tk_octet:
+      {
+	for (CORBA::ULong idx=0; idx<len; idx++) {
+	  buf[idx] = ds->get_octet ();
+	  ds->next ();
 	}
-        break;
-      case CORBA::tk_char:
-	{
-	  for (CORBA::ULong idx=0; idx<len; idx++) {
-	    buf[idx] = ds->get_char ();
-	    ds->next ();
-	  }
+      }
+      break;
+    case CORBA::tk_char:
+      {
+	for (CORBA::ULong idx=0; idx<len; idx++) {
+	  buf[idx] = ds->get_char ();
+	  ds->next ();
 	}
-        break;
-      default:
-	assert (0);
       }
-#if defined(COMBAT_USE_MICO)
+      break;
+    default:
+      assert (0);
     }
-    else {
+    return Combat::NewOctetSeqObj (buf, len);
+  }
+
+  /*
+   * Sequences of numbers are extracted in one go. With MICO, unbounded
+   * ones can be taken from the Any as a typed sequence.
+   */
+
+  if (Combat::NumberSize (uatc->kind())) {
+#if defined(COMBAT_USE_MICO)
+    if (!tc->length()) {
       CORBA::Any_var av = ds->to_any ();
-      CORBA::Boolean r;
       switch (uatc->kind()) {
-      case CORBA::tk_octet:
-	{
-	  r = (*av >>= os);
-	  assert (r);
-	  if ((len = os.length ()) > 0) {
-	    buf = os.get_buffer ();
-	  }
-	  else {
-	    buf = NULL;
-	  }
-	}
-        break;
-      case CORBA::tk_char:
-	{
-	  r = (*av >>= cs);
-	  assert (r);
-	  if ((len = cs.length ()) > 0) {
-	    buf = (CORBA::Octet *) cs.get_buffer ();
-	  }
-	  else {
-	    buf = NULL;
-	  }
-	}
-        break;
+      case CORBA::tk_short:
+	res = ExtractNumbers<CORBA::ShortSeq> (ctx, uatc->kind(), av.in());
+	break;
+      case CORBA::tk_long:
+	res = ExtractNumbers<CORBA::LongSeq> (ctx, uatc->kind(), av.in());
+	break;
+      case CORBA::tk_ushort:
+	res = ExtractNumbers<CORBA::UShortSeq> (ctx, uatc->kind(), av.in());
+	break;
+      case CORBA::tk_ulong:
+	res = ExtractNumbers<CORBA::ULongSeq> (ctx, uatc->kind(), av.in());
+	break;
+      case CORBA::tk_longlong:
+	res = ExtractNumbers<CORBA::LongLongSeq> (ctx, uatc->kind(), av.in());
+	break;
+      case CORBA::tk_ulonglong:
+	res = ExtractNumbers<CORBA::ULongLongSeq> (ctx, uatc->kind(), av.in());
+	break;
+      case CORBA::tk_float:
+	res = ExtractNumbers<CORBA::FloatSeq> (ctx, uatc->kind(), av.in());
+	break;
+      case CORBA::tk_double:
+	res = ExtractNumbers<CORBA::DoubleSeq> (ctx, uatc->kind(), av.in());
+	break;
       default:
-	assert (0);
+	res = NULL;
+      }
+      if (res) {
+	return res;
       }
     }
 #endif
-#if TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION == 0
-    return Tcl_NewStringObj ((char *) buf, len);
-#else
-    return Tcl_NewByteArrayObj ((unsigned char *) buf, len);
-#endif
+    if ((res = ex_Flat (any, tc)) != NULL) {
+      return res;
+    }
+    return ex_Numbers (ds.in(), uatc->kind(), ds->get_length());
   }
 
   res = Tcl_NewObj ();
@@ -1061,6 +1304,10 @@ Combat_Extractor::ex_Array (DynamicAny::DynAny_ptr any, CORBA::TypeCode_ptr tc)
     uatc = uatc->content_type ();
 
   if (uatc->kind() == CORBA::tk_octet || uatc->kind() == CORBA::tk_char) {
+    if ((res = ex_Flat (any, tc)) != NULL) {
+      return res;
+    }
+
     CORBA::ULong len = tc->length();
     CORBA::Octet * buf = new CORBA::Octet[len];
     switch (uatc->kind()) {
@@ -1083,31 +1330,106 @@ Combat_Extractor::ex_Array (DynamicAny::DynAny_ptr any, CORBA::TypeCode_ptr tc)
     default:
       assert (0);
     }
-#if TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION == 0
-    res = Tcl_NewStringObj ((char *) buf, len);
-#else
-    res = Tcl_NewByteArrayObj ((unsigned char *) buf, len);
-#endif
-    delete [] buf;
-    return res;
+    res = Combat::NewOctetSeqObj (buf, len);
+    delete [] buf;
+    return res;
+  }
+
+  /*
+   * Arrays of numbers are extracted in one go
+   */
+
+  if (Combat::NumberSize (uatc->kind())) {
+    if ((res = ex_Flat (any, tc)) != NULL) {
+      return res;
+    }
+    return ex_Numbers (any, uatc->kind(), tc->length());
+  }
+
+  res = Tcl_NewObj ();
+
+  for (CORBA::ULong i=tc->length(); i; i--) {
+    DynamicAny::DynAny_var member = any->current_component ();
+    Tcl_Obj * ts;
+    if (recurse) {
+      ts = Extract (member.in());
+    }
+    else {
+      CORBA::Any_var many = member->to_any();
+      ts = Combat::NewAnyObj (interp, ctx, many.in());
+    }
+    Tcl_ListObjAppendElement (NULL, res, ts);
+    any->next();
+  }
+
+  return res;
+}
+
+/*
+ * Extract len numbers from a sequence or array into a buffer of native
+ * values, which then becomes a list or a byte array
+ */
+
+Tcl_Obj *
+Combat_Extractor::ex_Numbers (DynamicAny::DynAny_ptr any, CORBA::TCKind kind,
+			      CORBA::ULong len)
+{
+  std::vector<CORBA::Double> buf ((len * Combat::NumberSize (kind) + 7) / 8);
+  void * dst = len ? &buf[0] : NULL;
+
+  for (CORBA::ULong i=0; i<len; i++) {
+    switch (kind) {
+    case CORBA::tk_short:
+      ((CORBA::Short *) dst)[i] = any->get_short ();
+      break;
+    case CORBA::tk_long:
+      ((CORBA::Long *) dst)[i] = any->get_long ();
+      break;
+    case CORBA::tk_ushort:
+      ((CORBA::UShort *) dst)[i] = any->get_ushort ();
+      break;
+    case CORBA::tk_ulong:
+      ((CORBA::ULong *) dst)[i] = any->get_ulong ();
+      break;
+    case CORBA::tk_longlong:
+      ((CORBA::LongLong *) dst)[i] = any->get_longlong ();
+      break;
+    case CORBA::tk_ulonglong:
+      ((CORBA::ULongLong *) dst)[i] = any->get_ulonglong ();
+      break;
+    case CORBA::tk_float:
+      ((CORBA::Float *) dst)[i] = any->get_float ();
+      break;
+    case CORBA::tk_double:
+      ((CORBA::Double *) dst)[i] = any->get_double ();
+      break;
+    default:
+      assert (0);
+    }
+    any->next ();
   }
 
-  res = Tcl_NewObj ();
+  return Combat::NewNumbersObj (ctx, kind, dst, len, false);
+}
 
-  for (CORBA::ULong i=tc->length(); i; i--) {
-    DynamicAny::DynAny_var member = any->current_component ();
-    Tcl_Obj * ts;
-    if (recurse) {
-      ts = Extract (member.in());
-    }
-    else {
-      CORBA::Any_var many = member->to_any();
-      ts = Combat::NewAnyObj (interp, ctx, many.in());
-    }
-    Tcl_ListObjAppendElement (NULL, res, ts);
-    any->next();
+/*
+ * Extract a sequence or array of a primitive type using its marshalling
+ * plan, which reads all elements from the encoding of the value in one
+ * go. Returns NULL if there is no usable plan.
+ */
+
+Tcl_Obj *
+Combat_Extractor::ex_Flat (DynamicAny::DynAny_ptr any, CORBA::TypeCode_ptr tc)
+{
+  Combat::MarshalPlan * plan = Combat::MarshalPlan::Lookup (tc);
+  Tcl_Obj * res = NULL;
+
+  if (plan->flat () && plan->usable ()) {
+    CORBA::Any_var av = any->to_any ();
+    res = plan->Unpack (interp, ctx, av.in());
   }
 
+  plan->deref ();
   return res;
 }
 
@@ -1442,6 +1764,36 @@ Combat_Extractor::Extract (DynamicAny::DynAny_ptr any, CORBA::TypeCode_ptr tc)
  * ----------------------------------------------------------------------
  */
 
+/*
+ * Find a struct member or enumerator by name. Uses the index of the
+ * type's marshalling plan, unless the type is too deeply nested to
+ * have one.
+ */
+
+static CORBA::Long
+MemberIndex (const CORBA::TypeCode_ptr tc, Tcl_Obj * name)
+{
+  Combat::MarshalPlan * plan = Combat::MarshalPlan::Lookup (tc);
+  CORBA::Long res = -1;
+
+  if (plan->described ()) {
+    res = plan->member_index (name);
+  }
+  else {
+    const char * str = Tcl_GetStringFromObj (name, NULL);
+    CORBA::ULong i, len = tc->member_count ();
+    for (i=0; i<len; i++) {
+      if (strcmp (str, tc->member_name (i)) == 0) {
+	res = i;
+	break;
+      }
+    }
+  }
+
+  plan->deref ();
+  return res;
+}
+
 Combat_Packer::Combat_Packer (Tcl_Interp * _i, Combat::Context * _c)
 {
   interp = _i;
@@ -1452,16 +1804,25 @@ Combat_Packer::Combat_Packer (Tcl_Interp * _i, Combat::Context * _c)
  * Unfortunately, Tcl_GetLongFromObj is buggy in Tcl 8.0; it doesn't
  * complain if the value is too large for a long, but fits an unsigned
  * long.
+ *
+ * Numbers with one of Tcl's numeric internal reps are taken from there
+ * (see GetNativeInteger), the string is only parsed for other objects.
  */
 
 bool
 Combat_Packer::pack_Short (Tcl_Obj * data, DynamicAny::DynAny_ptr da)
 {
+  CORBA::LongLong nval;
   CORBA::Short val;
   unsigned long tval;
   char *tmp, *ptr;
   int oops=0;
 
+  if (Combat::GetNativeInteger (data, CORBA::tk_short, nval)) {
+    da->insert_short ((CORBA::Short) nval);
+    return true;
+  }
+
   tmp = Tcl_GetStringFromObj (data, NULL);
   while (*tmp == ' ') tmp++;
 
@@ -1521,11 +1882,17 @@ Combat_Packer::pack_Short (Tcl_Obj * data, DynamicAny::DynAny_ptr da)
 bool
 Combat_Packer::pack_Long (Tcl_Obj * data, DynamicAny::DynAny_ptr da)
 {
+  CORBA::LongLong nval;
   CORBA::Long val;
   unsigned long tval;
   char *tmp, *ptr;
   int oops=0;
 
+  if (Combat::GetNativeInteger (data, CORBA::tk_long, nval)) {
+    da->insert_long ((CORBA::Long) nval);
+    return true;
+  }
+
   tmp = Tcl_GetStringFromObj (data, NULL);
   while (*tmp == ' ') tmp++;
 
@@ -1589,11 +1956,17 @@ Combat_Packer::pack_Long (Tcl_Obj * data, DynamicAny::DynAny_ptr da)
 bool
 Combat_Packer::pack_UShort (Tcl_Obj * data, DynamicAny::DynAny_ptr da)
 {
+  CORBA::LongLong nval;
   CORBA::UShort val;
   unsigned long tval;
   char *tmp, *ptr;
   int oops=0;
 
+  if (Combat::GetNativeInteger (data, CORBA::tk_ushort, nval)) {
+    da->insert_ushort ((CORBA::UShort) nval);
+    return true;
+  }
+
   errno = 0;
 
   tmp = Tcl_GetStringFromObj (data, NULL);
@@ -1647,11 +2020,17 @@ Combat_Packer::pack_UShort (Tcl_Obj * data, DynamicAny::DynAny_ptr da)
 bool
 Combat_Packer::pack_ULong (Tcl_Obj * data, DynamicAny::DynAny_ptr da)
 {
+  CORBA::LongLong nval;
   CORBA::ULong val;
   unsigned long tval;
   char *tmp, *ptr;
   int oops=0;
 
+  if (Combat::GetNativeInteger (data, CORBA::tk_ulong, nval)) {
+    da->insert_ulong ((CORBA::ULong) nval);
+    return true;
+  }
+
   errno = 0;
 
   tmp = Tcl_GetStringFromObj (data, NULL);
@@ -1709,9 +2088,15 @@ Combat_Packer::pack_ULong (Tcl_Obj * data, DynamicAny::DynAny_ptr da)
 bool
 Combat_Packer::pack_LongLong (Tcl_Obj * data, DynamicAny::DynAny_ptr da)
 {
+  CORBA::LongLong nval;
   long long tval;
   char *tmp;
 
+  if (Combat::GetNativeInteger (data, CORBA::tk_longlong, nval)) {
+    da->insert_longlong (nval);
+    return true;
+  }
+
   tmp = Tcl_GetStringFromObj (data, NULL);
 
   if (sscanf (tmp, "%Ld", &tval) != 1) {
@@ -1731,9 +2116,15 @@ Combat_Packer::pack_LongLong (Tcl_Obj * data, DynamicAny::DynAny_ptr da)
 bool
 Combat_Packer::pack_ULongLong (Tcl_Obj * data, DynamicAny::DynAny_ptr da)
 {
+  CORBA::LongLong nval;
   unsigned long long tval;
   char *tmp;
 
+  if (Combat::GetNativeInteger (data, CORBA::tk_ulonglong, nval)) {
+    da->insert_ulonglong ((CORBA::ULongLong) nval);
+    return true;
+  }
+
   tmp = Tcl_GetStringFromObj (data, NULL);
 
   if (sscanf (tmp, "%Lu", &tval) != 1) {
@@ -1755,7 +2146,8 @@ Combat_Packer::pack_Float (Tcl_Obj * data, DynamicAny::DynAny_ptr da)
 {
   double tval;
 
-  if (Tcl_GetDoubleFromObj (NULL, data, &tval) != TCL_OK) {
+  if (!Combat::GetNativeDouble (data, tval) &&
+      Tcl_GetDoubleFromObj (NULL, data, &tval) != TCL_OK) {
     if (interp) {
       Tcl_ResetResult (interp);
       Tcl_AppendResult (interp, "error: \"",
@@ -1774,7 +2166,8 @@ Combat_Packer::pack_Double (Tcl_Obj * data, DynamicAny::DynAny_ptr da)
 {
   double tval;
 
-  if (Tcl_GetDoubleFromObj (NULL, data, &tval) != TCL_OK) {
+  if (!Combat::GetNativeDouble (data, tval) &&
+      Tcl_GetDoubleFromObj (NULL, data, &tval) != TCL_OK) {
     if (interp) {
       Tcl_ResetResult (interp);
       Tcl_AppendResult (interp, "error: \"",
@@ -1793,7 +2186,8 @@ Combat_Packer::pack_LongDouble (Tcl_Obj * data, DynamicAny::DynAny_ptr da)
 {
   double tval;
 
-  if (Tcl_GetDoubleFromObj (NULL, data, &tval) != TCL_OK) {
+  if (!Combat::GetNativeDouble (data, tval) &&
+      Tcl_GetDoubleFromObj (NULL, data, &tval) != TCL_OK) {
     if (interp) {
       Tcl_ResetResult (interp);
       Tcl_AppendResult (interp, "error: \"",
@@ -1810,8 +2204,14 @@ Combat_Packer::pack_LongDouble (Tcl_Obj * data, DynamicAny::DynAny_ptr da)
 bool
 Combat_Packer::pack_Boolean (Tcl_Obj * data, DynamicAny::DynAny_ptr da)
 {
+  CORBA::LongLong nval;
   int tval;
 
+  if (Combat::GetNativeInteger (data, CORBA::tk_longlong, nval)) {
+    da->insert_boolean ((nval) ? TRUE : FALSE);
+    return true;
+  }
+
   if (Tcl_GetBooleanFromObj (NULL, data, &tval) != TCL_OK) {
     if (interp) {
       Tcl_ResetResult (interp);
@@ -1857,7 +2257,7 @@ Combat_Packer::pack_Octet (Tcl_Obj * data, DynamicAny::DynAny_ptr da)
   tmp = Tcl_GetStringFromObj (data, &len);
 #else
   unsigned char * tmp;
-  tmp = Tcl_GetByteArrayFromObj (data, &len);
+  tmp = Combat::GetByteArrayFromObj (data, &len);
 #endif
 
   if (len != 1) {
@@ -1969,17 +2369,24 @@ bool
 Combat_Packer::pack_Objref (Tcl_Obj * data, const CORBA::TypeCode_ptr tc,
 			    DynamicAny::DynAny_ptr da)
 {
-  const char * str = Tcl_GetStringFromObj (data, NULL);
+  CORBA::Object_ptr ref = Combat::GetObjrefFromObj (data);
   CORBA::Object_var obj;
+  Combat::Object * tobj = NULL;		// handle given by name
+  const char * str;
 
   assert (interp);
   assert (ctx);
 
   /*
-   * We accept a "0" as nil reference or a handle
+   * We accept a "0" as nil reference or a handle. References from
+   * results are passed on without making a handle.
    */
 
-  if (str[0] == '0' && str[1] == '\0') {
+  if (!CORBA::is_nil (ref)) {
+    obj = CORBA::Object::_duplicate (ref);
+  }
+  else if ((str = Tcl_GetStringFromObj (data, NULL))[0] == '0' &&
+	   str[1] == '\0') {
     obj = CORBA::Object::_nil ();
   }
   else {
@@ -1991,7 +2398,7 @@ Combat_Packer::pack_Objref (Tcl_Obj * data, const CORBA::TypeCode_ptr tc,
       return false;
     }
 
-    Combat::Object * tobj = (Combat::Object *) info.objClientData;
+    tobj = (Combat::Object *) info.objClientData;
 
     if (CORBA::is_nil (tobj->obj)) {
       Tcl_ResetResult (interp);
@@ -2002,10 +2409,17 @@ Combat_Packer::pack_Objref (Tcl_Obj * data, const CORBA::TypeCode_ptr tc,
     obj = CORBA::Object::_duplicate (tobj->obj);
   }
 
+  /*
+   * The check remembers the object's answer, so a value that the plan
+   * rejected for its type is not asked about twice
+   */
+
 #if defined(COMBAT_USE_ORBACUS) && OB_INTEGER_VERSION >= 4010000
   if (strcmp (tc->id(), "IDL:omg.org/CORBA/Object:1.0") != 0)
 #endif
-  if (!CORBA::is_nil (obj) && !obj->_is_a (tc->id())) {
+  if (!CORBA::is_nil (obj) &&
+      !(tobj ? Combat::ObjrefIsA (tobj, tc->id()) :
+	Combat::ObjrefIsA (data, tc->id()))) {
     if (interp) {
       Tcl_ResetResult (interp);
       Tcl_AppendResult (interp, "error: illegal type for object reference: ",
@@ -2165,50 +2579,46 @@ Combat_Packer::pack_Struct (Tcl_Obj * data, const CORBA::TypeCode_ptr tc,
    * can be pushed into the any value.
    */
 
-  CORBA::ULong * scramble = new CORBA::ULong [len];
+  CORBA::ULong sbuf[COMBAT_INLINE_MEMBERS];
+  std::vector<CORBA::ULong> heap;
+  CORBA::ULong * scramble = sbuf;
+
+  if (len > COMBAT_INLINE_MEMBERS) {
+    heap.resize (len);
+    scramble = &heap[0];
+  }
 
   for (i=0; i<len; i++) {
     scramble[i] = (CORBA::ULong) -1;
   }
 
   for (i=0; i<len; i++) {
-    const char * name, * mname;
+    const char * name;
     CORBA::ULong member;
+    CORBA::Long idx;
     Tcl_Obj * mno;
 
     r = (Tcl_ListObjIndex (NULL, data, 2*i, &mno) == TCL_OK);
     assert (r);
 
-    name  = Tcl_GetStringFromObj (mno, NULL);
-    mname = tc->member_name (i);
-
-    if (strcmp (name, mname) == 0) {
-      member = i;
-    }
-    else {
-      for (member=0; member<len; member++) {
-	mname = tc->member_name (member);
-	if (strcmp (name, mname) == 0) {
-	  break;
-	}
-      }
-      if (member >= len) {
-	if (interp) {
-	  Tcl_ResetResult (interp);
-	  Tcl_AppendResult (interp, "error: \"", name,
-			    "\" is not a member of \"", name, " ",
-			    tc->name(), "\"", NULL);
-	  Tcl_AddErrorInfo (interp, "\n  while packing \"");
-	  Tcl_AddErrorInfo (interp, name);
-	  Tcl_AddErrorInfo (interp, " ");
-	  Tcl_AddErrorInfo (interp, tc->name());
-	  Tcl_AddErrorInfo (interp, "\" from \"");
-	  Tcl_AddErrorInfo (interp, Tcl_GetStringFromObj (data, NULL));
-	  Tcl_AddErrorInfo (interp, "\"");
-	}
-	delete [] scramble;
-	return false;
+    name = Tcl_GetStringFromObj (mno, NULL);
+    idx  = MemberIndex (tc, mno);
+    member = (idx < 0) ? len : (CORBA::ULong) idx;
+    if (member >= len) {
+      if (interp) {
+	Tcl_ResetResult (interp);
+	Tcl_AppendResult (interp, "error: \"", name,
+			  "\" is not a member of \"", name, " ",
+			  tc->name(), "\"", NULL);
+	Tcl_AddErrorInfo (interp, "\n  while packing \"");
+	Tcl_AddErrorInfo (interp, name);
+	Tcl_AddErrorInfo (interp, " ");
+	Tcl_AddErrorInfo (interp, tc->name());
+	Tcl_AddErrorInfo (interp, "\" from \"");
+	Tcl_AddErrorInfo (interp, Tcl_GetStringFromObj (data, NULL));
+	Tcl_AddErrorInfo (interp, "\"");
       }
+      return false;
     }
 
     if (scramble[member] != (CORBA::ULong) -1) {
@@ -2224,7 +2634,6 @@ Combat_Packer::pack_Struct (Tcl_Obj * data, const CORBA::TypeCode_ptr tc,
 	Tcl_AddErrorInfo (interp, Tcl_GetStringFromObj (data, NULL));
 	Tcl_AddErrorInfo (interp, "\"");
       }
-      delete [] scramble;
       return false;
     }
 
@@ -2254,14 +2663,12 @@ Combat_Packer::pack_Struct (Tcl_Obj * data, const CORBA::TypeCode_ptr tc,
 	Tcl_AddErrorInfo (interp, tc->name());
 	Tcl_AddErrorInfo (interp, "\"");
       }
-      delete [] scramble;
       return false;
     }
 
     res->next ();
   }
 
-  delete [] scramble;
   return true;
 }
 
@@ -2339,12 +2746,8 @@ Combat_Packer::pack_Sequence (Tcl_Obj * data, const CORBA::TypeCode_ptr tc,
     uatc = uatc->content_type ();
 
   if (uatc->kind() == CORBA::tk_octet || uatc->kind() == CORBA::tk_char) {
-    CORBA::Octet * buf;
-#if TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION == 0
-    buf = (CORBA::Octet *) Tcl_GetStringFromObj (data, &llen);
-#else
-    buf = (CORBA::Octet *) Tcl_GetByteArrayFromObj (data, &llen);
-#endif
+    CORBA::Octet * buf =
+      (CORBA::Octet *) Combat::GetOctetsFromObj (data, &llen);
     if (tc->length() && (CORBA::ULong) llen > tc->length()) {
       if (interp) {
 	Tcl_Obj * name = Combat::NewTypeCodeObj (tc);
@@ -2365,11 +2768,17 @@ Combat_Packer::pack_Sequence (Tcl_Obj * data, const CORBA::TypeCode_ptr tc,
      * typecodes with a different length aren't equivalent, and from_any
      * would fail with BAD_TYPECODE. Bummer.
      * And ORBacus does not have an Any insertion operator for OctetSeq.
+     *
+     * The marshalling plan gets around this, if the ORB has a Codec, by
+     * producing an Any for the whole sequence in one go.
      */
 
 #if defined(COMBAT_USE_MICO)
     if (tc->length()) {
 #endif
+      if (pack_Flat (data, tc, da)) {
+	return true;
+      }
       res->set_length (llen);
       switch (uatc->kind()) {
       case CORBA::tk_octet:
@@ -2394,6 +2803,18 @@ Combat_Packer::pack_Sequence (Tcl_Obj * data, const CORBA::TypeCode_ptr tc,
       return true;
 #if defined(COMBAT_USE_MICO)
     }
+
+    /*
+     * A sequence that we received as this type is passed on as it is
+     */
+
+    const CORBA::Any * src = Combat::GetOctetSeqAny (data, tc);
+
+    if (src) {
+      res->from_any (*src);
+      return true;
+    }
+
     CORBA::Any any;
     switch (uatc->kind()) {
     case CORBA::tk_octet:
@@ -2416,6 +2837,38 @@ Combat_Packer::pack_Sequence (Tcl_Obj * data, const CORBA::TypeCode_ptr tc,
 #endif
   }
 
+  /*
+   * Sequences of numbers can come from a byte array that holds them
+   * in native byte order
+   */
+
+  CORBA::ULong nsize = Combat::NumberSize (uatc->kind());
+
+  if (nsize && pack_Flat (data, tc, da)) {
+    return true;
+  }
+
+#if !(TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION == 0)
+  if (nsize && Combat::IsPureOctets (data)) {
+    unsigned char * buf =
+      (unsigned char *) Combat::GetOctetsFromObj (data, &llen);
+    if (llen % nsize == 0) {
+      if (tc->length() && (CORBA::ULong) llen / nsize > tc->length()) {
+	if (interp) {
+	  Tcl_Obj * name = Combat::NewTypeCodeObj (tc);
+	  Tcl_ResetResult (interp);
+	  Tcl_AppendResult (interp, "error: byte array exceeds bound of \"",
+			    Tcl_GetStringFromObj (name, NULL),
+			    "\"", NULL);
+	  Tcl_DecrRefCount (name);
+	}
+	return false;
+      }
+      return pack_Numbers (buf, llen / nsize, tc, uatc->kind(), res.in());
+    }
+  }
+#endif
+
   if (Tcl_ListObjLength (NULL, data, &llen) != TCL_OK) {
     if (interp) {
       Tcl_Obj * name = Combat::NewTypeCodeObj (tc);
@@ -2445,6 +2898,23 @@ Combat_Packer::pack_Sequence (Tcl_Obj * data, const CORBA::TypeCode_ptr tc,
     return false;
   }
 
+  /*
+   * Convert numbers in one go. If one of them does not fit, the loop
+   * below finds it again and reports the error.
+   */
+
+  if (nsize && llen > 0) {
+    std::vector<CORBA::Double> buf ((llen * nsize + 7) / 8);
+    Tcl_Obj ** elems;
+
+    r = (Tcl_ListObjGetElements (NULL, data, &llen, &elems) == TCL_OK);
+    assert (r);
+
+    if (Combat::GetNumbers (elems, llen, uatc->kind(), &buf[0])) {
+      return pack_Numbers (&buf[0], llen, tc, uatc->kind(), res.in());
+    }
+  }
+
   res->set_length (llen);
   for (i=0; i<llen; i++) {
     r = (Tcl_ListObjIndex (NULL, data, i, &ts) == TCL_OK);
@@ -2494,12 +2964,8 @@ Combat_Packer::pack_Array (Tcl_Obj * data, const CORBA::TypeCode_ptr tc,
     uatc = uatc->content_type ();
 
   if (uatc->kind() == CORBA::tk_octet || uatc->kind() == CORBA::tk_char) {
-    CORBA::Octet * buf;
-#if TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION == 0
-    buf = (CORBA::Octet *) Tcl_GetStringFromObj (data, &llen);
-#else
-    buf = (CORBA::Octet *) Tcl_GetByteArrayFromObj (data, &llen);
-#endif
+    CORBA::Octet * buf =
+      (CORBA::Octet *) Combat::GetOctetsFromObj (data, &llen);
     if (tc->length() != (CORBA::ULong) llen) {
       if (interp) {
 	Tcl_Obj * name = Combat::NewTypeCodeObj (tc);
@@ -2513,6 +2979,9 @@ Combat_Packer::pack_Array (Tcl_Obj * data, const CORBA::TypeCode_ptr tc,
       }
       return false;
     }
+    if (pack_Flat (data, tc, da)) {
+      return true;
+    }
     switch (uatc->kind()) {
     case CORBA::tk_octet:
       {
@@ -2536,6 +3005,27 @@ Combat_Packer::pack_Array (Tcl_Obj * data, const CORBA::TypeCode_ptr tc,
     return true;
   }
 
+  /*
+   * Arrays of numbers can come from a byte array that holds them in
+   * native byte order
+   */
+
+  CORBA::ULong nsize = Combat::NumberSize (uatc->kind());
+
+  if (nsize && pack_Flat (data, tc, da)) {
+    return true;
+  }
+
+#if !(TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION == 0)
+  if (nsize && Combat::IsPureOctets (data)) {
+    unsigned char * buf =
+      (unsigned char *) Combat::GetOctetsFromObj (data, &llen);
+    if ((CORBA::ULong) llen == nsize * tc->length()) {
+      return pack_Numbers (buf, tc->length(), tc, uatc->kind(), res.in());
+    }
+  }
+#endif
+
   if (Tcl_ListObjLength (NULL, data, &llen) != TCL_OK) {
     if (interp) {
       Tcl_Obj * name = Combat::NewTypeCodeObj (tc);
@@ -2565,6 +3055,23 @@ Combat_Packer::pack_Array (Tcl_Obj * data, const CORBA::TypeCode_ptr tc,
     return false;
   }
 
+  /*
+   * Convert numbers in one go. If one of them does not fit, the loop
+   * below finds it again and reports the error.
+   */
+
+  if (nsize && llen > 0) {
+    std::vector<CORBA::Double> buf ((llen * nsize + 7) / 8);
+    Tcl_Obj ** elems;
+
+    r = (Tcl_ListObjGetElements (NULL, data, &llen, &elems) == TCL_OK);
+    assert (r);
+
+    if (Combat::GetNumbers (elems, llen, uatc->kind(), &buf[0])) {
+      return pack_Numbers (&buf[0], llen, tc, uatc->kind(), res.in());
+    }
+  }
+
   for (i=0; i<llen; i++) {
     r = (Tcl_ListObjIndex (NULL, data, i, &ts) == TCL_OK);
     assert (r);
@@ -2592,19 +3099,174 @@ Combat_Packer::pack_Array (Tcl_Obj * data, const CORBA::TypeCode_ptr tc,
   return true;
 }
 
+/*
+ * Pack a sequence or array of a primitive type using its marshalling
+ * plan, which copies octets and converts numbers in one go, and insert
+ * the result as a whole. DynAny has no other way of doing that for
+ * bounded sequences and arrays. Returns false if there is no usable
+ * plan or if the value does not fit; the caller then tries again and
+ * reports the error.
+ */
+
+bool
+Combat_Packer::pack_Flat (Tcl_Obj * data, const CORBA::TypeCode_ptr tc,
+			  DynamicAny::DynAny_ptr da)
+{
+  Combat::MarshalPlan * plan = Combat::MarshalPlan::Lookup (tc);
+  CORBA::Any * any = plan->flat () ? plan->Pack (interp, ctx, data) : NULL;
+
+  plan->deref ();
+
+  if (any == NULL) {
+    return false;
+  }
+
+  da->from_any (*any);
+  delete any;
+  return true;
+}
+
+/*
+ * Insert len numbers from a buffer of native values into a sequence or
+ * array, without creating a DynAny for each element
+ */
+
+bool
+Combat_Packer::pack_Numbers (const void * buf, CORBA::ULong len,
+			     const CORBA::TypeCode_ptr tc, CORBA::TCKind kind,
+			     DynamicAny::DynAny_ptr da)
+{
+  const CORBA::Octet * src = (const CORBA::Octet *) buf;
+  CORBA::ULong size = Combat::NumberSize (kind);
+
+  /*
+   * Unbounded sequences can be inserted as a whole with MICO, see the
+   * comment about octet sequences in pack_Sequence
+   */
+
+#if defined(COMBAT_USE_MICO)
+  if (tc->kind() == CORBA::tk_sequence && !tc->length()) {
+    CORBA::Any any;
+    switch (kind) {
+    case CORBA::tk_short:
+      InsertNumbers<CORBA::ShortSeq> (any, buf, len, size);
+      break;
+    case CORBA::tk_long:
+      InsertNumbers<CORBA::LongSeq> (any, buf, len, size);
+      break;
+    case CORBA::tk_ushort:
+      InsertNumbers<CORBA::UShortSeq> (any, buf, len, size);
+      break;
+    case CORBA::tk_ulong:
+      InsertNumbers<CORBA::ULongSeq> (any, buf, len, size);
+      break;
+    case CORBA::tk_longlong:
+      InsertNumbers<CORBA::LongLongSeq> (any, buf, len, size);
+      break;
+    case CORBA::tk_ulonglong:
+      InsertNumbers<CORBA::ULongLongSeq> (any, buf, len, size);
+      break;
+    case CORBA::tk_float:
+      InsertNumbers<CORBA::FloatSeq> (any, buf, len, size);
+      break;
+    case CORBA::tk_double:
+      InsertNumbers<CORBA::DoubleSeq> (any, buf, len, size);
+      break;
+    default:
+      assert (0);
+    }
+    da->from_any (any);
+    return true;
+  }
+#endif
+
+  if (tc->kind() == CORBA::tk_sequence) {
+    DynamicAny::DynSequence_var ds = DynamicAny::DynSequence::_narrow (da);
+    ds->set_length (len);
+  }
+
+  /*
+   * The buffer may be a byte array, so don't rely on its alignment
+   */
+
+  for (CORBA::ULong i=0; i<len; i++, src+=size) {
+    switch (kind) {
+    case CORBA::tk_short:
+      {
+	CORBA::Short val;
+	memcpy (&val, src, size);
+	da->insert_short (val);
+      }
+      break;
+    case CORBA::tk_long:
+      {
+	CORBA::Long val;
+	memcpy (&val, src, size);
+	da->insert_long (val);
+      }
+      break;
+    case CORBA::tk_ushort:
+      {
+	CORBA::UShort val;
+	memcpy (&val, src, size);
+	da->insert_ushort (val);
+      }
+      break;
+    case CORBA::tk_ulong:
+      {
+	CORBA::ULong val;
+	memcpy (&val, src, size);
+	da->insert_ulong (val);
+      }
+      break;
+    case CORBA::tk_longlong:
+      {
+	CORBA::LongLong val;
+	memcpy (&val, src, size);
+	da->insert_longlong (val);
+      }
+      break;
+    case CORBA::tk_ulonglong:
+      {
+	CORBA::ULongLong val;
+	memcpy (&val, src, size);
+	da->insert_ulonglong (val);
+      }
+      break;
+    case CORBA::tk_float:
+      {
+	CORBA::Float val;
+	memcpy (&val, src, size);
+	da->insert_float (val);
+      }
+      break;
+    case CORBA::tk_double:
+      {
+	CORBA::Double val;
+	memcpy (&val, src, size);
+	da->insert_double (val);
+      }
+      break;
+    default:
+      assert (0);
+    }
+    da->next ();
+  }
+
+  return true;
+}
+
 bool
 Combat_Packer::pack_Enum (Tcl_Obj * data, const CORBA::TypeCode_ptr tc,
 			  DynamicAny::DynAny_ptr da)
 {
-  char * tmp = Tcl_GetStringFromObj (data, NULL);
   DynamicAny::DynEnum_var res =
     DynamicAny::DynEnum::_narrow (da);
+  CORBA::Long idx = MemberIndex (tc, data);
 
-  for (CORBA::ULong i=0; i < tc->member_count(); i++) {
-    if (strcmp (tmp, tc->member_name (i)) == 0) {
-      res->set_as_ulong (i);
-      return true;
-    }
+  if (idx >= 0) {
+    res->set_as_ulong (idx);
+    return true;
   }
 
   if (interp) {
@@ -2643,6 +3305,24 @@ Combat_Packer::pack_Union (Tcl_Obj * data, const CORBA::TypeCode_ptr tc,
     return false;
   }
 
+  /*
+   * The union's marshalling plan picks the member through its label
+   * index, and encodes the discriminator along with the member. The
+   * DynUnion interface would have us pack the discriminator into a
+   * DynAny of its own first.
+   */
+
+  Combat::MarshalPlan * plan = Combat::MarshalPlan::Lookup (tc);
+  CORBA::Any * any = plan->Pack (interp, ctx, data);
+
+  plan->deref ();
+
+  if (any) {
+    da->from_any (*any);
+    delete any;
+    return true;
+  }
+
   DynamicAny::DynUnion_var res =
     DynamicAny::DynUnion::_narrow (da);
   
@@ -2949,10 +3629,15 @@ Combat_Packer::Pack (Tcl_Obj * data, const CORBA::TypeCode_ptr tc,
 
   if (data->typePtr == &Combat::AnyType) {
     TclAnyData * objInf = (TclAnyData *) data->internalRep.otherValuePtr;
-    if (!CORBA::is_nil (objInf->any)) {
-      CORBA::TypeCode_var objtc = objInf->any->type ();
+    if (!objInf->empty ()) {
+      CORBA::TypeCode_var objtc = objInf->type ();
       if (tc->equal (objtc)) {
-	value->assign (objInf->any);
+	if (objInf->shared) {
+	  value->from_any (*objInf->shared->value);
+	}
+	else {
+	  value->assign (objInf->dyn);
+	}
 	return true;
       }
     }
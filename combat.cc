@@ -111,6 +111,8 @@ Combat::Object::Object (Tcl_Interp * _interp, Context * _ctx,
   ctx    = _ctx;
   iface  = NULL;
   obj    = _obj;
+  hash   = 0;
+  checkedres = false;
   pseudo = NULL;
   name   = CORBA::string_dup (cmdname);
   assert (!CORBA::is_nil (obj));
@@ -135,6 +137,8 @@ Combat::Object::Object (Tcl_Interp * _interp, Context * _ctx,
   ctx    = _ctx;
   iface  = NULL;
   obj    = CORBA::Object::_nil ();
+  hash   = 0;
+  checkedres = false;
   pseudo = _pseudo;
   name   = CORBA::string_dup (cmdname);
   assert (pseudo);
@@ -174,11 +178,8 @@ Combat::Object::UpdateType (const char * repoid)
    * Don't update to a base type
    */
 
-  if (iface) {
-    CORBA::InterfaceDef_var ifd = iface->iface ();
-    if (ifd->is_a (repoid)) {
-      return false;
-    }
+  if (iface && iface->is_a (repoid)) {
+    return false;
   }
 
   InterfaceInfo * ninfo = GlobalData->icache.insert (repoid);
@@ -206,9 +207,8 @@ Combat::Object::UpdateType (CORBA::InterfaceDef_ptr ifd)
    */
 
   if (iface) {
-    CORBA::InterfaceDef_var oldifd = iface->iface ();
     CORBA::String_var nid = ifd->id ();
-    if (oldifd->is_a (nid.in())) {
+    if (iface->is_a (nid.in())) {
       return false;
     }
   }
@@ -239,33 +239,111 @@ Combat::Object::~Object ()
  * Interface Cache
  */
 
+extern "C" {
+
+/*
+ * Operation names hold the serial number of the InterfaceInfo in ptr1,
+ * and the Member in ptr2. Names always keep their string rep.
+ */
+
+static int
+OperationName_SetFromAny (Tcl_Interp * interp, Tcl_Obj * obj)
+{
+  if (interp) {
+    Tcl_SetResult (interp, "error: need interface information", TCL_STATIC);
+  }
+  return TCL_ERROR;
+}
+
+static void
+OperationName_DupInternal (Tcl_Obj * src, Tcl_Obj * dup)
+{
+  dup->typePtr = src->typePtr;
+  dup->internalRep.twoPtrValue.ptr1 = src->internalRep.twoPtrValue.ptr1;
+  dup->internalRep.twoPtrValue.ptr2 = src->internalRep.twoPtrValue.ptr2;
+}
+
+}
+
+#ifdef HAVE_NAMESPACE
+namespace Combat {
+  Tcl_ObjType OperationNameType = {
+    "combat::operation",
+    NULL,
+    OperationName_DupInternal,
+    NULL,
+    OperationName_SetFromAny
+  };
+};
+#else
+Tcl_ObjType Combat::OperationNameType = {
+  "combat::operation",
+  NULL,
+  OperationName_DupInternal,
+  NULL,
+  OperationName_SetFromAny
+};
+#endif
+
+unsigned long Combat::InterfaceInfo::serials = 0;
+
+Combat::InterfaceInfo::Member::Member ()
+{
+  od = NULL;
+  ad = NULL;
+  tmpl = NULL;
+  plan = NULL;
+}
+
 Combat::InterfaceInfo::InterfaceInfo (CORBA::InterfaceDef_ptr _ifd,
 				      const CORBA::InterfaceDef::FullInterfaceDescription & id)
 {
   CORBA::ULong i;
+
+  serial = ++serials;
+  members = new TclStringMap<Member>;
+
   for (i=0; i<id.operations.length(); i++) {
-    CORBA::OperationDescription * od =
-      new CORBA::OperationDescription (id.operations[i]);
-    operations[id.operations[i].name.in()] = od;
+    Member & m = (*members)[id.operations[i].name.in()];
+    m.od = new CORBA::OperationDescription (id.operations[i]);
   }
   for (i=0; i<id.attributes.length(); i++) {
-    CORBA::AttributeDescription * ad =
-      new CORBA::AttributeDescription (id.attributes[i]);
-    attributes[id.attributes[i].name.in()] = ad;
+    const char * name = id.attributes[i].name.in();
+    Member & m = (*members)[name];
+    m.ad = new CORBA::AttributeDescription (id.attributes[i]);
+    m.getname = CORBA::string_dup ((std::string ("_get_") + name).c_str());
+    m.setname = CORBA::string_dup ((std::string ("_set_") + name).c_str());
   }
   repoid = CORBA::string_dup (id.id.in());
   ifd = CORBA::InterfaceDef::_duplicate (_ifd);
-  assert (!CORBA::is_nil (ifd));
+  resolved = !CORBA::is_nil (ifd);
+
+  /*
+   * The cache adds the bases' sets to this one
+   */
+
+  bases = new TclStringMap<bool>;
+  bases->insert (repoid.in(), true);
+  bases->insert ("IDL:omg.org/CORBA/Object:1.0", true);
+  complete = true;
 }
 
 Combat::InterfaceInfo::~InterfaceInfo ()
 {
-  for (OpMap::iterator oi = operations.begin(); oi != operations.end(); oi++) {
-    delete (*oi).second;
+  for (TclStringMap<Member>::iterator mi = members->begin();
+       mi != members->end(); mi++) {
+    delete (*mi).second.od;
+    delete (*mi).second.ad;
+  }
+  delete members;
+  for (TemplateMap::iterator ti = templates.begin();
+       ti != templates.end(); ti++) {
+    (*ti).second->deref ();
   }
-  for (AtMap::iterator ai = attributes.begin(); ai != attributes.end(); ai++) {
-    delete (*ai).second;
+  for (PlanMap::iterator pi = atplans.begin(); pi != atplans.end(); pi++) {
+    (*pi).second->deref ();
   }
+  delete bases;
 }
 
 const char *
@@ -274,34 +352,241 @@ Combat::InterfaceInfo::id ()
   return repoid.in();
 }
 
+/*
+ * Descriptions from the cache file come without their InterfaceDef,
+ * which is then looked up (once) when it is needed. May return nil.
+ */
+
 CORBA::InterfaceDef_ptr
 Combat::InterfaceInfo::iface ()
 {
+  GlobalLock lock;
+
+  if (!resolved && !CORBA::is_nil (GlobalData->repo)) {
+    CORBA::Repository_var repo =
+      CORBA::Repository::_duplicate (GlobalData->repo);
+    CORBA::InterfaceDef_var nifd;
+
+#ifdef HAVE_EXCEPTIONS
+    try {
+#endif
+      GlobalUnlock unlock;
+      CORBA::Contained_var cv = repo->lookup_id (repoid.in());
+      nifd = CORBA::InterfaceDef::_narrow (cv);
+#ifdef HAVE_EXCEPTIONS
+    } catch (...) {
+      nifd = CORBA::InterfaceDef::_nil ();
+    }
+#endif
+
+    if (!resolved) {
+      resolved = true;
+      ifd = nifd._retn ();
+    }
+  }
+
   return CORBA::InterfaceDef::_duplicate (ifd);
 }
 
+bool
+Combat::InterfaceInfo::bases_known ()
+{
+  return complete;
+}
+
+bool
+Combat::InterfaceInfo::is_a (const char * id)
+{
+  if (bases->exists (id)) {
+    return true;
+  }
+  if (complete) {
+    return false;
+  }
+
+  CORBA::InterfaceDef_var theifd = iface ();
+
+  if (CORBA::is_nil (theifd)) {
+    return false;
+  }
+
+  CORBA::Boolean res;
+
+#ifdef HAVE_EXCEPTIONS
+  try {
+#endif
+    res = theifd->is_a (id);
+#ifdef HAVE_EXCEPTIONS
+  } catch (...) {
+    res = FALSE;
+  }
+#endif
+
+  return res ? true : false;
+}
+
 bool
 Combat::InterfaceInfo::lookup (const char * name,
 			       CORBA::OperationDescription *& od,
 			       CORBA::AttributeDescription *& ad)
 {
-  OpMap::iterator oi = operations.find (name);
-  if (oi != operations.end()) {
-    od = (*oi).second;
-    ad = NULL;
-    return true;
+  TclStringMap<Member>::iterator mi = members->find (name);
+
+  if (mi == members->end()) {
+    return false;
   }
-  AtMap::iterator ai = attributes.find (name);
-  if (ai != attributes.end()) {
-    od = NULL;
-    ad = (*ai).second;
-    return true;
+
+  od = (*mi).second.od;
+  ad = (*mi).second.ad;
+  return true;
+}
+
+/*
+ * Returns the member that a name was last resolved to, if that was
+ * against this interface, or NULL
+ */
+
+Combat::InterfaceInfo::Member *
+Combat::InterfaceInfo::cached (Tcl_Obj * name)
+{
+  if (name->typePtr == &OperationNameType &&
+      name->internalRep.twoPtrValue.ptr1 == (VOID *) serial) {
+    return (Member *) name->internalRep.twoPtrValue.ptr2;
+  }
+
+  return NULL;
+}
+
+Combat::InterfaceInfo::Member *
+Combat::InterfaceInfo::lookup (Tcl_Obj * name)
+{
+  Member * m = cached (name);
+
+  if (m) {
+    return m;
+  }
+
+  GlobalLock lock;
+  TclStringMap<Member>::iterator mi =
+    members->find (Tcl_GetStringFromObj (name, NULL));
+
+  if (mi == members->end()) {
+    return NULL;
+  }
+
+  m = &(*mi).second;
+
+  if (m->od && !m->tmpl) {
+    m->tmpl = operation (m->od);
+  }
+  else if (m->ad && !m->plan) {
+    m->plan = plan (m->ad);
+  }
+
+  /*
+   * Only take over pure strings, and our own names
+   */
+
+  if (name->typePtr == NULL || name->typePtr == &OperationNameType) {
+    name->typePtr = &OperationNameType;
+    name->internalRep.twoPtrValue.ptr1 = (VOID *) serial;
+    name->internalRep.twoPtrValue.ptr2 = (VOID *) m;
+  }
+
+  return m;
+}
+
+/*
+ * Invocation templates and plans are made when an operation or attribute
+ * is first used
+ */
+
+Combat::OperationTemplate *
+Combat::InterfaceInfo::operation (CORBA::OperationDescription * od)
+{
+  GlobalLock lock;
+  TemplateMap::iterator ti = templates.find (od);
+
+  if (ti != templates.end()) {
+    return (*ti).second;
+  }
+
+  OperationTemplate * tmpl = new OperationTemplate;
+  CORBA::ULong i;
+
+  tmpl->params = od->parameters;
+  tmpl->result = CORBA::TypeCode::_duplicate (od->result);
+  tmpl->oneway = (od->mode == CORBA::OP_ONEWAY);
+
+  for (i=0; i<od->parameters.length(); i++) {
+    tmpl->plans.push_back (MarshalPlan::Lookup (od->parameters[i].type));
+    if (od->parameters[i].mode != CORBA::PARAM_IN) {
+      tmpl->hasout = true;
+    }
+  }
+
+  tmpl->plans.push_back (MarshalPlan::Lookup (od->result));
+
+  GlobalData->orb->create_exception_list (tmpl->exceptions.out());
+
+  for (i=0; i<od->exceptions.length(); i++) {
+    tmpl->exceptions->add (od->exceptions[i].type);
+  }
+
+  templates[od] = tmpl;
+  return tmpl;
+}
+
+Combat::MarshalPlan *
+Combat::InterfaceInfo::plan (CORBA::AttributeDescription * ad)
+{
+  GlobalLock lock;
+  PlanMap::iterator pi = atplans.find (ad);
+
+  if (pi != atplans.end()) {
+    return (*pi).second;
+  }
+
+  return atplans[ad] = MarshalPlan::Lookup (ad->type);
+}
+
+/*
+ * Invocation templates
+ */
+
+Combat::OperationTemplate::OperationTemplate ()
+{
+  refs = 1;
+  oneway = false;
+  hasout = false;
+}
+
+Combat::OperationTemplate::~OperationTemplate ()
+{
+  for (CORBA::ULong i=0; i<plans.size(); i++) {
+    plans[i]->deref ();
+  }
+}
+
+void
+Combat::OperationTemplate::ref ()
+{
+  GlobalLock lock;
+  refs++;
+}
+
+void
+Combat::OperationTemplate::deref ()
+{
+  GlobalLock lock;
+  if (--refs == 0) {
+    delete this;
   }
-  return false;
 }
 
 Combat::InterfaceCache::InterfaceCache ()
 {
+  file = NULL;
 }
 
 Combat::InterfaceCache::~InterfaceCache ()
@@ -310,98 +595,341 @@ Combat::InterfaceCache::~InterfaceCache ()
   for (ii = interfaces.begin (); ii != interfaces.end(); ii++) {
     delete (*ii).second.desc;
   }
+  close ();
 }
 
+/*
+ * Descriptions are fetched from the Interface Repository without holding
+ * the global lock, so that other threads are not held up by the remote
+ * calls. Another thread may insert the same interface meanwhile, so the
+ * cache is looked at again before inserting.
+ */
+
 Combat::InterfaceInfo *
-Combat::InterfaceCache::insert (const char * repoid)
+Combat::InterfaceCache::take (const char * repoid)
 {
   IfaceMap::iterator ii = interfaces.find (repoid);
   if (ii != interfaces.end()) {
     (*ii).second.refs++;
     return (*ii).second.desc;
   }
-  if (!CORBA::is_nil (GlobalData->repo)) {
-    InterfaceInfo * res;
+  return NULL;
+}
+
+Combat::InterfaceInfo *
+Combat::InterfaceCache::insert (const char * repoid)
+{
+  GlobalLock lock;
+  InterfaceInfo * res;
+
+  if ((res = take (repoid)) != NULL) {
+    return res;
+  }
+
+  CORBA::InterfaceDef::FullInterfaceDescription * cfid = load (repoid);
+
+  if (cfid) {
+    res = insert (CORBA::InterfaceDef::_nil (), *cfid);
+    delete cfid;
+    return res;
+  }
+
+  if (CORBA::is_nil (GlobalData->repo)) {
+    return NULL;
+  }
+
+  CORBA::Repository_var repo = CORBA::Repository::_duplicate (GlobalData->repo);
+  CORBA::InterfaceDef_var ifd;
+  CORBA::InterfaceDef::FullInterfaceDescription_var fid;
+
 #ifdef HAVE_EXCEPTIONS
-    try {
+  try {
 #endif
-      CORBA::Contained_var cv = GlobalData->repo->lookup_id (repoid);
-      CORBA::InterfaceDef_var ifd = CORBA::InterfaceDef::_narrow (cv);
-      if (!CORBA::is_nil (ifd)) {
-	CORBA::InterfaceDef::FullInterfaceDescription_var fid =
-	  ifd->describe_interface ();
-	res = insert (ifd.in(), fid.in());
-      }
-      else {
-	res = NULL;
-      }
-#ifdef HAVE_EXCEPTIONS
-    } catch (...) {
-      res = NULL;
+    GlobalUnlock unlock;
+    CORBA::Contained_var cv = repo->lookup_id (repoid);
+    ifd = CORBA::InterfaceDef::_narrow (cv);
+    if (!CORBA::is_nil (ifd)) {
+      fid = ifd->describe_interface ();
     }
+#ifdef HAVE_EXCEPTIONS
+  } catch (...) {
+    return NULL;
+  }
 #endif
-    return res;
+
+  if (CORBA::is_nil (ifd)) {
+    return NULL;
   }
-  return NULL;
+
+  res = insert (ifd.in(), fid.in());
+  store (fid.in());
+  return res;
 }
 
 Combat::InterfaceInfo *
 Combat::InterfaceCache::insert (CORBA::InterfaceDef_ptr ifd)
 {
+  GlobalLock lock;
   InterfaceInfo * res;
+  CORBA::String_var repoid;
+
+#ifdef HAVE_EXCEPTIONS
+  try {
+#endif
+    GlobalUnlock unlock;
+    repoid = ifd->id ();
+#ifdef HAVE_EXCEPTIONS
+  } catch (...) {
+    return NULL;
+  }
+#endif
 
-  CORBA::String_var repoid = ifd->id ();
   if ((res = insert (repoid.in())) != NULL) {
     return res;
   }
 
+  CORBA::InterfaceDef::FullInterfaceDescription_var fid;
+
 #ifdef HAVE_EXCEPTIONS
   try {
 #endif
-    CORBA::InterfaceDef::FullInterfaceDescription_var fid =
-      ifd->describe_interface ();
-    res = insert (ifd, fid.in());
+    GlobalUnlock unlock;
+    fid = ifd->describe_interface ();
 #ifdef HAVE_EXCEPTIONS
   } catch (...) {
-    res = NULL;
+    return NULL;
   }
 #endif
-  return NULL;
+
+  res = insert (ifd, fid.in());
+  store (fid.in());
+  return res;
 }
 
 Combat::InterfaceInfo *
 Combat::InterfaceCache::insert (CORBA::InterfaceDef_ptr ifd,
 				const CORBA::InterfaceDef::FullInterfaceDescription & fid)
 {
+  GlobalLock lock;
+  InterfaceInfo * info;
+
+  if ((info = take (fid.id.in())) != NULL) {
+    return info;
+  }
+
+  info = new InterfaceInfo (ifd, fid);
+
+  /*
+   * Collect the base interfaces. The direct bases stay in the cache for
+   * as long as this interface does, so that a hierarchy is only fetched
+   * once.
+   */
+
+  for (CORBA::ULong i=0; i<fid.base_interfaces.length(); i++) {
+    InterfaceInfo * base = insert (fid.base_interfaces[i].in());
+
+    if (!base) {
+      info->complete = false;
+      continue;
+    }
+
+    for (TclStringMap<bool>::iterator bi = base->bases->begin();
+	 bi != base->bases->end(); bi++) {
+      info->bases->insert ((*bi).first, true);
+    }
+
+    if (!base->complete) {
+      info->complete = false;
+    }
+
+    info->parents.push_back (base);
+  }
+
+  /*
+   * Fetching the bases may have let another thread in first
+   */
+
+  InterfaceInfo * other = take (fid.id.in());
+
+  if (other) {
+    for (CORBA::ULong j=0; j<info->parents.size(); j++) {
+      remove (info->parents[j]->id());
+    }
+    delete info;
+    return other;
+  }
+
   InterfaceRef & ii = interfaces[fid.id.in()];
-  ii.desc = new InterfaceInfo (ifd, fid);
+  ii.desc = info;
   ii.refs = 1;
   return ii.desc;
 }
 
-void
-Combat::InterfaceCache::remove (const char * repoid)
+bool
+Combat::InterfaceCache::known (const char * repoid)
 {
-  IfaceMap::iterator ii = interfaces.find (repoid);
-  assert (ii != interfaces.end());
-  if (--(*ii).second.refs == 0) {
-    delete (*ii).second.desc;
-    interfaces.erase (ii);
+  GlobalLock lock;
+
+  if (interfaces.find (repoid) != interfaces.end()) {
+    return true;
   }
-}
 
-/*
- * Interpreter-specific Context
- */
+  CORBA::InterfaceDef::FullInterfaceDescription * cfid = load (repoid);
 
-Combat::Context::Context (void)
-{
-  cbReady = false;
+  if (cfid) {
+    insert (CORBA::InterfaceDef::_nil (), *cfid);
+    delete cfid;
+    return true;
+  }
+
+  return false;
+}
+
+unsigned long
+Combat::InterfaceCache::count ()
+{
+  GlobalLock lock;
+  return interfaces.size ();
+}
+
+bool
+Combat::InterfaceCache::is_a (const char * repoid, const char * base)
+{
+  GlobalLock lock;
+  IfaceMap::iterator ii = interfaces.find (repoid);
+  return ii != interfaces.end() && (*ii).second.desc->is_a (base);
+}
+
+void
+Combat::InterfaceCache::add (CORBA::InterfaceDef_ptr ifd,
+			     const CORBA::InterfaceDef::FullInterfaceDescription & fid)
+{
+  GlobalLock lock;
+
+  if (interfaces.find (fid.id.in()) == interfaces.end()) {
+    insert (ifd, fid);
+    store (fid);
+  }
+}
+
+void
+Combat::InterfaceCache::remove (const char * repoid)
+{
+  GlobalLock lock;
+  IfaceMap::iterator ii = interfaces.find (repoid);
+  assert (ii != interfaces.end());
+  if (--(*ii).second.refs == 0) {
+    InterfaceInfo * info = (*ii).second.desc;
+    interfaces.erase (ii);
+    for (CORBA::ULong i=0; i<info->parents.size(); i++) {
+      remove (info->parents[i]->id());
+    }
+    delete info;
+  }
+}
+
+/*
+ * Interpreter-specific Context
+ */
+
+Combat::Context::Context (void)
+{
+  AsyncOps = new RequestTable;
+  CbOps = new RequestTable;
+  cbQueued = false;
+  packedNumbers = false;
+  timeout = -1;
+#if defined(COMBAT_HAVE_THREADS)
+  thread = Tcl_GetCurrentThread ();
+#endif
+}
+
+/*
+ * Deletes the requests in a table. Requests in flight are thus taken
+ * out of GlobalData->pending, so that their replies are dropped rather
+ * than delivered to a Context that is gone.
+ */
+
+static void
+Combat_DropRequests (Combat::Context::RequestTable * table)
+{
+  while (!table->empty ()) {
+    Combat::Context::RequestTable::iterator el = table->begin ();
+    Combat::Request * req = (*el).second;
+    table->erase (el);
+    delete req;
+  }
 }
 
 Combat::Context::~Context ()
 {
-  /* Todo: clean up tables */
+  /*
+   * Stop preloads running in the background, which remove themselves
+   */
+
+  while (!preloads.empty ()) {
+    delete preloads.back ();
+  }
+
+  Combat_DropRequests (AsyncOps);
+  Combat_DropRequests (CbOps);
+
+  delete AsyncOps;
+  delete CbOps;
+}
+
+/*
+ * Per-thread statistics. Only the owning thread writes its counters,
+ * and they are handed over to GlobalData when it exits.
+ */
+
+struct Combat_StatsData {
+  int initialized;
+  Combat::Stats stats;
+};
+
+static Tcl_ThreadDataKey statsDataKey;
+
+extern "C" {
+  static void
+  Combat_ExitStats (ClientData clientData)
+  {
+    Combat::Stats * stats = (Combat::Stats *) clientData;
+    Combat::GlobalLock lock;
+
+    if (Combat::GlobalData == NULL) {
+      return;
+    }
+
+    std::vector<Combat::Stats *> & ts = Combat::GlobalData->threadstats;
+
+    for (CORBA::ULong i=0; i<ts.size(); i++) {
+      if (ts[i] == stats) {
+	ts.erase (ts.begin() + i);
+	break;
+      }
+    }
+
+    Combat::GlobalData->exitedstats.anycopiesavoided +=
+      stats->anycopiesavoided;
+  }
+}
+
+Combat::Stats *
+Combat::GetStats ()
+{
+  Combat_StatsData * data = (Combat_StatsData *)
+    Tcl_GetThreadData (&statsDataKey, sizeof (Combat_StatsData));
+
+  if (!data->initialized) {
+    data->initialized = 1;
+    data->stats.anycopiesavoided = 0;
+    GlobalLock lock;
+    GlobalData->threadstats.push_back (&data->stats);
+    Tcl_CreateThreadExitHandler (Combat_ExitStats, (ClientData) &data->stats);
+  }
+
+  return &data->stats;
 }
 
 /*
@@ -413,9 +941,16 @@ Combat::Global::Global (void)
   orb = CORBA::ORB::_nil ();
   repo = CORBA::Repository::_nil ();
   daf = DynamicAny::DynAnyFactory::_nil ();
+#if defined(COMBAT_HAVE_CODEC)
+  codec = IOP::Codec::_nil ();
+#endif
 #ifdef COMBAT_ORBACUS_LOCAL_REPO
   repopid = (pid_t) -1;
 #endif
+  useplans = true;
+  orbthread = -1;
+  exitedstats.anycopiesavoided = 0;
+  resetstats.anycopiesavoided = 0;
 }
 
 Combat::Global::~Global (void)
@@ -426,6 +961,9 @@ Combat::Global::~Global (void)
   }
   CORBA::release (repo);
   CORBA::release (daf);
+#if defined(COMBAT_HAVE_CODEC)
+  CORBA::release (codec);
+#endif
   CORBA::release (orb);
 #ifdef COMBAT_ORBACUS_LOCAL_REPO
   if (repopid != (pid_t) -1) {
@@ -444,15 +982,37 @@ Combat::Global::~Global (void)
 /*
  * Instantiate a CORBA object as a Tcl command.
  * The CORBA::Object is consumed.
+ *
+ * If we already have a handle for an equivalent reference, that one is
+ * returned instead, so that a service that keeps returning the same
+ * references does not make (and delete) a command each time. Its
+ * lifetime is still governed by the handle's reference count.
  */
 
+#define COMBAT_OBJ_HASH_MAX 0x7fffffff
+
 Tcl_Obj *
 Combat::InstantiateObj (Tcl_Interp * interp, Context * ctx,
 			CORBA::Object_ptr obj)
 {
+  CORBA::ULong hash = obj->_hash (COMBAT_OBJ_HASH_MAX);
+  Context::InternTable::iterator it = ctx->interned.lower_bound (hash);
+
+  for (; it != ctx->interned.end() && (*it).first == hash; it++) {
+    if ((*it).second->obj->_is_equivalent (obj)) {
+      Tcl_Obj * res = Tcl_NewStringObj ((*it).second->name, -1);
+      int inf = Tcl_ConvertToType (interp, res, CmdTypePtr);
+      assert (inf == TCL_OK);
+      CORBA::release (obj);
+      return res;
+    }
+  }
+
   CORBA::String_var name = Object::IdFactory.new_id ();
   Object * mobj = new Object (interp, ctx, name.in(), obj);
+  mobj->hash = hash;
   ctx->active[name.in()] = mobj;
+  ctx->interned.insert (Context::InternTable::value_type (hash, mobj));
   Tcl_CreateObjCommand (interp, (char *) name.in(),
 			Combat_Invoke, mobj, NULL);
 
@@ -491,6 +1051,266 @@ Combat::InstantiateObj (Tcl_Interp * interp, Context * ctx,
   return res;
 }
 
+/*
+ * Drop a reference to a handle, and delete it with the last one
+ */
+
+static void
+Combat_ReleaseHandle (Combat::Object * objInf)
+{
+  if (--objInf->refs == 0) {
+    Combat::Context * ctx = objInf->ctx;
+    Tcl_DeleteCommand (objInf->interp, objInf->name);
+    ctx->active.erase (objInf->name);
+
+    if (!objInf->pseudo) {
+      Combat::Context::InternTable::iterator it =
+	ctx->interned.lower_bound (objInf->hash);
+      while ((*it).second != objInf) {
+	it++;
+      }
+      ctx->interned.erase (it);
+    }
+
+    delete objInf;
+  }
+}
+
+/*
+ * Object references in results are not made into handles right away,
+ * as a script that receives many of them may only look at a few. They
+ * are kept in Tcl_Objs of type combat::objref, which hold the reference,
+ * and are made into a handle when their string rep is first asked for:
+ * when the script looks at the name, or invokes it. Passing them on as
+ * a parameter takes the reference as it is.
+ *
+ * Once it has its name, the Tcl_Obj holds a reference to the handle.
+ */
+
+struct Combat_ObjrefData {
+  Tcl_Interp * interp;
+  Combat::Context * ctx;
+  CORBA::Object_ptr obj;
+  CORBA::String_var repoid;		// type seen in the TypeCode
+  Combat::Object * handle;		// once made
+  CORBA::String_var checked;		// see ObjrefIsA
+  bool checkedres;
+};
+
+static void
+Combat_MakeHandle (Combat_ObjrefData * ref)
+{
+  if (ref->handle) {
+    return;
+  }
+
+  Tcl_Obj * res = Combat::InstantiateObj (ref->interp, ref->ctx,
+					  CORBA::Object::_duplicate (ref->obj));
+  Tcl_IncrRefCount (res);
+  ref->handle = (Combat::Object *) (void *) res->internalRep.twoPtrValue.ptr2;
+  assert (ref->handle);
+  ref->handle->refs++;
+  Tcl_DecrRefCount (res);
+
+  /*
+   * Update type info to the type we've seen in the TypeCode
+   */
+
+  if (ref->repoid.in() && *ref->repoid.in()) {
+    ref->handle->UpdateType (ref->repoid.in());
+  }
+}
+
+extern "C" {
+
+static int
+Combat_Objref_SetFromAny (Tcl_Interp * interp, Tcl_Obj * obj)
+{
+  if (interp) {
+    Tcl_SetResult (interp, "error: not an object reference", TCL_STATIC);
+  }
+  return TCL_ERROR;
+}
+
+static void
+Combat_Objref_UpdateString (Tcl_Obj * obj)
+{
+  Combat_ObjrefData * ref =
+    (Combat_ObjrefData *) obj->internalRep.otherValuePtr;
+
+  Combat_MakeHandle (ref);
+
+  int len = strlen (ref->handle->name);
+  obj->bytes = Tcl_Alloc (len + 1);
+  strcpy (obj->bytes, ref->handle->name);
+  obj->length = len;
+}
+
+static void
+Combat_Objref_DupInternal (Tcl_Obj * src, Tcl_Obj * dup)
+{
+  Combat_ObjrefData * ref =
+    (Combat_ObjrefData *) src->internalRep.otherValuePtr;
+  Combat_ObjrefData * dupref = new Combat_ObjrefData;
+
+  dupref->interp = ref->interp;
+  dupref->ctx = ref->ctx;
+  dupref->obj = CORBA::Object::_duplicate (ref->obj);
+  dupref->repoid = CORBA::string_dup (ref->repoid.in());
+  dupref->handle = ref->handle;
+  dupref->checked = CORBA::string_dup (ref->checked.in());
+  dupref->checkedres = ref->checkedres;
+
+  if (dupref->handle) {
+    dupref->handle->refs++;
+  }
+
+  dup->typePtr = src->typePtr;
+  dup->internalRep.otherValuePtr = (VOID *) (void *) dupref;
+}
+
+static void
+Combat_Objref_FreeInternal (Tcl_Obj * obj)
+{
+  Combat_ObjrefData * ref =
+    (Combat_ObjrefData *) obj->internalRep.otherValuePtr;
+
+  if (ref->handle) {
+    Combat_ReleaseHandle (ref->handle);
+  }
+
+  CORBA::release (ref->obj);
+  delete ref;
+}
+
+}
+
+#ifdef HAVE_NAMESPACE
+namespace Combat {
+  Tcl_ObjType ObjrefType = {
+    "combat::objref",
+    Combat_Objref_FreeInternal,
+    Combat_Objref_DupInternal,
+    Combat_Objref_UpdateString,
+    Combat_Objref_SetFromAny
+  };
+};
+#else
+Tcl_ObjType Combat::ObjrefType = {
+  "combat::objref",
+  Combat_Objref_FreeInternal,
+  Combat_Objref_DupInternal,
+  Combat_Objref_UpdateString,
+  Combat_Objref_SetFromAny
+};
+#endif
+
+/*
+ * Make a Tcl_Obj for an object reference from a result, without a
+ * handle for now. The reference, which must not be nil, is consumed.
+ */
+
+Tcl_Obj *
+Combat::NewObjrefObj (Tcl_Interp * interp, Context * ctx,
+		      CORBA::Object_ptr obj, const char * repoid)
+{
+  Combat_ObjrefData * ref = new Combat_ObjrefData;
+
+  assert (!CORBA::is_nil (obj));
+
+  ref->interp = interp;
+  ref->ctx = ctx;
+  ref->obj = obj;
+  ref->repoid = CORBA::string_dup (repoid ? repoid : "");
+  ref->handle = NULL;
+  ref->checked = CORBA::string_dup ("");
+  ref->checkedres = false;
+
+  Tcl_Obj * res = Tcl_NewObj ();
+  Tcl_InvalidateStringRep (res);
+  res->typePtr = &ObjrefType;
+  res->internalRep.otherValuePtr = (VOID *) (void *) ref;
+  return res;
+}
+
+/*
+ * The reference held by a handle or a combat::objref, without making a
+ * handle for the latter, or nil for anything else
+ */
+
+CORBA::Object_ptr
+Combat::GetObjrefFromObj (Tcl_Obj * data)
+{
+  if (data->typePtr == &ObjrefType) {
+    return ((Combat_ObjrefData *) data->internalRep.otherValuePtr)->obj;
+  }
+
+  if (data->typePtr == CmdTypePtr && data->internalRep.twoPtrValue.ptr2) {
+    return ((Object *) data->internalRep.twoPtrValue.ptr2)->obj.in();
+  }
+
+  return CORBA::Object::_nil ();
+}
+
+/*
+ * First the type seen in the reference's TypeCode, and the interface
+ * of its handle, are looked at. The answer of the object is kept, so
+ * that checking again, e.g. when the DynAny packer retries a value that
+ * the plan did not like, does not ask it again.
+ */
+
+static bool
+Combat_ObjrefIsA (CORBA::Object_ptr obj, const char * seen,
+		  Combat::InterfaceInfo * iface, CORBA::String_var & checked,
+		  bool & checkedres, const char * repoid)
+{
+  if (strcmp (repoid, "IDL:omg.org/CORBA/Object:1.0") == 0) {
+    return true;
+  }
+
+  if (seen && *seen && (strcmp (seen, repoid) == 0 ||
+			Combat::GlobalData->icache.is_a (seen, repoid))) {
+    return true;
+  }
+
+  if (iface && iface->is_a (repoid)) {
+    return true;
+  }
+
+  if (checked.in() && strcmp (checked.in(), repoid) == 0) {
+    return checkedres;
+  }
+
+  checkedres = obj->_is_a (repoid) ? true : false;
+  checked = CORBA::string_dup (repoid);
+  return checkedres;
+}
+
+bool
+Combat::ObjrefIsA (Tcl_Obj * data, const char * repoid)
+{
+  if (data->typePtr == &ObjrefType) {
+    Combat_ObjrefData * ref =
+      (Combat_ObjrefData *) data->internalRep.otherValuePtr;
+    return Combat_ObjrefIsA (ref->obj, ref->repoid.in(),
+			     ref->handle ? ref->handle->iface : NULL,
+			     ref->checked, ref->checkedres, repoid);
+  }
+
+  if (data->typePtr == CmdTypePtr && data->internalRep.twoPtrValue.ptr2) {
+    return ObjrefIsA ((Object *) data->internalRep.twoPtrValue.ptr2, repoid);
+  }
+
+  return false;
+}
+
+bool
+Combat::ObjrefIsA (Object * handle, const char * repoid)
+{
+  return Combat_ObjrefIsA (handle->obj, NULL, handle->iface,
+			   handle->checked, handle->checkedres, repoid);
+}
+
 /*
  * Check if the Tcl procedure threw an exception or simply failed.
  */
@@ -868,6 +1688,7 @@ Combat::UniqueIdGenerator::~UniqueIdGenerator ()
 char *
 Combat::UniqueIdGenerator::new_id ()
 {
+  GlobalLock lock;
   char * id;
 
   /*
@@ -919,11 +1740,11 @@ Combat::UniqueIdGenerator::new_id ()
 extern "C" {
 
 /*
- * This event handler is responsible for invoking callbacks for non-DII
- * requests, i.e. requests that are not handled by the ORB-specific event
- * handler, such as invocations on pseudo objects, or internal operations.
- * Such requests must finish synchronously; their readiness is signalled
- * via Context::cbReady.
+ * This event handler is responsible for invoking callbacks for requests
+ * on the Context's cbready list. Non-DII requests, such as invocations
+ * on pseudo objects or internal operations, finish synchronously and
+ * go there right away; DII requests are put there when the ORB-specific
+ * event handler collects their responses.
  */
 
 struct Combat_Event {
@@ -939,22 +1760,8 @@ Combat_HandleEvent (Tcl_Event * evPtr, int flags)
   Combat_Event * ev = (Combat_Event *) evPtr;
   Combat::Context * ctx = ev->ctx;
 
-  /*
-   * PerformCallback is supposed to call corba::request get, which
-   * alters our vector<>, so the iterator becomes invalid after
-   * executing a callback
-   */
-
-  Combat::Context::RequestTable::iterator el = ctx->CbOps.begin ();
-  while (el != ctx->CbOps.end()) {
-    if ((*el).second->PollResult()) {
-      (*el).second->PerformCallback();
-      el = ctx->CbOps.begin();
-    }
-    else {
-      el++;
-    }
-  }
+  ctx->cbQueued = false;
+  Combat::PerformCallbacks (ctx);
 
   return 1;
 }
@@ -966,7 +1773,7 @@ Combat_SetupEvents (ClientData clientData, int flags)
     return;
   }
 
-  if (((Combat::Context *) clientData)->cbReady) {
+  if (((Combat::Context *) clientData)->cbready.head) {
     Tcl_Time tm;
     tm.sec  = 0;
     tm.usec = 0;
@@ -983,12 +1790,12 @@ Combat_CheckEvents (ClientData clientData, int flags)
 
   Combat::Context * ctx = (Combat::Context *) clientData;
 
-  if (ctx->cbReady) {
+  if (ctx->cbready.head && !ctx->cbQueued) {
     Combat_Event * ev = (Combat_Event *) Tcl_Alloc (sizeof (Combat_Event));
     ev->ev.proc = Combat_HandleEvent;
     ev->ctx     = ctx;
     Tcl_QueueEvent ((struct Tcl_Event *) ev, TCL_QUEUE_TAIL);
-    ctx->cbReady = false;
+    ctx->cbQueued = true;
   }
 }
 
@@ -996,12 +1803,33 @@ Combat_CheckEvents (ClientData clientData, int flags)
  * Handler when interp is deleted
  */
 
+#if !(TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION == 0)
+static int
+Combat_MatchEvent (Tcl_Event * evPtr, ClientData clientData)
+{
+  return (evPtr->proc == Combat_HandleEvent &&
+	  ((Combat_Event *) evPtr)->ctx == (Combat::Context *) clientData);
+}
+#endif
+
 void
 Combat_DeleteLocal (ClientData, Tcl_Interp * interp)
 {
+  Combat::GlobalLock lock;
   Combat::Global::CtxMap::iterator it = 
     Combat::GlobalData->contexts.find (interp);
   assert (it != Combat::GlobalData->contexts.end());
+
+  /*
+   * Callback events that are still queued refer to the Context
+   */
+
+  Tcl_DeleteEventSource (Combat_SetupEvents, Combat_CheckEvents,
+			 (ClientData) (*it).second);
+#if !(TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION == 0)
+  Tcl_DeleteEvents (Combat_MatchEvent, (ClientData) (*it).second);
+#endif
+
   delete (*it).second;
   Combat::GlobalData->contexts.erase (it);
 }
@@ -1030,8 +1858,9 @@ Combat_Invoke (ClientData clientData, Tcl_Interp *interp,
 {
   Combat::Object * obj = (Combat::Object *) clientData;
   const char * objname = Tcl_GetStringFromObj (objv[0], NULL);
-  Combat::Request * req;
+  Combat::ObjectRequest * req;
   int async=0, option=1;
+  int timeout = obj->ctx->timeout;
   Tcl_Obj * callback=NULL;
 
   if (objc == 1) {
@@ -1055,6 +1884,15 @@ Combat_Invoke (ClientData clientData, Tcl_Interp *interp,
       async = 1;
       callback = objv[option];
     }
+    else if (strcmp (opname, "-timeout") == 0) {
+      if (option+1 >= objc) {
+	Tcl_AppendResult (interp, "error: -timeout needs a parameter", NULL);
+	return TCL_ERROR;
+      }
+      if (Tcl_GetIntFromObj (interp, objv[++option], &timeout) != TCL_OK) {
+	return TCL_ERROR;
+      }
+    }
     else if (strcmp (opname, "--") == 0) {
       option++;
       opname = Tcl_GetStringFromObj (objv[option], NULL);
@@ -1080,6 +1918,8 @@ Combat_Invoke (ClientData clientData, Tcl_Interp *interp,
     return TCL_ERROR;
   }
 
+  req->SetTimeout (timeout);
+
   if (callback) {
     req->SetCallback (interp, callback);
   }
@@ -1109,16 +1949,15 @@ Combat_Invoke (ClientData clientData, Tcl_Interp *interp,
    */
 
   if (callback) {
-    obj->ctx->CbOps[req->get_id()] = req;
-    if (req->PollResult()) {
-      obj->ctx->cbReady = true;
-    }
+    obj->ctx->CbOps->insert (req->get_id(), req);
+    req->Notify (&obj->ctx->cbready);
   }
   else {
-    obj->ctx->AsyncOps[req->get_id()] = req;
+    obj->ctx->AsyncOps->insert (req->get_id(), req);
+    req->Notify (&obj->ctx->ready);
   }
 
-  Tcl_SetResult (interp, (char *) req->get_id(), TCL_VOLATILE);
+  Tcl_SetObjResult (interp, req->handle());
   return TCL_OK;
 }
 
@@ -1132,34 +1971,115 @@ Combat_Init_Cmd (ClientData clientData, Tcl_Interp *interp,
 		 int objc, Tcl_Obj *CONST objv[])
 {
   Combat::Context * ctx = (Combat::Context *) clientData;
+  std::vector<Tcl_Obj *> orbargs;
   char **myargv, **cpargv;
-  int i, res, myargc=objc;
+  int i, res, myargc;
   CORBA::Object_var oir;
 
-  if (!CORBA::is_nil (Combat::GlobalData->orb)) {
-    return TCL_OK;
-  }
-
   /*
-   * Process parameters
+   * Process Combat's own options. These are not passed to the ORB, and
+   * can be changed after the ORB has been initialized.
    */
 
-  if ((myargv = (char **) malloc ((myargc+1) * sizeof (char *))) == NULL) {
-    Tcl_SetResult (interp, "oops: out of memory", TCL_STATIC);
-    return TCL_ERROR;
-  }
-  if ((cpargv = (char **) malloc ((myargc+1) * sizeof (char *))) == NULL) {
-    Tcl_SetResult (interp, "oops: out of memory", TCL_STATIC);
-    free (myargv);
-    return TCL_ERROR;
-  }
-
-  for (i=0; i<=myargc; i++) {
-    myargv[i] = cpargv[i] = NULL;
-  }
-
-  for (i=0; i<myargc; i++) {
+  for (i=0; i<objc; i++) {
     const char * strarg = Tcl_GetStringFromObj (objv[i], NULL);
+
+    if (i > 0 && i+1 < objc && strcmp (strarg, "-packednumbers") == 0) {
+      int val;
+      if (Tcl_GetBooleanFromObj (interp, objv[i+1], &val) != TCL_OK) {
+	return TCL_ERROR;
+      }
+      ctx->packedNumbers = val ? true : false;
+      i++;
+    }
+    else if (i > 0 && i+1 < objc && strcmp (strarg, "-ifcache") == 0) {
+      if (Combat::GlobalData->icache.open (interp,
+		     Tcl_GetStringFromObj (objv[i+1], NULL)) != TCL_OK) {
+	return TCL_ERROR;
+      }
+      i++;
+    }
+    else if (i > 0 && i+1 < objc && strcmp (strarg, "-timeout") == 0) {
+      if (Tcl_GetIntFromObj (interp, objv[i+1], &ctx->timeout) != TCL_OK) {
+	return TCL_ERROR;
+      }
+      i++;
+    }
+    else if (i > 0 && i+1 < objc && strcmp (strarg, "-plans") == 0) {
+      int val;
+      if (Tcl_GetBooleanFromObj (interp, objv[i+1], &val) != TCL_OK) {
+	return TCL_ERROR;
+      }
+      Combat::GlobalData->useplans = val ? true : false;
+      i++;
+    }
+    else if (i > 0 && i+1 < objc && strcmp (strarg, "-orbthread") == 0) {
+      int val;
+      if (Tcl_GetBooleanFromObj (interp, objv[i+1], &val) != TCL_OK) {
+	return TCL_ERROR;
+      }
+      if (!CORBA::is_nil (Combat::GlobalData->orb) &&
+	  Combat::OrbThreadRunning () != (val ? true : false)) {
+	Tcl_AppendResult (interp, "error: cannot change -orbthread after ",
+			  "the ORB has been initialized", NULL);
+	return TCL_ERROR;
+      }
+      Combat::GlobalData->orbthread = val ? 1 : 0;
+      i++;
+    }
+    else {
+      orbargs.push_back (objv[i]);
+    }
+  }
+
+  if (!CORBA::is_nil (Combat::GlobalData->orb)) {
+    return TCL_OK;
+  }
+
+  /*
+   * With the ORB in a thread of its own, have it dispatch requests in
+   * several threads, so that interpreter pools can serve them in
+   * parallel (see combat::pool), unless a concurrency model was chosen
+   */
+
+  const char * dispatch = NULL;
+
+#if defined(COMBAT_HAVE_THREADS) && defined(COMBAT_THREADED_DISPATCH)
+  if (Combat::GlobalData->orbthread > 0) {
+    dispatch = COMBAT_THREADED_DISPATCH;
+    for (i=1; i<(int) orbargs.size(); i++) {
+      if (strncmp (Tcl_GetStringFromObj (orbargs[i], NULL),
+		   COMBAT_THREADED_DISPATCH_PREFIX,
+		   strlen (COMBAT_THREADED_DISPATCH_PREFIX)) == 0) {
+	dispatch = NULL;
+      }
+    }
+  }
+#endif
+
+  myargc = orbargs.size () + (dispatch ? 1 : 0);
+
+  /*
+   * Process parameters
+   */
+
+  if ((myargv = (char **) malloc ((myargc+1) * sizeof (char *))) == NULL) {
+    Tcl_SetResult (interp, "oops: out of memory", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  if ((cpargv = (char **) malloc ((myargc+1) * sizeof (char *))) == NULL) {
+    Tcl_SetResult (interp, "oops: out of memory", TCL_STATIC);
+    free (myargv);
+    return TCL_ERROR;
+  }
+
+  for (i=0; i<=myargc; i++) {
+    myargv[i] = cpargv[i] = NULL;
+  }
+
+  for (i=0; i<myargc; i++) {
+    const char * strarg = (i < (int) orbargs.size()) ?
+      Tcl_GetStringFromObj (orbargs[i], NULL) : dispatch;
     if ((cpargv[i] = myargv[i] = strdup (strarg)) == NULL) {
       Tcl_SetResult (interp, "oops: out of memory", TCL_STATIC);
       res = TCL_ERROR;
@@ -1239,6 +2159,32 @@ Combat_Init_Cmd (ClientData clientData, Tcl_Interp *interp,
     goto cleanup;
   }
 
+  /*
+   * Get a CDR Codec for the compiled marshalling plans. Ignore if not
+   * available, values are then packed using DynAny.
+   */
+
+#if defined(COMBAT_HAVE_CODEC)
+#ifdef HAVE_EXCEPTIONS
+  try {
+#endif
+    oir = Combat::GlobalData->orb->resolve_initial_references ("CodecFactory");
+    IOP::CodecFactory_var cf = IOP::CodecFactory::_narrow (oir);
+    if (!CORBA::is_nil (cf)) {
+      IOP::Encoding enc;
+      enc.format = IOP::ENCODING_CDR_ENCAPS;
+      enc.major_version = 1;
+      enc.minor_version = 0;
+      Combat::GlobalData->codec = cf->create_codec (enc);
+    }
+#ifdef HAVE_EXCEPTIONS
+  }
+  catch (CORBA::Exception &ex) {
+    Combat::GlobalData->codec = IOP::Codec::_nil ();
+  }
+#endif
+#endif
+
   /*
    * push back args that were not consumed by the orb
    */
@@ -1689,7 +2635,7 @@ Combat_Register_Initial_Reference (ClientData clientData, Tcl_Interp *interp,
 }
 
 /*
- * corba::dii handle ?-async? operation spec ?args?
+ * corba::dii ?-async? ?-callback proc? ?-timeout ms? handle spec ?args?
  */
 
 static int
@@ -1699,6 +2645,7 @@ Combat_Dii (ClientData clientData, Tcl_Interp *interp,
   Combat::Context * ctx = (Combat::Context *) clientData;
   Combat::ObjectRequest * req;
   int async=0, option=1;
+  int timeout = ctx->timeout;
   Tcl_Obj * callback=NULL;
 
   if (objc < 3) {
@@ -1729,6 +2676,15 @@ Combat_Dii (ClientData clientData, Tcl_Interp *interp,
       async = 1;
       callback = objv[option];
     }
+    else if (strcmp (objname, "-timeout") == 0) {
+      if (option+1 >= objc) {
+	Tcl_AppendResult (interp, "error: -timeout needs a parameter", NULL);
+	return TCL_ERROR;
+      }
+      if (Tcl_GetIntFromObj (interp, objv[++option], &timeout) != TCL_OK) {
+	return TCL_ERROR;
+      }
+    }
     else if (strcmp (objname, "--") == 0) {
       option++;
       objname = Tcl_GetStringFromObj (objv[option], NULL);
@@ -1782,6 +2738,8 @@ Combat_Dii (ClientData clientData, Tcl_Interp *interp,
     return TCL_ERROR;
   }
 
+  req->SetTimeout (timeout);
+
   if (callback) {
     req->SetCallback (interp, callback);
   }
@@ -1811,19 +2769,77 @@ Combat_Dii (ClientData clientData, Tcl_Interp *interp,
    */
 
   if (callback) {
-    obj->ctx->CbOps[req->get_id()] = req;
-    if (req->PollResult()) {
-      obj->ctx->cbReady = true;
-    }
+    obj->ctx->CbOps->insert (req->get_id(), req);
+    req->Notify (&obj->ctx->cbready);
   }
   else {
-    obj->ctx->AsyncOps[req->get_id()] = req;
+    obj->ctx->AsyncOps->insert (req->get_id(), req);
+    req->Notify (&obj->ctx->ready);
   }
 
-  Tcl_SetResult (interp, (char *) req->get_id(), TCL_VOLATILE);
+  Tcl_SetObjResult (interp, req->handle());
   return TCL_OK;
 }
 
+/*
+ * corba::preload ?-async? repoid ...
+ *
+ * Fetches the descriptions of the interfaces, and of their bases, all
+ * at once (see preload.cc). With -async, returns at once, and the
+ * descriptions are added as the event loop is serviced; interfaces
+ * that cannot be found are then silently skipped.
+ */
+
+static int
+Combat_Preload (ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+  Combat::Context * ctx = (Combat::Context *) clientData;
+  bool async = false;
+  int i = 1;
+
+  if (i < objc && strcmp (Tcl_GetStringFromObj (objv[i], NULL),
+			  "-async") == 0) {
+    async = true;
+    i++;
+  }
+
+  if (i >= objc) {
+    Tcl_AppendResult (interp, "wrong # args: should be \"",
+		      Tcl_GetStringFromObj (objv[0], NULL),
+		      " ?-async? repoid ?repoid ...?\"", NULL);
+    return TCL_ERROR;
+  }
+
+  if (CORBA::is_nil (Combat::GlobalData->orb)) {
+    if (Combat_Init_Cmd (clientData, interp, 0, NULL) != TCL_OK) {
+      return TCL_ERROR;
+    }
+  }
+
+  if (CORBA::is_nil (Combat::GlobalData->repo)) {
+    Tcl_AppendResult (interp, "oops: no local repository available", NULL);
+    return TCL_ERROR;
+  }
+
+  Combat::Preload * preload = new Combat::Preload (interp, ctx);
+
+  for (; i<objc; i++) {
+    preload->add (Tcl_GetStringFromObj (objv[i], NULL));
+  }
+
+  if (async) {
+    preload->Async ();
+    return TCL_OK;
+  }
+
+  preload->Wait ();
+
+  int res = preload->Result (interp);
+  delete preload;
+  return res;
+}
+
 /*
  * corba::const repoid-or-scoped-name
  */
@@ -1883,30 +2899,420 @@ Combat_Const (ClientData clientData, Tcl_Interp *interp,
   return TCL_OK;
 }
 
-/*
- * Request handler, for asynchronous operations
- *
- * corba::request poll ?ops ...?
- * corba::request wait ?ops ...?
- * corba::request get op
- */
-
+/*
+ * Timer for corba::request wait -timeout
+ */
+
+static void
+Combat_RequestTimeout (ClientData clientData)
+{
+  *((bool *) clientData) = true;
+}
+
+/*
+ * Request handler, for asynchronous operations
+ *
+ * corba::request poll ?-all? ?-any ops? ?ops ...?
+ * corba::request wait ?-all? ?-any ops? ?-timeout ms? ?ops ...?
+ * corba::request get op
+ */
+
+static int
+Combat_Request (ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+  Combat::Context * ctx = (Combat::Context *) clientData;
+  const char *what;
+
+  if (objc < 2) {
+    Tcl_AppendResult (interp, "wrong # args: should be \"",
+		      Tcl_GetStringFromObj (objv[0], NULL),
+		      " poll ?ops?\" or \"",
+		      Tcl_GetStringFromObj (objv[0], NULL),
+		      " wait ?ops?\" or \"",
+		      Tcl_GetStringFromObj (objv[0], NULL),
+		      " get op\"",
+		      NULL);
+    return TCL_ERROR;
+  }
+
+  if (CORBA::is_nil (Combat::GlobalData->orb)) {
+    if (Combat_Init_Cmd (clientData, interp, 0, NULL) != TCL_OK) {
+      return TCL_ERROR;
+    }
+  }
+
+  what = Tcl_GetStringFromObj (objv[1], NULL);
+
+  /*
+   * Get result
+   */
+
+  if (strcmp (what, "get") == 0) {
+    if (objc != 3) {
+      Tcl_AppendResult (interp, "wrong # args: should be \"",
+			Tcl_GetStringFromObj (objv[0], NULL),
+			" get <op>\"", NULL);
+      return TCL_ERROR;
+    }
+
+    unsigned long key = Combat::Request::Key (objv[2]);
+    Combat::Context::RequestTable::iterator el;
+
+    if ((el = ctx->AsyncOps->find (key)) != ctx->AsyncOps->end()) {
+      Combat::Request * req = (*el).second;
+      ctx->AsyncOps->erase (el);
+      int res = req->GetResult (interp);
+      delete req;
+      return res;
+    }
+
+    if ((el = ctx->CbOps->find (key)) != ctx->CbOps->end()) {
+      Combat::Request * req = (*el).second;
+      ctx->CbOps->erase (el);
+      int res = req->GetResult (interp);
+      delete req;
+      return res;
+    }
+    
+    Tcl_AppendResult (interp, "error: not an active operation handle: \"",
+		      Tcl_GetStringFromObj (objv[2], NULL), "\"", NULL);
+    return TCL_ERROR;
+  }
+
+  /*
+   * Wait/Poll for results
+   */
+
+  bool wait;
+
+  if (strcmp (what, "wait") == 0) {
+    wait = true;
+  }
+  else if (strcmp (what, "poll") == 0) {
+    wait = false;
+  }
+  else {
+    Tcl_AppendResult (interp, "error: unknown subcommand \"", what,
+		      "\", should be get, poll or wait", NULL);
+    return TCL_ERROR;
+  }
+
+  std::vector<Tcl_Obj *> handles;
+  bool all = false, given = false;
+  int timeout = -1, option = 2;
+
+  while (option < objc) {
+    const char * opt = Tcl_GetStringFromObj (objv[option], NULL);
+
+    if (*opt != '-') {
+      break;
+    }
+    else if (strcmp (opt, "-all") == 0) {
+      all = true;
+    }
+    else if (strcmp (opt, "-any") == 0 || strcmp (opt, "-timeout") == 0) {
+      if (option+1 >= objc) {
+	Tcl_AppendResult (interp, "error: ", opt, " needs a parameter", NULL);
+	return TCL_ERROR;
+      }
+      if (opt[1] == 't') {
+	if (Tcl_GetIntFromObj (interp, objv[++option], &timeout) != TCL_OK) {
+	  return TCL_ERROR;
+	}
+      }
+      else {
+	Tcl_Obj ** elems;
+	int nelems;
+	if (Tcl_ListObjGetElements (interp, objv[++option],
+				    &nelems, &elems) != TCL_OK) {
+	  return TCL_ERROR;
+	}
+	handles.insert (handles.end(), elems, elems + nelems);
+	given = true;
+      }
+    }
+    else if (strcmp (opt, "--") == 0) {
+      option++;
+      break;
+    }
+    else {
+      Tcl_AppendResult (interp, "error: unknown option \"", opt,
+			"\"", NULL);
+      return TCL_ERROR;
+    }
+    option++;
+  }
+
+  for (; option < objc; option++) {
+    handles.push_back (objv[option]);
+    given = true;
+  }
+
+  /*
+   * Without handles, -all refers to the requests that are in progress
+   * now; otherwise we just look at the head of the ready list
+   */
+
+  Tcl_Obj * snapshot = NULL;
+
+  if (!given && all) {
+    Combat::Context::RequestTable::iterator el;
+    snapshot = Tcl_NewObj ();
+    Tcl_IncrRefCount (snapshot);
+    for (el = ctx->AsyncOps->begin(); el != ctx->AsyncOps->end(); el++) {
+      Tcl_Obj * name = (*el).second->handle ();
+      Tcl_ListObjAppendElement (NULL, snapshot, name);
+      handles.push_back (name);
+    }
+    given = true;
+  }
+
+  std::vector<unsigned long> keys;
+
+  for (CORBA::ULong i=0; i<handles.size(); i++) {
+    keys.push_back (Combat::Request::Key (handles[i]));
+    if (!ctx->AsyncOps->exists (keys[i])) {
+      Tcl_AppendResult (interp, "error: not an active operation handle: \"",
+			Tcl_GetStringFromObj (handles[i], NULL), "\"", NULL);
+      if (snapshot) {
+	Tcl_DecrRefCount (snapshot);
+      }
+      return TCL_ERROR;
+    }
+  }
+
+  /*
+   * The timer just wakes us up from Tcl_DoOneEvent
+   */
+
+  bool expired = (timeout == 0);
+  Tcl_TimerToken timer = NULL;
+
+  if (wait && timeout > 0) {
+    timer = Tcl_CreateTimerHandler (timeout, Combat_RequestTimeout,
+				    (ClientData) &expired);
+  }
+
+  Tcl_Obj * res = NULL;
+
+  while (42) {
+    Combat::CollectResponses ();
+
+    if (!given) {
+      if (ctx->ready.head) {
+	res = ctx->ready.head->handle ();
+	break;
+      }
+      if (ctx->AsyncOps->empty()) {
+	// no active async operations
+	break;
+      }
+    }
+    else {
+      Tcl_Obj * first = NULL;
+      CORBA::ULong count = 0;
+
+      if (all) {
+	res = Tcl_NewObj ();
+      }
+
+      for (CORBA::ULong i=0; i<handles.size(); i++) {
+	Combat::Context::RequestTable::iterator el;
+
+	/*
+	 * Handles that are gone have been collected by someone else
+	 */
+
+	if ((el = ctx->AsyncOps->find (keys[i])) == ctx->AsyncOps->end()) {
+	  count++;
+	}
+	else if ((*el).second->Ready()) {
+	  count++;
+	  if (!all) {
+	    first = handles[i];
+	    break;
+	  }
+	  Tcl_ListObjAppendElement (NULL, res, handles[i]);
+	}
+      }
+
+      if (!all && (first || count == handles.size())) {
+	res = first;
+	break;
+      }
+
+      if (all && (count == handles.size() || !wait || expired)) {
+	break;
+      }
+
+      if (all) {
+	Tcl_DecrRefCount (res);
+	res = NULL;
+      }
+    }
+
+    if (!wait || expired) {
+      break;
+    }
+
+    /*
+     * Process all events that are on line, then see what has finished
+     */
+
+    Tcl_DoOneEvent (0);
+    while (Tcl_DoOneEvent (TCL_DONT_WAIT));
+  }
+
+  if (timer && !expired) {
+    Tcl_DeleteTimerHandler (timer);
+  }
+
+  if (res) {
+    Tcl_SetObjResult (interp, res);
+  }
+
+  if (snapshot) {
+    Tcl_DecrRefCount (snapshot);
+  }
+
+  return TCL_OK;
+}
+
+/*
+ * Pipelined invocations
+ *
+ * corba::batch ?-window n? ?-callback proc? ?--? calls
+ *
+ * Each of the calls is a list {handle op ?parameters ...?}. Requests
+ * are set up and sent deferred, all at once or, with a window, with at
+ * most n outstanding, before waiting for any of them. Without a
+ * callback, a list of {code result} pairs is returned in the order of
+ * the calls. With a callback, the procedure is called at global level
+ * with the index of a call, its code and its result as it finishes.
+ */
+
+static Combat::ObjectRequest *
+Combat_BatchSetup (Tcl_Interp * interp, Tcl_Obj * call)
+{
+  Combat::ObjectRequest * req;
+  Combat::Object * obj;
+  Tcl_Obj ** elems;
+  Tcl_CmdInfo info;
+  int nelems;
+
+  if (Tcl_ListObjGetElements (interp, call, &nelems, &elems) != TCL_OK) {
+    return NULL;
+  }
+
+  if (nelems < 2) {
+    Tcl_AppendResult (interp, "error: invalid call \"",
+		      Tcl_GetStringFromObj (call, NULL),
+		      "\", should be \"handle op ?parameters?\"", NULL);
+    return NULL;
+  }
+
+  const char * objname = Tcl_GetStringFromObj (elems[0], NULL);
+
+  if (!Tcl_GetCommandInfo (interp, (char *) objname, &info) ||
+      info.objProc != Combat_Invoke) {
+    Tcl_AppendResult (interp, "error: no such object: ", objname, NULL);
+    return NULL;
+  }
+
+  obj = (Combat::Object *) info.objClientData;
+  req = new Combat::ObjectRequest (obj);
+
+  if (req->Setup (interp, obj->ctx, nelems-1, elems+1) != TCL_OK) {
+    delete req;
+    return NULL;
+  }
+
+  req->SetTimeout (obj->ctx->timeout);
+  return req;
+}
+
+/*
+ * Hands on the result of a call, which is in the interpreter
+ */
+
+static int
+Combat_BatchDone (Tcl_Interp * interp, Tcl_Obj * callback,
+		  std::vector<Tcl_Obj *> & results, int index, int code)
+{
+  Tcl_Obj *o[4], *com;
+  int res;
+
+  if (!callback) {
+    o[0] = Tcl_NewIntObj (code);
+    o[1] = Tcl_GetObjResult (interp);
+    results[index] = Tcl_NewListObj (2, o);
+    Tcl_IncrRefCount (results[index]);
+    Tcl_ResetResult (interp);
+    return TCL_OK;
+  }
+
+  o[0] = callback;
+  o[1] = Tcl_NewIntObj (index);
+  o[2] = Tcl_NewIntObj (code);
+  o[3] = Tcl_GetObjResult (interp);
+  com  = Tcl_NewListObj (4, o);
+  Tcl_IncrRefCount (com);
+  Tcl_ResetResult (interp);
+
+  res = Tcl_GlobalEvalObj (interp, com);
+  Tcl_DecrRefCount (com);
+
+  if (res != TCL_ERROR) {
+    Tcl_ResetResult (interp);
+    return TCL_OK;
+  }
+
+  return TCL_ERROR;
+}
+
 static int
-Combat_Request (ClientData clientData, Tcl_Interp *interp,
-		int objc, Tcl_Obj *CONST objv[])
+Combat_Batch (ClientData clientData, Tcl_Interp *interp,
+	      int objc, Tcl_Obj *CONST objv[])
 {
-  Combat::Context * ctx = (Combat::Context *) clientData;
-  const char *what;
+  Tcl_Obj * callback = NULL;
+  int window = 0, option = 1;
 
-  if (objc < 2) {
+  while (option < objc-1) {
+    const char * opt = Tcl_GetStringFromObj (objv[option], NULL);
+
+    if (*opt != '-') {
+      break;
+    }
+    else if (strcmp (opt, "-window") == 0) {
+      if (Tcl_GetIntFromObj (interp, objv[++option], &window) != TCL_OK) {
+	return TCL_ERROR;
+      }
+      if (window < 0) {
+	Tcl_AppendResult (interp, "error: -window must not be negative",
+			  NULL);
+	return TCL_ERROR;
+      }
+    }
+    else if (strcmp (opt, "-callback") == 0) {
+      callback = objv[++option];
+    }
+    else if (strcmp (opt, "--") == 0) {
+      option++;
+      break;
+    }
+    else {
+      Tcl_AppendResult (interp, "error: unknown option \"", opt,
+			"\"", NULL);
+      return TCL_ERROR;
+    }
+    option++;
+  }
+
+  if (option != objc-1) {
     Tcl_AppendResult (interp, "wrong # args: should be \"",
 		      Tcl_GetStringFromObj (objv[0], NULL),
-		      " poll ?ops?\" or \"",
-		      Tcl_GetStringFromObj (objv[0], NULL),
-		      " wait ?ops?\" or \"",
-		      Tcl_GetStringFromObj (objv[0], NULL),
-		      " get op\"",
-		      NULL);
+		      " ?-window n? ?-callback proc? calls\"", NULL);
     return TCL_ERROR;
   }
 
@@ -1916,100 +3322,126 @@ Combat_Request (ClientData clientData, Tcl_Interp *interp,
     }
   }
 
-  what = Tcl_GetStringFromObj (objv[1], NULL);
-
   /*
-   * Get result
+   * Work on a copy of the list, so that callbacks can't pull its
+   * elements away from under us
    */
 
-  if (strcmp (what, "get") == 0) {
-    if (objc != 3) {
-      Tcl_AppendResult (interp, "wrong # args: should be \"",
-			Tcl_GetStringFromObj (objv[0], NULL),
-			" get <op>\"", NULL);
-      return TCL_ERROR;
-    }
-
-    const char * op = Tcl_GetStringFromObj (objv[2], NULL);
-    Combat::Context::RequestTable::iterator el;
+  Tcl_Obj * list = Tcl_DuplicateObj (objv[option]);
+  Tcl_Obj ** calls;
+  int ncalls;
 
-    if ((el = ctx->AsyncOps.find (op)) != ctx->AsyncOps.end()) {
-      Combat::Request * req = (*el).second;
-      ctx->AsyncOps.erase (el);
-      int res = req->GetResult (interp);
-      delete req;
-      return res;
-    }
+  Tcl_IncrRefCount (list);
 
-    if ((el = ctx->CbOps.find (op)) != ctx->CbOps.end()) {
-      Combat::Request * req = (*el).second;
-      ctx->CbOps.erase (el);
-      int res = req->GetResult (interp);
-      delete req;
-      return res;
-    }
-    
-    Tcl_AppendResult (interp, "error: not an active operation handle: \"",
-		      op, "\"", NULL);
+  if (Tcl_ListObjGetElements (interp, list, &ncalls, &calls) != TCL_OK) {
+    Tcl_DecrRefCount (list);
     return TCL_ERROR;
   }
 
-  /*
-   * Wait/Poll for results
-   */
+  std::vector<Tcl_Obj *> results (callback ? 0 : ncalls);
+  std::map<Combat::Request *, int> inflight;
+  std::map<Combat::Request *, int>::iterator it;
+  Combat::ReadyList finished;
+  int next = 0, done = 0, res = TCL_OK;
+  CORBA::ULong i;
 
-  while (42) {
-    if (objc == 2) {
-      /*
-       * Check all active ops
-       */
-      Combat::Context::RequestTable::iterator el;
-      for (el = ctx->AsyncOps.begin(); el != ctx->AsyncOps.end(); el++) {
-	if ((*el).second->PollResult ()) {
-	  Tcl_SetResult (interp, (char *) (*el).first.c_str(), TCL_VOLATILE);
-	  return TCL_OK;
-	}
+  while (done < ncalls && res == TCL_OK) {
+    /*
+     * Set up as many requests as the window allows, and send them
+     */
+
+    std::vector<Combat::ObjectRequest *> sent;
+
+#ifdef COMBAT_HAVE_MULTIPLE_REQUESTS
+    CORBA::ORB::RequestSeq deferred;
+#endif
+
+    while (next < ncalls && res == TCL_OK &&
+	   (window == 0 || (int) inflight.size() < window)) {
+      Combat::ObjectRequest * req;
+      int index = next++;
+
+      if ((req = Combat_BatchSetup (interp, calls[index])) == NULL) {
+	done++;
+	res = Combat_BatchDone (interp, callback, results, index, TCL_ERROR);
+	continue;
       }
-      if (ctx->AsyncOps.size() == 0) {
-	// no active async operations
-	return TCL_OK;
+
+#ifdef COMBAT_HAVE_MULTIPLE_REQUESTS
+      CORBA::Request_ptr dreq = req->Deferred ();
+
+      if (!CORBA::is_nil (dreq)) {
+	CORBA::ULong len = deferred.length ();
+	deferred.length (len + 1);
+	deferred[len] = CORBA::Request::_duplicate (dreq);
       }
+      else
+#endif
+      req->Invoke (interp);
+
+      inflight[req] = index;
+      sent.push_back (req);
     }
-    else {
-      /*
-       * Check arguments
-       */
-      for (int i=2; i<objc; i++) {
-	const char * name = Tcl_GetStringFromObj (objv[i], NULL);
-	Combat::Context::RequestTable::iterator el;
-	if ((el = ctx->AsyncOps.find (name)) == ctx->AsyncOps.end()) {
-	  Tcl_AppendResult (interp,
-			    "error: not an active operation handle: \"",
-			    name, "\"", NULL);
-	  return TCL_ERROR;
-	}
-	Combat::Request * req = (*el).second;
-	if (req->PollResult ()) {
-	  Tcl_SetResult (interp, (char *) name, TCL_VOLATILE);
-	  return TCL_OK;
-	}
-      }
+
+#ifdef COMBAT_HAVE_MULTIPLE_REQUESTS
+    if (deferred.length() > 0) {
+      Combat::GlobalData->orb->send_multiple_requests_deferred (deferred);
     }
+#endif
 
-    if (strcmp (what, "poll") == 0) {
-      break;
+    for (i=0; i < sent.size(); i++) {
+      sent[i]->Notify (&finished);
     }
 
     /*
-     * The above loop is pretty costly, therefore we don't just process
-     * one event before trying again, but all events that are on line
+     * Collect the requests that have finished
      */
 
-    Tcl_DoOneEvent (0);
-    while (Tcl_DoOneEvent (TCL_DONT_WAIT));
+    Combat::CollectResponses ();
+
+    if (finished.head == NULL && !inflight.empty() && res == TCL_OK) {
+      Tcl_DoOneEvent (0);
+      while (Tcl_DoOneEvent (TCL_DONT_WAIT));
+    }
+
+    while (finished.head != NULL && res == TCL_OK) {
+      Combat::Request * req = finished.head;
+      finished.remove (req);
+
+      it = inflight.find (req);
+      assert (it != inflight.end());
+      int index = (*it).second;
+      inflight.erase (it);
+
+      int code = req->GetResult (interp);
+      delete req;
+      done++;
+
+      res = Combat_BatchDone (interp, callback, results, index, code);
+    }
   }
 
-  return TCL_OK;
+  /*
+   * After an error in a callback, the outstanding requests are dropped
+   */
+
+  for (it = inflight.begin(); it != inflight.end(); it++) {
+    delete (*it).first;
+  }
+
+  if (res == TCL_OK && !callback) {
+    Tcl_SetObjResult (interp, Tcl_NewListObj (ncalls,
+					      ncalls ? &results[0] : NULL));
+  }
+
+  for (i=0; i < results.size(); i++) {
+    if (results[i]) {
+      Tcl_DecrRefCount (results[i]);
+    }
+  }
+
+  Tcl_DecrRefCount (list);
+  return res;
 }
 
 /*
@@ -2446,16 +3878,15 @@ Combat_Bind (ClientData clientData, Tcl_Interp *interp,
    */
 
   if (callback) {
-    ctx->CbOps[req->get_id()] = req;
-    if (req->PollResult()) {
-      ctx->cbReady = true;
-    }
+    ctx->CbOps->insert (req->get_id(), req);
+    req->Notify (&ctx->cbready);
   }
   else {
-    ctx->AsyncOps[req->get_id()] = req;
+    ctx->AsyncOps->insert (req->get_id(), req);
+    req->Notify (&ctx->ready);
   }
 
-  Tcl_SetResult (interp, (char *) req->get_id(), TCL_VOLATILE);
+  Tcl_SetObjResult (interp, req->handle());
   return TCL_OK;
 }
 #endif
@@ -2579,6 +4010,150 @@ Combat_Servant (ClientData clientData, Tcl_Interp *interp,
   return TCL_OK;
 }
 
+/*
+ * Pool of interpreters
+ *
+ * combat::pool ?-size n? script
+ *
+ * Returns the name of a new servant, which passes each request on to
+ * one of a number of interpreters in threads of their own. Each of them
+ * evaluates the script, which returns the name of its own servant. The
+ * pool's command handles "_this" and "destroy".
+ */
+
+struct Combat_PoolInfo {
+  Combat::Context * ctx;
+  Combat::PoolServant * pool;
+  std::string name;
+};
+
+static Combat::UniqueIdGenerator PoolIdFactory ("_combat_pool_");
+
+static void
+Combat_DeletePool (ClientData clientData)
+{
+  Combat_PoolInfo * info = (Combat_PoolInfo *) clientData;
+  info->ctx->servants.erase (info->name);
+  info->pool->Stop ();
+  info->pool->_remove_ref ();
+  delete info;
+}
+
+static int
+Combat_PoolObj (ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+  Combat_PoolInfo * info = (Combat_PoolInfo *) clientData;
+
+  if (objc != 2) {
+    Tcl_AppendResult (interp, "wrong # args: should be \"",
+		      Tcl_GetStringFromObj (objv[0], NULL),
+		      " _this|destroy\"", NULL);
+    return TCL_ERROR;
+  }
+
+  const char * what = Tcl_GetStringFromObj (objv[1], NULL);
+
+  if (strcmp (what, "_this") == 0) {
+    CORBA::Object_ptr obj;
+#ifdef HAVE_EXCEPTIONS
+    try {
+#endif
+      obj = info->pool->_this ();
+#ifdef HAVE_EXCEPTIONS
+    } catch (CORBA::Exception &ex) {
+      Tcl_SetObjResult (interp, Combat::DecodeException (interp, info->ctx,
+							 &ex));
+      return TCL_ERROR;
+    }
+#endif
+    Tcl_Obj * res = Combat::InstantiateObj (interp, info->ctx, obj);
+    Tcl_SetObjResult (interp, res);
+  }
+  else if (strcmp (what, "destroy") == 0) {
+    Tcl_DeleteCommand (interp, (char *) info->name.c_str());
+  }
+  else {
+    Tcl_AppendResult (interp, "error: illegal op for pool: \"",
+		      what, "\"", NULL);
+    return TCL_ERROR;
+  }
+
+  return TCL_OK;
+}
+
+static int
+Combat_Pool (ClientData clientData, Tcl_Interp *interp,
+	     int objc, Tcl_Obj *CONST objv[])
+{
+  Combat::Context * ctx = (Combat::Context *) clientData;
+  int size = 4;
+  int i;
+
+  /*
+   * Pools need the ORB in a thread of its own, dispatching requests in
+   * several threads, so start it that way unless told otherwise
+   */
+
+  if (CORBA::is_nil (Combat::GlobalData->orb)) {
+    if (Combat::GlobalData->orbthread < 0) {
+      Combat::GlobalData->orbthread = 1;
+    }
+    if (Combat_Init_Cmd (clientData, interp, 0, NULL) != TCL_OK) {
+      return TCL_ERROR;
+    }
+  }
+
+  for (i=1; i+1<objc; i+=2) {
+    const char * opt = Tcl_GetStringFromObj (objv[i], NULL);
+
+    if (strcmp (opt, "-size") == 0) {
+      if (Tcl_GetIntFromObj (interp, objv[i+1], &size) != TCL_OK) {
+	return TCL_ERROR;
+      }
+      if (size < 1) {
+	Tcl_AppendResult (interp, "error: pool size must be positive", NULL);
+	return TCL_ERROR;
+      }
+    }
+    else {
+      break;
+    }
+  }
+
+  if (i+1 != objc) {
+    Tcl_AppendResult (interp, "wrong # args: should be \"",
+		      Tcl_GetStringFromObj (objv[0], NULL),
+		      " ?-size n? script\"", NULL);
+    return TCL_ERROR;
+  }
+
+  /*
+   * The servant is found by its fully qualified command name
+   */
+
+  CORBA::String_var id = PoolIdFactory.new_id ();
+  Combat_PoolInfo * info = new Combat_PoolInfo;
+  info->ctx = ctx;
+  info->name = std::string ("::") + id.in();
+
+  Tcl_Obj * name = Tcl_NewStringObj ((char *) info->name.c_str(), -1);
+  info->pool = new Combat::PoolServant (interp, name, ctx);
+
+  if (info->pool->Start (interp, size, objv[i]) != TCL_OK) {
+    info->pool->_remove_ref ();
+    delete info;
+    return TCL_ERROR;
+  }
+
+  ctx->servants[info->name] = info->pool;
+  Tcl_CreateObjCommand (interp, (char *) info->name.c_str(), Combat_PoolObj,
+			(ClientData) info, Combat_DeletePool);
+
+  Tcl_SetObjResult (interp, name);
+  return TCL_OK;
+}
+
 /*
  * if defined(COMBAT_NO_SERVER_SIDE)
  */
@@ -2862,6 +4437,77 @@ Combat_Release (ClientData clientData, Tcl_Interp *interp,
   return TCL_OK;
 }
 
+/*
+ * combat::stats ?reset?
+ *
+ * Returns Combat's counters as a list of names and values, or resets
+ * them
+ */
+
+static int
+Combat_Stats (ClientData clientData, Tcl_Interp *interp,
+	      int objc, Tcl_Obj *CONST objv[])
+{
+  if (objc == 2 &&
+      strcmp (Tcl_GetStringFromObj (objv[1], NULL), "reset") == 0) {
+    Combat::Global * g = Combat::GlobalData;
+    Combat::GlobalLock lock;
+    g->resetstats.anycopiesavoided = g->exitedstats.anycopiesavoided;
+    for (CORBA::ULong i=0; i<g->threadstats.size(); i++) {
+      g->resetstats.anycopiesavoided += g->threadstats[i]->anycopiesavoided;
+    }
+    return TCL_OK;
+  }
+
+  if (objc != 1) {
+    Tcl_AppendResult (interp, "wrong # args: should be \"",
+		      Tcl_GetStringFromObj (objv[0], NULL),
+		      " ?reset?\"", NULL);
+    return TCL_ERROR;
+  }
+
+  Combat::Global * g = Combat::GlobalData;
+  Tcl_Obj * res = Tcl_NewObj ();
+  unsigned long anycopiesavoided;
+  unsigned long preloads = 0;
+
+  {
+    Combat::GlobalLock lock;
+
+    /*
+     * Other threads may be counting while we read theirs
+     */
+
+    anycopiesavoided = g->exitedstats.anycopiesavoided;
+    for (CORBA::ULong i=0; i<g->threadstats.size(); i++) {
+      anycopiesavoided += g->threadstats[i]->anycopiesavoided;
+    }
+    anycopiesavoided -= g->resetstats.anycopiesavoided;
+
+    /*
+     * Current values rather than counters
+     */
+
+    Combat::Global::CtxMap::iterator it;
+    for (it = g->contexts.begin(); it != g->contexts.end(); it++) {
+      preloads += (*it).second->preloads.size ();
+    }
+  }
+
+  Tcl_ListObjAppendElement (NULL, res,
+			    Tcl_NewStringObj ("anycopiesavoided", -1));
+  Tcl_ListObjAppendElement (NULL, res,
+			    Tcl_NewLongObj ((long) anycopiesavoided));
+  Tcl_ListObjAppendElement (NULL, res, Tcl_NewStringObj ("interfaces", -1));
+  Tcl_ListObjAppendElement (NULL, res,
+			    Tcl_NewLongObj ((long) g->icache.count ()));
+  Tcl_ListObjAppendElement (NULL, res, Tcl_NewStringObj ("preloads", -1));
+  Tcl_ListObjAppendElement (NULL, res, Tcl_NewLongObj ((long) preloads));
+
+  Tcl_SetObjResult (interp, res);
+  return TCL_OK;
+}
+
 /*
  * ----------------------------------------------------------------------
  * Handling for Tcl's hijacked cmdName type.
@@ -2894,6 +4540,7 @@ Combat_Handle_SetFromAny (Tcl_Interp * interp, Tcl_Obj * obj)
    */
 
   if (Combat::GlobalData != NULL) {
+    Combat::GlobalLock lock;
     Combat::Global::CtxMap::iterator cit =
       Combat::GlobalData->contexts.find (interp);
     if (cit != Combat::GlobalData->contexts.end()) {
@@ -2960,11 +4607,7 @@ Combat_Handle_FreeInternal (Tcl_Obj * obj)
     (Combat::Object *) (void *) obj->internalRep.twoPtrValue.ptr2;
 
   if (objInf) {
-    if (--objInf->refs == 0) {
-      Tcl_DeleteCommand (objInf->interp, objInf->name);
-      objInf->ctx->active.erase (objInf->name);
-      delete objInf;
-    }
+    Combat_ReleaseHandle (objInf);
   }
 
   Combat::OldCmdType.freeIntRepProc (obj);
@@ -3031,6 +4674,8 @@ Combat_Init (Tcl_Interp *interp)
 			(ClientData) ctx, NULL);
   Tcl_CreateObjCommand (interp, "corba::type", Combat_Type,
 			(ClientData) ctx, NULL);
+  Tcl_CreateObjCommand (interp, "corba::preload", Combat_Preload,
+			(ClientData) ctx, NULL);
 
   Tcl_CreateObjCommand (interp, "corba::throw", Combat_Throw,
 			(ClientData) ctx, NULL);
@@ -3038,6 +4683,8 @@ Combat_Init (Tcl_Interp *interp)
 			(ClientData) ctx, NULL);
   Tcl_CreateObjCommand (interp, "corba::request", Combat_Request,
 			(ClientData) ctx, NULL);
+  Tcl_CreateObjCommand (interp, "corba::batch", Combat_Batch,
+			(ClientData) ctx, NULL);
 
   Tcl_CreateObjCommand (interp, "corba::duplicate", Combat_Duplicate,
 			(ClientData) ctx, NULL);
@@ -3056,16 +4703,23 @@ Combat_Init (Tcl_Interp *interp)
 #if !defined(COMBAT_NO_SERVER_SIDE)
   Tcl_CreateObjCommand (interp, "combat::servant", Combat_Servant,
 			(ClientData) ctx, NULL);
+  Tcl_CreateObjCommand (interp, "combat::pool", Combat_Pool,
+			(ClientData) ctx, NULL);
 #endif
 #if !defined(COMBAT_NO_COMBAT_IR)
   Tcl_CreateObjCommand (interp, "combat::ir", Combat_IR,
 			(ClientData) ctx, NULL);
 #endif
+  Tcl_CreateObjCommand (interp, "combat::stats", Combat_Stats,
+			(ClientData) ctx, NULL);
 
   /*
-   * Initialize global data
+   * Initialize global data. Interpreters in other threads may do the
+   * same (see combat::pool).
    */
 
+  Combat::Lock ();
+
   if (Combat::GlobalData == NULL) {
     Combat::GlobalData = new Combat::Global;
     Tcl_CreateExitHandler (Combat_DeleteGlobal, (ClientData) 0);
@@ -3076,6 +4730,25 @@ Combat_Init (Tcl_Interp *interp)
     
     Tcl_RegisterObjType (&Combat::TypeCodeType);
     Tcl_RegisterObjType (&Combat::AnyType);
+#if !(TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION == 0)
+    Tcl_RegisterObjType (&Combat::OctetSeqType);
+#endif
+    Tcl_RegisterObjType (&Combat::MemberNameType);
+    Tcl_RegisterObjType (&Combat::OperationNameType);
+
+    /*
+     * Byte arrays may hold sequences of numbers
+     */
+
+    Combat::ByteArrayTypePtr = Tcl_GetObjType ("bytearray");
+
+    /*
+     * Numbers are read from these types' internal reps
+     */
+
+    Combat::IntTypePtr = Tcl_GetObjType ("int");
+    Combat::WideIntTypePtr = Tcl_GetObjType ("wideInt");
+    Combat::DoubleTypePtr = Tcl_GetObjType ("double");
 
     /*
      * Hijack Tcl's list type
@@ -3104,6 +4777,7 @@ Combat_Init (Tcl_Interp *interp)
   assert (Combat::GlobalData->contexts.find (interp) ==
 	  Combat::GlobalData->contexts.end());
   Combat::GlobalData->contexts[interp] = ctx;
+  Combat::Unlock ();
 
 #if !defined(COMBAT_NO_SERVER_SIDE)
   /*
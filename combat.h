@@ -28,6 +28,9 @@
 
 #include <tcl.h>
 
+template<class vT> class TclStringMap;
+template<class kT, class vT> class TclIntegerMap;
+
 /*
  * ----------------------------------------------------------------------
  *
@@ -52,6 +55,7 @@ struct Context;
 class PseudoObj;
 class UniqueIdGenerator;
 class InterfaceInfo;
+class MarshalPlan;
 
 struct Object {
   Object (Tcl_Interp *, Context *, const char *, CORBA::Object_ptr);
@@ -88,6 +92,9 @@ struct Object {
 
   CORBA::Object_var obj;
   InterfaceInfo * iface;
+  CORBA::ULong hash;			// in Context::interned
+  CORBA::String_var checked;		// last type asked of the object,
+  bool checkedres;			// and its answer (see ObjrefIsA)
 
   /*
    * Info for pseudo objects
@@ -96,6 +103,24 @@ struct Object {
   PseudoObj * pseudo;
 };
 
+/*
+ * List of requests that have finished, linked through the requests
+ * themselves, so that they are queued and taken off in constant time
+ */
+
+class Request;
+
+struct ReadyList {
+  ReadyList ();
+
+  void push (Request *);
+  void remove (Request *);
+
+  Request * head;
+  Request * tail;
+  unsigned long count;
+};
+
 /*
  * Base class for Requests
  */
@@ -121,12 +146,40 @@ public:
   virtual void PerformCallback();
 
   /*
-   * Unique Id
+   * Unique Id. Request handles are "_mico_req_" followed by the id; the
+   * handle's Tcl_Obj is made once, when it is first asked for. Key
+   * returns the id of a handle, or 0 if it is not a request handle.
+   */
+
+  unsigned long get_id () const;
+  Tcl_Obj * handle ();
+
+  static unsigned long Key (Tcl_Obj *);
+
+  /*
+   * Asks for the request to be put on a ready list once it has finished,
+   * or right away if it has already. Subclasses call Finished when they
+   * find that they are done.
    */
 
-  virtual const char * get_id () const;
+  virtual void Notify         (ReadyList *);
+  void Finished               ();
+  bool Ready                  () const;
+
+  Request * next () const;
 
 private:
+  friend struct ReadyList;
+
+  /*
+   * Ready list linkage
+   */
+
+  ReadyList * notify;
+  ReadyList * rlist;
+  Request * rnext;
+  Request * rprev;
+
   /*
    * Information for Callback
    */
@@ -135,18 +188,260 @@ private:
   Tcl_Obj * cbfunc;
 
   /*
-   * Unique Id Generator
+   * Unique Id
    */
 
-  CORBA::String_var id;
-  static UniqueIdGenerator IdFactory;
+  unsigned long id;
+  Tcl_Obj * name;
+};
+
+/*
+ * Invocation template: what a request for an operation needs that does
+ * not change from one call to the next. Templates of IDL operations are
+ * made on first use and kept by their InterfaceInfo; a request holds a
+ * reference until it is done, as the interface may be updated meanwhile.
+ */
+
+struct OperationTemplate {
+  OperationTemplate ();
+  ~OperationTemplate ();
+
+  void ref ();
+  void deref ();
+
+  int refs;
+  CORBA::ParDescriptionSeq params;
+  CORBA::TypeCode_var result;
+  CORBA::ExceptionList_var exceptions;
+  std::vector<MarshalPlan *> plans;	// parameters, then result
+  bool oneway;
+  bool hasout;				// has out or inout parameters
+};
+
+/*
+ * Cache Interface Information
+ */
+
+class InterfaceInfo {
+public:
+  InterfaceInfo (CORBA::InterfaceDef_ptr,
+		 const CORBA::InterfaceDef::FullInterfaceDescription &);
+  ~InterfaceInfo ();
+
+  const char * id ();
+  bool lookup (const char *,
+	       CORBA::OperationDescription *&,
+	       CORBA::AttributeDescription *&);
+  CORBA::InterfaceDef_ptr iface ();
+
+  /*
+   * Whether this interface is, or inherits from, the given one. All base
+   * interfaces are collected from their descriptions when the interface
+   * is inserted into the cache, so this only asks the Interface
+   * Repository if one of them could not be found.
+   */
+
+  bool is_a (const char *);
+  bool bases_known ();			// is_a never asks the repository
+
+  /*
+   * Operations and attributes by name. Looking up a name from a Tcl_Obj
+   * leaves the result in the name's internal rep (combat::operation),
+   * tagged with the serial number of the InterfaceInfo, so that calls
+   * from the same literal find it again without hashing. Serial numbers
+   * are never reused, so a name resolved against an interface that has
+   * since been updated or released is simply looked up again.
+   */
+
+  struct Member {
+    Member ();
+
+    CORBA::OperationDescription * od;
+    CORBA::AttributeDescription * ad;
+    OperationTemplate * tmpl;		// for operations
+    MarshalPlan * plan;			// for attributes
+    CORBA::String_var getname;		// _get_ and _set_ operation names
+    CORBA::String_var setname;
+  };
+
+  Member * cached (Tcl_Obj *);
+  Member * lookup (Tcl_Obj *);
+
+  /*
+   * Invocation template for an operation, or the marshalling plan for
+   * an attribute. Owned by the InterfaceInfo.
+   */
+
+  OperationTemplate * operation (CORBA::OperationDescription *);
+  MarshalPlan * plan (CORBA::AttributeDescription *);
+
+private:
+  friend class InterfaceCache;
+
+  typedef std::map<const void *, OperationTemplate *> TemplateMap;
+  typedef std::map<const void *, MarshalPlan *> PlanMap;
+
+  static unsigned long serials;
+
+  unsigned long serial;
+  TclStringMap<Member> * members;
+  TemplateMap templates;
+  PlanMap atplans;
+  CORBA::String_var repoid;
+  CORBA::InterfaceDef_var ifd;		// nil until asked for, if the
+  bool resolved;			// description came from a file
+  TclStringMap<bool> * bases;		// this and all base interfaces
+  std::vector<InterfaceInfo *> parents;	// direct bases, held in the cache
+  bool complete;			// all bases were found
+};
+
+class InterfaceCache {
+public:
+  InterfaceCache ();
+  ~InterfaceCache ();
+
+  InterfaceInfo * insert (const char *);
+  InterfaceInfo * insert (CORBA::InterfaceDef_ptr);
+  void remove (const char *);
+
+  /*
+   * Optional cache file that descriptions are looked up in before
+   * asking the Interface Repository, and written to after (ifcache.cc,
+   * corba::init -ifcache). An empty name closes it.
+   */
+
+  int open (Tcl_Interp *, const char *);
+
+  /*
+   * For corba::preload (preload.cc): whether a description is at hand,
+   * in memory or in the cache file, and adding one that was fetched
+   * elsewhere. Descriptions added either way stay in the cache.
+   */
+
+  bool known (const char *);
+
+  /*
+   * Whether a cached interface is, or inherits from, another. False if
+   * the first is not in the cache; never fetches anything.
+   */
+
+  bool is_a (const char *, const char *);
+  void add (CORBA::InterfaceDef_ptr,
+	    const CORBA::InterfaceDef::FullInterfaceDescription &);
+
+  /*
+   * The number of descriptions in the cache (combat::stats)
+   */
+
+  unsigned long count ();
+
+private:
+  InterfaceInfo * insert (CORBA::InterfaceDef_ptr,
+			  const CORBA::InterfaceDef::FullInterfaceDescription &);
+  InterfaceInfo * take (const char *);
+
+  struct CacheFile;
+  CacheFile * file;
+
+  void close ();
+  CORBA::InterfaceDef::FullInterfaceDescription * load (const char *);
+  void store (const CORBA::InterfaceDef::FullInterfaceDescription &);
+
+  struct InterfaceRef {
+    InterfaceInfo * desc;
+    unsigned long refs;
+  };
+  typedef std::map<std::string, InterfaceRef> IfaceMap;
+  IfaceMap interfaces;
+};
+
+/*
+ * Something that waits for the responses to deferred requests. It is
+ * entered in GlobalData->pending for each of them, so that responses
+ * that the ORB hands out from get_next_response get back to it: to the
+ * thread of its Context, where PollResult is called.
+ */
+
+class PendingResponse {
+public:
+  virtual ~PendingResponse () {}
+
+  virtual Context * context () const = 0;
+  virtual bool PollResult (void) = 0;
+};
+
+/*
+ * Fetches the descriptions of a list of interfaces, and of their bases,
+ * from the Interface Repository with deferred requests that are all in
+ * flight at once, then adds them to the InterfaceCache (preload.cc)
+ */
+
+class Preload : public PendingResponse {
+public:
+  Preload (Tcl_Interp *, Context *);
+  ~Preload ();
+
+  void add (const char *);
+
+  /*
+   * Poll takes the responses that have arrived, and returns true once
+   * all are in and the descriptions have been added. Wait blocks until
+   * then. After Async, PollResult polls as responses come in; once all
+   * are in, the interfaces that were not found are reported as a
+   * background error, and the Preload is deleted. Otherwise it is
+   * deleted with its Context.
+   */
+
+  bool Poll ();
+  void Wait ();
+  void Async ();
+
+  /*
+   * Leaves an error about the missing interfaces, if any, in interp
+   */
+
+  int Result (Tcl_Interp *);
+
+  Context * context () const;
+  bool PollResult (void);
+
+  /*
+   * Interfaces passed to add that could not be found
+   */
+
+  std::vector<std::string> missing;
+
+private:
+  struct Entry {
+    bool wanted;			// passed to add, rather than a base
+    bool failed;
+    bool added;				// to the cache, or was there
+    CORBA::Request_var req;		// in flight
+    CORBA::InterfaceDef_var ifd;
+    CORBA::InterfaceDef::FullInterfaceDescription * fid;
+  };
+
+  typedef std::map<std::string, Entry> EntryMap;
+
+  void Queue (const char *, bool);
+  void Send (const std::string &, Entry &, CORBA::Request_ptr);
+  void Fail (const std::string &, Entry &);
+  void Receive (const std::string &, Entry &);
+  void Add (Entry &);
+  void Finish ();
+
+  Tcl_Interp * interp;
+  Context * ctx;
+  bool background;			// in ctx->preloads
+  EntryMap entries;
+  unsigned long inflight;
 };
 
 /*
  * ObjectRequest handles any invocations on Objects or Pseudo-Objects
  */
 
-class ObjectRequest : virtual public Request
+class ObjectRequest : virtual public Request, public PendingResponse
 {
 public:
   ObjectRequest (Object *);
@@ -161,14 +456,55 @@ public:
   int  GetResult      (Tcl_Interp *);
   bool PollResult     (void);
 
+  /*
+   * The request that Invoke would send deferred, or nil for oneway and
+   * builtin requests, so that corba::batch can send several at once.
+   * The caller must then call Notify.
+   */
+
+  CORBA::Request_ptr Deferred ();
+
+  /*
+   * Requests that are not waited for right away are looked up when
+   * the ORB reports their response
+   */
+
+  void Notify (ReadyList *);
+
+  /*
+   * The Context that the request was made in
+   */
+
+  Context * context () const;
+
+  /*
+   * ObjectRequests are allocated from a free list that is kept for
+   * each thread, as an application that makes many asynchronous
+   * invocations would otherwise allocate and free one for each
+   */
+
+  static void * operator new (size_t);
+  static void operator delete (void *, size_t);
+
+  /*
+   * Deadline in milliseconds from when the request is sent, or -1.
+   * Once it passes, the request is abandoned, and finishes with a
+   * CORBA::TIMEOUT exception.
+   */
+
+  void SetTimeout (int);
+  void Expire ();
+
 private:
+  void Arm ();
+
   int  SetupGet        (Tcl_Interp *, const char *,
-			CORBA::AttributeDescription *);
+			InterfaceInfo::Member *);
   int  SetupSet        (Tcl_Interp *, const char *, Tcl_Obj *,
-			CORBA::AttributeDescription *);
+			InterfaceInfo::Member *);
   int  SetupInvoke     (Tcl_Interp *, const char *,
 			int, Tcl_Obj *CONST [],
-			CORBA::OperationDescription *);
+			InterfaceInfo::Member *);
   bool SetupPseudo     (Tcl_Interp *, const char *, int,
 			Tcl_Obj *CONST [], int *);
   bool SetupBuiltin    (Tcl_Interp *, const char *, int,
@@ -181,6 +517,7 @@ private:
   Object * obj;
   Context * ctx;
   bool is_finished;
+  bool is_pending;		// in GlobalData->pending
   CORBA::Request_var req;
   CORBA::TypeCode_var rtype;
   Tcl_Obj * req_except;
@@ -198,54 +535,151 @@ private:
 
   bool is_oneway;
   Tcl_Obj ** params;
-  CORBA::ParDescriptionSeq * pds;
+  OperationTemplate * tmpl;
+
+  /*
+   * Marshalling plan for the result
+   */
+
+  MarshalPlan * rplan;
+
+  /*
+   * Deadline
+   */
+
+  int timeout;
+  Tcl_TimerToken timer;
+  Tcl_Time deadline;
 };
 
 /*
- * Cache Interface Information
+ * Compiled marshalling plan. A TypeCode is translated once into a flat
+ * program of opcodes, which is then used to encode Tcl values straight
+ * into CDR, and from there into an Any, without building a DynAny tree.
+ * Types that cannot be expressed in a plan (e.g. valuetypes) are still
+ * handled by the DynAny-based packer in any.cc.
+ *
+ * Plans also record facts about their type that would otherwise be
+ * rediscovered for every value, so they double as a TypeCode cache.
  */
 
-class InterfaceInfo {
+/*
+ * Structs with up to this many members are packed without allocating
+ * memory for their member order
+ */
+
+#define COMBAT_INLINE_MEMBERS 64
+
+class CdrOut;
+class CdrIn;
+
+class MarshalPlan {
 public:
-  InterfaceInfo (CORBA::InterfaceDef_ptr,
-		 const CORBA::InterfaceDef::FullInterfaceDescription &);
-  ~InterfaceInfo ();
+  enum OpCode {
+    OpNull, OpShort, OpLong, OpUShort, OpULong, OpLongLong, OpULongLong,
+    OpFloat, OpDouble, OpBoolean, OpChar, OpOctet, OpString, OpEnum,
+    OpObjref, OpTypeCode, OpAny, OpStruct, OpExcept, OpSequence,
+    OpArray, OpUnion, OpOther
+  };
 
-  const char * id ();
-  bool lookup (const char *,
-	       CORBA::OperationDescription *&,
-	       CORBA::AttributeDescription *&);
-  CORBA::InterfaceDef_ptr iface ();
+  /*
+   * Pass transient for a TypeCode that was just decoded from a value
+   * (see the plan cache in marshal.cc)
+   */
 
-private:
-  typedef std::map<std::string, CORBA::OperationDescription *> OpMap;
-  typedef std::map<std::string, CORBA::AttributeDescription *> AtMap;
+  static MarshalPlan * Lookup (CORBA::TypeCode_ptr, bool transient = false);
 
-  OpMap operations;
-  AtMap attributes;
-  CORBA::String_var repoid;
-  CORBA::InterfaceDef_var ifd;
-};
+  void ref ();
+  void deref ();
 
-class InterfaceCache {
-public:
-  InterfaceCache ();
-  ~InterfaceCache ();
+  bool usable ();
+  CORBA::Any * Pack   (Tcl_Interp *, Context *, Tcl_Obj *);
+  Tcl_Obj *    Unpack (Tcl_Interp *, Context *, const CORBA::Any &);
 
-  InterfaceInfo * insert (const char *);
-  InterfaceInfo * insert (CORBA::InterfaceDef_ptr);
-  void remove (const char *);
+  /*
+   * Facts about the type. Those below described() are only known if it
+   * returns true, which it does unless the type is nested too deeply.
+   */
+
+  CORBA::TypeCode_ptr typecode ();
+  CORBA::TCKind kind ();
+  CORBA::TCKind content_kind ();
+  bool has_objref ();
+
+  bool described ();
+  CORBA::ULong length ();
+  bool fixed_size (CORBA::ULong &);
+  bool flat ();
+  CORBA::Long member_index (Tcl_Obj *);
+  CORBA::Long label_index (CORBA::LongLong);
 
 private:
-  InterfaceInfo * insert (CORBA::InterfaceDef_ptr,
-			  const CORBA::InterfaceDef::FullInterfaceDescription &);
+  MarshalPlan (CORBA::TypeCode_ptr);
+  ~MarshalPlan ();
 
-  struct InterfaceRef {
-    InterfaceInfo * desc;
-    unsigned long refs;
+  /*
+   * The subtree of an op is stored right after it; members of structs
+   * and unions follow each other, so the next member starts at `next'
+   * of the previous one.
+   */
+
+  struct Op {
+    OpCode code;
+    CORBA::TypeCode_var tc;	// as declared, possibly an alias
+    CORBA::TypeCode_var utc;	// with aliases resolved
+    CORBA::ULong count;		// members, bound or length
+    CORBA::ULong next;		// index of the op following this subtree
+    CORBA::ULong align;		// alignment of the first primitive
+    CORBA::ULong maxalign;	// largest alignment within the subtree
+    CORBA::Long aux;		// index into unions, or -1
+    CORBA::Long index;		// index into names, or -1
+    CORBA::TCKind kind;		// kind of utc
+    bool objref;		// subtree contains an object reference
+    bool fixed;			// subtree has a fixed-size encoding
   };
-  typedef std::map<std::string, InterfaceRef> IfaceMap;
-  IfaceMap interfaces;
+
+  struct NameIndex;		// hashed names, see marshal.cc
+  typedef std::map<CORBA::LongLong, CORBA::ULong> LabelIndex;
+
+  /*
+   * If the labels are close together, they are also looked up in a
+   * table indexed by the label value minus the smallest label
+   */
+
+  struct UnionInfo {
+    LabelIndex index;
+    std::vector<CORBA::Long> dense;
+    CORBA::LongLong densemin;
+    bool labelled;
+    CORBA::Long defidx;
+    CORBA::LongLong defdisc;
+  };
+
+  bool Compile     (CORBA::TypeCode_ptr, CORBA::ULong);
+  bool Measure     (CORBA::ULong, CORBA::ULong &);
+  CORBA::Long FindMember (CORBA::ULong, Tcl_Obj *);
+  CORBA::Long FindLabel  (CORBA::ULong, CORBA::LongLong);
+  bool GetScalar   (Tcl_Obj *, CORBA::ULong, CORBA::LongLong &);
+  void PutScalar   (CORBA::ULong, CORBA::LongLong, CdrOut &);
+  bool PutLength   (CORBA::ULong, CORBA::ULong, CdrOut &);
+  bool PackValue   (Tcl_Interp *, Context *, Tcl_Obj *, CORBA::ULong,
+		    CdrOut &);
+  bool PackMembers (Tcl_Interp *, Context *, Tcl_Obj *, CORBA::ULong,
+		    CdrOut &);
+  bool ReadScalar  (CdrIn &, CORBA::ULong, CORBA::LongLong &);
+  Tcl_Obj * NewScalarObj (CORBA::ULong, CORBA::LongLong);
+  Tcl_Obj * UnpackValue   (Tcl_Interp *, Context *, CdrIn &, CORBA::ULong);
+  Tcl_Obj * UnpackMembers (Tcl_Interp *, Context *, CdrIn &, CORBA::ULong);
+
+  int refs;
+  bool compiled;
+  bool complete;
+  bool objref;
+  CORBA::TCKind rkind, ckind;
+  CORBA::TypeCode_var type;
+  std::vector<Op> ops;
+  std::vector<UnionInfo> unions;
+  std::vector<NameIndex *> names;
 };
 
 /*
@@ -410,6 +844,45 @@ private:
   PortableServer::Current_ptr managed;
 };
 
+/*
+ * Upcall from the ORB into a servant. If the ORB runs in a thread of its
+ * own, Perform hands it to the interpreter's thread and waits until it
+ * has been Run there; otherwise, it is Run right away.
+ */
+
+class Upcall
+{
+public:
+  Upcall ();
+  virtual ~Upcall ();
+
+  void Perform (Context *);
+
+  /*
+   * Runs the upcalls that were handed to the current thread
+   */
+
+  static bool RunQueued ();
+
+protected:
+  virtual void Run () = 0;
+
+private:
+  friend bool OrbThreadWait (Request *, const Tcl_Time *);
+
+  void Dispatch ();
+
+#if defined(COMBAT_HAVE_THREADS)
+  Tcl_ThreadId thread;
+#endif
+  bool done;
+
+  PortableServer::ForwardRequest * fwd;
+  bool failed;
+  CORBA::ULong minor;
+  CORBA::CompletionStatus completed;
+};
+
 /*
  * Tcl Servant, DSI servant and Servant Managers
  */
@@ -478,6 +951,41 @@ public:
 					  PortableServer::POA_ptr);
 };
 
+/*
+ * A pool of interpreters, each in a thread of its own and with its own
+ * instance of a (dynamic) servant, made by combat::pool. Each request
+ * is passed on to an idle one.
+ */
+
+class PoolServant :
+  virtual public Servant,
+  virtual public PortableServer::DynamicImplementation
+{
+public:
+  PoolServant (Tcl_Interp *, Tcl_Obj *, Context *);
+  ~PoolServant ();
+
+  int  Start (Tcl_Interp *, int size, Tcl_Obj * script);
+  void Stop  ();
+
+  CORBA::Object_ptr _this ();
+
+  void invoke (CORBA::ServerRequest_ptr);
+  CORBA::Boolean _is_a (const char *);
+  CORBA::RepositoryId _primary_interface (const PortableServer::ObjectId &,
+					  PortableServer::POA_ptr);
+
+  struct Worker;
+
+private:
+  Worker * Acquire ();
+  void Release (Worker *);
+
+  std::vector<Worker *> workers;
+  std::vector<Worker *> idle;
+  bool stopped;
+};
+
 class ServantActivator :
   virtual public Servant,
   virtual public POA_PortableServer::ServantActivator
@@ -562,6 +1070,17 @@ private:
   char * prefix;
 };
 
+/*
+ * Counters for combat::stats. Each thread has its own (see GetStats),
+ * so that counting needs no lock; combat::stats adds them up.
+ */
+
+struct Stats {
+  unsigned long anycopiesavoided;
+};
+
+COMBAT_EXPORT Stats * GetStats ();
+
 /*
  * Interpreter-specific context data:
  *   - Objects
@@ -583,11 +1102,20 @@ struct Context {
    */
 
   typedef std::map<std::string, Object *> ActiveObjTable;
-  typedef std::map<std::string, Request *> RequestTable;
+  typedef TclIntegerMap<unsigned long, Request *> RequestTable;
 
   ActiveObjTable active;
-  RequestTable AsyncOps;
-  RequestTable CbOps;
+
+  /*
+   * Handles of real objects by the hash of their reference, so that a
+   * reference that we already hold is mapped to the same handle
+   */
+
+  typedef std::multimap<CORBA::ULong, Object *> InternTable;
+  InternTable interned;
+
+  RequestTable * AsyncOps;		// by Request::get_id
+  RequestTable * CbOps;
 
 #if !defined(COMBAT_NO_SERVER_SIDE)
   typedef std::map<std::string, Servant *> ServantMap;
@@ -595,10 +1123,47 @@ struct Context {
 #endif
 
   /*
-   * Do we need to call back an unhandled callback?
+   * Requests in AsyncOps that have finished, for corba::request wait
+   */
+
+  ReadyList ready;
+
+  /*
+   * Requests in CbOps that have finished, whose callbacks are due, and
+   * whether an event to run them is queued
+   */
+
+  ReadyList cbready;
+  bool cbQueued;
+
+  /*
+   * Return sequences and arrays of numbers as byte arrays rather than
+   * lists (corba::init -packednumbers)
+   */
+
+  bool packedNumbers;
+
+  /*
+   * Deadline for invocations in milliseconds, or -1 for none
+   * (corba::init -timeout)
+   */
+
+  int timeout;
+
+  /*
+   * corba::preload -async runs that are in progress, which are deleted
+   * with the Context
+   */
+
+  std::vector<Preload *> preloads;
+
+#if defined(COMBAT_HAVE_THREADS)
+  /*
+   * The interpreter's thread, which upcalls are handed to
    */
 
-  bool cbReady;
+  Tcl_ThreadId thread;
+#endif
 };
 
 struct Global {
@@ -610,6 +1175,32 @@ struct Global {
   DynamicAny::DynAnyFactory_ptr daf;
   InterfaceCache icache;
 
+#if defined(COMBAT_HAVE_CODEC)
+  IOP::Codec_ptr codec;
+#endif
+
+  bool useplans;   // corba::init -plans
+  int orbthread;   // corba::init -orbthread, -1 for the default
+
+  /*
+   * Deferred requests that are waited for asynchronously, by the
+   * CORBA::Request that the ORB hands out from get_next_response.
+   * Responses to requests that are not in here are dropped.
+   */
+
+  typedef std::map<CORBA::Request_ptr, PendingResponse *> PendingMap;
+  PendingMap pending;
+
+  /*
+   * Statistics, reported by combat::stats: the counters of the running
+   * threads, those of threads that have exited, and the totals as of
+   * the last "combat::stats reset"
+   */
+
+  std::vector<Stats *> threadstats;
+  Stats exitedstats;
+  Stats resetstats;
+
 #ifdef COMBAT_ORBACUS_LOCAL_REPO
   pid_t repopid;
 #endif
@@ -626,6 +1217,12 @@ struct Global {
 
 COMBAT_EXPORT_VAR Global * GlobalData;
 
+/*
+ * Operation names resolved by InterfaceInfo::lookup
+ */
+
+COMBAT_EXPORT_VAR Tcl_ObjType OperationNameType;
+
 /*
  * ----------------------------------------------------------------------
  * Exported Functions
@@ -639,6 +1236,26 @@ COMBAT_EXPORT_VAR Tcl_ObjType TypeCodeType;
 COMBAT_EXPORT Tcl_Obj *           NewTypeCodeObj     (CORBA::TypeCode_ptr);
 COMBAT_EXPORT CORBA::TypeCode_ptr GetTypeCodeFromObj (Tcl_Interp *,
 						      Tcl_Obj *);
+COMBAT_EXPORT MarshalPlan *       GetPlanFromObj     (Tcl_Interp *,
+						      Tcl_Obj *);
+
+// from marshal.cc
+
+COMBAT_EXPORT_VAR Tcl_ObjType * ByteArrayTypePtr;
+COMBAT_EXPORT_VAR Tcl_ObjType * IntTypePtr;
+COMBAT_EXPORT_VAR Tcl_ObjType * WideIntTypePtr;
+COMBAT_EXPORT_VAR Tcl_ObjType * DoubleTypePtr;
+COMBAT_EXPORT_VAR Tcl_ObjType MemberNameType;
+
+COMBAT_EXPORT bool GetNativeInteger (Tcl_Obj *, CORBA::TCKind,
+				     CORBA::LongLong &);
+COMBAT_EXPORT bool GetNativeDouble  (Tcl_Obj *, double &);
+
+COMBAT_EXPORT CORBA::ULong NumberSize    (CORBA::TCKind);
+COMBAT_EXPORT bool         GetNumbers    (Tcl_Obj **, CORBA::ULong,
+					  CORBA::TCKind, void *);
+COMBAT_EXPORT Tcl_Obj *    NewNumbersObj (Context *, CORBA::TCKind,
+					  const void *, CORBA::ULong, bool);
 
 // from any.cc
 
@@ -648,10 +1265,38 @@ COMBAT_EXPORT_VAR Tcl_ObjType * ListTypePtr;
 
 COMBAT_EXPORT Tcl_Obj    * NewAnyObj     (Tcl_Interp *, Context *,
 					  const CORBA::Any &);
+COMBAT_EXPORT Tcl_Obj    * NewAnyObj     (Tcl_Interp *, Context *,
+					  const CORBA::Any &,
+					  MarshalPlan *);
+COMBAT_EXPORT Tcl_Obj    * NewAnyObj     (Tcl_Interp *, Context *,
+					  CORBA::NamedValue_ptr);
+COMBAT_EXPORT Tcl_Obj    * NewAnyObj     (Tcl_Interp *, Context *,
+					  CORBA::NamedValue_ptr,
+					  MarshalPlan *);
 COMBAT_EXPORT Tcl_Obj    * NewAnyObj     (const CORBA::Any &);
 COMBAT_EXPORT CORBA::Any * GetAnyFromObj (Tcl_Interp *, Context *,
 					  Tcl_Obj *,
 					  const CORBA::TypeCode_ptr);
+COMBAT_EXPORT CORBA::Any * GetAnyFromObj (Tcl_Interp *, Context *,
+					  Tcl_Obj *, MarshalPlan *);
+COMBAT_EXPORT const CORBA::Any * GetAnyRef (Tcl_Obj *,
+					    const CORBA::TypeCode_ptr);
+COMBAT_EXPORT CORBA::Any * GetAnyRep     (Tcl_Obj *,
+					  const CORBA::TypeCode_ptr);
+
+// from octetseq.cc
+
+COMBAT_EXPORT_VAR Tcl_ObjType OctetSeqType;
+
+COMBAT_EXPORT Tcl_Obj * NewOctetSeqObj (const CORBA::Any &, CORBA::TCKind);
+COMBAT_EXPORT Tcl_Obj * NewOctetSeqObj (CORBA::Any *, CORBA::TCKind);
+COMBAT_EXPORT Tcl_Obj * NewOctetSeqObj (CORBA::NamedValue_ptr, CORBA::TCKind);
+COMBAT_EXPORT Tcl_Obj * NewOctetSeqObj (const CORBA::Octet *, CORBA::ULong);
+COMBAT_EXPORT const CORBA::Octet * GetOctetsFromObj (Tcl_Obj *, int *);
+COMBAT_EXPORT bool IsPureOctets (Tcl_Obj *);
+COMBAT_EXPORT const CORBA::Any * GetOctetSeqAny (Tcl_Obj *,
+						 const CORBA::TypeCode_ptr);
+COMBAT_EXPORT unsigned char * GetByteArrayFromObj (Tcl_Obj *, int *);
 
 // from ir.cc
 
@@ -663,6 +1308,49 @@ COMBAT_EXPORT int       IR_Add      (Tcl_Interp *, Tcl_Obj *,
 				     const char *);
 #endif
 
+// from request.cc
+
+COMBAT_EXPORT bool CollectResponses ();
+COMBAT_EXPORT void PerformCallbacks (Context *);
+
+// from orbthread.cc
+
+COMBAT_EXPORT int  StartOrbThread    (Tcl_Interp *, Context *);
+COMBAT_EXPORT bool OrbThreadRunning  ();
+COMBAT_EXPORT bool InInterpThread    (Context *);
+COMBAT_EXPORT bool OrbThreadResponse (CORBA::Request_out);
+COMBAT_EXPORT void OrbThreadPending  ();
+COMBAT_EXPORT bool OrbThreadWait     (Request *, const Tcl_Time *);
+
+/*
+ * The global lock serializes access to GlobalData and the caches behind
+ * it, which are shared by the interpreters in all threads. It may be
+ * taken recursively, but never while blocking for another thread.
+ */
+
+COMBAT_EXPORT void Lock   ();
+COMBAT_EXPORT void Unlock ();
+
+struct GlobalLock {
+  GlobalLock () { Lock (); }
+  ~GlobalLock () { Unlock (); }
+};
+
+/*
+ * Gives up the global lock, however often this thread holds it, for
+ * the duration of a remote call, and takes it again after. Anything
+ * that the lock protects may have changed by then.
+ */
+
+COMBAT_EXPORT int  UnlockAll ();
+COMBAT_EXPORT void Relock    (int);
+
+struct GlobalUnlock {
+  GlobalUnlock () { depth = UnlockAll (); }
+  ~GlobalUnlock () { Relock (depth); }
+  int depth;
+};
+
 // from skel.cc
 
 #if !defined(COMBAT_NO_SERVER_SIDE)
@@ -679,6 +1367,25 @@ COMBAT_EXPORT Tcl_Obj * InstantiateObj (Tcl_Interp *, Context *,
 COMBAT_EXPORT Tcl_Obj * InstantiateObj (Tcl_Interp *, Context *,
 					PseudoObj *);
 
+/*
+ * Object references in results, made into handles on first use
+ */
+
+COMBAT_EXPORT_VAR Tcl_ObjType ObjrefType;
+
+COMBAT_EXPORT Tcl_Obj * NewObjrefObj (Tcl_Interp *, Context *,
+				      CORBA::Object_ptr, const char *);
+COMBAT_EXPORT CORBA::Object_ptr GetObjrefFromObj (Tcl_Obj *);
+
+/*
+ * Whether the reference in a handle or combat::objref is of a type, as
+ * needed when passing it on. The object itself is only asked if the
+ * types known locally do not say yes.
+ */
+
+COMBAT_EXPORT bool ObjrefIsA (Tcl_Obj *, const char *);
+COMBAT_EXPORT bool ObjrefIsA (Object *, const char *);
+
 COMBAT_EXPORT CORBA::Any * EncodeException (Tcl_Interp *, Context *, Tcl_Obj *);
 COMBAT_EXPORT Tcl_Obj * DecodeException (Tcl_Interp *, Context *, const CORBA::Exception *);
 
@@ -691,6 +1398,7 @@ COMBAT_EXPORT Servant * FindServantByName (Tcl_Interp *, Context *, Tcl_Obj *);
 // from event-*.cc
 
 COMBAT_EXPORT int SetupORBEventHandler (Tcl_Interp *, Context *);
+COMBAT_EXPORT void PollOrb (long);
 
 }; // namespace Combat
 
@@ -19,6 +19,29 @@
 
 #include <CORBA.h>
 
+/*
+ * corba::batch sends its requests with send_multiple_requests_deferred
+ */
+
+#define COMBAT_HAVE_MULTIPLE_REQUESTS
+
+/*
+ * The ORB can only run in a thread of its own if MICO is thread-safe
+ */
+
+#if defined(COMBAT_HAVE_THREADS) && !defined(HAVE_THREADS)
+#undef COMBAT_HAVE_THREADS
+#endif
+
+/*
+ * ORB option for dispatching requests in a pool of threads, which is
+ * passed when the ORB runs in a thread of its own, unless one of the
+ * other -ORBThread... concurrency models is chosen
+ */
+
+#define COMBAT_THREADED_DISPATCH "-ORBThreadPool"
+#define COMBAT_THREADED_DISPATCH_PREFIX "-ORBThread"
+
 #if MICO_BIN_VERSION < 0x020309
 #define COMBAT_NAMESPACE MICO_NAMESPACE_DECL
 #define COMBAT_EXPORT MICO_EXPORT_DECL
@@ -37,4 +60,10 @@
 #define COMBAT_NAMESPACE namespace
 #define COMBAT_EXPORT extern
 #define COMBAT_EXPORT_VAR extern
+
+/*
+ * IOP::Codec is used by the compiled marshalling plans
+ */
+
+#define COMBAT_HAVE_CODEC
 #endif
@@ -0,0 +1,103 @@
+#! /bin/sh
+# \
+exec combatsh "$0" ${1+"$@"}
+
+#
+# Times sending and receiving 64k sequences and arrays, and the overhead
+# of invoking an operation without parameters. Pass "-plans 0" to compare
+# against marshalling without compiled plans.
+#
+
+eval corba::init $argv
+source test.tcl
+combat::ir add $_ir_test
+
+set obj [corba::string_to_object file://[pwd]/server.ior]
+
+set count 100
+set size 65536
+
+#
+# Build the data once; [binary format] yields byte arrays
+#
+
+set data [binary format a$size ""]
+set longs [list]
+for {set i 0} {$i < $size/4} {incr i} {
+    lappend longs $i
+}
+set intlist $longs
+set strlist [split [join $longs ,] ,]
+set longs [binary format i* $longs]
+
+proc report {what script {n 0}} {
+    global count
+    if {$n == 0} {
+	set n $count
+    }
+    set usec [lindex [uplevel 1 [list time $script $n]] 0]
+    puts [format "  %-32s %10d usec/call" $what $usec]
+}
+
+puts "Marshalling only ($argv):"
+report "sequence<octet,65536>" {
+    corba::type match {sequence octet 65536} $data
+}
+report "octet\[65536\]" {
+    corba::type match {array octet 65536} $data
+}
+report "sequence<long> from integers" {
+    corba::type match {sequence long} $intlist
+}
+report "sequence<long> from strings" {
+    corba::type match {sequence long} $strlist
+}
+
+puts "Invocation overhead ($argv):"
+report "ping (no parameters)" {
+    $obj ping
+} 1000
+report "tick (oneway, no parameters)" {
+    $obj tick
+} 1000
+
+# wait for the server to catch up with the oneways
+$obj ping
+
+set pings [list]
+for {set i 0} {$i < 100} {incr i} {
+    lappend pings [list $obj ping]
+}
+report "100 x ping, one by one" {
+    foreach call $pings {
+	eval $call
+    }
+}
+report "100 x ping, corba::batch" {
+    corba::batch $pings
+}
+report "100 x ping, corba::batch -window 10" {
+    corba::batch -window 10 $pings
+}
+
+puts "Round trips ($argv):"
+report "sequence<octet>" {
+    $obj blob $data
+    $obj blob
+}
+report "sequence<octet,65536>" {
+    $obj buf $data
+    $obj buf
+}
+report "sequence<char,65536>" {
+    $obj chars $data
+    $obj chars
+}
+report "sequence<long,16384>" {
+    $obj longs $longs
+    $obj longs
+}
+report "octet\[65536\]" {
+    $obj block $data
+    $obj block
+}
@@ -0,0 +1,47 @@
+#! /bin/sh
+# \
+exec combatsh "$0" ${1+"$@"}
+
+#
+# Times how long it takes for the reply to an asynchronous invocation to
+# be noticed by the event loop. Pass "-orbthread 0" to poll the ORB, or
+# "-orbthread 1" to have it run in a thread of its own.
+#
+
+if {[catch {eval corba::init $argv} err]} {
+    puts "Event loop latency ($argv): skipped, $err"
+    exit
+}
+
+source test.tcl
+combat::ir add $_ir_test
+
+set obj [corba::string_to_object file://[pwd]/server.ior]
+set count 100
+
+# connect first
+$obj ping
+
+proc report {what script} {
+    global count
+    set usec [lindex [uplevel 1 [list time $script $count]] 0]
+    puts [format "  %-32s %10d usec/call" $what $usec]
+}
+
+proc done {handle} {
+    global finished
+    corba::request get $handle
+    set finished 1
+}
+
+puts "Event loop latency ($argv):"
+report "ping, synchronous" {
+    $obj ping
+}
+report "ping, -async and wait" {
+    corba::request wait [$obj -async ping]
+}
+report "ping, -callback and vwait" {
+    $obj -callback done ping
+    vwait finished
+}
@@ -0,0 +1,67 @@
+/*
+ * Bench server: stores the values of its attributes, so that the
+ * client can send and receive large sequences and arrays
+ */
+
+#include "server.h"
+#include <fstream.h>
+#include <stdio.h>
+
+class Bench_impl : virtual public POA_Bench
+{
+private:
+  Blob _blob;
+  Buf64k _buf;
+  Chars64k _chars;
+  Longs16k _longs;
+  Block64k_var _block;
+
+public:
+  Bench_impl () { _block = Block64k_alloc (); };
+
+  Blob * blob () { return new Blob (_blob); };
+  void blob (const Blob & __blob) { _blob = __blob; };
+
+  Buf64k * buf () { return new Buf64k (_buf); };
+  void buf (const Buf64k & __buf) { _buf = __buf; };
+
+  Chars64k * chars () { return new Chars64k (_chars); };
+  void chars (const Chars64k & __chars) { _chars = __chars; };
+
+  Longs16k * longs () { return new Longs16k (_longs); };
+  void longs (const Longs16k & __longs) { _longs = __longs; };
+
+  Block64k_slice * block () { return Block64k_dup (_block.in()); };
+  void block (const Block64k __block) { _block = Block64k_dup (__block); };
+
+  void ping () {};
+  void tick () {};
+};
+
+int
+main (int argc, char *argv[])
+{
+  CORBA::ORB_var orb = CORBA::ORB_init (argc, argv);
+  CORBA::Object_var poaobj = orb->resolve_initial_references ("RootPOA");
+  PortableServer::POA_var poa = PortableServer::POA::_narrow (poaobj);
+  PortableServer::POAManager_var mgr = poa->the_POAManager();
+
+  Bench_impl * bench = new Bench_impl;
+  PortableServer::ObjectId_var oid = poa->activate_object (bench);
+
+  ofstream of ("server.ior");
+  CORBA::Object_var ref = poa->id_to_reference (oid.in());
+  CORBA::String_var str = orb->object_to_string (ref.in());
+  of << str.in() << endl;
+  of.close ();
+
+  printf ("Running.\n");
+
+  mgr->activate ();
+  orb->run();
+
+  poa->destroy (1, 1);
+  delete bench;
+
+  return 0;
+}
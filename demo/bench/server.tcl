@@ -0,0 +1,68 @@
+#! /bin/sh
+# \
+exec combatsh "$0" ${1+"$@"}
+
+#
+# require Itcl
+#
+
+package require Itcl
+
+#
+# Bench server implementation: stores the values of its attributes,
+# and does nothing at all for ping and tick
+#
+
+class Bench {
+    inherit PortableServer::ServantBase
+
+    public method _Interface {} {
+	return "IDL:Bench:1.0"
+    }
+
+    public variable blob
+    public variable buf
+    public variable chars
+    public variable longs
+    public variable block
+
+    public method ping {} {
+    }
+
+    public method tick {} {
+    }
+}
+
+#
+# Initialize ORB and feed the local Interface Repository
+#
+
+eval corba::init $argv
+source test.tcl
+combat::ir add $_ir_test
+
+#
+# Create a Bench server and activate it
+#
+
+set poa [corba::resolve_initial_references RootPOA]
+set mgr [$poa the_POAManager]
+set srv [Bench #auto]
+set oid [$poa activate_object $srv]
+
+set reffile [open "server.ior" w]
+set ref [$poa id_to_reference $oid]
+set str [corba::object_to_string $ref]
+puts -nonewline $reffile $str
+close $reffile
+
+#
+# Activate the POA and serve
+#
+
+$mgr activate
+
+puts "Running."
+vwait forever
+
+puts "oops"
@@ -0,0 +1,23 @@
+#
+# This file was automatically generated from test.idl
+# by idl2tcl. Do not edit.
+#
+
+set _ir_test \
+{{typedef {IDL:Blob:1.0 Blob 1.0} {sequence octet}} {typedef {IDL:Buf64k:1.0\
+Buf64k 1.0} {sequence octet 65536}} {typedef {IDL:Chars64k:1.0 Chars64k 1.0}\
+{sequence char 65536}} {typedef {IDL:Longs16k:1.0 Longs16k 1.0} {sequence\
+long 16384}} {typedef {IDL:Block64k:1.0 Block64k 1.0} {array octet 65536}}\
+{interface {IDL:Bench:1.0 Bench 1.0} {} {{attribute {IDL:Bench/blob:1.0 blob\
+1.0} IDL:Blob:1.0} {attribute {IDL:Bench/buf:1.0 buf 1.0} IDL:Buf64k:1.0}\
+{attribute {IDL:Bench/chars:1.0 chars 1.0} IDL:Chars64k:1.0} {attribute\
+{IDL:Bench/longs:1.0 longs 1.0} IDL:Longs16k:1.0} {attribute\
+{IDL:Bench/block:1.0 block 1.0} IDL:Block64k:1.0} {operation\
+{IDL:Bench/ping:1.0 ping 1.0} void {} {}} {operation {IDL:Bench/tick:1.0 tick\
+1.0} void {} {} oneway}}}}
+
+#
+# This is just to clear the interp from the ridiculously long string above
+#
+
+expr 1
@@ -13,6 +13,10 @@
  * Unfortunately, CORBA does not allow asynchronous handling (callbacks)
  * for DII requests. So we must poll the ORB once in a while to handle
  * incoming data, using CORBA::ORB::work_pending() and perform_work().
+ *
+ * If Combat was compiled with thread support, the ORB runs in a thread
+ * of its own by default instead (see orbthread.cc), which wakes us when
+ * there is something to do, so that we need not poll at all.
  */
 
 #include "combat.h"
@@ -50,49 +54,13 @@ Combat_HandleCorbaEvent (Tcl_Event * evPtr, int flags)
   }
 
   /*
-   * If any asynchronous DII requests have finished, try all callbacks.
+   * If any asynchronous DII requests have finished, take them off the
+   * ORB's queue, which puts them on their ready list, and run the
+   * callbacks of those that have one.
    */
 
-  bool ready;
-
-#ifdef HAVE_EXCEPTIONS
-  try {
-#endif
-    ready = Combat::GlobalData->orb->poll_next_response();
-#ifdef HAVE_EXCEPTIONS
-  } catch (CORBA::BAD_INV_ORDER &) {
-    ready = false;
-  }
-#endif
-
-  if (ready) {
-    /*
-     * Call PollResult on AsyncOps so that the finished request is
-     * removed from the ORBs queue and won't cause continous events
-     * within SetupCorbaEvents
-     */
-
-    Combat::Context::RequestTable::iterator el = ctx->AsyncOps.begin ();
-    while (el != ctx->AsyncOps.end()) {
-      (*el++).second->PollResult();
-    }
-
-    /*
-     * PerformCallback is supposed to call corba::request get, which
-     * alters our vector<>, so the iterator becomes invalid after
-     * executing a callback
-     */
-
-    el = ctx->CbOps.begin ();
-    while (el != ctx->CbOps.end()) {
-      if ((*el).second->PollResult()) {
-	(*el).second->PerformCallback();
-	el = ctx->CbOps.begin();
-      }
-      else {
-	el++;
-      }
-    }
+  if (Combat::CollectResponses()) {
+    Combat::PerformCallbacks (ctx);
   }
 
   return 1;
@@ -168,10 +136,51 @@ Combat_CheckCorbaEvents (ClientData clientData, int flags)
  */
 
 int
-Combat::SetupORBEventHandler (Tcl_Interp *, Combat::Context * ctx)
+Combat::SetupORBEventHandler (Tcl_Interp * interp, Combat::Context * ctx)
 {
+#if defined(COMBAT_HAVE_THREADS)
+  if (Combat::GlobalData->orbthread != 0) {
+    return Combat::StartOrbThread (interp, ctx);
+  }
+#else
+  if (Combat::GlobalData->orbthread > 0) {
+    return Combat::StartOrbThread (interp, ctx);
+  }
+#endif
+
   Tcl_CreateEventSource (Combat_SetupCorbaEvents,
 			 Combat_CheckCorbaEvents,
 			 (ClientData) ctx);
   return TCL_OK;
 }
+
+/*
+ * Drive the ORB for at most ms milliseconds without running the event
+ * loop, for synchronous invocations with a timeout
+ */
+
+void
+Combat::PollOrb (long ms)
+{
+  bool ready;
+
+#ifdef HAVE_EXCEPTIONS
+  try {
+#endif
+    ready = Combat::GlobalData->orb->work_pending();
+#ifdef HAVE_EXCEPTIONS
+  } catch (CORBA::BAD_INV_ORDER &) {
+    ready = false;
+  }
+#endif
+
+  if (ready) {
+    Combat::GlobalData->orb->perform_work ();
+  }
+  else if (ms > (long) (PollDelay / 1000)) {
+    Tcl_Sleep ((int) (PollDelay / 1000));
+  }
+  else {
+    Tcl_Sleep ((int) ms);
+  }
+}
@@ -23,13 +23,17 @@
 /*
  * Registers all fd's managed by MICO as a Tcl event source. We only need
  * to check our callbacks if file events have occured. This solution works
- * entirely without polling.
+ * entirely without polling, but all of MICO's I/O happens in the Tcl
+ * thread; corba::init -orbthread 1 moves it to a thread of its own.
  * For the most part, this is the original `tclmico.cc' from the MICO
  * distribution.
  */
 
 #include "combat.h"
 #include <assert.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <unistd.h>
 #include <mico/template_impl.h>
 
 char * combat_event_mico_id = "$Id: event-mico.cc,v 1.5 2003/06/27 01:55:16 fp Exp $";
@@ -52,11 +56,12 @@ class TclDispatcher : public CORBA::Dispatcher {
 	CORBA::DispatcherCallback *cb;
 	Event ev;
 	CORBA::Long handle;
+	unsigned long stamp;
 
 	FileEvent () {}
 	FileEvent (TclDispatcher *_disp, CORBA::Long _handle, 
 		   CORBA::DispatcherCallback *_cb, Event _ev)
-	    : disp (_disp), handle (_handle), cb (_cb), ev (_ev)
+	    : disp (_disp), handle (_handle), cb (_cb), ev (_ev), stamp (0)
 	{}
     };
     struct TimerEvent {
@@ -78,9 +83,18 @@ class TclDispatcher : public CORBA::Dispatcher {
 
     Combat::Context * ctx;
 
+    /*
+     * Number of the latest input_callback, and of changes to fevents
+     */
+
+    unsigned long fstamp;
+    unsigned long fchanges;
+
     int tcl_mask (CORBA::Long handle, FileEvent * &next_event);
     int tcl_mask (CORBA::Long handle);
 
+    void dispatch (CORBA::Long handle, int mask);
+
 public:
     TclDispatcher (Combat::Context *);
     virtual ~TclDispatcher ();
@@ -93,8 +107,16 @@ public:
     virtual void run (CORBA::Boolean infinite = TRUE);
     virtual void move (CORBA::Dispatcher *);
     virtual CORBA::Boolean idle () const;
+
+    void poll (long ms);
 };
 
+/*
+ * The dispatcher registered by SetupORBEventHandler, if any
+ */
+
+static TclDispatcher * TheDispatcher = 0;
+
 
 void
 TclDispatcher::input_callback (ClientData _event, int mask)
@@ -110,67 +132,54 @@ TclDispatcher::input_callback (ClientData _event, int mask)
 
     FileEvent *event = (FileEvent *)_event;
     TclDispatcher *disp = event->disp;
-    CORBA::Long handle = event->handle;
-
-    set<FileEvent *, less<FileEvent *> > seen;
-    while (42) {
-	list<FileEvent *>::iterator i;
-	for (i = disp->fevents.begin(); i != disp->fevents.end(); ++i) {
-	    if ((*i)->handle != handle)
-		continue;
-	    Event ev = (*i)->ev;
-	    if (!((ev == Read   && (mask & TCL_READABLE)) ||
-		  (ev == Write  && (mask & TCL_WRITABLE)) ||
-		  (ev == Except && (mask & TCL_EXCEPTION))))
-		continue;
-	    if (seen.count (*i))
-		continue;
-	    seen.insert (*i);
-	    (*i)->cb->callback (disp, (*i)->ev);
-	    /*
-	     * callback may have removed or added events, which can
-	     * invalidate the iterators. thraverse list again from begin.
-	     * by recording called handlers in 'seen' we avoid calling
-	     * handlers twice.
-	     */
-	    break;
-	}
-	if (i == disp->fevents.end())
-	    break;
-    }
+
+    disp->dispatch (event->handle, mask);
 
     /*
-     * If any asynchronous DII requests have finished, try all callbacks.
+     * If any asynchronous DII requests have finished, take them off
+     * the ORB's queue, which puts them on their ready list, and run
+     * the callbacks of those that have one.
      */
     
-    if (Combat::GlobalData->orb->poll_next_response()) {
-      /*
-       * Call PollResult on AsyncOps so that the finished request is
-       * removed from the ORBs queue and won't cause continous events
-       * within SetupCorbaEvents
-       */
-      
-      Combat::Context::RequestTable::iterator el = disp->ctx->AsyncOps.begin();
-      while (el != disp->ctx->AsyncOps.end()) {
-	(*el++).second->PollResult();
-      }
-
-      /*
-       * PerformCallback is supposed to call corba::request get, which
-       * alters our vector<>, so the iterator becomes invalid after
-       * executing a callback
-       */
-
-      el = disp->ctx->CbOps.begin ();
-      while (el != disp->ctx->CbOps.end()) {
-	if ((*el).second->PollResult()) {
-	  (*el).second->PerformCallback();
-	  el = disp->ctx->CbOps.begin();
+    if (Combat::CollectResponses()) {
+      Combat::PerformCallbacks (disp->ctx);
+    }
+}
+
+void
+TclDispatcher::dispatch (CORBA::Long handle, int mask)
+{
+    TclDispatcher *disp = this;
+    unsigned long stamp = ++disp->fstamp;
+
+    list<FileEvent *>::iterator i = disp->fevents.begin();
+    while (i != disp->fevents.end()) {
+	if ((*i)->handle != handle || (*i)->stamp == stamp) {
+	    ++i;
+	    continue;
+	}
+	Event ev = (*i)->ev;
+	if (!((ev == Read   && (mask & TCL_READABLE)) ||
+	      (ev == Write  && (mask & TCL_WRITABLE)) ||
+	      (ev == Except && (mask & TCL_EXCEPTION)))) {
+	    ++i;
+	    continue;
+	}
+	unsigned long changes = disp->fchanges;
+	(*i)->stamp = stamp;
+	(*i)->cb->callback (disp, ev);
+	/*
+	 * callback may have removed or added events, which can
+	 * invalidate the iterators. in that case, traverse the list
+	 * again from begin. handlers that were called are stamped,
+	 * so that we do not call them twice.
+	 */
+	if (disp->fchanges != changes) {
+	    i = disp->fevents.begin();
 	}
 	else {
-	  el++;
+	    ++i;
 	}
-      }
     }
 }
 
@@ -194,6 +203,8 @@ TclDispatcher::timer_callback (ClientData _event)
 TclDispatcher::TclDispatcher (Combat::Context * _ctx)
 {
   ctx = _ctx;
+  fstamp = 0;
+  fchanges = 0;
 }
 
 TclDispatcher::~TclDispatcher ()
@@ -250,6 +261,7 @@ TclDispatcher::rd_event (CORBA::DispatcherCallback *cb, CORBA::Long fd)
 {
     FileEvent *ev = new FileEvent (this, fd, cb, Read);
     fevents.push_back (ev);
+    fchanges++;
     Tcl_CreateFileHandler (TCL_FILE (fd),
 			   tcl_mask (fd), input_callback, (ClientData)ev);
 }
@@ -259,6 +271,7 @@ TclDispatcher::wr_event (CORBA::DispatcherCallback *cb, CORBA::Long fd)
 {
     FileEvent *ev = new FileEvent (this, fd, cb, Write);
     fevents.push_back (ev);
+    fchanges++;
     Tcl_CreateFileHandler (TCL_FILE (fd),
 			   tcl_mask (fd), input_callback, (ClientData)ev);
 }
@@ -268,6 +281,7 @@ TclDispatcher::ex_event (CORBA::DispatcherCallback *cb, CORBA::Long fd)
 {
     FileEvent *ev = new FileEvent (this, fd, cb, Except);
     fevents.push_back (ev);
+    fchanges++;
     Tcl_CreateFileHandler (TCL_FILE (fd),
 			   tcl_mask (fd), input_callback, (ClientData)ev);
 }
@@ -304,6 +318,7 @@ TclDispatcher::remove (CORBA::DispatcherCallback *cb, Event e)
 		CORBA::Long handle = (*i)->handle;
 		delete *i;
 		fevents.erase (i);
+		fchanges++;
 		FileEvent *next_event;
 		int nmask = tcl_mask (handle, next_event);
 		if (next_event) {
@@ -339,13 +354,94 @@ TclDispatcher::idle () const
 }
 
 /*
- * Register Dispatcher with MICO
+ * Wait for at most ms milliseconds for I/O on MICO's file handles, and
+ * run MICO's handlers for them, but not the Tcl event loop, nor the
+ * callbacks of asynchronous requests. MICO's timers are left to the
+ * event loop.
+ */
+
+void
+TclDispatcher::poll (long ms)
+{
+    fd_set rset, wset, xset;
+    CORBA::Long maxfd = -1;
+
+    FD_ZERO (&rset);
+    FD_ZERO (&wset);
+    FD_ZERO (&xset);
+
+    list<FileEvent *>::iterator i;
+    for (i = fevents.begin(); i != fevents.end(); ++i) {
+	switch ((*i)->ev) {
+	case Read:
+	    FD_SET ((*i)->handle, &rset);
+	    break;
+	case Write:
+	    FD_SET ((*i)->handle, &wset);
+	    break;
+	case Except:
+	    FD_SET ((*i)->handle, &xset);
+	    break;
+	}
+	if ((*i)->handle > maxfd)
+	    maxfd = (*i)->handle;
+    }
+
+    struct timeval tv;
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+
+    if (select (maxfd + 1, &rset, &wset, &xset, &tv) <= 0)
+	return;
+
+    /*
+     * Handlers may add or remove events, so collect the masks first
+     */
+
+    for (CORBA::Long fd = 0; fd <= maxfd; fd++) {
+	int mask = 0;
+	if (FD_ISSET (fd, &rset))
+	    mask |= TCL_READABLE;
+	if (FD_ISSET (fd, &wset))
+	    mask |= TCL_WRITABLE;
+	if (FD_ISSET (fd, &xset))
+	    mask |= TCL_EXCEPTION;
+	if (mask)
+	    dispatch (fd, mask);
+    }
+}
+
+/*
+ * Register Dispatcher with MICO. With corba::init -orbthread 1, MICO
+ * keeps its own dispatcher instead, running in a thread of its own, so
+ * that reading and decoding large messages does not hold up the event
+ * loop (see orbthread.cc).
  */
 
 int
-Combat::SetupORBEventHandler (Tcl_Interp *, Combat::Context * ctx)
+Combat::SetupORBEventHandler (Tcl_Interp * interp, Combat::Context * ctx)
 {
-  CORBA::Dispatcher * disp = new TclDispatcher (ctx);
-  Combat::GlobalData->orb->dispatcher (disp);
+  if (Combat::GlobalData->orbthread > 0) {
+    return Combat::StartOrbThread (interp, ctx);
+  }
+
+  TheDispatcher = new TclDispatcher (ctx);
+  Combat::GlobalData->orb->dispatcher (TheDispatcher);
   return TCL_OK;
 }
+
+/*
+ * Drive the ORB for at most ms milliseconds without running the event
+ * loop, for synchronous invocations with a timeout
+ */
+
+void
+Combat::PollOrb (long ms)
+{
+  if (TheDispatcher) {
+    TheDispatcher->poll (ms);
+  }
+  else {
+    Tcl_Sleep ((int) ms);
+  }
+}
@@ -0,0 +1,457 @@
+/*
+ * ======================================================================
+ *
+ * This file is part of Combat, the Tcl interface for CORBA
+ * Copyright (c) Frank Pilhofer
+ *
+ * ======================================================================
+ */
+
+/*
+ * ----------------------------------------------------------------------
+ * Interface description cache file
+ * ----------------------------------------------------------------------
+ *
+ * With "corba::init -ifcache file", the descriptions that InterfaceCache
+ * fetches from the Interface Repository are also appended to a file,
+ * and looked up there before asking the repository, so that the next
+ * process does not need to ask again. The file is mapped into memory,
+ * and indexed by repository id, when it is opened. Entries appended
+ * later, by this or other processes, are mapped and indexed as they
+ * are noticed, without going over the earlier ones again.
+ *
+ * The file starts with eight magic bytes and a version number. Entries
+ * follow, each made of the length of the repository id and that of the
+ * description, a checksum of both, the repository id, and the
+ * description, as encoded by the Codec (a CDR encapsulation of the
+ * FullInterfaceDescription's value). Numbers are four bytes, big
+ * endian. Entries are only ever appended; an incomplete one at the end
+ * may still be being written, and is looked at again later. Indexing
+ * stops for good at an entry whose checksum does not match.
+ *
+ * A file that is not ours, of a different version, or damaged is never
+ * truncated, as other processes may have it mapped. A new one is
+ * written under a temporary name instead, and renamed into its place.
+ *
+ * Nothing notices when the repository changes, so the file must be
+ * removed after the IDL is changed.
+ */
+
+#include "combat.h"
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(__WIN32__)
+#include <io.h>
+#include <process.h>
+#include <stdlib.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+char * combat_ifcache_id = "$Id$";
+
+#define COMBAT_IFCACHE_MAGIC "COMBATIF"
+#define COMBAT_IFCACHE_MAGIC_LEN 8
+#define COMBAT_IFCACHE_VERSION 2
+#define COMBAT_IFCACHE_HEADER_LEN (COMBAT_IFCACHE_MAGIC_LEN + 4)
+#define COMBAT_IFCACHE_ENTRY_LEN 12
+
+#if !defined(O_BINARY)
+#define O_BINARY 0
+#endif
+
+struct Combat::InterfaceCache::CacheFile {
+  std::string name;
+  int fd;
+  bool broken;			// found a bad entry
+
+  /*
+   * Mapped parts of the file, each starting at a page boundary
+   */
+
+  struct Region {
+    char * data;
+    size_t offset;
+    size_t length;
+  };
+
+  std::vector<Region> regions;
+  size_t length;		// indexed so far
+
+  typedef std::map<std::string, std::pair<const char *, size_t> > Index;
+  Index index;			// repoid to description and its length
+
+  bool map ();
+  void unmap ();
+};
+
+#if defined(COMBAT_HAVE_CODEC)
+
+static CORBA::ULong
+GetNumber (const char * ptr)
+{
+  const unsigned char * p = (const unsigned char *) ptr;
+  return ((CORBA::ULong) p[0] << 24) | ((CORBA::ULong) p[1] << 16) |
+    ((CORBA::ULong) p[2] << 8) | (CORBA::ULong) p[3];
+}
+
+static void
+PutNumber (std::string & buf, CORBA::ULong num)
+{
+  buf += (char) ((num >> 24) & 0xff);
+  buf += (char) ((num >> 16) & 0xff);
+  buf += (char) ((num >> 8) & 0xff);
+  buf += (char) (num & 0xff);
+}
+
+/*
+ * Adler-32 checksum, continuing from sum (1 to start with)
+ */
+
+static CORBA::ULong
+Checksum (CORBA::ULong sum, const char * ptr, size_t len)
+{
+  const unsigned char * p = (const unsigned char *) ptr;
+  CORBA::ULong a = sum & 0xffff, b = (sum >> 16) & 0xffff;
+
+  while (len--) {
+    a = (a + *p++) % 65521;
+    b = (b + a) % 65521;
+  }
+
+  return (b << 16) | a;
+}
+
+/*
+ * Create an empty file in place of the one that is there, if any
+ */
+
+static int
+CreateCacheFile (const char * name)
+{
+  char pid[32];
+  sprintf (pid, ".%lu", (unsigned long) getpid ());
+  std::string tmp (name);
+  tmp += pid;
+
+  std::string header (COMBAT_IFCACHE_MAGIC);
+  PutNumber (header, COMBAT_IFCACHE_VERSION);
+
+  int fd = ::open (tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND |
+		   O_BINARY, 0666);
+
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (write (fd, header.data(), COMBAT_IFCACHE_HEADER_LEN) !=
+      COMBAT_IFCACHE_HEADER_LEN) {
+    int err = errno;
+    ::close (fd);
+    unlink (tmp.c_str());
+    errno = err;
+    return -1;
+  }
+
+#if defined(__WIN32__)
+  /*
+   * rename does not replace files here, and the file cannot be mapped
+   * by others
+   */
+
+  unlink (name);
+#endif
+
+  if (rename (tmp.c_str(), name) != 0) {
+    int err = errno;
+    ::close (fd);
+    unlink (tmp.c_str());
+    errno = err;
+    return -1;
+  }
+
+  return fd;
+}
+
+/*
+ * Map and index what has been appended to the file since the last call.
+ * Returns false if a bad entry was found.
+ */
+
+bool
+Combat::InterfaceCache::CacheFile::map ()
+{
+  struct stat sb;
+
+  if (broken) {
+    return false;
+  }
+
+  if (fstat (fd, &sb) != 0 ||
+      (size_t) sb.st_size < length + COMBAT_IFCACHE_ENTRY_LEN) {
+    return true;
+  }
+
+  Region r;
+  size_t end = (size_t) sb.st_size;
+
+#if defined(__WIN32__)
+  r.offset = length;
+  r.length = end - r.offset;
+  r.data = (char *) malloc (r.length);
+  if (r.data == NULL || lseek (fd, (long) r.offset, SEEK_SET) < 0 ||
+      read (fd, r.data, r.length) != (int) r.length) {
+    free (r.data);
+    return true;
+  }
+#else
+  size_t pagesize = (size_t) sysconf (_SC_PAGESIZE);
+  r.offset = length - length % pagesize;
+  r.length = end - r.offset;
+  void * mem = mmap (NULL, r.length, PROT_READ, MAP_SHARED, fd,
+		     (off_t) r.offset);
+  if (mem == MAP_FAILED) {
+    return true;
+  }
+  r.data = (char *) mem;
+#endif
+
+  regions.push_back (r);
+
+  const char * data = r.data - r.offset;
+
+  while (length + COMBAT_IFCACHE_ENTRY_LEN <= end) {
+    const char * ptr = data + length;
+    CORBA::ULong idlen = GetNumber (ptr);
+    CORBA::ULong desclen = GetNumber (ptr + 4);
+    CORBA::ULong sum = GetNumber (ptr + 8);
+
+    if (idlen > end || desclen > end ||
+	length + COMBAT_IFCACHE_ENTRY_LEN + idlen + desclen > end) {
+      /*
+       * Not complete yet
+       */
+      break;
+    }
+
+    ptr += COMBAT_IFCACHE_ENTRY_LEN;
+
+    if (Checksum (Checksum (1, ptr, idlen), ptr + idlen, desclen) != sum) {
+      broken = true;
+      return false;
+    }
+
+    std::string repoid (ptr, idlen);
+    index[repoid] = std::make_pair (ptr + idlen, (size_t) desclen);
+    length += COMBAT_IFCACHE_ENTRY_LEN + idlen + desclen;
+  }
+
+  return true;
+}
+
+void
+Combat::InterfaceCache::CacheFile::unmap ()
+{
+  for (size_t i=0; i<regions.size(); i++) {
+#if defined(__WIN32__)
+    free (regions[i].data);
+#else
+    munmap (regions[i].data, regions[i].length);
+#endif
+  }
+  regions.clear ();
+  length = COMBAT_IFCACHE_HEADER_LEN;
+  index.clear ();
+}
+
+#endif
+
+/*
+ * corba::init -ifcache file
+ */
+
+int
+Combat::InterfaceCache::open (Tcl_Interp * interp, const char * name)
+{
+  GlobalLock lock;
+
+  close ();
+
+  if (!*name) {
+    return TCL_OK;
+  }
+
+#if defined(COMBAT_HAVE_CODEC)
+  /*
+   * Use the file if it is ours, otherwise start a new one
+   */
+
+  char header[COMBAT_IFCACHE_HEADER_LEN];
+  std::string expect (COMBAT_IFCACHE_MAGIC);
+  PutNumber (expect, COMBAT_IFCACHE_VERSION);
+
+  int fd = ::open (name, O_RDWR | O_APPEND | O_BINARY);
+
+  if (fd >= 0 &&
+      (read (fd, header, COMBAT_IFCACHE_HEADER_LEN) !=
+       COMBAT_IFCACHE_HEADER_LEN ||
+       memcmp (header, expect.data(), COMBAT_IFCACHE_HEADER_LEN) != 0)) {
+    ::close (fd);
+    fd = -1;
+  }
+
+  file = new CacheFile;
+  file->name = name;
+  file->broken = false;
+  file->length = COMBAT_IFCACHE_HEADER_LEN;
+
+  if (fd >= 0) {
+    file->fd = fd;
+    if (file->map ()) {
+      return TCL_OK;
+    }
+
+    file->unmap ();
+    ::close (fd);
+    file->broken = false;
+  }
+
+  if ((file->fd = CreateCacheFile (name)) < 0) {
+    Tcl_AppendResult (interp, "error: cannot write interface cache \"",
+		      name, "\": ", Tcl_PosixError (interp), NULL);
+    delete file;
+    file = NULL;
+    return TCL_ERROR;
+  }
+
+  return TCL_OK;
+#else
+  Tcl_AppendResult (interp, "error: the interface cache is not ",
+		    "supported with this ORB", NULL);
+  return TCL_ERROR;
+#endif
+}
+
+void
+Combat::InterfaceCache::close ()
+{
+#if defined(COMBAT_HAVE_CODEC)
+  if (file) {
+    file->unmap ();
+    ::close (file->fd);
+    delete file;
+    file = NULL;
+  }
+#endif
+}
+
+/*
+ * Look up a description in the file. Returns NULL if there is none.
+ */
+
+CORBA::InterfaceDef::FullInterfaceDescription *
+Combat::InterfaceCache::load (const char * repoid)
+{
+#if defined(COMBAT_HAVE_CODEC)
+  if (!file || CORBA::is_nil (GlobalData->codec)) {
+    return NULL;
+  }
+
+  CacheFile::Index::iterator it = file->index.find (repoid);
+
+  if (it == file->index.end()) {
+    return NULL;
+  }
+
+  CORBA::ULong len = (*it).second.second;
+  CORBA::OctetSeq os (len, len, (CORBA::Octet *) (*it).second.first, 0);
+  CORBA::InterfaceDef::FullInterfaceDescription * fid =
+    new CORBA::InterfaceDef::FullInterfaceDescription;
+  CORBA::Any_var any;
+
+#ifdef HAVE_EXCEPTIONS
+  try {
+#endif
+    any = GlobalData->codec->decode_value (os,
+		  CORBA::InterfaceDef::_tc_FullInterfaceDescription);
+#ifdef HAVE_EXCEPTIONS
+  } catch (CORBA::Exception &) {
+    delete fid;
+    return NULL;
+  }
+#endif
+
+  if (!(any.in() >>= *fid) || strcmp (fid->id.in(), repoid) != 0) {
+    delete fid;
+    return NULL;
+  }
+
+  return fid;
+#else
+  return NULL;
+#endif
+}
+
+/*
+ * Append a description to the file, unless it is there already
+ */
+
+void
+Combat::InterfaceCache::store (const CORBA::InterfaceDef::FullInterfaceDescription & fid)
+{
+#if defined(COMBAT_HAVE_CODEC)
+  if (!file || file->broken || CORBA::is_nil (GlobalData->codec) ||
+      file->index.find (fid.id.in()) != file->index.end()) {
+    return;
+  }
+
+  CORBA::Any any;
+  CORBA::OctetSeq_var enc;
+
+  any <<= fid;
+
+#ifdef HAVE_EXCEPTIONS
+  try {
+#endif
+    enc = GlobalData->codec->encode_value (any);
+#ifdef HAVE_EXCEPTIONS
+  } catch (CORBA::Exception &) {
+    return;
+  }
+#endif
+
+  /*
+   * Write the entry in one go, so that entries from processes sharing
+   * the file are not mixed up
+   */
+
+  std::string entry;
+  CORBA::ULong idlen = strlen (fid.id.in());
+  const char * desc = (const char *) enc->get_buffer();
+
+  PutNumber (entry, idlen);
+  PutNumber (entry, enc->length());
+  PutNumber (entry, Checksum (Checksum (1, fid.id.in(), idlen),
+			      desc, enc->length()));
+  entry.append (fid.id.in(), idlen);
+  entry.append (desc, enc->length());
+
+  if (write (file->fd, entry.data(), entry.length()) != (int) entry.length()) {
+    return;
+  }
+
+  /*
+   * Map and index it, along with what others have added meanwhile
+   */
+
+  file->map ();
+#endif
+}
@@ -0,0 +1,2961 @@
+/*
+ * ======================================================================
+ *
+ * This file is part of Combat, the Tcl interface for CORBA
+ * Copyright (c) Frank Pilhofer
+ *
+ * ======================================================================
+ */
+
+/*
+ * ----------------------------------------------------------------------
+ * Compiled Marshalling Plans
+ * ----------------------------------------------------------------------
+ *
+ * Packing a value through DynAny costs one ORB object per node of the
+ * type and one virtual call per leaf, followed by a to_any() copy. For
+ * most types, we can do better: a TypeCode is compiled once into a flat
+ * list of opcodes, and values are then encoded by running that list,
+ * writing CDR into a buffer that the IOP::Codec turns into an Any.
+ *
+ * Any value that the plan does not like makes Pack() return NULL; the
+ * caller then retries with the DynAny-based packer, which also produces
+ * the proper error message. Plans therefore never report errors.
+ */
+
+#include "combat.h"
+#include "tclmap.h"
+#include <vector>
+#include <map>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+char * combat_marshal_id = "$Id$";
+
+/*
+ * Limits for plan compilation and caching. Recursive types are caught
+ * by the nesting limit and left to DynAny.
+ */
+
+#define COMBAT_PLAN_MAX_NESTING 32
+#define COMBAT_PLAN_CACHE_SIZE  1024
+
+/*
+ * ----------------------------------------------------------------------
+ * CDR output buffer
+ * ----------------------------------------------------------------------
+ *
+ * Data is written in native byte order. The buffer starts with the byte
+ * order flag of an encapsulation, and alignment is relative to the
+ * beginning of the buffer.
+ */
+
+static CORBA::Octet
+NativeByteOrder ()
+{
+  CORBA::UShort one = 1;
+  return *((CORBA::Octet *) &one);
+}
+
+class Combat::CdrOut {
+public:
+  CdrOut ();
+  ~CdrOut ();
+
+  CORBA::ULong length () { return len; }
+  CORBA::Octet * buffer () { return buf; }
+
+  void align (CORBA::ULong);
+  void put (const void *, CORBA::ULong);
+  CORBA::Octet * extend (CORBA::ULong);
+
+  void put_octet     (CORBA::Octet);
+  void put_ushort    (CORBA::UShort);
+  void put_ulong     (CORBA::ULong);
+  void put_ulonglong (CORBA::ULongLong);
+  void put_float     (CORBA::Float);
+  void put_double    (CORBA::Double);
+  void put_string    (const char *, CORBA::ULong);
+
+private:
+  void reserve (CORBA::ULong);
+
+  CORBA::Octet * buf;
+  CORBA::ULong len, max;
+};
+
+Combat::CdrOut::CdrOut ()
+{
+  max = 256;
+  len = 0;
+  buf = CORBA::OctetSeq::allocbuf (max);
+  put_octet (NativeByteOrder ());
+}
+
+Combat::CdrOut::~CdrOut ()
+{
+  CORBA::OctetSeq::freebuf (buf);
+}
+
+void
+Combat::CdrOut::reserve (CORBA::ULong count)
+{
+  if (len + count <= max) {
+    return;
+  }
+
+  CORBA::ULong nmax = 2 * max;
+  while (len + count > nmax) {
+    nmax *= 2;
+  }
+
+  CORBA::Octet * nbuf = CORBA::OctetSeq::allocbuf (nmax);
+  memcpy (nbuf, buf, len);
+  CORBA::OctetSeq::freebuf (buf);
+  buf = nbuf;
+  max = nmax;
+}
+
+void
+Combat::CdrOut::align (CORBA::ULong a)
+{
+  CORBA::ULong pad = (a - (len % a)) % a;
+  if (pad) {
+    reserve (pad);
+    memset (buf + len, 0, pad);
+    len += pad;
+  }
+}
+
+void
+Combat::CdrOut::put (const void * data, CORBA::ULong count)
+{
+  reserve (count);
+  memcpy (buf + len, data, count);
+  len += count;
+}
+
+/*
+ * Append count octets, to be filled in by the caller
+ */
+
+CORBA::Octet *
+Combat::CdrOut::extend (CORBA::ULong count)
+{
+  reserve (count);
+  len += count;
+  return buf + len - count;
+}
+
+void
+Combat::CdrOut::put_octet (CORBA::Octet val)
+{
+  reserve (1);
+  buf[len++] = val;
+}
+
+void
+Combat::CdrOut::put_ushort (CORBA::UShort val)
+{
+  align (2);
+  put (&val, 2);
+}
+
+void
+Combat::CdrOut::put_ulong (CORBA::ULong val)
+{
+  align (4);
+  put (&val, 4);
+}
+
+void
+Combat::CdrOut::put_ulonglong (CORBA::ULongLong val)
+{
+  align (8);
+  put (&val, 8);
+}
+
+void
+Combat::CdrOut::put_float (CORBA::Float val)
+{
+  align (4);
+  put (&val, 4);
+}
+
+void
+Combat::CdrOut::put_double (CORBA::Double val)
+{
+  align (8);
+  put (&val, 8);
+}
+
+void
+Combat::CdrOut::put_string (const char * str, CORBA::ULong count)
+{
+  put_ulong (count + 1);
+  put (str, count);
+  put_octet (0);
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * CDR input buffer
+ * ----------------------------------------------------------------------
+ *
+ * Reads an encapsulation as produced by the Codec, in either byte order.
+ * All accessors fail rather than read beyond the end of the buffer.
+ */
+
+class Combat::CdrIn {
+public:
+  CdrIn (const CORBA::Octet *, CORBA::ULong);
+
+  CORBA::ULong position () { return pos; }
+  CORBA::ULong remaining () { return (pos < len) ? len - pos : 0; }
+  bool swapped () { return swap; }
+  const CORBA::Octet * buffer () { return buf; }
+
+  bool align (CORBA::ULong);
+  const CORBA::Octet * get (CORBA::ULong);
+
+  bool get_octet     (CORBA::Octet &);
+  bool get_ushort    (CORBA::UShort &);
+  bool get_ulong     (CORBA::ULong &);
+  bool get_ulonglong (CORBA::ULongLong &);
+  bool get_float     (CORBA::Float &);
+  bool get_double    (CORBA::Double &);
+  bool get_string    (const char *&, CORBA::ULong &);
+
+private:
+  bool get_swapped (void *, CORBA::ULong);
+
+  const CORBA::Octet * buf;
+  CORBA::ULong len, pos;
+  bool swap;
+};
+
+Combat::CdrIn::CdrIn (const CORBA::Octet * _b, CORBA::ULong _l)
+{
+  buf = _b;
+  len = _l;
+  pos = 1;
+  swap = (len > 0 && buf[0] != NativeByteOrder ());
+}
+
+bool
+Combat::CdrIn::align (CORBA::ULong a)
+{
+  CORBA::ULong npos = (pos + a - 1) / a * a;
+  if (npos > len) {
+    return false;
+  }
+  pos = npos;
+  return true;
+}
+
+const CORBA::Octet *
+Combat::CdrIn::get (CORBA::ULong count)
+{
+  if (pos > len || count > len - pos) {
+    return NULL;
+  }
+  const CORBA::Octet * res = buf + pos;
+  pos += count;
+  return res;
+}
+
+bool
+Combat::CdrIn::get_swapped (void * data, CORBA::ULong count)
+{
+  const CORBA::Octet * src;
+
+  if (!align (count) || (src = get (count)) == NULL) {
+    return false;
+  }
+
+  if (swap) {
+    CORBA::Octet * dst = (CORBA::Octet *) data;
+    for (CORBA::ULong i=0; i<count; i++) {
+      dst[i] = src[count-i-1];
+    }
+  }
+  else {
+    memcpy (data, src, count);
+  }
+
+  return true;
+}
+
+bool
+Combat::CdrIn::get_octet (CORBA::Octet & val)
+{
+  const CORBA::Octet * src = get (1);
+  if (!src) {
+    return false;
+  }
+  val = *src;
+  return true;
+}
+
+bool
+Combat::CdrIn::get_ushort (CORBA::UShort & val)
+{
+  return get_swapped (&val, 2);
+}
+
+bool
+Combat::CdrIn::get_ulong (CORBA::ULong & val)
+{
+  return get_swapped (&val, 4);
+}
+
+bool
+Combat::CdrIn::get_ulonglong (CORBA::ULongLong & val)
+{
+  return get_swapped (&val, 8);
+}
+
+bool
+Combat::CdrIn::get_float (CORBA::Float & val)
+{
+  return get_swapped (&val, 4);
+}
+
+bool
+Combat::CdrIn::get_double (CORBA::Double & val)
+{
+  return get_swapped (&val, 8);
+}
+
+/*
+ * Returns a pointer into the buffer and the length without the trailing
+ * null character
+ */
+
+bool
+Combat::CdrIn::get_string (const char *& str, CORBA::ULong & count)
+{
+  CORBA::ULong slen;
+
+  if (!get_ulong (slen) || slen == 0 ||
+      (str = (const char *) get (slen)) == NULL ||
+      str[slen-1] != '\0') {
+    return false;
+  }
+
+  count = slen - 1;
+  return true;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * Helpers
+ * ----------------------------------------------------------------------
+ */
+
+/*
+ * Numbers that a script has computed, or that Combat has returned,
+ * carry one of Tcl's numeric internal reps. Reading that directly saves
+ * generating a string rep just to parse it again. Other objects, and
+ * values that are out of range, are left to the string parsers, which
+ * also produce the error messages.
+ */
+
+Tcl_ObjType * Combat::IntTypePtr = NULL;
+Tcl_ObjType * Combat::WideIntTypePtr = NULL;
+Tcl_ObjType * Combat::DoubleTypePtr = NULL;
+
+bool
+Combat::GetNativeInteger (Tcl_Obj * data, CORBA::TCKind kind,
+			  CORBA::LongLong & val)
+{
+  CORBA::LongLong tval;
+
+  if (data->typePtr == NULL) {
+    return false;
+  }
+  else if (data->typePtr == IntTypePtr) {
+    tval = (CORBA::LongLong) data->internalRep.longValue;
+  }
+#if TCL_MAJOR_VERSION > 8 || (TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION >= 4)
+  else if (data->typePtr == WideIntTypePtr) {
+    tval = (CORBA::LongLong) data->internalRep.wideValue;
+  }
+#endif
+  else {
+    return false;
+  }
+
+  switch (kind) {
+  case CORBA::tk_short:
+    if (tval < -32768 || tval > 32767) {
+      return false;
+    }
+    break;
+
+  case CORBA::tk_long:
+    if (tval < -2147483647 - 1 || tval > 2147483647) {
+      return false;
+    }
+    break;
+
+  case CORBA::tk_ushort:
+    if (tval < 0 || tval > 65535) {
+      return false;
+    }
+    break;
+
+  case CORBA::tk_ulong:
+    if (tval < 0 || tval > 4294967295LL) {
+      return false;
+    }
+    break;
+
+  case CORBA::tk_longlong:
+    break;
+
+  case CORBA::tk_ulonglong:
+    if (tval < 0) {
+      return false;
+    }
+    break;
+
+  default:
+    return false;
+  }
+
+  val = tval;
+  return true;
+}
+
+bool
+Combat::GetNativeDouble (Tcl_Obj * data, double & val)
+{
+  if (data->typePtr == NULL) {
+    return false;
+  }
+  else if (data->typePtr == DoubleTypePtr) {
+    val = data->internalRep.doubleValue;
+  }
+  else if (data->typePtr == IntTypePtr) {
+    val = (double) data->internalRep.longValue;
+  }
+#if TCL_MAJOR_VERSION > 8 || (TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION >= 4)
+  else if (data->typePtr == WideIntTypePtr) {
+    val = (double) data->internalRep.wideValue;
+  }
+#endif
+  else {
+    return false;
+  }
+
+  return true;
+}
+
+/*
+ * Parse an integer just like the DynAny packer does: an optional sign,
+ * anything that strtoul accepts, and an optional fraction of zeros.
+ */
+
+static bool
+ParseInteger (Tcl_Obj * data, bool & neg, unsigned long & mag)
+{
+  char *tmp, *ptr;
+
+  tmp = Tcl_GetStringFromObj (data, NULL);
+  while (*tmp == ' ') tmp++;
+
+  neg = false;
+
+  if (*tmp == '-') {
+    neg = true;
+    tmp++;
+  }
+  else if (*tmp == '+') {
+    tmp++;
+  }
+
+  errno = 0;
+  mag = strtoul (tmp, &ptr, 0);
+
+  if (errno == ERANGE) {
+    return false;
+  }
+
+  if (*ptr == '.') {
+    ptr++;
+    while (*ptr == '0') ptr++;
+  }
+
+  while (*ptr == ' ') {
+    ptr++;
+  }
+
+  return (*ptr == '\0');
+}
+
+/*
+ * Get the value of an integral type, checking its range
+ */
+
+static bool
+GetInteger (Tcl_Obj * data, CORBA::TCKind kind, CORBA::LongLong & val)
+{
+  unsigned long mag;
+  bool neg;
+
+  if (Combat::GetNativeInteger (data, kind, val)) {
+    return true;
+  }
+
+  switch (kind) {
+  case CORBA::tk_short:
+    if (!ParseInteger (data, neg, mag) || mag > (neg ? 32768UL : 32767UL)) {
+      return false;
+    }
+    val = neg ? -((CORBA::LongLong) mag) : (CORBA::LongLong) mag;
+    break;
+
+  case CORBA::tk_long:
+    if (!ParseInteger (data, neg, mag) ||
+	mag > (neg ? 2147483648UL : 2147483647UL)) {
+      return false;
+    }
+    val = neg ? -((CORBA::LongLong) mag) : (CORBA::LongLong) mag;
+    break;
+
+  case CORBA::tk_ushort:
+    if (!ParseInteger (data, neg, mag) || (neg && mag) || mag > 65535UL) {
+      return false;
+    }
+    val = (CORBA::LongLong) mag;
+    break;
+
+  case CORBA::tk_ulong:
+    if (!ParseInteger (data, neg, mag) || (neg && mag) ||
+	mag > 4294967295UL) {
+      return false;
+    }
+    val = (CORBA::LongLong) mag;
+    break;
+
+  case CORBA::tk_longlong:
+    {
+      long long tval;
+      if (sscanf (Tcl_GetStringFromObj (data, NULL), "%Ld", &tval) != 1) {
+	return false;
+      }
+      val = (CORBA::LongLong) tval;
+    }
+    break;
+
+  case CORBA::tk_ulonglong:
+    {
+      unsigned long long tval;
+      if (sscanf (Tcl_GetStringFromObj (data, NULL), "%Lu", &tval) != 1) {
+	return false;
+      }
+      val = (CORBA::LongLong) tval;
+    }
+    break;
+
+  default:
+    return false;
+  }
+
+  return true;
+}
+
+/*
+ * Append the encoding of an Any's value, as produced by the Codec. The
+ * encapsulation's padding only carries over if the value lands at the
+ * same offset, modulo its largest alignment, as in the encapsulation.
+ */
+
+#if defined(COMBAT_HAVE_CODEC)
+
+static bool
+SpliceAny (Combat::CdrOut & out, const CORBA::Any & any,
+	   CORBA::ULong align, CORBA::ULong maxalign)
+{
+  CORBA::OctetSeq_var enc = Combat::GlobalData->codec->encode_value (any);
+  const CORBA::Octet * ebuf = enc->get_buffer ();
+  CORBA::ULong elen = enc->length ();
+
+  CORBA::ULong src = (1 + align - 1) / align * align;
+  CORBA::ULong dst = (out.length() + align - 1) / align * align;
+
+  if (elen < src || ebuf[0] != NativeByteOrder () ||
+      src % maxalign != dst % maxalign) {
+    return false;
+  }
+
+  out.align (align);
+  out.put (ebuf + src, elen - src);
+  return true;
+}
+
+#endif
+
+/*
+ * Skip over an encoded TypeCode or object reference. Indirections within
+ * a TypeCode always point into the top-level TypeCode, so the skipped
+ * range can be decoded on its own.
+ */
+
+static bool
+SkipTypeCode (Combat::CdrIn & in)
+{
+  CORBA::ULong kind, tmp;
+  CORBA::UShort stmp;
+
+  if (!in.get_ulong (kind)) {
+    return false;
+  }
+
+  switch (kind) {
+  case CORBA::tk_null:
+  case CORBA::tk_void:
+  case CORBA::tk_short:
+  case CORBA::tk_long:
+  case CORBA::tk_ushort:
+  case CORBA::tk_ulong:
+  case CORBA::tk_float:
+  case CORBA::tk_double:
+  case CORBA::tk_boolean:
+  case CORBA::tk_char:
+  case CORBA::tk_octet:
+  case CORBA::tk_any:
+  case CORBA::tk_TypeCode:
+  case CORBA::tk_Principal:
+  case CORBA::tk_longlong:
+  case CORBA::tk_ulonglong:
+  case CORBA::tk_longdouble:
+  case CORBA::tk_wchar:
+    return true;
+
+  case CORBA::tk_string:
+  case CORBA::tk_wstring:
+  case 0xffffffff:		// indirection
+    return in.get_ulong (tmp);
+
+  case CORBA::tk_fixed:
+    return in.get_ushort (stmp) && in.get_ushort (stmp);
+
+  case CORBA::tk_objref:
+  case CORBA::tk_struct:
+  case CORBA::tk_union:
+  case CORBA::tk_enum:
+  case CORBA::tk_sequence:
+  case CORBA::tk_array:
+  case CORBA::tk_alias:
+  case CORBA::tk_except:
+  case CORBA::tk_value:
+  case CORBA::tk_value_box:
+  case CORBA::tk_native:
+  case CORBA::tk_abstract_interface:
+  case CORBA::tk_local_interface:
+    return in.get_ulong (tmp) && in.get (tmp) != NULL;
+  }
+
+  return false;
+}
+
+static bool
+SkipObjref (Combat::CdrIn & in, CORBA::ULong & profiles)
+{
+  CORBA::ULong i, tmp, count;
+  const char * str;
+
+  if (!in.get_string (str, tmp) || !in.get_ulong (profiles)) {
+    return false;
+  }
+
+  for (i=0; i<profiles; i++) {
+    if (!in.get_ulong (tmp) || !in.get_ulong (count) ||
+	in.get (count) == NULL) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/*
+ * Decode part of an encapsulation, from start to the current position
+ * of the reader, as a value of the given type. The data is copied to an
+ * encapsulation of its own, at the same offset modulo 8, so that its
+ * padding remains valid.
+ */
+
+#if defined(COMBAT_HAVE_CODEC)
+
+static CORBA::Any *
+DecodeRange (Combat::CdrIn & in, CORBA::ULong start, CORBA::TypeCode_ptr tc)
+{
+  CORBA::ULong count = in.position () - start;
+  CORBA::ULong offset = (start % 8) ? (start % 8) : 8;
+  CORBA::OctetSeq os;
+  CORBA::Any * res;
+
+  os.length (offset + count);
+  memset (os.get_buffer(), 0, offset);
+  os[0] = in.buffer()[0];
+  memcpy (os.get_buffer() + offset, in.buffer() + start, count);
+
+#ifdef HAVE_EXCEPTIONS
+  try {
+#endif
+    res = Combat::GlobalData->codec->decode_value (os, tc);
+#ifdef HAVE_EXCEPTIONS
+  } catch (CORBA::Exception &) {
+    res = NULL;
+  }
+#endif
+
+  return res;
+}
+
+static CORBA::TypeCode_ptr
+ReadTypeCode (Combat::CdrIn & in)
+{
+  CORBA::TypeCode_ptr tc;
+  CORBA::Any * any;
+  CORBA::ULong start;
+
+  if (!in.align (4)) {
+    return CORBA::TypeCode::_nil ();
+  }
+
+  start = in.position ();
+
+  if (!SkipTypeCode (in) ||
+      (any = DecodeRange (in, start, CORBA::_tc_TypeCode)) == NULL) {
+    return CORBA::TypeCode::_nil ();
+  }
+
+  if (*any >>= tc) {
+    tc = CORBA::TypeCode::_duplicate (tc);
+  }
+  else {
+    tc = CORBA::TypeCode::_nil ();
+  }
+
+  delete any;
+  return tc;
+}
+
+#endif
+
+/*
+ * Whether a type contains object references. Only used for types that
+ * cannot be compiled into a plan, i.e., valuetypes and recursive types.
+ * The types that are being looked at are kept on the caller's stack.
+ */
+
+static bool
+ContainsObjref (CORBA::TypeCode_ptr tc, std::vector<void*> & recursion)
+{
+  CORBA::TypeCode_var ctc;
+
+  switch (tc->kind()) {
+  case CORBA::tk_objref:
+    return true;
+  case CORBA::tk_struct:
+  case CORBA::tk_except:
+  case CORBA::tk_union:
+  case CORBA::tk_value:
+    {
+      for (CORBA::ULong idx=0; idx<recursion.size(); idx++) {
+	if ((void *) tc == recursion[idx]) {
+	  return false;
+	}
+      }
+
+      recursion.push_back ((void *) tc);
+
+      CORBA::ULong len = tc->member_count();
+      for (CORBA::ULong i=0; i<len; i++) {
+	ctc = tc->member_type (i);
+
+	if (ContainsObjref (ctc.in(), recursion)) {
+	  recursion.pop_back ();
+	  return true;
+	}
+      }
+      recursion.pop_back ();
+    }
+    break;
+  case CORBA::tk_sequence:
+  case CORBA::tk_array:
+  case CORBA::tk_value_box:
+  case CORBA::tk_alias:
+    ctc = tc->content_type ();
+    return ContainsObjref (ctc.in(), recursion);
+  default:
+    break;
+  }
+  return false;
+}
+
+static bool
+ContainsObjref (CORBA::TypeCode_ptr tc)
+{
+  std::vector<void*> recursion;
+  return ContainsObjref (tc, recursion);
+}
+
+/*
+ * Get the numeric value of a union label. Only done once per plan, so
+ * we can afford a DynAny here.
+ */
+
+static bool
+LabelValue (const CORBA::Any & label, Combat::MarshalPlan::OpCode code,
+	    CORBA::LongLong & val)
+{
+  if (CORBA::is_nil (Combat::GlobalData->daf)) {
+    return false;
+  }
+
+  DynamicAny::DynAny_var da =
+    Combat::GlobalData->daf->create_dyn_any (label);
+  bool res = true;
+
+  switch (code) {
+  case Combat::MarshalPlan::OpShort:
+    val = da->get_short ();
+    break;
+  case Combat::MarshalPlan::OpLong:
+    val = da->get_long ();
+    break;
+  case Combat::MarshalPlan::OpUShort:
+    val = da->get_ushort ();
+    break;
+  case Combat::MarshalPlan::OpULong:
+    val = da->get_ulong ();
+    break;
+  case Combat::MarshalPlan::OpLongLong:
+    val = da->get_longlong ();
+    break;
+  case Combat::MarshalPlan::OpULongLong:
+    val = (CORBA::LongLong) da->get_ulonglong ();
+    break;
+  case Combat::MarshalPlan::OpBoolean:
+    val = da->get_boolean () ? 1 : 0;
+    break;
+  case Combat::MarshalPlan::OpChar:
+    val = (unsigned char) da->get_char ();
+    break;
+  case Combat::MarshalPlan::OpEnum:
+    {
+      DynamicAny::DynEnum_var de = DynamicAny::DynEnum::_narrow (da);
+      val = de->get_as_ulong ();
+    }
+    break;
+  default:
+    res = false;
+  }
+
+  da->destroy ();
+  return res;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * Sequences of numbers
+ * ----------------------------------------------------------------------
+ *
+ * Sequences and arrays of numbers are converted as a whole, between a
+ * Tcl list and a contiguous buffer of native values, rather than one
+ * element at a time. Scripts may also pass such a buffer directly as a
+ * byte array, as made by [binary format], and can ask for results in
+ * that form using the -packednumbers option of corba::init. Used by the
+ * plans as well as by the DynAny-based packer and extractor.
+ */
+
+Tcl_ObjType * Combat::ByteArrayTypePtr = NULL;
+
+/*
+ * Size of an element, or 0 if the kind is not a number
+ */
+
+CORBA::ULong
+Combat::NumberSize (CORBA::TCKind kind)
+{
+  switch (kind) {
+  case CORBA::tk_short:
+  case CORBA::tk_ushort:
+    return 2;
+  case CORBA::tk_long:
+  case CORBA::tk_ulong:
+  case CORBA::tk_float:
+    return 4;
+  case CORBA::tk_longlong:
+  case CORBA::tk_ulonglong:
+  case CORBA::tk_double:
+    return 8;
+  default:
+    break;
+  }
+  return 0;
+}
+
+/*
+ * Convert a list of numbers into a buffer of native values. Fails on
+ * the first element that does not fit; callers then fall back to code
+ * that reports the error.
+ */
+
+bool
+Combat::GetNumbers (Tcl_Obj ** elems, CORBA::ULong count,
+		    CORBA::TCKind kind, void * buf)
+{
+  CORBA::LongLong val;
+  CORBA::ULong i;
+  double tval;
+
+  switch (kind) {
+  case CORBA::tk_short:
+  case CORBA::tk_ushort:
+    for (i=0; i<count; i++) {
+      if (!GetInteger (elems[i], kind, val)) {
+	return false;
+      }
+      ((CORBA::UShort *) buf)[i] = (CORBA::UShort) val;
+    }
+    break;
+
+  case CORBA::tk_long:
+  case CORBA::tk_ulong:
+    for (i=0; i<count; i++) {
+      if (!GetInteger (elems[i], kind, val)) {
+	return false;
+      }
+      ((CORBA::ULong *) buf)[i] = (CORBA::ULong) val;
+    }
+    break;
+
+  case CORBA::tk_longlong:
+  case CORBA::tk_ulonglong:
+    for (i=0; i<count; i++) {
+      if (!GetInteger (elems[i], kind, val)) {
+	return false;
+      }
+      ((CORBA::ULongLong *) buf)[i] = (CORBA::ULongLong) val;
+    }
+    break;
+
+  case CORBA::tk_float:
+    for (i=0; i<count; i++) {
+      if (!GetNativeDouble (elems[i], tval) &&
+	  Tcl_GetDoubleFromObj (NULL, elems[i], &tval) != TCL_OK) {
+	return false;
+      }
+      ((CORBA::Float *) buf)[i] = (CORBA::Float) tval;
+    }
+    break;
+
+  case CORBA::tk_double:
+    for (i=0; i<count; i++) {
+      if (!GetNativeDouble (elems[i], tval) &&
+	  Tcl_GetDoubleFromObj (NULL, elems[i], &tval) != TCL_OK) {
+	return false;
+      }
+      ((CORBA::Double *) buf)[i] = (CORBA::Double) tval;
+    }
+    break;
+
+  default:
+    return false;
+  }
+
+  return true;
+}
+
+static void
+SwapNumber (const CORBA::Octet * src, CORBA::Octet * dst, CORBA::ULong size)
+{
+  for (CORBA::ULong i=0; i<size; i++) {
+    dst[i] = src[size-i-1];
+  }
+}
+
+/*
+ * Same representation as Combat_Extractor uses, except that unsigned
+ * shorts always fit into a long
+ */
+
+static Tcl_Obj *
+NewNumberObj (CORBA::TCKind kind, const CORBA::Octet * src)
+{
+  char tmp[64];
+
+  switch (kind) {
+  case CORBA::tk_short:
+    {
+      CORBA::Short val;
+      memcpy (&val, src, 2);
+      return Tcl_NewLongObj (val);
+    }
+
+  case CORBA::tk_ushort:
+    {
+      CORBA::UShort val;
+      memcpy (&val, src, 2);
+      return Tcl_NewLongObj (val);
+    }
+
+  case CORBA::tk_long:
+    {
+      CORBA::Long val;
+      memcpy (&val, src, 4);
+      return Tcl_NewLongObj (val);
+    }
+
+  case CORBA::tk_ulong:
+    {
+      CORBA::ULong val;
+      memcpy (&val, src, 4);
+      sprintf (tmp, "%lu", (unsigned long) val);
+      return Tcl_NewStringObj (tmp, -1);
+    }
+
+  case CORBA::tk_longlong:
+    {
+      CORBA::LongLong val;
+      memcpy (&val, src, 8);
+      sprintf (tmp, "%Ld", (long long) val);
+      return Tcl_NewStringObj (tmp, -1);
+    }
+
+  case CORBA::tk_ulonglong:
+    {
+      CORBA::ULongLong val;
+      memcpy (&val, src, 8);
+      sprintf (tmp, "%Lu", (unsigned long long) val);
+      return Tcl_NewStringObj (tmp, -1);
+    }
+
+  case CORBA::tk_float:
+    {
+      CORBA::Float val;
+      memcpy (&val, src, 4);
+      return Tcl_NewDoubleObj (val);
+    }
+
+  case CORBA::tk_double:
+    {
+      CORBA::Double val;
+      memcpy (&val, src, 8);
+      return Tcl_NewDoubleObj (val);
+    }
+
+  default:
+    assert (0);
+  }
+
+  return NULL;
+}
+
+/*
+ * Make a list from a buffer of numbers, or a byte array if the script
+ * asked for packed numbers. The buffer is in native byte order unless
+ * swap is set.
+ */
+
+Tcl_Obj *
+Combat::NewNumbersObj (Context * ctx, CORBA::TCKind kind, const void * buf,
+		       CORBA::ULong count, bool swap)
+{
+  const CORBA::Octet * src = (const CORBA::Octet *) buf;
+  CORBA::ULong i, size = NumberSize (kind);
+  CORBA::Octet tmp[8];
+
+  if (count == 0) {
+    return Tcl_NewObj ();
+  }
+
+  if (ctx && ctx->packedNumbers) {
+    std::vector<CORBA::Octet> native;
+
+    if (swap) {
+      native.resize (count * size);
+      for (i=0; i<count; i++) {
+	SwapNumber (src + i*size, &native[i*size], size);
+      }
+      src = &native[0];
+    }
+
+#if TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION == 0
+    return Tcl_NewStringObj ((char *) src, count * size);
+#else
+    return Tcl_NewByteArrayObj ((unsigned char *) src, count * size);
+#endif
+  }
+
+  std::vector<Tcl_Obj *> elems (count);
+
+  for (i=0; i<count; i++, src+=size) {
+    if (swap) {
+      SwapNumber (src, tmp, size);
+      elems[i] = NewNumberObj (kind, tmp);
+    }
+    else {
+      elems[i] = NewNumberObj (kind, src);
+    }
+  }
+
+  return Tcl_NewListObj (count, &elems[0]);
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * Plan cache
+ * ----------------------------------------------------------------------
+ *
+ * Plans are keyed by TypeCode identity. The plan holds a reference to
+ * its TypeCode, so that the pointer cannot be reused while the plan is
+ * in the cache. Plans are reference counted, the cache owns one of the
+ * references; if the cache overflows, it is simply flushed. The cache
+ * and the reference counts are protected by the global lock.
+ *
+ * TypeCodes that are decoded from a value, e.g. that of an Any, are new
+ * each time, so they never match by identity. Plans for named types and
+ * for basic types are therefore also found by a key (see PlanKey), and
+ * an equal TypeCode. Transient TypeCodes without a key, i.e. anonymous
+ * sequences and arrays, bounded strings and fixed, get a plan of their
+ * own that is not cached, rather than churning the cache.
+ */
+
+typedef TclIntegerMap<CORBA::TypeCode_ptr, Combat::MarshalPlan *> PlanMap;
+typedef std::multimap<std::string, Combat::MarshalPlan *> PlanKeyMap;
+static PlanMap * PlanCache = NULL;
+static PlanKeyMap PlanKeys;
+static CORBA::ULong PlanCacheSize = 0;
+
+static bool
+PlanKey (CORBA::TypeCode_ptr tc, std::string & key)
+{
+  char tmp[32];
+
+  switch (tc->kind()) {
+  case CORBA::tk_objref:
+  case CORBA::tk_struct:
+  case CORBA::tk_union:
+  case CORBA::tk_enum:
+  case CORBA::tk_alias:
+  case CORBA::tk_except:
+  case CORBA::tk_value:
+  case CORBA::tk_value_box:
+  case CORBA::tk_native:
+  case CORBA::tk_abstract_interface:
+  case CORBA::tk_local_interface:
+    key = tc->id ();
+    return true;
+
+  case CORBA::tk_sequence:
+  case CORBA::tk_array:
+  case CORBA::tk_fixed:
+    return false;
+
+  case CORBA::tk_string:
+  case CORBA::tk_wstring:
+    if (tc->length() != 0) {
+      return false;
+    }
+    break;
+
+  default:
+    break;
+  }
+
+  sprintf (tmp, "#%lu", (unsigned long) tc->kind());
+  key = tmp;
+  return true;
+}
+
+Combat::MarshalPlan *
+Combat::MarshalPlan::Lookup (CORBA::TypeCode_ptr tc, bool transient)
+{
+  GlobalLock lock;
+
+  if (PlanCache == NULL) {
+    PlanCache = new PlanMap;
+  }
+
+  PlanMap::iterator it = PlanCache->find (tc);
+
+  if (it != PlanCache->end()) {
+    MarshalPlan * plan = (*it).second;
+    plan->ref ();
+    return plan;
+  }
+
+  std::string key;
+  bool haskey = false;
+
+#ifdef HAVE_EXCEPTIONS
+  try {
+#endif
+    haskey = PlanKey (tc, key);
+#ifdef HAVE_EXCEPTIONS
+  } catch (CORBA::Exception &) {
+  }
+#endif
+
+  if (haskey) {
+    std::pair<PlanKeyMap::iterator, PlanKeyMap::iterator> range =
+      PlanKeys.equal_range (key);
+
+    for (PlanKeyMap::iterator ki = range.first; ki != range.second; ki++) {
+      if ((*ki).second->type->equal (tc)) {
+	MarshalPlan * plan = (*ki).second;
+	plan->ref ();
+	return plan;
+      }
+    }
+  }
+  else if (transient) {
+    return new MarshalPlan (tc);
+  }
+
+  if (PlanCacheSize >= COMBAT_PLAN_CACHE_SIZE) {
+    for (it = PlanCache->begin(); it != PlanCache->end(); it++) {
+      (*it).second->deref ();
+    }
+    delete PlanCache;
+    PlanCache = new PlanMap;
+    PlanKeys.clear ();
+    PlanCacheSize = 0;
+  }
+
+  MarshalPlan * plan = new MarshalPlan (tc);
+  PlanCache->insert (tc, plan);
+  if (haskey) {
+    PlanKeys.insert (PlanKeyMap::value_type (key, plan));
+  }
+  PlanCacheSize++;
+  plan->ref ();
+  return plan;
+}
+
+void
+Combat::MarshalPlan::ref ()
+{
+  GlobalLock lock;
+  refs++;
+}
+
+void
+Combat::MarshalPlan::deref ()
+{
+  GlobalLock lock;
+  if (--refs == 0) {
+    delete this;
+  }
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * Plan compilation
+ * ----------------------------------------------------------------------
+ */
+
+/*
+ * Index of struct member names or enumerators. Serial numbers identify
+ * the index in the names' Tcl_Obj (see FindMember); they are never
+ * reused.
+ */
+
+struct Combat::MarshalPlan::NameIndex {
+  NameIndex ();
+
+  unsigned long serial;
+  TclStringMap<CORBA::ULong> map;
+};
+
+static unsigned long NameIndexSerial = 0;
+
+Combat::MarshalPlan::NameIndex::NameIndex ()
+{
+  serial = ++NameIndexSerial;
+}
+
+Combat::MarshalPlan::MarshalPlan (CORBA::TypeCode_ptr tc)
+{
+  refs = 1;
+  complete = true;
+  type = CORBA::TypeCode::_duplicate (tc);
+
+#ifdef HAVE_EXCEPTIONS
+  try {
+#endif
+    compiled = Compile (tc, 0);
+#ifdef HAVE_EXCEPTIONS
+  } catch (CORBA::Exception &) {
+    compiled = false;
+  }
+#endif
+
+  if (!compiled) {
+    complete = false;
+    ops.clear ();
+    unions.clear ();
+    for (CORBA::ULong i=0; i<names.size(); i++) {
+      delete names[i];
+    }
+    names.clear ();
+  }
+
+  /*
+   * These are needed even if the type could not be compiled
+   */
+
+  CORBA::TypeCode_var utc = CORBA::TypeCode::_duplicate (tc);
+
+  while (utc->kind() == CORBA::tk_alias) {
+    utc = utc->content_type ();
+  }
+
+  rkind = utc->kind ();
+  ckind = CORBA::tk_null;
+
+  if (rkind == CORBA::tk_sequence || rkind == CORBA::tk_array) {
+    CORBA::TypeCode_var ctc = utc->content_type ();
+    while (ctc->kind() == CORBA::tk_alias) {
+      ctc = ctc->content_type ();
+    }
+    ckind = ctc->kind ();
+  }
+
+  objref = compiled ? ops[0].objref : ContainsObjref (tc);
+}
+
+Combat::MarshalPlan::~MarshalPlan ()
+{
+  for (CORBA::ULong i=0; i<names.size(); i++) {
+    delete names[i];
+  }
+}
+
+bool
+Combat::MarshalPlan::usable ()
+{
+#if defined(COMBAT_HAVE_CODEC)
+  return compiled && complete && GlobalData->useplans &&
+    !CORBA::is_nil (GlobalData->codec);
+#else
+  return false;
+#endif
+}
+
+bool
+Combat::MarshalPlan::Compile (CORBA::TypeCode_ptr tc, CORBA::ULong nesting)
+{
+  CORBA::TypeCode_var utc = CORBA::TypeCode::_duplicate (tc);
+  CORBA::ULong i, pc = ops.size ();
+
+  if (nesting > COMBAT_PLAN_MAX_NESTING) {
+    return false;
+  }
+
+  while (utc->kind() == CORBA::tk_alias) {
+    utc = utc->content_type ();
+  }
+
+  /*
+   * ops may be reallocated by the recursive calls below, so always
+   * access our own op by index
+   */
+
+  ops.push_back (Op ());
+  ops[pc].tc = CORBA::TypeCode::_duplicate (tc);
+  ops[pc].utc = CORBA::TypeCode::_duplicate (utc);
+  ops[pc].kind = utc->kind ();
+  ops[pc].count = 0;
+  ops[pc].aux = -1;
+  ops[pc].index = -1;
+  ops[pc].objref = false;
+  ops[pc].fixed = true;
+
+  switch (utc->kind()) {
+  case CORBA::tk_null:
+  case CORBA::tk_void:
+    ops[pc].code = OpNull;
+    ops[pc].align = ops[pc].maxalign = 1;
+    break;
+
+  case CORBA::tk_short:
+    ops[pc].code = OpShort;
+    ops[pc].align = ops[pc].maxalign = 2;
+    break;
+
+  case CORBA::tk_ushort:
+    ops[pc].code = OpUShort;
+    ops[pc].align = ops[pc].maxalign = 2;
+    break;
+
+  case CORBA::tk_long:
+    ops[pc].code = OpLong;
+    ops[pc].align = ops[pc].maxalign = 4;
+    break;
+
+  case CORBA::tk_ulong:
+    ops[pc].code = OpULong;
+    ops[pc].align = ops[pc].maxalign = 4;
+    break;
+
+  case CORBA::tk_longlong:
+    ops[pc].code = OpLongLong;
+    ops[pc].align = ops[pc].maxalign = 8;
+    break;
+
+  case CORBA::tk_ulonglong:
+    ops[pc].code = OpULongLong;
+    ops[pc].align = ops[pc].maxalign = 8;
+    break;
+
+  case CORBA::tk_float:
+    ops[pc].code = OpFloat;
+    ops[pc].align = ops[pc].maxalign = 4;
+    break;
+
+  case CORBA::tk_double:
+    ops[pc].code = OpDouble;
+    ops[pc].align = ops[pc].maxalign = 8;
+    break;
+
+  case CORBA::tk_boolean:
+    ops[pc].code = OpBoolean;
+    ops[pc].align = ops[pc].maxalign = 1;
+    break;
+
+  case CORBA::tk_char:
+    ops[pc].code = OpChar;
+    ops[pc].align = ops[pc].maxalign = 1;
+    break;
+
+  case CORBA::tk_octet:
+    ops[pc].code = OpOctet;
+    ops[pc].align = ops[pc].maxalign = 1;
+    break;
+
+  case CORBA::tk_string:
+    ops[pc].code = OpString;
+    ops[pc].count = utc->length ();
+    ops[pc].align = ops[pc].maxalign = 4;
+    ops[pc].fixed = false;
+    break;
+
+  case CORBA::tk_enum:
+    {
+      NameIndex * ni = new NameIndex;
+
+      ops[pc].code = OpEnum;
+      ops[pc].count = utc->member_count ();
+      ops[pc].align = ops[pc].maxalign = 4;
+      ops[pc].index = names.size ();
+      names.push_back (ni);
+
+      for (i=0; i<ops[pc].count; i++) {
+	ni->map.insert (utc->member_name (i), i);
+      }
+    }
+    break;
+
+  case CORBA::tk_objref:
+    ops[pc].code = OpObjref;
+    ops[pc].align = ops[pc].maxalign = 4;
+    ops[pc].objref = true;
+    ops[pc].fixed = false;
+    break;
+
+  case CORBA::tk_TypeCode:
+    ops[pc].code = OpTypeCode;
+    ops[pc].align = ops[pc].maxalign = 4;
+    ops[pc].fixed = false;
+    break;
+
+  case CORBA::tk_any:
+    ops[pc].code = OpAny;
+    ops[pc].align = 4;
+    ops[pc].maxalign = 8;
+    ops[pc].fixed = false;
+    break;
+
+  case CORBA::tk_struct:
+  case CORBA::tk_except:
+    {
+      CORBA::ULong len = utc->member_count ();
+      CORBA::ULong maxalign = 1;
+      NameIndex * ni = new NameIndex;
+
+      ops[pc].code = (utc->kind() == CORBA::tk_struct) ? OpStruct : OpExcept;
+      ops[pc].count = len;
+      ops[pc].index = names.size ();
+      names.push_back (ni);
+
+      for (i=0; i<len; i++) {
+	CORBA::ULong mpc = ops.size ();
+	CORBA::TypeCode_var mtc = utc->member_type (i);
+	if (!Compile (mtc.in(), nesting+1)) {
+	  return false;
+	}
+	if (ops[mpc].maxalign > maxalign) {
+	  maxalign = ops[mpc].maxalign;
+	}
+	ops[pc].objref = ops[pc].objref || ops[mpc].objref;
+	ops[pc].fixed = ops[pc].fixed && ops[mpc].fixed;
+	if (!ni->map.exists (utc->member_name (i))) {
+	  ni->map.insert (utc->member_name (i), i);
+	}
+      }
+
+      if (ops[pc].code == OpExcept) {
+	ops[pc].align = 4;
+	ops[pc].maxalign = (maxalign > 4) ? maxalign : 4;
+	ops[pc].fixed = false;
+      }
+      else {
+	ops[pc].align = (len > 0) ? ops[pc+1].align : 1;
+	ops[pc].maxalign = maxalign;
+      }
+    }
+    break;
+
+  case CORBA::tk_sequence:
+  case CORBA::tk_array:
+    {
+      CORBA::TypeCode_var ctc = utc->content_type ();
+
+      if (!Compile (ctc.in(), nesting+1)) {
+	return false;
+      }
+
+      ops[pc].count = utc->length ();
+      ops[pc].objref = ops[pc+1].objref;
+
+      if (utc->kind() == CORBA::tk_sequence) {
+	ops[pc].code = OpSequence;
+	ops[pc].align = 4;
+	ops[pc].maxalign = (ops[pc+1].maxalign > 4) ? ops[pc+1].maxalign : 4;
+	ops[pc].fixed = false;
+      }
+      else {
+	ops[pc].code = OpArray;
+	ops[pc].align = ops[pc+1].align;
+	ops[pc].maxalign = ops[pc+1].maxalign;
+	ops[pc].fixed = ops[pc+1].fixed;
+      }
+    }
+    break;
+
+  case CORBA::tk_union:
+    {
+      CORBA::TypeCode_var dtc = utc->discriminator_type ();
+      CORBA::ULong len = utc->member_count ();
+      CORBA::ULong maxalign;
+      bool labelled = true;
+      UnionInfo ui;
+
+      ui.densemin = 0;
+
+      ops[pc].code = OpUnion;
+      ops[pc].count = len;
+      ops[pc].fixed = false;
+
+      if (!Compile (dtc.in(), nesting+1)) {
+	return false;
+      }
+
+      OpCode dcode = ops[pc+1].code;
+
+      switch (dcode) {
+      case OpShort: case OpLong: case OpUShort: case OpULong:
+      case OpLongLong: case OpULongLong: case OpBoolean: case OpChar:
+      case OpEnum:
+	break;
+      default:
+	labelled = false;
+      }
+
+      maxalign = ops[pc+1].maxalign;
+      ui.defidx = utc->default_index ();
+
+      for (i=0; i<len; i++) {
+	CORBA::ULong mpc = ops.size ();
+	CORBA::TypeCode_var mtc = utc->member_type (i);
+	CORBA::LongLong lv = 0;
+
+	if (!Compile (mtc.in(), nesting+1)) {
+	  return false;
+	}
+	if (ops[mpc].maxalign > maxalign) {
+	  maxalign = ops[mpc].maxalign;
+	}
+	ops[pc].objref = ops[pc].objref || ops[mpc].objref;
+
+	if (labelled && (CORBA::Long) i != ui.defidx) {
+	  CORBA::Any_var label = utc->member_label (i);
+	  if (!LabelValue (label.in(), dcode, lv)) {
+	    labelled = false;
+	  }
+	  else if (ui.index.find (lv) == ui.index.end()) {
+	    ui.index[lv] = i;
+	  }
+	}
+      }
+
+      /*
+       * Find a discriminator value that selects the default member.
+       * With n labels, one of n+1 candidates must be unused, unless
+       * the discriminator's range is exhausted.
+       */
+
+      ui.defdisc = 0;
+
+      if (labelled && ui.defidx >= 0) {
+	CORBA::LongLong cand, limit;
+
+	switch (dcode) {
+	case OpBoolean:
+	  limit = 2;
+	  break;
+	case OpChar:
+	  limit = 256;
+	  break;
+	case OpEnum:
+	  limit = ops[pc+1].count;
+	  break;
+	default:
+	  limit = len + 1;
+	}
+
+	for (cand=0; cand<limit; cand++) {
+	  if (ui.index.find (cand) == ui.index.end()) {
+	    break;
+	  }
+	}
+
+	if (cand >= limit) {
+	  labelled = false;
+	}
+
+	ui.defdisc = cand;
+      }
+
+      /*
+       * Without labels, the plan can still describe the type, but not
+       * marshal it
+       */
+
+      if (!labelled) {
+	ui.index.clear ();
+	complete = false;
+      }
+      else if (!ui.index.empty ()) {
+	CORBA::LongLong lmin = (*ui.index.begin()).first;
+	CORBA::LongLong lmax = (*ui.index.rbegin()).first;
+
+	if (lmax - lmin < (CORBA::LongLong) (4 * ui.index.size() + 16)) {
+	  ui.densemin = lmin;
+	  ui.dense.resize ((size_t) (lmax - lmin + 1), ui.defidx);
+	  for (LabelIndex::iterator it = ui.index.begin();
+	       it != ui.index.end(); it++) {
+	    ui.dense[(size_t) ((*it).first - lmin)] = (*it).second;
+	  }
+	}
+      }
+
+      ui.labelled = labelled;
+
+      ops[pc].aux = unions.size ();
+      ops[pc].align = ops[pc+1].align;
+      ops[pc].maxalign = maxalign;
+      unions.push_back (ui);
+    }
+    break;
+
+  default:
+    /*
+     * wchar, wstring, fixed, long double, valuetypes and friends are
+     * left to DynAny
+     */
+
+    ops[pc].code = OpOther;
+    ops[pc].align = 1;
+    ops[pc].maxalign = 8;
+    ops[pc].objref = ContainsObjref (utc.in());
+    ops[pc].fixed = false;
+    complete = false;
+    break;
+  }
+
+  ops[pc].next = ops.size ();
+  return true;
+}
+
+/*
+ * Compute the encoded size of a fixed-size subtree, starting at offset
+ */
+
+bool
+Combat::MarshalPlan::Measure (CORBA::ULong pc, CORBA::ULong & offset)
+{
+  const Op & op = ops[pc];
+  CORBA::ULong i, mpc, start;
+
+  if (!op.fixed) {
+    return false;
+  }
+
+  switch (op.code) {
+  case OpNull:
+    return true;
+
+  case OpShort:
+  case OpLong:
+  case OpUShort:
+  case OpULong:
+  case OpLongLong:
+  case OpULongLong:
+  case OpFloat:
+  case OpDouble:
+  case OpBoolean:
+  case OpChar:
+  case OpOctet:
+  case OpEnum:
+    offset = (offset + op.align - 1) / op.align * op.align + op.align;
+    return true;
+
+  case OpStruct:
+    for (i=0, mpc=pc+1; i<op.count; i++) {
+      if (!Measure (mpc, offset)) {
+	return false;
+      }
+      mpc = ops[mpc].next;
+    }
+    return true;
+
+  case OpArray:
+    /*
+     * Once an element starts at the same offset modulo 8 as the
+     * previous one, all remaining elements are the same size
+     */
+
+    for (i=0; i<op.count; i++) {
+      start = offset;
+      if (!Measure (pc+1, offset)) {
+	return false;
+      }
+      if (start % 8 == offset % 8) {
+	offset += (op.count - i - 1) * (offset - start);
+	break;
+      }
+    }
+    return true;
+
+  default:
+    break;
+  }
+
+  return false;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * Indexes
+ * ----------------------------------------------------------------------
+ *
+ * Struct member names and enumerators are kept in a hash table. Looking
+ * up a name also leaves the result in the name's Tcl_Obj, tagged with
+ * the serial number of the index, so that names from the same literals
+ * or lists are found again without hashing, and without allocating
+ * anything. As serial numbers are never reused, a stale result is never
+ * mistaken for one from a different plan.
+ */
+
+extern "C" {
+
+/*
+ * The internal rep holds the serial number of the index in ptr1, and
+ * the member's position in ptr2. Names always keep their string rep.
+ */
+
+static int
+MemberName_SetFromAny (Tcl_Interp * interp, Tcl_Obj * obj)
+{
+  if (interp) {
+    Tcl_SetResult (interp, "error: need typecode information", TCL_STATIC);
+  }
+  return TCL_ERROR;
+}
+
+static void
+MemberName_DupInternal (Tcl_Obj * src, Tcl_Obj * dup)
+{
+  dup->typePtr = src->typePtr;
+  dup->internalRep.twoPtrValue.ptr1 = src->internalRep.twoPtrValue.ptr1;
+  dup->internalRep.twoPtrValue.ptr2 = src->internalRep.twoPtrValue.ptr2;
+}
+
+}
+
+#ifdef HAVE_NAMESPACE
+namespace Combat {
+  Tcl_ObjType MemberNameType = {
+    "combat::member",
+    NULL,
+    MemberName_DupInternal,
+    NULL,
+    MemberName_SetFromAny
+  };
+};
+#else
+Tcl_ObjType Combat::MemberNameType = {
+  "combat::member",
+  NULL,
+  MemberName_DupInternal,
+  NULL,
+  MemberName_SetFromAny
+};
+#endif
+
+CORBA::Long
+Combat::MarshalPlan::FindMember (CORBA::ULong pc, Tcl_Obj * name)
+{
+  if (ops[pc].index < 0) {
+    return -1;
+  }
+
+  NameIndex * ni = names[ops[pc].index];
+
+  if (name->typePtr == &MemberNameType &&
+      name->internalRep.twoPtrValue.ptr1 == (VOID *) ni->serial) {
+    return (CORBA::Long) (long) name->internalRep.twoPtrValue.ptr2;
+  }
+
+  TclStringMap<CORBA::ULong>::iterator it =
+    ni->map.find (Tcl_GetStringFromObj (name, NULL));
+
+  if (it == ni->map.end()) {
+    return -1;
+  }
+
+  CORBA::ULong idx = (*it).second;
+
+  /*
+   * Only take over pure strings, and our own names
+   */
+
+  if (name->typePtr == NULL || name->typePtr == &MemberNameType) {
+    name->typePtr = &MemberNameType;
+    name->internalRep.twoPtrValue.ptr1 = (VOID *) ni->serial;
+    name->internalRep.twoPtrValue.ptr2 = (VOID *) (long) idx;
+  }
+
+  return idx;
+}
+
+/*
+ * Returns the member selected by a discriminator value, which may be
+ * the default member, or -1 if none is active
+ */
+
+CORBA::Long
+Combat::MarshalPlan::FindLabel (CORBA::ULong pc, CORBA::LongLong val)
+{
+  const UnionInfo & ui = unions[ops[pc].aux];
+
+  if (!ui.dense.empty ()) {
+    if (val < ui.densemin ||
+	val - ui.densemin >= (CORBA::LongLong) ui.dense.size()) {
+      return ui.defidx;
+    }
+    return ui.dense[(size_t) (val - ui.densemin)];
+  }
+
+  LabelIndex::const_iterator it = ui.index.find (val);
+
+  if (it == ui.index.end()) {
+    return ui.defidx;
+  }
+
+  return (*it).second;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * Type information
+ * ----------------------------------------------------------------------
+ */
+
+CORBA::TypeCode_ptr
+Combat::MarshalPlan::typecode ()
+{
+  return type.in ();
+}
+
+CORBA::TCKind
+Combat::MarshalPlan::kind ()
+{
+  return rkind;
+}
+
+CORBA::TCKind
+Combat::MarshalPlan::content_kind ()
+{
+  return ckind;
+}
+
+bool
+Combat::MarshalPlan::has_objref ()
+{
+  return objref;
+}
+
+bool
+Combat::MarshalPlan::described ()
+{
+  return compiled;
+}
+
+/*
+ * Bound of a string or sequence, or length of an array
+ */
+
+CORBA::ULong
+Combat::MarshalPlan::length ()
+{
+  return compiled ? ops[0].count : 0;
+}
+
+/*
+ * Size of the encoding, if it is the same for all values. Assumes that
+ * the value starts at an offset that satisfies all of its alignments.
+ */
+
+bool
+Combat::MarshalPlan::fixed_size (CORBA::ULong & size)
+{
+  size = 0;
+  return compiled && Measure (0, size);
+}
+
+/*
+ * A sequence or array of a primitive type other than string, which can
+ * be dealt with as a block of memory
+ */
+
+bool
+Combat::MarshalPlan::flat ()
+{
+  return compiled &&
+    (ops[0].code == OpSequence || ops[0].code == OpArray) &&
+    ops[1].code >= OpShort && ops[1].code <= OpOctet;
+}
+
+CORBA::Long
+Combat::MarshalPlan::member_index (Tcl_Obj * name)
+{
+  return compiled ? FindMember (0, name) : -1;
+}
+
+CORBA::Long
+Combat::MarshalPlan::label_index (CORBA::LongLong val)
+{
+  if (!compiled || ops[0].code != OpUnion || !unions[ops[0].aux].labelled) {
+    return -1;
+  }
+  return FindLabel (0, val);
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * Packing
+ * ----------------------------------------------------------------------
+ */
+
+/*
+ * Get the value of an integral type, including those that can be used
+ * as union discriminators
+ */
+
+bool
+Combat::MarshalPlan::GetScalar (Tcl_Obj * data, CORBA::ULong pc,
+				CORBA::LongLong & val)
+{
+  const Op & op = ops[pc];
+
+  switch (op.code) {
+  case OpShort:
+  case OpLong:
+  case OpUShort:
+  case OpULong:
+  case OpLongLong:
+  case OpULongLong:
+    return GetInteger (data, op.kind, val);
+
+  case OpBoolean:
+    {
+      int tval;
+      if (GetNativeInteger (data, CORBA::tk_longlong, val)) {
+	val = val ? 1 : 0;
+	break;
+      }
+      if (Tcl_GetBooleanFromObj (NULL, data, &tval) != TCL_OK) {
+	return false;
+      }
+      val = tval ? 1 : 0;
+    }
+    break;
+
+  case OpChar:
+    {
+      int len;
+      char * tmp = Tcl_GetStringFromObj (data, &len);
+      if (len != 1) {
+	return false;
+      }
+      val = (unsigned char) *tmp;
+    }
+    break;
+
+  case OpOctet:
+    {
+      int len;
+#if TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION == 0
+      char * tmp = Tcl_GetStringFromObj (data, &len);
+#else
+      unsigned char * tmp = GetByteArrayFromObj (data, &len);
+#endif
+      if (len != 1) {
+	return false;
+      }
+      val = (CORBA::Octet) *tmp;
+    }
+    break;
+
+  case OpEnum:
+    {
+      CORBA::Long idx = FindMember (pc, data);
+      if (idx < 0) {
+	return false;
+      }
+      val = idx;
+    }
+    break;
+
+  default:
+    return false;
+  }
+
+  return true;
+}
+
+void
+Combat::MarshalPlan::PutScalar (CORBA::ULong pc, CORBA::LongLong val,
+				CdrOut & out)
+{
+  switch (ops[pc].code) {
+  case OpShort:
+  case OpUShort:
+    out.put_ushort ((CORBA::UShort) val);
+    break;
+  case OpLong:
+  case OpULong:
+  case OpEnum:
+    out.put_ulong ((CORBA::ULong) val);
+    break;
+  case OpLongLong:
+  case OpULongLong:
+    out.put_ulonglong ((CORBA::ULongLong) val);
+    break;
+  case OpBoolean:
+  case OpChar:
+  case OpOctet:
+    out.put_octet ((CORBA::Octet) val);
+    break;
+  default:
+    assert (0);
+  }
+}
+
+/*
+ * Check the number of elements of a sequence or array, and write the
+ * length of a sequence
+ */
+
+bool
+Combat::MarshalPlan::PutLength (CORBA::ULong pc, CORBA::ULong len,
+				CdrOut & out)
+{
+  const Op & op = ops[pc];
+
+  if (op.code == OpSequence) {
+    if (op.count && len > op.count) {
+      return false;
+    }
+    out.put_ulong (len);
+    return true;
+  }
+
+  return (len == op.count);
+}
+
+/*
+ * Pack the members of a struct or exception from a name/value list
+ */
+
+bool
+Combat::MarshalPlan::PackMembers (Tcl_Interp * interp, Context * ctx,
+				  Tcl_Obj * data, CORBA::ULong pc,
+				  CdrOut & out)
+{
+  const Op & op = ops[pc];
+  CORBA::ULong i, len = op.count;
+  CORBA::Long member;
+  Tcl_Obj ** elems;
+  int llen;
+
+  if (Tcl_ListObjGetElements (NULL, data, &llen, &elems) != TCL_OK ||
+      (CORBA::ULong) llen != 2*len) {
+    return false;
+  }
+
+  /*
+   * Find the order in which the elements must be written
+   */
+
+  CORBA::ULong sbuf[COMBAT_INLINE_MEMBERS];
+  std::vector<CORBA::ULong> heap;
+  CORBA::ULong * scramble = sbuf;
+
+  if (len > COMBAT_INLINE_MEMBERS) {
+    heap.resize (len);
+    scramble = &heap[0];
+  }
+
+  for (i=0; i<len; i++) {
+    scramble[i] = (CORBA::ULong) -1;
+  }
+
+  for (i=0; i<len; i++) {
+    member = FindMember (pc, elems[2*i]);
+
+    if (member < 0 || scramble[member] != (CORBA::ULong) -1) {
+      return false;
+    }
+
+    scramble[member] = i;
+  }
+
+  CORBA::ULong mpc = pc + 1;
+
+  for (i=0; i<len; i++) {
+    if (!PackValue (interp, ctx, elems[2*scramble[i]+1], mpc, out)) {
+      return false;
+    }
+    mpc = ops[mpc].next;
+  }
+
+  return true;
+}
+
+bool
+Combat::MarshalPlan::PackValue (Tcl_Interp * interp, Context * ctx,
+				Tcl_Obj * data, CORBA::ULong pc,
+				CdrOut & out)
+{
+#if defined(COMBAT_HAVE_CODEC)
+  const Op & op = ops[pc];
+  CORBA::LongLong val;
+
+  /*
+   * Values that are already Anys of the right type are spliced in
+   */
+
+  if (data->typePtr == &AnyType) {
+    const CORBA::Any * rep = GetAnyRef (data, op.tc);
+    if (rep) {
+      return SpliceAny (out, *rep, op.align, op.maxalign);
+    }
+  }
+
+  switch (op.code) {
+  case OpNull:
+    {
+      int len;
+      return (Tcl_ListObjLength (NULL, data, &len) == TCL_OK && len == 0);
+    }
+
+  case OpShort:
+  case OpLong:
+  case OpUShort:
+  case OpULong:
+  case OpLongLong:
+  case OpULongLong:
+  case OpBoolean:
+  case OpChar:
+  case OpOctet:
+  case OpEnum:
+    if (!GetScalar (data, pc, val)) {
+      return false;
+    }
+    PutScalar (pc, val, out);
+    return true;
+
+  case OpFloat:
+    {
+      double tval;
+      if (!GetNativeDouble (data, tval) &&
+	  Tcl_GetDoubleFromObj (NULL, data, &tval) != TCL_OK) {
+	return false;
+      }
+      out.put_float ((CORBA::Float) tval);
+    }
+    return true;
+
+  case OpDouble:
+    {
+      double tval;
+      if (!GetNativeDouble (data, tval) &&
+	  Tcl_GetDoubleFromObj (NULL, data, &tval) != TCL_OK) {
+	return false;
+      }
+      out.put_double ((CORBA::Double) tval);
+    }
+    return true;
+
+  case OpString:
+    {
+      int len;
+      char * tmp = Tcl_GetStringFromObj (data, &len);
+      if (op.count && (CORBA::ULong) len > op.count) {
+	return false;
+      }
+      out.put_string (tmp, len);
+    }
+    return true;
+
+  case OpObjref:
+    {
+      CORBA::Object_ptr ref = GetObjrefFromObj (data);
+      CORBA::Object_var obj;
+      const char * str;
+
+      if (!interp || !ctx) {
+	return false;
+      }
+
+      /*
+       * References from results are passed on without making a handle
+       */
+
+      if (!CORBA::is_nil (ref)) {
+	if (!ObjrefIsA (data, op.utc->id())) {
+	  return false;
+	}
+	obj = CORBA::Object::_duplicate (ref);
+      }
+      else if ((str = Tcl_GetStringFromObj (data, NULL))[0] == '0' &&
+	       str[1] == '\0') {
+	obj = CORBA::Object::_nil ();
+      }
+      else {
+	Tcl_CmdInfo info;
+
+	if (!Tcl_GetCommandInfo (interp, (char *) str, &info) ||
+	    info.objProc != Combat_Invoke) {
+	  return false;
+	}
+
+	Combat::Object * tobj = (Combat::Object *) info.objClientData;
+
+	if (CORBA::is_nil (tobj->obj)) {
+	  return false;
+	}
+
+	if (!ObjrefIsA (tobj, op.utc->id())) {
+	  return false;
+	}
+
+	obj = CORBA::Object::_duplicate (tobj->obj);
+      }
+
+      CORBA::Any any;
+      any <<= obj.in();
+      return SpliceAny (out, any, op.align, op.maxalign);
+    }
+
+  case OpTypeCode:
+    {
+      CORBA::TypeCode_var ctc = GetTypeCodeFromObj (interp, data);
+      if (CORBA::is_nil (ctc)) {
+	return false;
+      }
+      CORBA::Any any;
+      any <<= ctc.in();
+      return SpliceAny (out, any, op.align, op.maxalign);
+    }
+
+  case OpAny:
+    {
+      Tcl_Obj ** elems;
+      int llen;
+
+      if (Tcl_ListObjGetElements (NULL, data, &llen, &elems) != TCL_OK ||
+	  llen != 2) {
+	return false;
+      }
+
+      MarshalPlan * plan = GetPlanFromObj (interp, elems[0]);
+
+      if (plan == NULL) {
+	return false;
+      }
+
+      bool res = plan->usable ();
+
+      if (res) {
+	CORBA::Any any;
+	any <<= plan->typecode ();
+	res = SpliceAny (out, any, 4, 4) &&
+	  plan->PackValue (interp, ctx, elems[1], 0, out);
+      }
+
+      plan->deref ();
+      return res;
+    }
+
+  case OpStruct:
+    return PackMembers (interp, ctx, data, pc, out);
+
+  case OpExcept:
+    {
+      Tcl_Obj ** elems;
+      int llen;
+
+      if (Tcl_ListObjGetElements (NULL, data, &llen, &elems) != TCL_OK ||
+	  (llen != 1 && llen != 2) ||
+	  strcmp (Tcl_GetStringFromObj (elems[0], NULL), op.utc->id()) != 0) {
+	return false;
+      }
+
+      out.put_string (op.utc->id(), strlen (op.utc->id()));
+
+      if (llen == 1) {
+	return (op.count == 0);
+      }
+
+      return PackMembers (interp, ctx, elems[1], pc, out);
+    }
+
+  case OpSequence:
+  case OpArray:
+    {
+      const Op & elem = ops[pc+1];
+      CORBA::ULong size;
+      Tcl_Obj ** elems;
+      int i, llen;
+
+      /*
+       * Octet and char sequences come from byte arrays
+       */
+
+      if (elem.code == OpOctet || elem.code == OpChar) {
+	const CORBA::Octet * buf = GetOctetsFromObj (data, &llen);
+	if (!PutLength (pc, llen, out)) {
+	  return false;
+	}
+	out.put (buf, llen);
+	return true;
+      }
+
+      /*
+       * Numbers are converted in one go, straight into the buffer, or
+       * copied from a byte array that holds them in native byte order
+       */
+
+      if ((size = NumberSize (elem.kind)) != 0) {
+#if !(TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION == 0)
+	if (IsPureOctets (data)) {
+	  const CORBA::Octet * buf = GetOctetsFromObj (data, &llen);
+	  if (llen % size == 0) {
+	    if (!PutLength (pc, llen / size, out)) {
+	      return false;
+	    }
+	    if (llen) {
+	      out.align (size);
+	      out.put (buf, llen);
+	    }
+	    return true;
+	  }
+	}
+#endif
+	if (Tcl_ListObjGetElements (NULL, data, &llen, &elems) != TCL_OK ||
+	    !PutLength (pc, llen, out)) {
+	  return false;
+	}
+	if (llen == 0) {
+	  return true;
+	}
+	out.align (size);
+	return GetNumbers (elems, llen, elem.kind, out.extend (llen * size));
+      }
+
+      if (Tcl_ListObjGetElements (NULL, data, &llen, &elems) != TCL_OK ||
+	  !PutLength (pc, llen, out)) {
+	return false;
+      }
+
+      for (i=0; i<llen; i++) {
+	if (!PackValue (interp, ctx, elems[i], pc+1, out)) {
+	  return false;
+	}
+      }
+    }
+    return true;
+
+  case OpUnion:
+    {
+      const UnionInfo & ui = unions[op.aux];
+      CORBA::ULong i, mpc;
+      CORBA::Long member;
+      Tcl_Obj ** elems;
+      int llen;
+
+      if (Tcl_ListObjGetElements (NULL, data, &llen, &elems) != TCL_OK ||
+	  llen != 2) {
+	return false;
+      }
+
+      if (strcmp (Tcl_GetStringFromObj (elems[0], NULL), "(default)") == 0) {
+	if (ui.defidx < 0) {
+	  return false;
+	}
+	val = ui.defdisc;
+	member = ui.defidx;
+      }
+      else {
+	if (!GetScalar (elems[0], pc+1, val)) {
+	  return false;
+	}
+	member = FindLabel (pc, val);
+      }
+
+      PutScalar (pc+1, val, out);
+
+      if (member < 0) {
+	int ilen;
+	return (Tcl_ListObjLength (NULL, elems[1], &ilen) == TCL_OK &&
+		ilen == 0);
+      }
+
+      for (i=0, mpc=ops[pc+1].next; i<(CORBA::ULong) member; i++) {
+	mpc = ops[mpc].next;
+      }
+
+      return PackValue (interp, ctx, elems[1], mpc, out);
+    }
+  }
+
+  return false;
+#else
+  return false;
+#endif
+}
+
+/*
+ * Public entry point. Returns NULL if the value could not be packed by
+ * this plan, in which case the DynAny packer must be used.
+ */
+
+CORBA::Any *
+Combat::MarshalPlan::Pack (Tcl_Interp * interp, Context * ctx,
+			   Tcl_Obj * data)
+{
+#if defined(COMBAT_HAVE_CODEC)
+  CORBA::Any * res = NULL;
+
+  if (!usable ()) {
+    return NULL;
+  }
+
+  CdrOut out;
+
+#ifdef HAVE_EXCEPTIONS
+  try {
+#endif
+    if (PackValue (interp, ctx, data, 0, out)) {
+      CORBA::OctetSeq os (out.length(), out.length(), out.buffer(), FALSE);
+      res = GlobalData->codec->decode_value (os, type.in());
+    }
+#ifdef HAVE_EXCEPTIONS
+  } catch (CORBA::Exception &) {
+    res = NULL;
+  }
+#endif
+
+  return res;
+#else
+  return NULL;
+#endif
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * Unpacking
+ * ----------------------------------------------------------------------
+ *
+ * Values are read from the Codec's encoding of an Any straight into Tcl
+ * objects. Since this is a single pass over a buffer, the value is
+ * always unrolled completely; converting an Any to a list therefore
+ * still yields the list of its top-level components, just that these
+ * are plain Tcl objects rather than Anys.
+ */
+
+/*
+ * Read the value of an integral type
+ */
+
+bool
+Combat::MarshalPlan::ReadScalar (CdrIn & in, CORBA::ULong pc,
+				 CORBA::LongLong & val)
+{
+  switch (ops[pc].code) {
+  case OpShort:
+  case OpUShort:
+    {
+      CORBA::UShort tval;
+      if (!in.get_ushort (tval)) {
+	return false;
+      }
+      if (ops[pc].code == OpShort) {
+	val = (CORBA::Short) tval;
+      }
+      else {
+	val = tval;
+      }
+    }
+    return true;
+
+  case OpLong:
+  case OpULong:
+  case OpEnum:
+    {
+      CORBA::ULong tval;
+      if (!in.get_ulong (tval)) {
+	return false;
+      }
+      if (ops[pc].code == OpLong) {
+	val = (CORBA::Long) tval;
+      }
+      else {
+	val = tval;
+      }
+    }
+    return true;
+
+  case OpLongLong:
+  case OpULongLong:
+    {
+      CORBA::ULongLong tval;
+      if (!in.get_ulonglong (tval)) {
+	return false;
+      }
+      val = (CORBA::LongLong) tval;
+    }
+    return true;
+
+  case OpBoolean:
+  case OpChar:
+  case OpOctet:
+    {
+      CORBA::Octet tval;
+      if (!in.get_octet (tval)) {
+	return false;
+      }
+      val = tval;
+    }
+    return true;
+
+  default:
+    break;
+  }
+
+  return false;
+}
+
+/*
+ * Same representation as Combat_Extractor uses
+ */
+
+Tcl_Obj *
+Combat::MarshalPlan::NewScalarObj (CORBA::ULong pc, CORBA::LongLong val)
+{
+  char tmp[64];
+
+  switch (ops[pc].code) {
+  case OpShort:
+  case OpLong:
+    return Tcl_NewLongObj ((long) val);
+
+  case OpUShort:
+  case OpULong:
+    sprintf (tmp, "%lu", (unsigned long) val);
+    return Tcl_NewStringObj (tmp, -1);
+
+  case OpLongLong:
+    sprintf (tmp, "%Ld", (long long) val);
+    return Tcl_NewStringObj (tmp, -1);
+
+  case OpULongLong:
+    sprintf (tmp, "%Lu", (unsigned long long) val);
+    return Tcl_NewStringObj (tmp, -1);
+
+  case OpBoolean:
+    return Tcl_NewBooleanObj (val ? 1 : 0);
+
+  case OpChar:
+    tmp[0] = (char) val;
+    return Tcl_NewStringObj (tmp, 1);
+
+  case OpOctet:
+    tmp[0] = (char) val;
+#if TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION == 0
+    return Tcl_NewStringObj (tmp, 1);
+#else
+    return Tcl_NewByteArrayObj ((unsigned char *) tmp, 1);
+#endif
+
+  case OpEnum:
+    if (val < 0 || (CORBA::ULongLong) val >= ops[pc].count) {
+      return NULL;
+    }
+    return Tcl_NewStringObj ((char *) ops[pc].utc->member_name (val), -1);
+
+  default:
+    break;
+  }
+
+  return NULL;
+}
+
+static void
+DiscardObj (Tcl_Obj * obj)
+{
+  Tcl_IncrRefCount (obj);
+  Tcl_DecrRefCount (obj);
+}
+
+/*
+ * Unpack the members of a struct or exception into a name/value list
+ */
+
+Tcl_Obj *
+Combat::MarshalPlan::UnpackMembers (Tcl_Interp * interp, Context * ctx,
+				    CdrIn & in, CORBA::ULong pc)
+{
+  const Op & op = ops[pc];
+  std::vector<Tcl_Obj *> elems (2 * op.count);
+  CORBA::ULong i, mpc = pc + 1;
+
+  for (i=0; i<op.count; i++) {
+    elems[2*i+1] = UnpackValue (interp, ctx, in, mpc);
+
+    if (elems[2*i+1] == NULL) {
+      while (i--) {
+	DiscardObj (elems[2*i]);
+	DiscardObj (elems[2*i+1]);
+      }
+      return NULL;
+    }
+
+    elems[2*i] = Tcl_NewStringObj ((char *) op.utc->member_name (i), -1);
+    mpc = ops[mpc].next;
+  }
+
+  return Tcl_NewListObj (2 * op.count, op.count ? &elems[0] : NULL);
+}
+
+Tcl_Obj *
+Combat::MarshalPlan::UnpackValue (Tcl_Interp * interp, Context * ctx,
+				  CdrIn & in, CORBA::ULong pc)
+{
+#if defined(COMBAT_HAVE_CODEC)
+  const Op & op = ops[pc];
+  CORBA::LongLong val;
+
+  switch (op.code) {
+  case OpNull:
+    return Tcl_NewObj ();
+
+  case OpShort:
+  case OpLong:
+  case OpUShort:
+  case OpULong:
+  case OpLongLong:
+  case OpULongLong:
+  case OpBoolean:
+  case OpChar:
+  case OpOctet:
+  case OpEnum:
+    if (!ReadScalar (in, pc, val)) {
+      return NULL;
+    }
+    return NewScalarObj (pc, val);
+
+  case OpFloat:
+    {
+      CORBA::Float tval;
+      if (!in.get_float (tval)) {
+	return NULL;
+      }
+      return Tcl_NewDoubleObj (tval);
+    }
+
+  case OpDouble:
+    {
+      CORBA::Double tval;
+      if (!in.get_double (tval)) {
+	return NULL;
+      }
+      return Tcl_NewDoubleObj (tval);
+    }
+
+  case OpString:
+    {
+      const char * str;
+      CORBA::ULong len;
+      if (!in.get_string (str, len)) {
+	return NULL;
+      }
+      return Tcl_NewStringObj ((char *) str, len);
+    }
+
+  case OpTypeCode:
+    {
+      CORBA::TypeCode_var ctc = ReadTypeCode (in);
+      if (CORBA::is_nil (ctc)) {
+	return NULL;
+      }
+      return NewTypeCodeObj (ctc.in());
+    }
+
+  case OpObjref:
+    {
+      CORBA::ULong start, profiles;
+      CORBA::Any * any;
+      Tcl_Obj * res;
+
+      if (!in.align (4)) {
+	return NULL;
+      }
+
+      start = in.position ();
+
+      if (!SkipObjref (in, profiles)) {
+	return NULL;
+      }
+
+      /*
+       * Map nil references to `0', others to a combat::objref
+       */
+
+      if (profiles == 0) {
+	return Tcl_NewIntObj (0);
+      }
+
+      if (!interp || !ctx ||
+	  (any = DecodeRange (in, start, CORBA::_tc_Object)) == NULL) {
+	return NULL;
+      }
+
+      CORBA::Object_ptr obj;
+      *any >>= CORBA::Any::to_object (obj);
+      delete any;
+
+      return NewObjrefObj (interp, ctx, obj, op.utc->id());
+    }
+
+  case OpAny:
+    {
+      CORBA::TypeCode_var atc = ReadTypeCode (in);
+      Tcl_Obj * o[2];
+
+      if (CORBA::is_nil (atc)) {
+	return NULL;
+      }
+
+      MarshalPlan * plan = Lookup (atc.in(), true);
+      o[1] = plan->usable () ? plan->UnpackValue (interp, ctx, in, 0) : NULL;
+      plan->deref ();
+
+      if (o[1] == NULL) {
+	return NULL;
+      }
+
+      o[0] = NewTypeCodeObj (atc.in());
+      return Tcl_NewListObj (2, o);
+    }
+
+  case OpStruct:
+    return UnpackMembers (interp, ctx, in, pc);
+
+  case OpExcept:
+    {
+      const char * str;
+      CORBA::ULong len;
+      Tcl_Obj * r[2];
+
+      if (!in.get_string (str, len) ||
+	  (r[1] = UnpackMembers (interp, ctx, in, pc)) == NULL) {
+	return NULL;
+      }
+
+      r[0] = Tcl_NewStringObj ((char *) op.utc->id(), -1);
+      return Tcl_NewListObj (2, r);
+    }
+
+  case OpSequence:
+  case OpArray:
+    {
+      const Op & elem = ops[pc+1];
+      CORBA::ULong i, len, size;
+
+      if (op.code == OpSequence) {
+	if (!in.get_ulong (len)) {
+	  return NULL;
+	}
+      }
+      else {
+	len = op.count;
+      }
+
+      /*
+       * Octet and char sequences become byte arrays
+       */
+
+      if (elem.code == OpOctet || elem.code == OpChar) {
+	const CORBA::Octet * buf = in.get (len);
+	if (buf == NULL) {
+	  return NULL;
+	}
+	return NewOctetSeqObj (buf, len);
+      }
+
+      /*
+       * Numbers are converted in one go
+       */
+
+      if ((size = NumberSize (elem.kind)) != 0) {
+	const CORBA::Octet * buf = NULL;
+
+	if (len > 0 &&
+	    (!in.align (size) || len > in.remaining () / size ||
+	     (buf = in.get (len * size)) == NULL)) {
+	  return NULL;
+	}
+
+	return NewNumbersObj (ctx, elem.kind, buf, len, in.swapped ());
+      }
+
+      /*
+       * Guard against bogus lengths before allocating anything. Apart
+       * from these three, every element takes at least one octet.
+       */
+
+      if (elem.code != OpNull && elem.code != OpStruct &&
+	  elem.code != OpArray && len > in.remaining ()) {
+	return NULL;
+      }
+
+      std::vector<Tcl_Obj *> elems (len);
+
+      for (i=0; i<len; i++) {
+	if ((elems[i] = UnpackValue (interp, ctx, in, pc+1)) == NULL) {
+	  while (i--) {
+	    DiscardObj (elems[i]);
+	  }
+	  return NULL;
+	}
+      }
+
+      return Tcl_NewListObj (len, len ? &elems[0] : NULL);
+    }
+
+  case OpUnion:
+    {
+      CORBA::ULong i, mpc;
+      CORBA::Long member;
+      Tcl_Obj * m[2];
+
+      if (!ReadScalar (in, pc+1, val)) {
+	return NULL;
+      }
+
+      if ((member = FindLabel (pc, val)) < 0) {
+	m[1] = Tcl_NewObj ();
+      }
+      else {
+	for (i=0, mpc=ops[pc+1].next; i<(CORBA::ULong) member; i++) {
+	  mpc = ops[mpc].next;
+	}
+	if ((m[1] = UnpackValue (interp, ctx, in, mpc)) == NULL) {
+	  return NULL;
+	}
+      }
+
+      if ((m[0] = NewScalarObj (pc+1, val)) == NULL) {
+	DiscardObj (m[1]);
+	return NULL;
+      }
+
+      return Tcl_NewListObj (2, m);
+    }
+  }
+
+  return NULL;
+#else
+  return NULL;
+#endif
+}
+
+/*
+ * Public entry point. Returns NULL if the value could not be unpacked
+ * by this plan, in which case Combat_Extractor must be used.
+ */
+
+Tcl_Obj *
+Combat::MarshalPlan::Unpack (Tcl_Interp * interp, Context * ctx,
+			     const CORBA::Any & any)
+{
+#if defined(COMBAT_HAVE_CODEC)
+  CORBA::OctetSeq_var enc;
+
+  if (!usable ()) {
+    return NULL;
+  }
+
+#ifdef HAVE_EXCEPTIONS
+  try {
+#endif
+    enc = GlobalData->codec->encode_value (any);
+#ifdef HAVE_EXCEPTIONS
+  } catch (CORBA::Exception &) {
+    return NULL;
+  }
+#endif
+
+  CdrIn in (enc->get_buffer(), enc->length());
+  return UnpackValue (interp, ctx, in, 0);
+#else
+  return NULL;
+#endif
+}
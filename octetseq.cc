@@ -0,0 +1,476 @@
+/*
+ * ======================================================================
+ *
+ * This file is part of Combat, the Tcl interface for CORBA
+ * Copyright (c) Frank Pilhofer
+ *
+ * ======================================================================
+ */
+
+/*
+ * ----------------------------------------------------------------------
+ * Shared octet sequences
+ * ----------------------------------------------------------------------
+ *
+ * Octet and char sequences are mapped to byte arrays. Received ones are
+ * wrapped in a Tcl_Obj type of our own rather than copied into a Tcl
+ * byte array. The object keeps the Any that the ORB delivered them in
+ * (or the request argument or result holding it), and refers to the
+ * sequence in there, which the Any extracts just once. Duplicating the
+ * object shares the buffer, and sending it again as the same type uses
+ * that Any as it is.
+ *
+ * To scripts, these objects look like byte arrays, as they have the
+ * same string rep. Code that wants a real byte array can have one with
+ * GetByteArrayFromObj, which builds it from the buffer rather than by
+ * generating and parsing the string rep.
+ */
+
+#include "combat.h"
+#include <string.h>
+#include <assert.h>
+
+char * combat_octetseq_id = "$Id$";
+
+struct TclOctetData {
+  TclOctetData (bool);
+  ~TclOctetData ();
+
+  bool hold (const CORBA::Any &);
+  const CORBA::Octet * buffer ();
+  CORBA::ULong length ();
+
+  int refs;
+  bool chars;
+
+  /*
+   * The Any that holds a received value, and the sequence in there.
+   * The Any is either owned, or belongs to a request's argument or
+   * result, which is kept.
+   */
+
+  const CORBA::Any * src;
+  CORBA::Any * any;
+  CORBA::NamedValue_var nv;
+  const CORBA::OctetSeq * ros;
+  const CORBA::CharSeq * rcs;
+
+  /*
+   * Otherwise, a value of our own
+   */
+
+  CORBA::OctetSeq octets;
+  CORBA::CharSeq cs;
+};
+
+TclOctetData::TclOctetData (bool _c)
+{
+  refs = 1;
+  chars = _c;
+  src = NULL;
+  any = NULL;
+  ros = NULL;
+  rcs = NULL;
+}
+
+TclOctetData::~TclOctetData ()
+{
+  delete any;
+}
+
+/*
+ * Refer to the sequence held by an Any, which must outlive us
+ */
+
+bool
+TclOctetData::hold (const CORBA::Any & a)
+{
+#if !defined(COMBAT_USE_ORBACUS) && !defined(COMBAT_USE_ORBIX)
+  CORBA::Boolean r;
+
+  if (chars) {
+    r = (a >>= rcs);
+  }
+  else {
+    r = (a >>= ros);
+  }
+
+  if (!r) {
+    ros = NULL;
+    rcs = NULL;
+    return false;
+  }
+
+  src = &a;
+  return true;
+#else
+  return false;
+#endif
+}
+
+const CORBA::Octet *
+TclOctetData::buffer ()
+{
+  if (length() == 0) {
+    return (const CORBA::Octet *) "";
+  }
+  if (rcs) {
+    return (const CORBA::Octet *) rcs->get_buffer ();
+  }
+  if (ros) {
+    return ros->get_buffer ();
+  }
+  if (chars) {
+    return (const CORBA::Octet *) cs.get_buffer ();
+  }
+  return octets.get_buffer ();
+}
+
+CORBA::ULong
+TclOctetData::length ()
+{
+  if (rcs) {
+    return rcs->length ();
+  }
+  if (ros) {
+    return ros->length ();
+  }
+  return chars ? cs.length() : octets.length();
+}
+
+#if !(TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION == 0)
+
+extern "C" {
+
+/*
+ * Octet sequence data type implementation
+ */
+
+static int
+TclOctetSeq_SetFromAny (Tcl_Interp * interp, Tcl_Obj * obj)
+{
+  if (obj->typePtr == &Combat::OctetSeqType) {
+    return TCL_OK;
+  }
+
+  /*
+   * We only wrap buffers received from the ORB
+   */
+
+  if (interp) {
+    Tcl_SetResult (interp, "error: not an octet sequence", TCL_STATIC);
+  }
+
+  return TCL_ERROR;
+}
+
+/*
+ * Same string rep as a byte array: each octet is a character in the
+ * range 0-255, and the null character uses the two-byte encoding.
+ */
+
+static void
+TclOctetSeq_UpdateString (Tcl_Obj * obj)
+{
+  TclOctetData * objInf = (TclOctetData *) obj->internalRep.otherValuePtr;
+  const CORBA::Octet * buf = objInf->buffer ();
+  CORBA::ULong i, len = objInf->length ();
+  CORBA::ULong slen = 0;
+  char * str;
+
+  for (i=0; i<len; i++) {
+    slen += (buf[i] > 0 && buf[i] < 0x80) ? 1 : 2;
+  }
+
+  str = obj->bytes = Tcl_Alloc (slen + 1);
+  obj->length = slen;
+
+  for (i=0; i<len; i++) {
+    if (buf[i] > 0 && buf[i] < 0x80) {
+      *str++ = (char) buf[i];
+    }
+    else {
+      *str++ = (char) (0xc0 | (buf[i] >> 6));
+      *str++ = (char) (0x80 | (buf[i] & 0x3f));
+    }
+  }
+
+  *str = '\0';
+}
+
+static void
+TclOctetSeq_DupInternal (Tcl_Obj * src, Tcl_Obj * dup)
+{
+  assert (src->typePtr == &Combat::OctetSeqType);
+
+  TclOctetData * objInf = (TclOctetData *) src->internalRep.otherValuePtr;
+  objInf->refs++;
+
+  dup->typePtr = src->typePtr;
+  dup->internalRep.otherValuePtr = (VOID *) (void *) objInf;
+}
+
+static void
+TclOctetSeq_FreeInternal (Tcl_Obj * obj)
+{
+  assert (obj->typePtr == &Combat::OctetSeqType);
+
+  TclOctetData * objInf = (TclOctetData *) obj->internalRep.otherValuePtr;
+
+  if (--objInf->refs == 0) {
+    delete objInf;
+  }
+}
+
+}
+
+#ifdef HAVE_NAMESPACE
+namespace Combat {
+  Tcl_ObjType OctetSeqType = {
+    "CORBA::OctetSeq",
+    TclOctetSeq_FreeInternal,
+    TclOctetSeq_DupInternal,
+    TclOctetSeq_UpdateString,
+    TclOctetSeq_SetFromAny
+  };
+};
+#else
+Tcl_ObjType Combat::OctetSeqType = {
+  "CORBA::OctetSeq",
+  TclOctetSeq_FreeInternal,
+  TclOctetSeq_DupInternal,
+  TclOctetSeq_UpdateString,
+  TclOctetSeq_SetFromAny
+};
+#endif
+
+static Tcl_Obj *
+WrapOctetData (TclOctetData * objInf)
+{
+  Tcl_Obj * obj = Tcl_NewObj ();
+
+  Tcl_InvalidateStringRep (obj);
+
+  obj->typePtr = &Combat::OctetSeqType;
+  obj->internalRep.otherValuePtr = (VOID *) (void *) objInf;
+
+  return obj;
+}
+
+#endif
+
+static Tcl_Obj *
+NewOctetDataObj (TclOctetData * objInf)
+{
+#if TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION == 0
+  Tcl_Obj * res = Tcl_NewStringObj ((char *) objInf->buffer(),
+				    objInf->length());
+  delete objInf;
+  return res;
+#else
+  return WrapOctetData (objInf);
+#endif
+}
+
+/*
+ * Create an object from an Any that holds an unbounded octet or char
+ * sequence. Returns NULL if the Any does not hold the requested kind
+ * of sequence. Only MICO provides the necessary Any extraction
+ * operators.
+ *
+ * The Any is the caller's, so its value is extracted into a sequence
+ * of our own.
+ */
+
+Tcl_Obj *
+Combat::NewOctetSeqObj (const CORBA::Any & any, CORBA::TCKind kind)
+{
+#if !defined(COMBAT_USE_ORBACUS) && !defined(COMBAT_USE_ORBIX)
+  TclOctetData * objInf = new TclOctetData (kind == CORBA::tk_char);
+  CORBA::Boolean r;
+
+  if (kind == CORBA::tk_char) {
+    r = (any >>= objInf->cs);
+  }
+  else {
+    r = (any >>= objInf->octets);
+  }
+
+  if (!r) {
+    delete objInf;
+    return NULL;
+  }
+
+  return NewOctetDataObj (objInf);
+#else
+  return NULL;
+#endif
+}
+
+/*
+ * Same as above, taking ownership of the Any, which is kept rather than
+ * copied. The Any is deleted if it does not hold the sequence.
+ */
+
+Tcl_Obj *
+Combat::NewOctetSeqObj (CORBA::Any * any, CORBA::TCKind kind)
+{
+  TclOctetData * objInf = new TclOctetData (kind == CORBA::tk_char);
+
+  objInf->any = any;
+
+  if (!objInf->hold (*any)) {
+    delete objInf;
+    return NULL;
+  }
+
+  return NewOctetDataObj (objInf);
+}
+
+/*
+ * Same as above, for the value of a request's argument or result. The
+ * NamedValue is kept, and with it the Any.
+ */
+
+Tcl_Obj *
+Combat::NewOctetSeqObj (CORBA::NamedValue_ptr nv, CORBA::TCKind kind)
+{
+  TclOctetData * objInf = new TclOctetData (kind == CORBA::tk_char);
+
+  objInf->nv = CORBA::NamedValue::_duplicate (nv);
+
+  if (!objInf->hold (*nv->value())) {
+    delete objInf;
+    return NULL;
+  }
+
+  return NewOctetDataObj (objInf);
+}
+
+/*
+ * Create an object from a buffer of octets, which is copied
+ */
+
+Tcl_Obj *
+Combat::NewOctetSeqObj (const CORBA::Octet * buf, CORBA::ULong len)
+{
+#if TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION == 0
+  return Tcl_NewStringObj ((char *) buf, len);
+#else
+  TclOctetData * objInf = new TclOctetData (false);
+  objInf->octets.length (len);
+  if (len) {
+    memcpy (objInf->octets.get_buffer(), buf, len);
+  }
+  return WrapOctetData (objInf);
+#endif
+}
+
+/*
+ * Get the octets of an octet or char sequence from an object, without
+ * converting it if it is one of ours
+ */
+
+const CORBA::Octet *
+Combat::GetOctetsFromObj (Tcl_Obj * data, int * len)
+{
+#if TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION == 0
+  return (const CORBA::Octet *) Tcl_GetStringFromObj (data, len);
+#else
+  if (data->typePtr == &OctetSeqType) {
+    TclOctetData * objInf = (TclOctetData *) data->internalRep.otherValuePtr;
+    *len = (int) objInf->length ();
+    return objInf->buffer ();
+  }
+
+  return (const CORBA::Octet *) Tcl_GetByteArrayFromObj (data, len);
+#endif
+}
+
+/*
+ * Does data hold nothing but octets, so that they may be taken as
+ * numbers in native byte order? Our octet sequences only come from the
+ * ORB. A byte array qualifies only without a string rep: a list that
+ * shimmered to a byte array, e.g. when it was passed as an octet
+ * sequence, still means its string.
+ */
+
+bool
+Combat::IsPureOctets (Tcl_Obj * data)
+{
+#if TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION == 0
+  return false;
+#else
+  if (data->typePtr == &OctetSeqType) {
+    return true;
+  }
+
+  return (ByteArrayTypePtr && data->typePtr == ByteArrayTypePtr &&
+	  data->bytes == NULL);
+#endif
+}
+
+/*
+ * If data is one of ours, and holds a received Any of the requested
+ * type, return that Any. It remains owned by data, and is valid as long
+ * as data's internal rep is not changed.
+ */
+
+const CORBA::Any *
+Combat::GetOctetSeqAny (Tcl_Obj * data, const CORBA::TypeCode_ptr tc)
+{
+#if TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION == 0
+  return NULL;
+#else
+  if (data->typePtr != &OctetSeqType) {
+    return NULL;
+  }
+
+  TclOctetData * objInf = (TclOctetData *) data->internalRep.otherValuePtr;
+
+  if (objInf->src == NULL) {
+    return NULL;
+  }
+
+  CORBA::TypeCode_var srctc = objInf->src->type ();
+
+  if (!tc->equal (srctc)) {
+    return NULL;
+  }
+
+  return objInf->src;
+#endif
+}
+
+/*
+ * Same as Tcl_GetByteArrayFromObj, but if data is one of ours, its
+ * internal rep is replaced with that of a byte array made right from
+ * the buffer, rather than generating and then parsing the string rep.
+ */
+
+unsigned char *
+Combat::GetByteArrayFromObj (Tcl_Obj * data, int * len)
+{
+#if TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION == 0
+  return (unsigned char *) Tcl_GetStringFromObj (data, len);
+#else
+  if (data->typePtr == &OctetSeqType) {
+    TclOctetData * objInf = (TclOctetData *) data->internalRep.otherValuePtr;
+    Tcl_Obj * ba = Tcl_NewByteArrayObj (objInf->buffer(),
+					(int) objInf->length());
+
+    /*
+     * Take over the new object's internal rep. Our string rep, if
+     * there is one, remains valid.
+     */
+
+    TclOctetSeq_FreeInternal (data);
+    data->typePtr = ba->typePtr;
+    data->internalRep = ba->internalRep;
+    ba->typePtr = NULL;
+    Tcl_DecrRefCount (ba);
+  }
+
+  return Tcl_GetByteArrayFromObj (data, len);
+#endif
+}
@@ -0,0 +1,690 @@
+/*
+ * ======================================================================
+ *
+ * This file is part of Combat, the Tcl interface for CORBA
+ * Copyright (c) Frank Pilhofer
+ *
+ * ======================================================================
+ */
+
+/*
+ * ----------------------------------------------------------------------
+ * ORB thread
+ * ----------------------------------------------------------------------
+ *
+ * With a threaded Tcl and a thread-safe ORB, the ORB can run in a thread
+ * of its own, blocked in CORBA::ORB::run(), rather than being polled from
+ * the event loop. All of the ORB's I/O then happens in that thread, and
+ * the interpreter's thread is only woken when there is something for it
+ * to do:
+ *
+ * - An upcall to one of our servants is handed to the thread of the
+ *   servant's interpreter as a queued event, while the ORB's thread
+ *   waits for it to finish.
+ *
+ * - A second thread is blocked in get_next_response() while there are
+ *   deferred requests that someone waits for. It hands each response
+ *   over to CollectResponses in the thread of the interpreter that
+ *   made the request, and queues an event to wake that thread.
+ *
+ * An interpreter that is blocked in a synchronous invocation does not
+ * service its event loop, so OrbThreadWait runs the upcalls handed to
+ * its thread meanwhile, like the ORB would run nested requests.
+ *
+ * There may be interpreters in several threads (see combat::pool).
+ * They share the global state, which is protected by the global lock
+ * below.
+ */
+
+#include "combat.h"
+#include <assert.h>
+#include <deque>
+#include <list>
+#include <map>
+#include <vector>
+
+char * combat_orbthread_id = "$Id$";
+
+#if defined(COMBAT_HAVE_THREADS)
+
+/*
+ * The global lock. It is recursive, as e.g. InterfaceInfo::lookup makes
+ * plans, which are looked up in the plan cache. It is taken before
+ * orbMutex, never while holding it.
+ */
+
+TCL_DECLARE_MUTEX(globalMutex)
+static Tcl_Condition globalCond;
+static Tcl_ThreadId globalOwner;
+static unsigned long globalDepth = 0;
+
+/*
+ * All of the below is protected by orbMutex.
+ *
+ * The reply thread waits on replyCond until there are more requests in
+ * GlobalData->pending (as counted by OrbThreadPending) than responses
+ * that it already handed over. interpCond is signalled for interpreter
+ * threads in OrbThreadWait, and doneCond for ORB threads waiting for an
+ * upcall to finish.
+ */
+
+TCL_DECLARE_MUTEX(orbMutex)
+static Tcl_Condition replyCond;
+static Tcl_Condition interpCond;
+static Tcl_Condition doneCond;
+
+static Combat::Context * orbCtx = NULL;	// initialized the ORB
+static bool orbDone = false;		// ORB::run() has returned
+
+static unsigned long pendingCount = 0;
+static unsigned long pendingGen = 0;
+
+/*
+ * Responses that were handed over, by the thread that waits for them
+ */
+
+struct ThreadReplies {
+  ThreadReplies () { wakeQueued = false; }
+
+  std::deque<CORBA::Request_ptr> queue;
+  bool wakeQueued;			// wakeup event not yet handled
+};
+
+typedef std::map<Tcl_ThreadId, ThreadReplies> ReplyMap;
+static ReplyMap replies;
+static unsigned long replyCount = 0;
+
+#if !defined(COMBAT_NO_SERVER_SIDE)
+static std::list<Combat::Upcall *> upcalls;
+#endif
+
+/*
+ * Event for an interpreter's thread. It runs the upcalls that were
+ * handed to that thread, and collects responses if it was queued by
+ * the reply thread. It refers to the thread rather than to a Context,
+ * as the interpreter may be deleted while the event is queued.
+ */
+
+struct Combat_OrbThreadEvent {
+  struct Tcl_Event ev;
+  Tcl_ThreadId thread;
+  bool wake;
+};
+
+extern "C" {
+
+static int
+Combat_HandleOrbThreadEvent (Tcl_Event * evPtr, int flags)
+{
+  if (!(flags & TCL_FILE_EVENTS)) {
+    return 0;
+  }
+
+  Combat_OrbThreadEvent * ev = (Combat_OrbThreadEvent *) evPtr;
+
+#if !defined(COMBAT_NO_SERVER_SIDE)
+  Combat::Upcall::RunQueued ();
+#endif
+
+  if (ev->wake) {
+    Tcl_MutexLock (&orbMutex);
+    replies[ev->thread].wakeQueued = false;
+    Tcl_MutexUnlock (&orbMutex);
+
+    if (!Combat::CollectResponses()) {
+      return 1;
+    }
+
+    /*
+     * Run the callbacks that are due in this thread's interpreters.
+     * Each is looked up again, as a callback may delete another one;
+     * only this thread deletes them.
+     */
+
+    std::vector<Tcl_Interp *> interps;
+    Combat::Global::CtxMap::iterator it;
+
+    {
+      Combat::GlobalLock lock;
+      for (it = Combat::GlobalData->contexts.begin();
+	   it != Combat::GlobalData->contexts.end(); it++) {
+	if ((*it).second->thread == ev->thread) {
+	  interps.push_back ((*it).first);
+	}
+      }
+    }
+
+    for (CORBA::ULong i=0; i<interps.size(); i++) {
+      Combat::Context * ctx = NULL;
+
+      {
+	Combat::GlobalLock lock;
+	it = Combat::GlobalData->contexts.find (interps[i]);
+	if (it != Combat::GlobalData->contexts.end()) {
+	  ctx = (*it).second;
+	}
+      }
+
+      if (ctx) {
+	Combat::PerformCallbacks (ctx);
+      }
+    }
+  }
+
+  return 1;
+}
+
+static void
+Combat_QueueOrbThreadEvent (Tcl_ThreadId thread, bool wake)
+{
+  Combat_OrbThreadEvent * ev =
+    (Combat_OrbThreadEvent *) Tcl_Alloc (sizeof (Combat_OrbThreadEvent));
+  ev->ev.proc = Combat_HandleOrbThreadEvent;
+  ev->thread  = thread;
+  ev->wake    = wake;
+  Tcl_ThreadQueueEvent (thread, (Tcl_Event *) ev, TCL_QUEUE_TAIL);
+  Tcl_ThreadAlert (thread);
+}
+
+/*
+ * The ORB's thread
+ */
+
+static Tcl_ThreadCreateType
+Combat_OrbThread (ClientData)
+{
+#ifdef HAVE_EXCEPTIONS
+  try {
+#endif
+    Combat::GlobalData->orb->run ();
+#ifdef HAVE_EXCEPTIONS
+  } catch (CORBA::Exception &) {
+  }
+#endif
+
+  Tcl_MutexLock (&orbMutex);
+  orbDone = true;
+  Tcl_ConditionNotify (&replyCond);
+  Tcl_ConditionNotify (&interpCond);
+  Tcl_MutexUnlock (&orbMutex);
+
+  TCL_THREAD_CREATE_RETURN;
+}
+
+/*
+ * The reply thread. If get_next_response fails, e.g. because the
+ * request that we expected was finished by a synchronous get_response
+ * meanwhile, wait until the set of pending requests changes.
+ */
+
+static Tcl_ThreadCreateType
+Combat_ReplyThread (ClientData)
+{
+  unsigned long failedGen = 0;
+  bool failed = false;
+
+  Tcl_MutexLock (&orbMutex);
+
+  while (!orbDone) {
+    if (pendingCount <= replyCount ||
+	(failed && failedGen == pendingGen)) {
+      Tcl_ConditionWait (&replyCond, &orbMutex, NULL);
+      continue;
+    }
+
+    unsigned long gen = pendingGen;
+    CORBA::Request_ptr creq = CORBA::Request::_nil ();
+    Tcl_MutexUnlock (&orbMutex);
+
+#ifdef HAVE_EXCEPTIONS
+    try {
+#endif
+      Combat::GlobalData->orb->get_next_response (creq);
+      failed = false;
+#ifdef HAVE_EXCEPTIONS
+    } catch (CORBA::SystemException &) {
+      failed = true;
+      failedGen = gen;
+    }
+#endif
+
+    /*
+     * Find the Context that made the request. Nobody waits for
+     * responses to requests that are not pending (anymore).
+     */
+
+    Tcl_ThreadId owner = NULL;
+
+    if (!failed) {
+      Combat::GlobalLock lock;
+      Combat::Global::PendingMap::iterator it =
+	Combat::GlobalData->pending.find (creq);
+      if (it != Combat::GlobalData->pending.end()) {
+	owner = (*it).second->context()->thread;
+      }
+      else {
+	CORBA::release (creq);
+      }
+    }
+
+    Tcl_MutexLock (&orbMutex);
+
+    if (owner) {
+      ThreadReplies & tr = replies[owner];
+      tr.queue.push_back (creq);
+      replyCount++;
+      Tcl_ConditionNotify (&interpCond);
+
+      if (!tr.wakeQueued) {
+	tr.wakeQueued = true;
+	Combat_QueueOrbThreadEvent (owner, true);
+      }
+    }
+  }
+
+  Tcl_MutexUnlock (&orbMutex);
+
+  TCL_THREAD_CREATE_RETURN;
+}
+
+}
+
+#endif
+
+/*
+ * The global lock
+ */
+
+void
+Combat::Lock ()
+{
+#if defined(COMBAT_HAVE_THREADS)
+  Tcl_ThreadId self = Tcl_GetCurrentThread ();
+
+  Tcl_MutexLock (&globalMutex);
+
+  while (globalDepth > 0 && globalOwner != self) {
+    Tcl_ConditionWait (&globalCond, &globalMutex, NULL);
+  }
+
+  globalOwner = self;
+  globalDepth++;
+  Tcl_MutexUnlock (&globalMutex);
+#endif
+}
+
+void
+Combat::Unlock ()
+{
+#if defined(COMBAT_HAVE_THREADS)
+  Tcl_MutexLock (&globalMutex);
+  assert (globalDepth > 0 && globalOwner == Tcl_GetCurrentThread ());
+
+  if (--globalDepth == 0) {
+    Tcl_ConditionNotify (&globalCond);
+  }
+
+  Tcl_MutexUnlock (&globalMutex);
+#endif
+}
+
+int
+Combat::UnlockAll ()
+{
+#if defined(COMBAT_HAVE_THREADS)
+  int depth = 0;
+
+  Tcl_MutexLock (&globalMutex);
+
+  if (globalDepth > 0 && globalOwner == Tcl_GetCurrentThread ()) {
+    depth = (int) globalDepth;
+    globalDepth = 0;
+    Tcl_ConditionNotify (&globalCond);
+  }
+
+  Tcl_MutexUnlock (&globalMutex);
+  return depth;
+#else
+  return 0;
+#endif
+}
+
+void
+Combat::Relock (int depth)
+{
+#if defined(COMBAT_HAVE_THREADS)
+  Tcl_ThreadId self = Tcl_GetCurrentThread ();
+
+  if (depth == 0) {
+    return;
+  }
+
+  Tcl_MutexLock (&globalMutex);
+
+  while (globalDepth > 0 && globalOwner != self) {
+    Tcl_ConditionWait (&globalCond, &globalMutex, NULL);
+  }
+
+  globalOwner = self;
+  globalDepth += depth;
+  Tcl_MutexUnlock (&globalMutex);
+#endif
+}
+
+/*
+ * Start the ORB's thread and the reply thread
+ */
+
+int
+Combat::StartOrbThread (Tcl_Interp * interp, Context * ctx)
+{
+#if defined(COMBAT_HAVE_THREADS)
+  Tcl_ThreadId tid;
+
+  assert (orbCtx == NULL);
+  orbCtx = ctx;
+
+  if (Tcl_CreateThread (&tid, Combat_OrbThread, NULL,
+			TCL_THREAD_STACK_DEFAULT,
+			TCL_THREAD_NOFLAGS) != TCL_OK ||
+      Tcl_CreateThread (&tid, Combat_ReplyThread, NULL,
+			TCL_THREAD_STACK_DEFAULT,
+			TCL_THREAD_NOFLAGS) != TCL_OK) {
+    Tcl_AppendResult (interp, "error: could not create ORB thread", NULL);
+    return TCL_ERROR;
+  }
+
+  return TCL_OK;
+#else
+  Tcl_AppendResult (interp, "error: Combat was compiled without ",
+		    "thread support", NULL);
+  return TCL_ERROR;
+#endif
+}
+
+bool
+Combat::OrbThreadRunning ()
+{
+#if defined(COMBAT_HAVE_THREADS)
+  return orbCtx != NULL;
+#else
+  return false;
+#endif
+}
+
+/*
+ * Are we in the thread that the Context's interpreter lives in? Always
+ * true without an ORB thread.
+ */
+
+bool
+Combat::InInterpThread (Context * ctx)
+{
+#if defined(COMBAT_HAVE_THREADS)
+  return orbCtx == NULL || Tcl_GetCurrentThread () == ctx->thread;
+#else
+  return true;
+#endif
+}
+
+/*
+ * Take a response that the reply thread has handed to this thread
+ */
+
+bool
+Combat::OrbThreadResponse (CORBA::Request_out creq)
+{
+#if defined(COMBAT_HAVE_THREADS)
+  Tcl_MutexLock (&orbMutex);
+
+  ReplyMap::iterator it = replies.find (Tcl_GetCurrentThread ());
+
+  if (it == replies.end() || (*it).second.queue.empty ()) {
+    Tcl_MutexUnlock (&orbMutex);
+    return false;
+  }
+
+  creq = (*it).second.queue.front ();
+  (*it).second.queue.pop_front ();
+  replyCount--;
+  Tcl_MutexUnlock (&orbMutex);
+  return true;
+#else
+  return false;
+#endif
+}
+
+/*
+ * Called whenever GlobalData->pending changes, so that the reply thread
+ * knows whether there is a response to wait for
+ */
+
+void
+Combat::OrbThreadPending ()
+{
+#if defined(COMBAT_HAVE_THREADS)
+  if (orbCtx == NULL) {
+    return;
+  }
+
+  Tcl_MutexLock (&orbMutex);
+  pendingCount = GlobalData->pending.size ();
+  pendingGen++;
+  Tcl_ConditionNotify (&replyCond);
+  Tcl_MutexUnlock (&orbMutex);
+#endif
+}
+
+/*
+ * Wait for a request that is in GlobalData->pending to finish, running
+ * the upcalls that are handed to this thread meanwhile. Returns early
+ * if the ORB is shut down. Returns false if the deadline, if any, passes
+ * first.
+ */
+
+bool
+Combat::OrbThreadWait (Request * req, const Tcl_Time * deadline)
+{
+#if defined(COMBAT_HAVE_THREADS)
+  while (!req->PollResult ()) {
+#if !defined(COMBAT_NO_SERVER_SIDE)
+    if (Upcall::RunQueued ()) {
+      continue;
+    }
+#endif
+
+    if (CollectResponses ()) {
+      continue;
+    }
+
+    Tcl_ThreadId self = Tcl_GetCurrentThread ();
+    bool idle = true;
+
+    Tcl_MutexLock (&orbMutex);
+
+    ReplyMap::iterator rit = replies.find (self);
+
+    if (orbDone || (rit != replies.end() && !(*rit).second.queue.empty())) {
+      idle = false;
+    }
+
+#if !defined(COMBAT_NO_SERVER_SIDE)
+    std::list<Upcall *>::iterator it;
+    for (it = upcalls.begin(); idle && it != upcalls.end(); it++) {
+      if ((*it)->thread == self) {
+	idle = false;
+      }
+    }
+#endif
+
+    bool expired = false;
+
+    if (idle && deadline) {
+      Tcl_Time now, left;
+      Tcl_GetTime (&now);
+      left.sec = deadline->sec - now.sec;
+      left.usec = deadline->usec - now.usec;
+      if (left.usec < 0) {
+	left.sec--;
+	left.usec += 1000000;
+      }
+      if (left.sec < 0) {
+	expired = true;
+      }
+      else {
+	Tcl_ConditionWait (&interpCond, &orbMutex, &left);
+      }
+    }
+    else if (idle) {
+      Tcl_ConditionWait (&interpCond, &orbMutex, NULL);
+    }
+
+    bool done = orbDone;
+    Tcl_MutexUnlock (&orbMutex);
+
+    if (expired) {
+      return false;
+    }
+
+    if (done) {
+      break;
+    }
+  }
+#endif
+
+  return true;
+}
+
+#if !defined(COMBAT_NO_SERVER_SIDE)
+
+/*
+ * Upcalls
+ */
+
+Combat::Upcall::Upcall ()
+{
+  done = false;
+  fwd = NULL;
+  failed = false;
+}
+
+Combat::Upcall::~Upcall ()
+{
+  delete fwd;
+}
+
+void
+Combat::Upcall::Perform (Context * ctx)
+{
+  if (InInterpThread (ctx)) {
+    Run ();
+    return;
+  }
+
+#if defined(COMBAT_HAVE_THREADS)
+  thread = ctx->thread;
+
+  Tcl_MutexLock (&orbMutex);
+  upcalls.push_back (this);
+  Tcl_ConditionNotify (&interpCond);
+  Tcl_MutexUnlock (&orbMutex);
+
+  Combat_QueueOrbThreadEvent (thread, false);
+
+  Tcl_MutexLock (&orbMutex);
+  while (!done) {
+    Tcl_ConditionWait (&doneCond, &orbMutex, NULL);
+  }
+  Tcl_MutexUnlock (&orbMutex);
+
+  /*
+   * Raise the exception, if any, in this thread. System exceptions
+   * cannot be copied portably, so they are passed on as UNKNOWN.
+   */
+
+#ifdef HAVE_EXCEPTIONS
+  if (fwd) {
+    PortableServer::ForwardRequest fw2 (*fwd);
+    throw (fw2);
+  }
+
+  if (failed) {
+    throw CORBA::UNKNOWN (minor, completed);
+  }
+#endif
+#endif
+}
+
+void
+Combat::Upcall::Dispatch ()
+{
+#ifdef HAVE_EXCEPTIONS
+  try {
+#endif
+    Run ();
+#ifdef HAVE_EXCEPTIONS
+  } catch (PortableServer::ForwardRequest & fw) {
+    fwd = new PortableServer::ForwardRequest (fw);
+  } catch (CORBA::SystemException & ex) {
+    failed = true;
+    minor = ex.minor ();
+    completed = ex.completed ();
+  } catch (...) {
+    /*
+     * Anything else, e.g. a user exception from a servant manager,
+     * must not unwind through the event loop, or the waiting thread
+     * would never be woken
+     */
+    failed = true;
+    minor = 0;
+    completed = CORBA::COMPLETED_MAYBE;
+  }
+#endif
+
+#if defined(COMBAT_HAVE_THREADS)
+  Tcl_MutexLock (&orbMutex);
+  done = true;
+  Tcl_ConditionNotify (&doneCond);
+  Tcl_MutexUnlock (&orbMutex);
+#endif
+}
+
+bool
+Combat::Upcall::RunQueued ()
+{
+  bool found = false;
+
+#if defined(COMBAT_HAVE_THREADS)
+  Tcl_ThreadId self = Tcl_GetCurrentThread ();
+
+  Tcl_MutexLock (&orbMutex);
+
+  std::list<Upcall *>::iterator it = upcalls.begin ();
+  while (it != upcalls.end()) {
+    if ((*it)->thread != self) {
+      it++;
+      continue;
+    }
+
+    /*
+     * The list may change while the upcall runs
+     */
+
+    Upcall * up = *it;
+    upcalls.erase (it);
+    Tcl_MutexUnlock (&orbMutex);
+
+    up->Dispatch ();
+    found = true;
+
+    Tcl_MutexLock (&orbMutex);
+    it = upcalls.begin ();
+  }
+
+  Tcl_MutexUnlock (&orbMutex);
+#endif
+
+  return found;
+}
+
+#endif
@@ -0,0 +1,451 @@
+/*
+ * ======================================================================
+ *
+ * This file is part of Combat, the Tcl interface for CORBA
+ * Copyright (c) Frank Pilhofer
+ *
+ * ======================================================================
+ */
+
+#if defined(COMBAT_NO_SERVER_SIDE)
+#error "pool.cc not needed when compiling without server-side support only!"
+#endif
+
+/*
+ * ----------------------------------------------------------------------
+ * Interpreter Pools
+ * ----------------------------------------------------------------------
+ *
+ * combat::pool starts a number of threads, each with an interpreter of
+ * its own that evaluates the same script to make its own instance of a
+ * servant. The pool is a servant itself: each request that the ORB
+ * dispatches to it is passed on to a worker that is not busy, and is
+ * handed to that worker's thread like any other upcall (see orbthread.cc).
+ * If the ORB dispatches requests from several threads at once, they are
+ * thus processed in parallel.
+ *
+ * Workers service their event loop until the pool is stopped.
+ */
+
+#include "combat.h"
+#include <assert.h>
+#include <string>
+
+char * combat_pool_id = "$Id$";
+
+extern "C" int Combat_Init (Tcl_Interp *);
+
+/*
+ * Tcl_Objs cannot be shared between threads, so workers get a copy of
+ * the script and of the pool interpreter's auto_path
+ */
+
+struct Combat::PoolServant::Worker {
+  std::string script;
+  std::string autopath;
+
+#if defined(COMBAT_HAVE_THREADS)
+  Tcl_ThreadId thread;
+#endif
+  Combat::Servant * servant;
+  PortableServer::DynamicImplementation * impl;
+  std::string error;
+
+  bool started;		// servant made, or error set
+  bool quit;		// event loop to be left
+  bool finished;	// interpreter deleted
+};
+
+#if defined(COMBAT_HAVE_THREADS)
+
+/*
+ * Protects all pools' lists of idle workers, and the workers' state
+ * flags. poolCond is signalled whenever these change.
+ */
+
+TCL_DECLARE_MUTEX(poolMutex)
+static Tcl_Condition poolCond;
+
+struct Combat_PoolQuitEvent {
+  struct Tcl_Event ev;
+  Combat::PoolServant::Worker * worker;
+};
+
+extern "C" {
+
+static int
+Combat_HandlePoolQuitEvent (Tcl_Event * evPtr, int)
+{
+  Combat_PoolQuitEvent * ev = (Combat_PoolQuitEvent *) evPtr;
+  ev->worker->quit = true;
+  return 1;
+}
+
+/*
+ * A worker's thread
+ */
+
+static Tcl_ThreadCreateType
+Combat_PoolThread (ClientData clientData)
+{
+  Combat::PoolServant::Worker * w =
+    (Combat::PoolServant::Worker *) clientData;
+  Tcl_Interp * interp = Tcl_CreateInterp ();
+  Combat::Servant * serv = NULL;
+  PortableServer::DynamicImplementation * impl = NULL;
+  int res;
+
+  /*
+   * Set up the interpreter like the pool's, then make the servant.
+   * The script returns its name.
+   */
+
+  res = Tcl_Init (interp);
+
+  if (res == TCL_OK &&
+      Tcl_SetVar (interp, "auto_path", (char *) w->autopath.c_str(),
+		  TCL_GLOBAL_ONLY | TCL_LEAVE_ERR_MSG) == NULL) {
+    res = TCL_ERROR;
+  }
+
+  if (res == TCL_OK) {
+    res = Combat_Init (interp);
+  }
+
+  if (res == TCL_OK) {
+    res = Tcl_GlobalEval (interp, (char *) w->script.c_str());
+  }
+
+  if (res == TCL_OK) {
+    Combat::Context * ctx;
+    Tcl_Obj * name = Tcl_GetObjResult (interp);
+    Tcl_IncrRefCount (name);
+    Tcl_ResetResult (interp);
+
+    {
+      Combat::GlobalLock lock;
+      ctx = Combat::GlobalData->contexts[interp];
+    }
+
+    serv = Combat::FindServantByName (interp, ctx, name);
+
+    if (serv) {
+      impl = dynamic_cast<PortableServer::DynamicImplementation *> (serv);
+      if (impl == NULL) {
+	Tcl_AppendResult (interp, "error: pool servant \"",
+			  Tcl_GetStringFromObj (name, NULL),
+			  "\" is not a dynamic servant", NULL);
+	serv = NULL;
+      }
+      else {
+	serv->_add_ref ();
+      }
+    }
+
+    Tcl_DecrRefCount (name);
+  }
+
+  Tcl_MutexLock (&poolMutex);
+  if (serv) {
+    w->servant = serv;
+    w->impl = impl;
+  }
+  else {
+    w->error = Tcl_GetStringFromObj (Tcl_GetObjResult (interp), NULL);
+  }
+  w->started = true;
+  Tcl_ConditionNotify (&poolCond);
+  Tcl_MutexUnlock (&poolMutex);
+
+  if (serv) {
+    while (!w->quit) {
+      Tcl_DoOneEvent (TCL_ALL_EVENTS);
+    }
+    serv->_remove_ref ();
+  }
+
+  Tcl_DeleteInterp (interp);
+
+  Tcl_MutexLock (&poolMutex);
+  w->finished = true;
+  Tcl_ConditionNotify (&poolCond);
+  Tcl_MutexUnlock (&poolMutex);
+
+  Tcl_FinalizeThread ();
+  TCL_THREAD_CREATE_RETURN;
+}
+
+}
+
+#endif
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * Combat::PoolServant
+ *
+ * ----------------------------------------------------------------------
+ */
+
+Combat::PoolServant::PoolServant (Tcl_Interp * _i, Tcl_Obj * _o,
+				  Context * _c)
+  : Combat::Servant (_i, _o, _c)
+{
+  stopped = false;
+}
+
+Combat::PoolServant::~PoolServant ()
+{
+  assert (workers.empty ());
+}
+
+/*
+ * Start the workers, and wait for each to make its servant. Requires
+ * the ORB to run in a thread of its own, which all upcalls come from.
+ */
+
+int
+Combat::PoolServant::Start (Tcl_Interp * interp, int size, Tcl_Obj * script)
+{
+#if defined(COMBAT_HAVE_THREADS)
+  if (!OrbThreadRunning ()) {
+    Tcl_AppendResult (interp, "error: interpreter pools need the ORB ",
+		      "to run in a thread of its own", NULL);
+    return TCL_ERROR;
+  }
+
+  Tcl_Obj * autopath = Tcl_GetVar2Ex (interp, "auto_path", NULL,
+				      TCL_GLOBAL_ONLY);
+  bool failed = false;
+  int i;
+
+  for (i=0; i<size; i++) {
+    Worker * w = new Worker;
+    w->script = Tcl_GetStringFromObj (script, NULL);
+    w->autopath = autopath ? Tcl_GetStringFromObj (autopath, NULL) : "";
+    w->servant = NULL;
+    w->impl = NULL;
+    w->started = false;
+    w->quit = false;
+    w->finished = false;
+
+    if (Tcl_CreateThread (&w->thread, Combat_PoolThread, (ClientData) w,
+			  TCL_THREAD_STACK_DEFAULT,
+			  TCL_THREAD_NOFLAGS) != TCL_OK) {
+      Tcl_AppendResult (interp, "error: could not create pool thread",
+			NULL);
+      delete w;
+      failed = true;
+      break;
+    }
+
+    workers.push_back (w);
+  }
+
+  Tcl_MutexLock (&poolMutex);
+
+  for (i=0; i<(int) workers.size(); i++) {
+    while (!workers[i]->started) {
+      Tcl_ConditionWait (&poolCond, &poolMutex, NULL);
+    }
+    if (workers[i]->servant) {
+      idle.push_back (workers[i]);
+    }
+    else if (!failed) {
+      Tcl_AppendResult (interp, workers[i]->error.c_str(), NULL);
+      failed = true;
+    }
+  }
+
+  Tcl_MutexUnlock (&poolMutex);
+
+  if (failed) {
+    Stop ();
+    return TCL_ERROR;
+  }
+
+  return TCL_OK;
+#else
+  Tcl_AppendResult (interp, "error: Combat was compiled without ",
+		    "thread support", NULL);
+  return TCL_ERROR;
+#endif
+}
+
+/*
+ * Wait for the requests in progress, then stop the workers. Requests
+ * that come in later raise OBJECT_NOT_EXIST.
+ */
+
+void
+Combat::PoolServant::Stop ()
+{
+#if defined(COMBAT_HAVE_THREADS)
+  CORBA::ULong i, running = 0;
+
+  Tcl_MutexLock (&poolMutex);
+  stopped = true;
+
+  for (i=0; i<workers.size(); i++) {
+    if (workers[i]->servant) {
+      running++;
+    }
+  }
+
+  while (idle.size() < running) {
+    Tcl_ConditionWait (&poolCond, &poolMutex, NULL);
+  }
+
+  idle.clear ();
+  Tcl_MutexUnlock (&poolMutex);
+
+  for (i=0; i<workers.size(); i++) {
+    if (workers[i]->servant) {
+      Combat_PoolQuitEvent * ev =
+	(Combat_PoolQuitEvent *) Tcl_Alloc (sizeof (Combat_PoolQuitEvent));
+      ev->ev.proc = Combat_HandlePoolQuitEvent;
+      ev->worker = workers[i];
+      Tcl_ThreadQueueEvent (workers[i]->thread, (Tcl_Event *) ev,
+			    TCL_QUEUE_TAIL);
+      Tcl_ThreadAlert (workers[i]->thread);
+    }
+  }
+
+  Tcl_MutexLock (&poolMutex);
+
+  for (i=0; i<workers.size(); i++) {
+    while (!workers[i]->finished) {
+      Tcl_ConditionWait (&poolCond, &poolMutex, NULL);
+    }
+    delete workers[i];
+  }
+
+  workers.clear ();
+  Tcl_MutexUnlock (&poolMutex);
+#endif
+}
+
+Combat::PoolServant::Worker *
+Combat::PoolServant::Acquire ()
+{
+  Worker * w = NULL;
+
+#if defined(COMBAT_HAVE_THREADS)
+  Tcl_MutexLock (&poolMutex);
+
+  while (!stopped && idle.empty ()) {
+    Tcl_ConditionWait (&poolCond, &poolMutex, NULL);
+  }
+
+  if (!stopped) {
+    w = idle.back ();
+    idle.pop_back ();
+  }
+
+  Tcl_MutexUnlock (&poolMutex);
+#endif
+
+  return w;
+}
+
+void
+Combat::PoolServant::Release (Worker * w)
+{
+#if defined(COMBAT_HAVE_THREADS)
+  Tcl_MutexLock (&poolMutex);
+  idle.push_back (w);
+  Tcl_ConditionNotify (&poolCond);
+  Tcl_MutexUnlock (&poolMutex);
+#endif
+}
+
+CORBA::Object_ptr
+Combat::PoolServant::_this ()
+{
+  return PortableServer::DynamicImplementation::_this ();
+}
+
+void
+Combat::PoolServant::invoke (CORBA::ServerRequest_ptr svr)
+{
+  Worker * w = Acquire ();
+
+  if (w == NULL) {
+    CORBA::Any ex;
+    ex <<= CORBA::OBJECT_NOT_EXIST (0, CORBA::COMPLETED_NO);
+    svr->set_exception (ex);
+    return;
+  }
+
+#ifdef HAVE_EXCEPTIONS
+  try {
+#endif
+    w->impl->invoke (svr);
+#ifdef HAVE_EXCEPTIONS
+  } catch (...) {
+    Release (w);
+    throw;
+  }
+#endif
+
+  Release (w);
+}
+
+CORBA::Boolean
+Combat::PoolServant::_is_a (const char * repoid)
+{
+  Worker * w = Acquire ();
+  CORBA::Boolean res;
+
+  if (w == NULL) {
+#ifdef HAVE_EXCEPTIONS
+    throw CORBA::OBJECT_NOT_EXIST (0, CORBA::COMPLETED_NO);
+#else
+    return FALSE;
+#endif
+  }
+
+#ifdef HAVE_EXCEPTIONS
+  try {
+#endif
+    res = w->impl->_is_a (repoid);
+#ifdef HAVE_EXCEPTIONS
+  } catch (...) {
+    Release (w);
+    throw;
+  }
+#endif
+
+  Release (w);
+  return res;
+}
+
+CORBA::RepositoryId
+Combat::PoolServant::_primary_interface (const PortableServer::ObjectId & oid,
+					 PortableServer::POA_ptr poa)
+{
+  Worker * w = Acquire ();
+  CORBA::RepositoryId res;
+
+  if (w == NULL) {
+#ifdef HAVE_EXCEPTIONS
+    throw CORBA::OBJECT_NOT_EXIST (0, CORBA::COMPLETED_NO);
+#else
+    return CORBA::string_dup ("");
+#endif
+  }
+
+#ifdef HAVE_EXCEPTIONS
+  try {
+#endif
+    res = w->impl->_primary_interface (oid, poa);
+#ifdef HAVE_EXCEPTIONS
+  } catch (...) {
+    Release (w);
+    throw;
+  }
+#endif
+
+  Release (w);
+  return res;
+}
@@ -0,0 +1,387 @@
+/*
+ * ======================================================================
+ *
+ * This file is part of Combat, the Tcl interface for CORBA
+ * Copyright (c) Frank Pilhofer
+ *
+ * ======================================================================
+ */
+
+/*
+ * ----------------------------------------------------------------------
+ * Preloading Interface Descriptions
+ * ----------------------------------------------------------------------
+ *
+ * Interface descriptions are otherwise fetched when an object of that
+ * type is first used, with a synchronous lookup_id and describe_interface
+ * for the interface and for each of its bases. corba::preload fetches a
+ * whole list of them up front instead: lookup_id is sent for all of them
+ * at once as deferred requests, describe_interface for each InterfaceDef
+ * as it comes back, and lookup_id again for the bases that turn up and
+ * are not known yet. The descriptions are added to the InterfaceCache,
+ * bases first, when all responses are in.
+ */
+
+#include "combat.h"
+#include <assert.h>
+#include <string>
+
+char * combat_preload_id = "$Id$";
+
+Combat::Preload::Preload (Tcl_Interp * _interp, Context * _ctx)
+{
+  interp = _interp;
+  ctx = _ctx;
+  background = false;
+  inflight = 0;
+}
+
+Combat::Preload::~Preload ()
+{
+  GlobalLock lock;
+
+  if (background) {
+    for (CORBA::ULong i=0; i<ctx->preloads.size(); i++) {
+      if (ctx->preloads[i] == this) {
+	ctx->preloads.erase (ctx->preloads.begin() + i);
+	break;
+      }
+    }
+  }
+
+  for (EntryMap::iterator it = entries.begin(); it != entries.end(); it++) {
+    if (!CORBA::is_nil ((*it).second.req)) {
+      GlobalData->pending.erase ((*it).second.req.in());
+    }
+    delete (*it).second.fid;
+  }
+
+  OrbThreadPending ();
+}
+
+Combat::Context *
+Combat::Preload::context () const
+{
+  return ctx;
+}
+
+/*
+ * Called by CollectResponses when the ORB hands out a response to one
+ * of our requests. In the background, this is what drives the Preload
+ * along, and finishes it once the last response is in.
+ */
+
+bool
+Combat::Preload::PollResult ()
+{
+  if (!Poll ()) {
+    return false;
+  }
+
+  if (background) {
+    Finish ();
+  }
+
+  return true;
+}
+
+void
+Combat::Preload::add (const char * repoid)
+{
+  Queue (repoid, true);
+}
+
+void
+Combat::Preload::Queue (const char * repoid, bool wanted)
+{
+  EntryMap::iterator it = entries.find (repoid);
+
+  if (it != entries.end()) {
+    if (wanted && !(*it).second.wanted) {
+      (*it).second.wanted = true;
+      if ((*it).second.failed) {
+	missing.push_back (repoid);
+      }
+    }
+    return;
+  }
+
+  Entry & e = entries[repoid];
+  e.wanted = wanted;
+  e.failed = false;
+  e.added = false;
+  e.fid = NULL;
+
+  if (GlobalData->icache.known (repoid)) {
+    e.added = true;
+    return;
+  }
+
+  CORBA::Request_ptr req = GlobalData->repo->_request ("lookup_id");
+  req->add_in_arg () <<= repoid;
+  req->set_return_type (CORBA::_tc_Object);
+  Send (repoid, e, req);
+}
+
+/*
+ * Send a request for an entry, which takes ownership of it
+ */
+
+void
+Combat::Preload::Send (const std::string & repoid, Entry & e,
+		       CORBA::Request_ptr req)
+{
+#ifdef HAVE_EXCEPTIONS
+  try {
+#endif
+    req->send_deferred ();
+#ifdef HAVE_EXCEPTIONS
+  } catch (CORBA::Exception &) {
+    CORBA::release (req);
+    Fail (repoid, e);
+    return;
+  }
+#endif
+
+  e.req = req;
+  inflight++;
+
+  /*
+   * Have CollectResponses pass the response on to us, rather than
+   * dropping it
+   */
+
+  GlobalLock lock;
+  GlobalData->pending[req] = this;
+  OrbThreadPending ();
+}
+
+void
+Combat::Preload::Fail (const std::string & repoid, Entry & e)
+{
+  e.failed = true;
+  if (e.wanted) {
+    missing.push_back (repoid);
+  }
+}
+
+/*
+ * Takes the response for an entry, blocking until it is there, and
+ * sends the next request
+ */
+
+void
+Combat::Preload::Receive (const std::string & repoid, Entry & e)
+{
+  CORBA::Request_var req = e.req._retn ();
+  bool ok = true;
+
+  assert (!CORBA::is_nil (req));
+  inflight--;
+
+  {
+    GlobalLock lock;
+    GlobalData->pending.erase (req.in());
+    OrbThreadPending ();
+  }
+
+#ifdef HAVE_EXCEPTIONS
+  try {
+#endif
+    req->get_response ();
+#ifdef HAVE_EXCEPTIONS
+  } catch (CORBA::Exception &) {
+    ok = false;
+  }
+#endif
+
+  if (ok && req->env()->exception()) {
+    ok = false;
+  }
+
+  if (!ok) {
+    Fail (repoid, e);
+    return;
+  }
+
+  if (CORBA::is_nil (e.ifd)) {
+    /*
+     * lookup_id is done, ask the InterfaceDef for its description
+     */
+
+    CORBA::Object_var obj;
+
+    if (req->return_value () >>= CORBA::Any::to_object (obj)) {
+      e.ifd = CORBA::InterfaceDef::_narrow (obj);
+    }
+
+    if (CORBA::is_nil (e.ifd)) {
+      Fail (repoid, e);
+      return;
+    }
+
+    CORBA::Request_ptr nreq = e.ifd->_request ("describe_interface");
+    nreq->set_return_type (CORBA::InterfaceDef::_tc_FullInterfaceDescription);
+    Send (repoid, e, nreq);
+    return;
+  }
+
+  /*
+   * describe_interface is done, go on with the bases
+   */
+
+  const CORBA::InterfaceDef::FullInterfaceDescription * fid;
+
+  if (!(req->return_value () >>= fid)) {
+    Fail (repoid, e);
+    return;
+  }
+
+  e.fid = new CORBA::InterfaceDef::FullInterfaceDescription (*fid);
+
+  for (CORBA::ULong i=0; i<e.fid->base_interfaces.length(); i++) {
+    Queue (e.fid->base_interfaces[i].in(), false);
+  }
+}
+
+/*
+ * Add an entry's description to the cache, after those of its bases,
+ * so that the cache does not fetch them again itself
+ */
+
+void
+Combat::Preload::Add (Entry & e)
+{
+  e.added = true;
+
+  for (CORBA::ULong i=0; i<e.fid->base_interfaces.length(); i++) {
+    EntryMap::iterator bi = entries.find (e.fid->base_interfaces[i].in());
+    if (bi != entries.end() && (*bi).second.fid && !(*bi).second.added) {
+      Add ((*bi).second);
+    }
+  }
+
+  GlobalData->icache.add (e.ifd, *e.fid);
+}
+
+bool
+Combat::Preload::Poll ()
+{
+  EntryMap::iterator it;
+
+  /*
+   * Entries that Receive queues may or may not be visited in this
+   * round; either is fine
+   */
+
+  for (it = entries.begin(); it != entries.end() && inflight > 0; it++) {
+    Entry & e = (*it).second;
+    bool finished;
+
+    if (CORBA::is_nil (e.req)) {
+      continue;
+    }
+
+#ifdef HAVE_EXCEPTIONS
+    try {
+#endif
+      finished = e.req->poll_response ();
+#ifdef HAVE_EXCEPTIONS
+    } catch (CORBA::Exception &) {
+      finished = true;
+    }
+#endif
+
+    if (finished) {
+      Receive ((*it).first, e);
+    }
+  }
+
+  if (inflight > 0) {
+    return false;
+  }
+
+  for (it = entries.begin(); it != entries.end(); it++) {
+    if ((*it).second.fid && !(*it).second.added) {
+      Add ((*it).second);
+    }
+  }
+
+  return true;
+}
+
+void
+Combat::Preload::Wait ()
+{
+  while (!Poll ()) {
+    /*
+     * Block on the first request that is still in flight
+     */
+
+    EntryMap::iterator it;
+
+    for (it = entries.begin(); it != entries.end(); it++) {
+      if (!CORBA::is_nil ((*it).second.req)) {
+	Receive ((*it).first, (*it).second);
+	break;
+      }
+    }
+  }
+}
+
+int
+Combat::Preload::Result (Tcl_Interp * interp)
+{
+  if (missing.empty ()) {
+    return TCL_OK;
+  }
+
+  Tcl_AppendResult (interp, "error: could not find interface", NULL);
+
+  for (CORBA::ULong j=0; j<missing.size(); j++) {
+    Tcl_AppendResult (interp, (j == 0) ? " \"" : ", \"",
+		      missing[j].c_str(), "\"", NULL);
+  }
+
+  return TCL_ERROR;
+}
+
+void
+Combat::Preload::Async ()
+{
+  {
+    GlobalLock lock;
+    ctx->preloads.push_back (this);
+    background = true;
+  }
+
+  /*
+   * Responses are passed on to PollResult as they come in. If none
+   * are outstanding, e.g. because all interfaces were known, we are
+   * done already.
+   */
+
+  if (Poll ()) {
+    Finish ();
+  }
+}
+
+void
+Combat::Preload::Finish ()
+{
+  /*
+   * Nobody waits for us, so failures are reported in the background
+   */
+
+  Tcl_Interp * ip = interp;
+  Tcl_Preserve ((ClientData) ip);
+  Tcl_ResetResult (ip);
+
+  if (Result (ip) != TCL_OK) {
+    Tcl_AddErrorInfo (ip, "\n    (corba::preload -async)");
+    Tcl_BackgroundError (ip);
+  }
+
+  delete this;
+  Tcl_Release ((ClientData) ip);
+}
@@ -404,7 +404,7 @@ Combat::ServerRequest::arguments (Tcl_Interp * interp, Context * ctx,
     Tcl_Obj *val;
 
     if (args->item(i)->flags() == CORBA::ARG_IN) {
-      val = Combat::NewAnyObj (interp, ctx, *args->item(i)->value());
+      val = Combat::NewAnyObj (interp, ctx, args->item(i));
       Tcl_ListObjAppendElement (NULL, res, val);
     }
     else if (args->item(i)->flags() == CORBA::ARG_OUT) {
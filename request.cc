@@ -9,8 +9,15 @@
  
 #include "combat.h"
 #include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
+#if !(TCL_MAJOR_VERSION > 8 || (TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION >= 4))
+#include <sys/time.h>
+#endif
+
 char * combat_request_id = "$Id: request.cc,v 1.28 2003/06/27 01:55:16 fp Exp $";
 
 /*
@@ -21,32 +28,199 @@ char * combat_request_id = "$Id: request.cc,v 1.28 2003/06/27 01:55:16 fp Exp $"
  * ----------------------------------------------------------------------
  */
 
-#ifdef HAVE_NAMESPACE
-namespace Combat {
-  UniqueIdGenerator Request::IdFactory("_mico_req_");
+/*
+ * Request ids, and the memory of ObjectRequests that have been deleted,
+ * for reuse. Each thread keeps its own, so that none of this needs to
+ * be locked; ids need only be unique within an interpreter.
+ */
+
+#define COMBAT_REQ_PREFIX "_mico_req_"
+#define COMBAT_REQ_PREFIX_LEN 10
+#define COMBAT_MAX_FREE_REQUESTS 256
+
+struct Combat_RequestData {
+  int initialized;
+  unsigned long ids;
+  void * freelist;		// linked through their first word
+  unsigned long nfree;
 };
-#else
-Combat::UniqueIdGenerator Combat::Request::IdFactory ("_mico_req_");
-#endif
+
+static Tcl_ThreadDataKey requestDataKey;
+
+extern "C" {
+  static void
+  Combat_FreeRequests (ClientData clientData)
+  {
+    Combat_RequestData * data = (Combat_RequestData *) clientData;
+
+    while (data->freelist) {
+      void * mem = data->freelist;
+      data->freelist = *((void **) mem);
+      ::operator delete (mem);
+    }
+
+    data->nfree = 0;
+  }
+}
+
+static Combat_RequestData *
+Combat_GetRequestData ()
+{
+  Combat_RequestData * data = (Combat_RequestData *)
+    Tcl_GetThreadData (&requestDataKey, sizeof (Combat_RequestData));
+
+  if (!data->initialized) {
+    data->initialized = 1;
+    Tcl_CreateThreadExitHandler (Combat_FreeRequests, (ClientData) data);
+  }
+
+  return data;
+}
 
 Combat::Request::Request ()
 {
+  notify = NULL;
+  rlist = NULL;
+  rnext = NULL;
+  rprev = NULL;
   cbinterp = NULL;
   cbfunc = NULL;
-  id = IdFactory.new_id();
+  name = NULL;
+  id = ++Combat_GetRequestData()->ids;
 }
 
 Combat::Request::~Request ()
 {
+  if (rlist) {
+    rlist->remove (this);
+  }
   if (cbfunc) {
     Tcl_DecrRefCount (cbfunc);
   }
+  if (name) {
+    Tcl_DecrRefCount (name);
+  }
 }
 
-const char *
+unsigned long
 Combat::Request::get_id () const
 {
-  return id.in();
+  return id;
+}
+
+Tcl_Obj *
+Combat::Request::handle ()
+{
+  if (name == NULL) {
+    char tmp[COMBAT_REQ_PREFIX_LEN + 32];
+    sprintf (tmp, "%s%lu", COMBAT_REQ_PREFIX, id);
+    name = Tcl_NewStringObj (tmp, -1);
+    Tcl_IncrRefCount (name);
+  }
+
+  return name;
+}
+
+unsigned long
+Combat::Request::Key (Tcl_Obj * obj)
+{
+  const char * str = Tcl_GetStringFromObj (obj, NULL);
+  unsigned long key;
+  char * end;
+
+  if (strncmp (str, COMBAT_REQ_PREFIX, COMBAT_REQ_PREFIX_LEN) != 0 ||
+      str[COMBAT_REQ_PREFIX_LEN] < '1' || str[COMBAT_REQ_PREFIX_LEN] > '9') {
+    return 0;
+  }
+
+  key = strtoul (str + COMBAT_REQ_PREFIX_LEN, &end, 10);
+  return (*end == '\0') ? key : 0;
+}
+
+/*
+ * Ready lists
+ */
+
+Combat::ReadyList::ReadyList ()
+{
+  head = NULL;
+  tail = NULL;
+  count = 0;
+}
+
+void
+Combat::ReadyList::push (Request * req)
+{
+  assert (req->rlist == NULL);
+
+  req->rlist = this;
+  req->rnext = NULL;
+  req->rprev = tail;
+
+  if (tail) {
+    tail->rnext = req;
+  }
+  else {
+    head = req;
+  }
+
+  tail = req;
+  count++;
+}
+
+void
+Combat::ReadyList::remove (Request * req)
+{
+  assert (req->rlist == this);
+
+  if (req->rprev) {
+    req->rprev->rnext = req->rnext;
+  }
+  else {
+    head = req->rnext;
+  }
+
+  if (req->rnext) {
+    req->rnext->rprev = req->rprev;
+  }
+  else {
+    tail = req->rprev;
+  }
+
+  req->rlist = NULL;
+  req->rnext = NULL;
+  req->rprev = NULL;
+  count--;
+}
+
+void
+Combat::Request::Notify (ReadyList * list)
+{
+  notify = list;
+
+  if (PollResult ()) {
+    Finished ();
+  }
+}
+
+void
+Combat::Request::Finished ()
+{
+  if (notify && !rlist) {
+    notify->push (this);
+  }
+}
+
+bool
+Combat::Request::Ready () const
+{
+  return rlist != NULL;
+}
+
+Combat::Request *
+Combat::Request::next () const
+{
+  return rnext;
 }
 
 /*
@@ -76,7 +250,7 @@ Combat::Request::PerformCallback ()
 
   Tcl_Obj *o[2], *com;
   o[0] = cbfunc;
-  o[1] = Tcl_NewStringObj ((char *) id.in(), -1);
+  o[1] = handle ();
   com  = Tcl_NewListObj (2, o);
   Tcl_IncrRefCount (com);
 
@@ -97,32 +271,52 @@ Combat::Request::PerformCallback ()
 Combat::ObjectRequest::ObjectRequest (Object * _o)
 {
   obj = _o;
-  pds = NULL;
+  tmpl = NULL;
   params = NULL;
   is_builtin = false;
   is_oneway = false;
   is_finished = false;
+  is_pending = false;
   builtin_result = NULL;
   req_except = NULL;
+  rplan = NULL;
+  timeout = -1;
+  timer = NULL;
 }
 
 Combat::ObjectRequest::~ObjectRequest ()
 {
-  if (params && pds) {
-    for (CORBA::ULong i=0; i < pds->length(); i++) {
+  if (timer) {
+    Tcl_DeleteTimerHandler (timer);
+  }
+
+  if (is_pending) {
+    GlobalLock lock;
+    GlobalData->pending.erase (req.in());
+    OrbThreadPending ();
+  }
+
+  if (params) {
+    for (CORBA::ULong i=0; i < tmpl->params.length(); i++) {
       Tcl_DecrRefCount (params[i]);
     }
     delete [] params;
   }
 
-  delete pds;
-
   if (is_builtin && builtin_result) {
     Tcl_DecrRefCount (builtin_result);
   }
   if (req_except) {
     Tcl_DecrRefCount (req_except);
   }
+
+  if (tmpl) {
+    tmpl->deref ();
+  }
+
+  if (rplan) {
+    rplan->deref ();
+  }
 }
 
 /*
@@ -132,12 +326,12 @@ Combat::ObjectRequest::~ObjectRequest ()
 int
 Combat::ObjectRequest::SetupGet (Tcl_Interp * interp,
 				 const char * attr,
-				 CORBA::AttributeDescription * ad)
+				 InterfaceInfo::Member * m)
 {
-  std::string command ("_get_");
-  command += attr;
-  req      = obj->obj->_request (command.c_str());
-  rtype    = CORBA::TypeCode::_duplicate (ad->type);
+  req      = obj->obj->_request (m->getname.in());
+  rtype    = CORBA::TypeCode::_duplicate (m->ad->type);
+  rplan    = m->plan;
+  rplan->ref ();
   req->set_return_type (rtype.in());
   return TCL_OK;
 }
@@ -150,18 +344,15 @@ int
 Combat::ObjectRequest::SetupSet (Tcl_Interp * interp,
 				 const char * attr,
 				 Tcl_Obj * data,
-				 CORBA::AttributeDescription * ad)
+				 InterfaceInfo::Member * m)
 {
-  std::string command = ("_set_");
-  command += attr;
-
-  if (ad->mode == CORBA::ATTR_READONLY) {
+  if (m->ad->mode == CORBA::ATTR_READONLY) {
     Tcl_AppendResult (interp, "error: attribute \"", attr,
 		      "\" is readonly", NULL);
     return TCL_ERROR;
   }
 
-  CORBA::Any * any = Combat::GetAnyFromObj (interp, ctx, data, ad->type.in());
+  CORBA::Any * any = Combat::GetAnyFromObj (interp, ctx, data, m->plan);
 
   if (!any) {
     Tcl_AppendResult (interp, "\n  while setting attribute \"", attr,
@@ -175,7 +366,7 @@ Combat::ObjectRequest::SetupSet (Tcl_Interp * interp,
 #else
   rtype = CORBA::TypeCode::_nil ();
 #endif
-  req   = obj->obj->_request (command.c_str());
+  req   = obj->obj->_request (m->setname.in());
   req->arguments()->add_value_consume (CORBA::string_dup (""),
 				       any, CORBA::ARG_IN);
   req->set_return_type (CORBA::_tc_void);
@@ -192,60 +383,46 @@ Combat::ObjectRequest::SetupSet (Tcl_Interp * interp,
 int
 Combat::ObjectRequest::SetupInvoke (Tcl_Interp * interp, const char * op,
 				    int objc, Tcl_Obj *CONST objv[],
-				    CORBA::OperationDescription * od)
+				    InterfaceInfo::Member * m)
 {
   CORBA::ULong i;
-  int res;
 
-  res = TCL_OK;
-  pds = new CORBA::ParDescriptionSeq (od->parameters);
+  /*
+   * Modes, types, plans and exceptions come with the template
+   */
 
-  if ((CORBA::ULong) objc != od->parameters.length()) {
+  tmpl = m->tmpl;
+  tmpl->ref ();
+  is_oneway = tmpl->oneway;
+
+  if ((CORBA::ULong) objc != tmpl->params.length()) {
     char tmp[64];
-    sprintf (tmp, "%lu", (unsigned long) od->parameters.length());
+    sprintf (tmp, "%lu", (unsigned long) tmpl->params.length());
     Tcl_AppendResult (interp, "error: operation \"", op,
 		      "\" of interface ", obj->iface->id(),
 		      " takes ", tmp, " parameters", NULL);
     return TCL_ERROR;
   }
 
-  /*
-   * Build request
-   */
-
-  req   = obj->obj->_request (op);
-  rtype = CORBA::TypeCode::_duplicate (od->result);
-  req->set_return_type (rtype.in());
-
-  if (od->mode == CORBA::OP_ONEWAY) {
-    is_oneway = true;
-  }
-
-  /*
-   * User Exceptions
-   */
-
-  for (i=0; i < od->exceptions.length(); i++) {
-    req->exceptions()->add (od->exceptions[i].type);
-  }
-  
   /*
    * Parameters
    */
 
-  for (i=0; i < od->parameters.length(); i++) {
+  CORBA::NVList_var args;
+  GlobalData->orb->create_list (objc, args.out());
+
+  for (i=0; i < tmpl->params.length(); i++) {
     CORBA::Any * any;
     CORBA::Flags mode;
 
-    switch (od->parameters[i].mode) {
+    switch (tmpl->params[i].mode) {
     case CORBA::PARAM_IN:
-      any = Combat::GetAnyFromObj (interp, ctx, objv[i],
-				    od->parameters[i].type);
+      any = Combat::GetAnyFromObj (interp, ctx, objv[i], tmpl->plans[i]);
       mode = CORBA::ARG_IN;
       break;
 
     case CORBA::PARAM_OUT:
-      any = new CORBA::Any (od->parameters[i].type, (void *) NULL);
+      any = new CORBA::Any (tmpl->params[i].type, (void *) NULL);
       mode = CORBA::ARG_OUT;
       break;
 
@@ -261,8 +438,7 @@ Combat::ObjectRequest::SetupInvoke (Tcl_Interp * interp, const char * op,
 	  any = NULL;
 	  break;
 	}
-	any = Combat::GetAnyFromObj (interp, ctx, data,
-				      od->parameters[i].type);
+	any = Combat::GetAnyFromObj (interp, ctx, data, tmpl->plans[i]);
 	mode = CORBA::ARG_INOUT;
       }
       break;
@@ -273,23 +449,45 @@ Combat::ObjectRequest::SetupInvoke (Tcl_Interp * interp, const char * op,
 
     if (!any) {
       Tcl_AppendResult (interp, "\n  while packing parameter ",
-			od->parameters[i].name.in(),
+			tmpl->params[i].name.in(),
 			" of operation \"", op, "\"", NULL);
       return TCL_ERROR;
     }
 
-    req->arguments()->add_value_consume (CORBA::string_dup (""), any, mode);
+    args->add_value_consume (CORBA::string_dup (""), any, mode);
   }
 
+  /*
+   * Build request. The exception list is shared by all requests for
+   * this operation, rather than filled in for each.
+   */
+
+  CORBA::NamedValue_var result;
+  GlobalData->orb->create_named_value (result.out());
+
+  obj->obj->_create_request (CORBA::Context::_nil(), op,
+			     args.in(), result.in(),
+			     tmpl->exceptions.in(),
+			     CORBA::ContextList::_nil(),
+			     req.out(), 0);
+
+  rtype = CORBA::TypeCode::_duplicate (tmpl->result);
+  req->set_return_type (rtype.in());
+
+  rplan = tmpl->plans[i];
+  rplan->ref ();
+
   /*
    * Save information about out/inout parameters
    */
 
-  params = new Tcl_Obj * [od->parameters.length()];
+  if (tmpl->hasout) {
+    params = new Tcl_Obj * [tmpl->params.length()];
 
-  for (i=0; i < od->parameters.length(); i++) {
-    Tcl_IncrRefCount (objv[i]);
-    params[i] = objv[i];
+    for (i=0; i < tmpl->params.length(); i++) {
+      Tcl_IncrRefCount (objv[i]);
+      params[i] = objv[i];
+    }
   }
 
   return TCL_OK;
@@ -379,10 +577,17 @@ Combat::ObjectRequest::SetupBuiltin (Tcl_Interp * interp, const char * op,
     }
     const char * repoid = Tcl_GetStringFromObj (objv[0], NULL);
     CORBA::Boolean result;
+
+    /*
+     * Only ask the object if its known type does not tell
+     */
+
+    bool known = obj->iface && obj->iface->is_a (repoid);
+
 #ifdef HAVE_EXCEPTIONS
     try {
 #endif
-      result = obj->obj->_is_a (repoid);
+      result = known || obj->obj->_is_a (repoid);
 #ifdef HAVE_EXCEPTIONS
     } catch (CORBA::Exception &ex) {
       Tcl_SetObjResult (interp, Combat::DecodeException (interp, ctx, &ex));
@@ -496,77 +701,82 @@ Combat::ObjectRequest::Setup (Tcl_Interp * interp, Context * c,
    * objv[0] is operation name, objv[1] is the first actual parameter.
    */
 
-  const char * op = Tcl_GetStringFromObj (objv[0], NULL);
+  Tcl_Obj * opname = objv[0];
+  const char * op = Tcl_GetStringFromObj (opname, NULL);
+  InterfaceInfo::Member * m = NULL;
   objv++; objc--;
 
   /*
-   * Handle Invocations on Pseudo Objects
+   * A name that was resolved against this interface before cannot be
+   * a pseudo operation or builtin, and need not be looked up again
    */
 
-  if (SetupPseudo (interp, op, objc, objv, &res)) {
-    return res;
+  if (obj->iface) {
+    m = obj->iface->cached (opname);
   }
 
-  /*
-   * Handle Builtins
-   */
+  if (m == NULL) {
+    /*
+     * Handle Invocations on Pseudo Objects
+     */
 
-  if (SetupBuiltin (interp, op, objc, objv, &res)) {
-    return res;
-  }
+    if (SetupPseudo (interp, op, objc, objv, &res)) {
+      return res;
+    }
 
-  /*
-   * Do we have type information for the object?
-   */
+    /*
+     * Handle Builtins
+     */
 
-  if (obj->iface == NULL) {
-    if (!obj->UpdateType()) {
-      Tcl_AppendResult (interp, "error: no type information for \"",
-			obj->name, "\": _get_interface failed",
-			NULL);
-      return TCL_ERROR;
+    if (SetupBuiltin (interp, op, objc, objv, &res)) {
+      return res;
     }
-  }
 
-  assert (obj->iface);
+    /*
+     * Do we have type information for the object?
+     */
 
-  /*
-   * Operation or Attribute?
-   */
+    if (obj->iface == NULL) {
+      if (!obj->UpdateType()) {
+	Tcl_AppendResult (interp, "error: no type information for \"",
+			  obj->name, "\": _get_interface failed",
+			  NULL);
+	return TCL_ERROR;
+      }
+    }
 
-  CORBA::OperationDescription * od;
-  CORBA::AttributeDescription * ad;
-  bool found;
+    assert (obj->iface);
 
-  /*
-   * If lookup failed, update our type information, maybe it's wrong, or
-   * maybe the object has morphed.
-   */
+    /*
+     * Operation or Attribute? If lookup failed, update our type
+     * information, maybe it's wrong, or maybe the object has morphed.
+     */
 
-  if (!(found = obj->iface->lookup (op, od, ad))) {
-    if (obj->UpdateType()) {
-      found = obj->iface->lookup (op, od, ad);
+    if ((m = obj->iface->lookup (opname)) == NULL) {
+      if (obj->UpdateType()) {
+	m = obj->iface->lookup (opname);
+      }
     }
-  }
 
-  if (!found) {
-    Tcl_AppendResult (interp, "error: \"", op,
-		      "\" is neither operation nor attribute for \"",
-		      obj->iface->id(), "\"", NULL);
-    return TCL_ERROR;
+    if (m == NULL) {
+      Tcl_AppendResult (interp, "error: \"", op,
+			"\" is neither operation nor attribute for \"",
+			obj->iface->id(), "\"", NULL);
+      return TCL_ERROR;
+    }
   }
 
-  assert (od != NULL || ad != NULL);
+  assert (m->od != NULL || m->ad != NULL);
 
-  if (od != NULL) {
-    res = SetupInvoke (interp, op, objc, objv, od);
+  if (m->od != NULL) {
+    res = SetupInvoke (interp, op, objc, objv, m);
   }
   else {
     if (objc == 0) {
-      res = SetupGet (interp, op, ad);
+      res = SetupGet (interp, op, m);
     }
     else if (objc == 1) {
-      res = SetupSet (interp, op, objv[0], ad);
+      res = SetupSet (interp, op, objv[0], m);
     }
     else {
       Tcl_AppendResult (interp, "error: usage: \"", op, " ?value?\"", NULL);
@@ -651,14 +861,16 @@ Combat::ObjectRequest::SetupDii (Tcl_Interp * interp, Context * c,
    * Set result type
    */
 
-  rtype = Combat::GetTypeCodeFromObj (interp, rtypeobj);
+  rplan = Combat::GetPlanFromObj (interp, rtypeobj);
 
-  if (CORBA::is_nil (rtype)) {
+  if (rplan == NULL) {
     Tcl_AppendResult (interp, "\nerror: invalid return typecode in dii spec",
 		      NULL);
     return TCL_ERROR;
   }
 
+  rtype = CORBA::TypeCode::_duplicate (rplan->typecode ());
+
   req->set_return_type (rtype.in());
 
   /*
@@ -688,13 +900,15 @@ Combat::ObjectRequest::SetupDii (Tcl_Interp * interp, Context * c,
    * Parameters
    */
 
-  pds = new CORBA::ParDescriptionSeq;
-  pds->length (numparams);
+  tmpl = new OperationTemplate;
+  tmpl->params.length (numparams);
+  tmpl->oneway = is_oneway;
 
   for (i=0; i<numparams; i++) {
     Tcl_Obj *paramspec, *paramdirobj, *paramtypeobj;
     const char *paramdirstr;
     CORBA::TypeCode_var ptc;
+    Combat::MarshalPlan * pplan;
     CORBA::Any * any;
     CORBA::Flags mode;
     int parspeclen;
@@ -712,9 +926,9 @@ Combat::ObjectRequest::SetupDii (Tcl_Interp * interp, Context * c,
       return TCL_ERROR;
     }
 
-    ptc = Combat::GetTypeCodeFromObj (interp, paramtypeobj);
+    pplan = Combat::GetPlanFromObj (interp, paramtypeobj);
 
-    if (CORBA::is_nil (ptc)) {
+    if (pplan == NULL) {
       char tmp[64];
       sprintf (tmp, "%d", i);
       Tcl_AppendResult (interp, "\nerror: invalid param typecode ",
@@ -722,18 +936,21 @@ Combat::ObjectRequest::SetupDii (Tcl_Interp * interp, Context * c,
       return TCL_ERROR;
     }
 
+    tmpl->plans.push_back (pplan);
+    ptc = CORBA::TypeCode::_duplicate (pplan->typecode ());
 
     if (strcmp (paramdirstr, "PARAM_IN") == 0 ||
 	strcmp (paramdirstr, "in") == 0) {
-      (*pds)[i].mode = CORBA::PARAM_IN;
-      (*pds)[i].type = CORBA::TypeCode::_duplicate (ptc);
-      any = Combat::GetAnyFromObj (interp, ctx, objv[i], ptc.in());
+      tmpl->params[i].mode = CORBA::PARAM_IN;
+      tmpl->params[i].type = CORBA::TypeCode::_duplicate (ptc);
+      any = Combat::GetAnyFromObj (interp, ctx, objv[i], pplan);
       mode = CORBA::ARG_IN;
     }
     else if (strcmp (paramdirstr, "PARAM_OUT") == 0 ||
 	     strcmp (paramdirstr, "out") == 0) {
-      (*pds)[i].mode = CORBA::PARAM_OUT;
-      (*pds)[i].type = CORBA::TypeCode::_duplicate (ptc);
+      tmpl->params[i].mode = CORBA::PARAM_OUT;
+      tmpl->params[i].type = CORBA::TypeCode::_duplicate (ptc);
+      tmpl->hasout = true;
       any = new CORBA::Any (ptc.in(), (void *) NULL);
       mode = CORBA::ARG_OUT;
     }
@@ -750,10 +967,11 @@ Combat::ObjectRequest::SetupDii (Tcl_Interp * interp, Context * c,
 	break;
       }
 
-      (*pds)[i].mode = CORBA::PARAM_INOUT;
-      (*pds)[i].type = CORBA::TypeCode::_duplicate (ptc);
+      tmpl->params[i].mode = CORBA::PARAM_INOUT;
+      tmpl->params[i].type = CORBA::TypeCode::_duplicate (ptc);
+      tmpl->hasout = true;
 
-      any = Combat::GetAnyFromObj (interp, ctx, data, ptc.in());
+      any = Combat::GetAnyFromObj (interp, ctx, data, pplan);
       mode = CORBA::ARG_INOUT;
     }
     else {
@@ -778,16 +996,124 @@ Combat::ObjectRequest::SetupDii (Tcl_Interp * interp, Context * c,
    * Save information about out/inout parameters
    */
 
-  params = new Tcl_Obj * [numparams];
+  rplan->ref ();
+  tmpl->plans.push_back (rplan);
 
-  for (i=0; i < numparams; i++) {
-    Tcl_IncrRefCount (objv[i]);
-    params[i] = objv[i];
+  if (tmpl->hasout) {
+    params = new Tcl_Obj * [numparams];
+
+    for (i=0; i < numparams; i++) {
+      Tcl_IncrRefCount (objv[i]);
+      params[i] = objv[i];
+    }
   }
 
   return TCL_OK;
 }
 
+/*
+ * Timeouts. The timer runs in the thread that sent the request, which
+ * is the interpreter's. The reply may still come in after the request
+ * has expired; it is then dropped like that of a request that has been
+ * deleted.
+ */
+
+extern "C" {
+  static void
+  Combat_RequestExpired (ClientData clientData)
+  {
+    Combat::ObjectRequest * req = (Combat::ObjectRequest *) clientData;
+    req->Expire ();
+  }
+}
+
+/*
+ * Tcl_GetTime is public only since Tcl 8.4
+ */
+
+static void
+Combat_GetTime (Tcl_Time * tm)
+{
+#if TCL_MAJOR_VERSION > 8 || (TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION >= 4)
+  Tcl_GetTime (tm);
+#else
+  struct timeval tv;
+  gettimeofday (&tv, NULL);
+  tm->sec = tv.tv_sec;
+  tm->usec = tv.tv_usec;
+#endif
+}
+
+/*
+ * Milliseconds left until the deadline, rounded up
+ */
+
+static long
+Combat_TimeLeft (const Tcl_Time * deadline)
+{
+  Tcl_Time now;
+  Combat_GetTime (&now);
+  return (deadline->sec - now.sec) * 1000 +
+    (deadline->usec - now.usec + 999) / 1000;
+}
+
+void
+Combat::ObjectRequest::SetTimeout (int ms)
+{
+  timeout = ms;
+}
+
+void
+Combat::ObjectRequest::Arm ()
+{
+  if (timeout < 0 || timer) {
+    return;
+  }
+
+  Combat_GetTime (&deadline);
+  deadline.sec += timeout / 1000;
+  deadline.usec += (timeout % 1000) * 1000;
+  if (deadline.usec >= 1000000) {
+    deadline.sec++;
+    deadline.usec -= 1000000;
+  }
+
+  timer = Tcl_CreateTimerHandler (timeout, Combat_RequestExpired,
+				  (ClientData) this);
+}
+
+void
+Combat::ObjectRequest::Expire ()
+{
+  if (timer) {
+    Tcl_DeleteTimerHandler (timer);
+    timer = NULL;
+  }
+
+  if (is_finished) {
+    return;
+  }
+
+  /*
+   * CORBA::TIMEOUT is not known to all ORBs, so the exception is made
+   * up here in the form that DecodeException would have given it
+   */
+
+  req_except = Tcl_NewStringObj ("IDL:omg.org/CORBA/TIMEOUT:1.0 "
+				 "{minor 0 completed COMPLETED_MAYBE}", -1);
+  Tcl_IncrRefCount (req_except);
+  is_finished = true;
+
+  if (is_pending) {
+    GlobalLock lock;
+    GlobalData->pending.erase (req.in());
+    is_pending = false;
+    OrbThreadPending ();
+  }
+
+  Finished ();
+}
+
 /*
  * Send / Query invocation
  */
@@ -799,16 +1125,78 @@ Combat::ObjectRequest::Invoke (Tcl_Interp *)
 
   if (is_builtin) {
   }
-  else if (params && is_oneway) {
+  else if (is_oneway) {
     req->send_oneway ();
   }
   else {
     req->send_deferred ();
+    Arm ();
   }
 
   return TCL_OK;
 }
 
+CORBA::Request_ptr
+Combat::ObjectRequest::Deferred ()
+{
+  if (is_builtin || is_oneway) {
+    return CORBA::Request::_nil ();
+  }
+
+  Arm ();
+  return req.in();
+}
+
+void
+Combat::ObjectRequest::Notify (ReadyList * list)
+{
+  if (!is_builtin && !is_oneway && !is_finished && !is_pending) {
+    GlobalLock lock;
+    GlobalData->pending[req.in()] = this;
+    is_pending = true;
+    OrbThreadPending ();
+  }
+
+  Request::Notify (list);
+}
+
+Combat::Context *
+Combat::ObjectRequest::context () const
+{
+  return ctx;
+}
+
+void *
+Combat::ObjectRequest::operator new (size_t size)
+{
+  Combat_RequestData * data = Combat_GetRequestData ();
+
+  if (size != sizeof (ObjectRequest) || data->freelist == NULL) {
+    return ::operator new (size);
+  }
+
+  void * mem = data->freelist;
+  data->freelist = *((void **) mem);
+  data->nfree--;
+  return mem;
+}
+
+void
+Combat::ObjectRequest::operator delete (void * mem, size_t size)
+{
+  Combat_RequestData * data = Combat_GetRequestData ();
+
+  if (size != sizeof (ObjectRequest) ||
+      data->nfree >= COMBAT_MAX_FREE_REQUESTS) {
+    ::operator delete (mem);
+    return;
+  }
+
+  *((void **) mem) = data->freelist;
+  data->freelist = mem;
+  data->nfree++;
+}
+
 bool
 Combat::ObjectRequest::PollResult (void)
 {
@@ -819,7 +1207,7 @@ Combat::ObjectRequest::PollResult (void)
   if (is_builtin) {
     res = true;
   }
-  else if (params && is_oneway) {
+  else if (is_oneway) {
     res = true;
   }
   else if (is_finished) {
@@ -836,14 +1224,104 @@ Combat::ObjectRequest::PollResult (void)
     } catch (CORBA::Exception &ex) {
       req_except = Combat::DecodeException (NULL, ctx, &ex);
       Tcl_IncrRefCount (req_except);
-      is_finished = true;
+      res = is_finished = true;
     }
 #endif
+
+    if (is_finished) {
+      if (is_pending) {
+	GlobalLock lock;
+	GlobalData->pending.erase (req.in());
+	is_pending = false;
+	OrbThreadPending ();
+      }
+      Finished ();
+    }
   }
 
   return res;
 }
 
+/*
+ * Takes the responses that the ORB has for deferred requests, so that
+ * the requests waiting for them are marked as finished, and go on their
+ * ready list. This is constant work for each response, no matter how
+ * many requests are outstanding. Returns true if any were found.
+ */
+
+bool
+Combat::CollectResponses ()
+{
+  bool found = false;
+
+  while (42) {
+    CORBA::Request_var creq;
+
+    if (OrbThreadRunning ()) {
+      /*
+       * The reply thread has taken them from the ORB already
+       */
+
+      if (!OrbThreadResponse (creq.out())) {
+	break;
+      }
+    }
+    else {
+#ifdef HAVE_EXCEPTIONS
+      try {
+#endif
+	if (!GlobalData->orb->poll_next_response ()) {
+	  break;
+	}
+	GlobalData->orb->get_next_response (creq.out());
+#ifdef HAVE_EXCEPTIONS
+      } catch (CORBA::SystemException &) {
+	break;
+      }
+#endif
+    }
+
+    /*
+     * The request is owned by this thread, so that it cannot go away
+     * once it has been found
+     */
+
+    PendingResponse * waiter = NULL;
+
+    {
+      GlobalLock lock;
+      Global::PendingMap::iterator it = GlobalData->pending.find (creq.in());
+      if (it != GlobalData->pending.end()) {
+	waiter = (*it).second;
+      }
+    }
+
+    if (waiter) {
+      waiter->PollResult ();
+      found = true;
+    }
+  }
+
+  return found;
+}
+
+/*
+ * Runs the callbacks of the requests on a Context's cbready list. Each
+ * request is taken off the list before its callback runs, as the
+ * callback is supposed to call corba::request get, which deletes it.
+ */
+
+void
+Combat::PerformCallbacks (Context * ctx)
+{
+  Request * req;
+
+  while ((req = ctx->cbready.head) != NULL) {
+    ctx->cbready.remove (req);
+    req->PerformCallback ();
+  }
+}
+
 /*
  * Handle completed request
  */
@@ -871,9 +1349,40 @@ Combat::ObjectRequest::GetResult (Tcl_Interp * interp)
   }
 
   /*
-   * Make sure result is available
+   * Make sure result is available. With the ORB in a thread of its own,
+   * wait for the reply thread to hand it over, so that upcalls to this
+   * interpreter can be run in the meantime.
+   */
+
+  if (!is_finished && OrbThreadRunning ()) {
+    if (!is_pending) {
+      Notify (NULL);
+    }
+#if defined(COMBAT_HAVE_THREADS)
+    if (!OrbThreadWait (this, timer ? &deadline : NULL)) {
+      Expire ();
+    }
+#else
+    OrbThreadWait (this, NULL);
+#endif
+  }
+
+  /*
+   * With a deadline, poll the ORB until either the reply comes in or
+   * the deadline passes. The event loop is not run, so that no scripts
+   * run while the caller waits for a synchronous invocation.
    */
 
+  while (!is_finished && timer && !PollResult ()) {
+    long left = Combat_TimeLeft (&deadline);
+    if (left <= 0) {
+      Expire ();
+    }
+    else {
+      PollOrb (left);
+    }
+  }
+
   if (!is_finished) {
 #ifdef HAVE_EXCEPTIONS
     try {
@@ -904,21 +1413,22 @@ Combat::ObjectRequest::GetResult (Tcl_Interp * interp)
    */
 
   if (params) {
-    for (CORBA::ULong i=0; i < pds->length(); i++) {
+    for (CORBA::ULong i=0; i < tmpl->params.length(); i++) {
       Tcl_Obj * data;
 
-      switch ((*pds)[i].mode) {
+      switch (tmpl->params[i].mode) {
       case CORBA::PARAM_OUT:
       case CORBA::PARAM_INOUT:
 	data = Combat::NewAnyObj (interp, ctx,
-				   *req->arguments()->item(i)->value());
+				   req->arguments()->item(i),
+				   tmpl->plans[i]);
 
 	if (Tcl_ObjSetVar2 (interp, params[i], NULL,
 			    data, TCL_PARSE_PART1) == NULL) {
 	  Tcl_AppendResult (interp, "can't set variable \"",
 			    Tcl_GetStringFromObj (params[i], NULL),
 			    "\n  while extracting parameter ",
-			    (*pds)[i].name.in(),
+			    tmpl->params[i].name.in(),
 			    "\"", NULL);
 	  Tcl_DecrRefCount (data);
 	  return TCL_ERROR;
@@ -937,7 +1447,13 @@ Combat::ObjectRequest::GetResult (Tcl_Interp * interp)
 
 
   if (!CORBA::is_nil (rtype)) {
-    Tcl_Obj * res = Combat::NewAnyObj (interp, ctx, *req->result()->value());
+    Tcl_Obj * res;
+    if (rplan) {
+      res = Combat::NewAnyObj (interp, ctx, req->result(), rplan);
+    }
+    else {
+      res = Combat::NewAnyObj (interp, ctx, req->result());
+    }
     Tcl_SetObjResult (interp, res);
   }
   else {
@@ -64,6 +64,167 @@ namespace eval PortableServer {\n\
 };
 #endif
 
+/*
+ * ----------------------------------------------------------------------
+ *
+ * Upcalls
+ *
+ * If the ORB runs in a thread of its own, it calls our servants from
+ * there. Each of the methods below then hands an Upcall to the thread
+ * of the servant's interpreter, which calls the same method again.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+class InvokeUpcall : public Combat::Upcall {
+public:
+  InvokeUpcall (PortableServer::DynamicImplementation * _s,
+		CORBA::ServerRequest_ptr _r)
+    : serv (_s), svr (_r) {}
+
+protected:
+  void Run () { serv->invoke (svr); }
+
+private:
+  PortableServer::DynamicImplementation * serv;
+  CORBA::ServerRequest_ptr svr;
+};
+
+class IsAUpcall : public Combat::Upcall {
+public:
+  IsAUpcall (PortableServer::ServantBase * _s, const char * _id)
+    : serv (_s), repoid (_id) {}
+
+  CORBA::Boolean res;
+
+protected:
+  void Run () { res = serv->_is_a (repoid); }
+
+private:
+  PortableServer::ServantBase * serv;
+  const char * repoid;
+};
+
+class PrimaryInterfaceUpcall : public Combat::Upcall {
+public:
+  PrimaryInterfaceUpcall (PortableServer::DynamicImplementation * _s,
+			  const PortableServer::ObjectId & _oid,
+			  PortableServer::POA_ptr _poa)
+    : serv (_s), oid (_oid), poa (_poa) {}
+
+  CORBA::RepositoryId res;
+
+protected:
+  void Run () { res = serv->_primary_interface (oid, poa); }
+
+private:
+  PortableServer::DynamicImplementation * serv;
+  const PortableServer::ObjectId & oid;
+  PortableServer::POA_ptr poa;
+};
+
+class IncarnateUpcall : public Combat::Upcall {
+public:
+  IncarnateUpcall (Combat::ServantActivator * _s,
+		   const PortableServer::ObjectId & _oid,
+		   PortableServer::POA_ptr _poa)
+    : serv (_s), oid (_oid), poa (_poa) {}
+
+  PortableServer::Servant res;
+
+protected:
+  void Run () { res = serv->incarnate (oid, poa); }
+
+private:
+  Combat::ServantActivator * serv;
+  const PortableServer::ObjectId & oid;
+  PortableServer::POA_ptr poa;
+};
+
+class EtherealizeUpcall : public Combat::Upcall {
+public:
+  EtherealizeUpcall (Combat::ServantActivator * _s,
+		     const PortableServer::ObjectId & _oid,
+		     PortableServer::POA_ptr _poa,
+		     PortableServer::Servant _serv,
+		     CORBA::Boolean _c, CORBA::Boolean _w)
+    : serv (_s), oid (_oid), poa (_poa), which (_serv),
+      cleanup (_c), wait (_w) {}
+
+protected:
+  void Run () { serv->etherealize (oid, poa, which, cleanup, wait); }
+
+private:
+  Combat::ServantActivator * serv;
+  const PortableServer::ObjectId & oid;
+  PortableServer::POA_ptr poa;
+  PortableServer::Servant which;
+  CORBA::Boolean cleanup, wait;
+};
+
+class PreinvokeUpcall : public Combat::Upcall {
+public:
+  PreinvokeUpcall (Combat::ServantLocator * _s,
+		   const PortableServer::ObjectId & _oid,
+		   PortableServer::POA_ptr _poa,
+		   const char * _op,
+		   PortableServer::ServantLocator::Cookie & _c)
+    : serv (_s), oid (_oid), poa (_poa), operation (_op), cookie (_c) {}
+
+  PortableServer::Servant res;
+
+protected:
+  void Run () { res = serv->preinvoke (oid, poa, operation, cookie); }
+
+private:
+  Combat::ServantLocator * serv;
+  const PortableServer::ObjectId & oid;
+  PortableServer::POA_ptr poa;
+  const char * operation;
+  PortableServer::ServantLocator::Cookie & cookie;
+};
+
+class PostinvokeUpcall : public Combat::Upcall {
+public:
+  PostinvokeUpcall (Combat::ServantLocator * _s,
+		    const PortableServer::ObjectId & _oid,
+		    PortableServer::POA_ptr _poa,
+		    const char * _op,
+		    PortableServer::ServantLocator::Cookie _c,
+		    PortableServer::Servant _serv)
+    : serv (_s), oid (_oid), poa (_poa), operation (_op), cookie (_c),
+      which (_serv) {}
+
+protected:
+  void Run () { serv->postinvoke (oid, poa, operation, cookie, which); }
+
+private:
+  Combat::ServantLocator * serv;
+  const PortableServer::ObjectId & oid;
+  PortableServer::POA_ptr poa;
+  const char * operation;
+  PortableServer::ServantLocator::Cookie cookie;
+  PortableServer::Servant which;
+};
+
+class UnknownAdapterUpcall : public Combat::Upcall {
+public:
+  UnknownAdapterUpcall (Combat::AdapterActivator * _s,
+			PortableServer::POA_ptr _parent,
+			const char * _name)
+    : serv (_s), parent (_parent), name (_name) {}
+
+  CORBA::Boolean res;
+
+protected:
+  void Run () { res = serv->unknown_adapter (parent, name); }
+
+private:
+  Combat::AdapterActivator * serv;
+  PortableServer::POA_ptr parent;
+  const char * name;
+};
+
 /*
  * ----------------------------------------------------------------------
  *
@@ -170,7 +331,7 @@ Combat::DynamicServant::dispatch_invoke (const char * op,
   for (CORBA::ULong i3=0; i3 < od->parameters.length(); i3++) {
     switch (od->parameters[i3].mode) {
     case CORBA::PARAM_IN:
-      c[i3+2] = Combat::NewAnyObj (interp, ctx, *args->item(i3)->value());
+      c[i3+2] = Combat::NewAnyObj (interp, ctx, args->item(i3));
       break;
     case CORBA::PARAM_INOUT:
     case CORBA::PARAM_OUT:
@@ -230,10 +391,16 @@ Combat::DynamicServant::dispatch_invoke (const char * op,
    */
 
   if (od->result->kind() != CORBA::tk_void) {
-    CORBA::Any * any = Combat::GetAnyFromObj (interp, ctx, ores,
-					       od->result.in());
+    /*
+     * If the result is an Any object of the right type, its value is
+     * handed to the ORB without copying it first
+     */
 
-    if (!any) {
+    const CORBA::Any * ref = Combat::GetAnyRef (ores, od->result.in());
+    CORBA::Any * any = NULL;
+
+    if (!ref && !(any = Combat::GetAnyFromObj (interp, ctx, ores,
+					       od->result.in()))) {
       Tcl_AddErrorInfo (interp, "\n  while packing return value");
       Tcl_AddErrorInfo (interp, "\n  after invoking operation \"");
       Tcl_AddErrorInfo (interp, (char *) op);
@@ -249,7 +416,7 @@ Combat::DynamicServant::dispatch_invoke (const char * op,
       return;
     }
 
-    svr->set_result (*any);
+    svr->set_result (ref ? *ref : *any);
     delete any;
   }
 
@@ -291,8 +458,18 @@ Combat::DynamicServant::dispatch_invoke (const char * op,
 	return;
       }
       
-      CORBA::Any * par = Combat::GetAnyFromObj (interp, ctx, value,
-						od->parameters[i4].type);
+      const CORBA::Any * ref = Combat::GetAnyRef (value,
+						  od->parameters[i4].type);
+      CORBA::Any * par = NULL;
+
+      if (ref) {
+	*args->item(i4)->value() = *ref;
+	Tcl_UnsetVar (interp, tmp, 0);
+	continue;
+      }
+
+      par = Combat::GetAnyFromObj (interp, ctx, value,
+				   od->parameters[i4].type);
       Tcl_UnsetVar (interp, tmp, 0);
       
       if (!par) {
@@ -366,10 +543,11 @@ Combat::DynamicServant::dispatch_attr_get (const char * attr,
     delete ex;
   }
   else {
-    CORBA::Any * any = Combat::GetAnyFromObj (interp, ctx, ores,
-					       ad->type.in());
+    const CORBA::Any * ref = Combat::GetAnyRef (ores, ad->type.in());
+    CORBA::Any * any = NULL;
 
-    if (!any) {
+    if (!ref && !(any = Combat::GetAnyFromObj (interp, ctx, ores,
+					       ad->type.in()))) {
       Tcl_AddErrorInfo (interp, "\n  while packing return value");
       Tcl_AddErrorInfo (interp, "\n  after getting attribute \"");
       Tcl_AddErrorInfo (interp, (char *) attr);
@@ -383,7 +561,7 @@ Combat::DynamicServant::dispatch_attr_get (const char * attr,
       svr->set_exception (uex);
     }
     else {
-      svr->set_result (*any);
+      svr->set_result (ref ? *ref : *any);
       delete any;
     }
   }
@@ -412,7 +590,7 @@ Combat::DynamicServant::dispatch_attr_set (const char * attr,
   c[1] = Tcl_NewStringObj ("configure", 9);
   c[2] = Tcl_NewStringObj ("-", 1);
   Tcl_AppendStringsToObj (c[2], attr, NULL);
-  c[3] = Combat::NewAnyObj (interp, ctx, *args->item(0)->value());
+  c[3] = Combat::NewAnyObj (interp, ctx, args->item(0));
   com  = Tcl_NewListObj (4, c);
   Tcl_IncrRefCount (com);
 
@@ -451,6 +629,12 @@ Combat::DynamicServant::dispatch_attr_set (const char * attr,
 void
 Combat::DynamicServant::invoke (CORBA::ServerRequest_ptr svr)
 {
+  if (!Combat::InInterpThread (ctx)) {
+    InvokeUpcall up (this, svr);
+    up.Perform (ctx);
+    return;
+  }
+
   /*
    * Operation or Attribute
    */
@@ -499,8 +683,23 @@ Combat::DynamicServant::_primary_interface (const PortableServer::ObjectId &,
 CORBA::Boolean
 Combat::DynamicServant::_is_a (const char * repoid)
 {
-  CORBA::InterfaceDef_var ifd = iface->iface ();
-  return ifd->is_a (repoid);
+  /*
+   * The set of base interfaces does not change once it is made, so it
+   * can be probed from the ORB's thread as well
+   */
+
+  if (iface->bases_known ()) {
+    GlobalLock lock;
+    return iface->is_a (repoid);
+  }
+
+  if (!Combat::InInterpThread (ctx)) {
+    IsAUpcall up (this, repoid);
+    up.Perform (ctx);
+    return up.res;
+  }
+
+  return iface->is_a (repoid);
 }
 
 /*
@@ -531,6 +730,12 @@ Combat::DynamicImplementation::_this ()
 void
 Combat::DynamicImplementation::invoke (CORBA::ServerRequest_ptr svr)
 {
+  if (!Combat::InInterpThread (ctx)) {
+    InvokeUpcall up (this, svr);
+    up.Perform (ctx);
+    return;
+  }
+
   /*
    * Create a new ServerRequest pseudo object
    */
@@ -584,6 +789,12 @@ CORBA::Boolean
 Combat::DynamicImplementation::_is_a (const char * repoid)
   throw (CORBA::SystemException)
 {
+  if (!Combat::InInterpThread (ctx)) {
+    IsAUpcall up (this, repoid);
+    up.Perform (ctx);
+    return up.res;
+  }
+
   int res;
 
   Tcl_Obj * com, * c[3];
@@ -624,6 +835,12 @@ CORBA::RepositoryId
 Combat::DynamicImplementation::_primary_interface (const PortableServer::ObjectId & oid,
 						   PortableServer::POA_ptr poa)
 {
+  if (!Combat::InInterpThread (ctx)) {
+    PrimaryInterfaceUpcall up (this, oid, poa);
+    up.Perform (ctx);
+    return up.res;
+  }
+
   char * result = NULL;
 
   Combat::POA * mpoa = new Combat::POA (poa);
@@ -691,6 +908,12 @@ Combat::ServantActivator::incarnate (const PortableServer::ObjectId & oid,
 				     PortableServer::POA_ptr poa)
   throw (PortableServer::ForwardRequest, CORBA::SystemException)
 {
+  if (!Combat::InInterpThread (ctx)) {
+    IncarnateUpcall up (this, oid, poa);
+    up.Perform (ctx);
+    return up.res;
+  }
+
   Combat::POA * mpoa = new Combat::POA (poa);
   Tcl_Obj * poaobj = Combat::InstantiateObj (interp, ctx, mpoa);
   Tcl_IncrRefCount (poaobj);
@@ -764,6 +987,13 @@ Combat::ServantActivator::etherealize (const PortableServer::ObjectId & oid,
 				       CORBA::Boolean wait_for_completion)
   throw (CORBA::SystemException)
 {
+  if (!Combat::InInterpThread (ctx)) {
+    EtherealizeUpcall up (this, oid, poa, serv, cleanup_in_progress,
+			  wait_for_completion);
+    up.Perform (ctx);
+    return;
+  }
+
   Combat::POA * mpoa = new Combat::POA (poa);
   Tcl_Obj * poaobj = Combat::InstantiateObj (interp, ctx, mpoa);
   Tcl_IncrRefCount (poaobj);
@@ -843,6 +1073,12 @@ Combat::ServantLocator::preinvoke (const PortableServer::ObjectId & oid,
 				   PortableServer::ServantLocator::Cookie &cookie)
     throw (PortableServer::ForwardRequest, CORBA::SystemException)
 {
+  if (!Combat::InInterpThread (ctx)) {
+    PreinvokeUpcall up (this, oid, poa, operation, cookie);
+    up.Perform (ctx);
+    return up.res;
+  }
+
   Combat::POA * mpoa = new Combat::POA (poa);
   Tcl_Obj * poaobj = Combat::InstantiateObj (interp, ctx, mpoa);
   Tcl_IncrRefCount (poaobj);
@@ -933,6 +1169,12 @@ Combat::ServantLocator::postinvoke (const PortableServer::ObjectId & oid,
 				    PortableServer::Servant serv)
     throw (CORBA::SystemException)
 {
+  if (!Combat::InInterpThread (ctx)) {
+    PostinvokeUpcall up (this, oid, poa, operation, cookie, serv);
+    up.Perform (ctx);
+    return;
+  }
+
   Combat::POA * mpoa = new Combat::POA (poa);
   Tcl_Obj * poaobj = Combat::InstantiateObj (interp, ctx, mpoa);
   Tcl_IncrRefCount (poaobj);
@@ -1027,6 +1269,12 @@ Combat::AdapterActivator::unknown_adapter (PortableServer::POA_ptr parent,
 					   const char * name)
   throw (CORBA::SystemException)
 {
+  if (!Combat::InInterpThread (ctx)) {
+    UnknownAdapterUpcall up (this, parent, name);
+    up.Perform (ctx);
+    return up.res;
+  }
+
   Combat::POA * mpoa = new Combat::POA (parent);
   Tcl_Obj * poaobj = Combat::InstantiateObj (interp, ctx, mpoa);
   Tcl_IncrRefCount (poaobj);
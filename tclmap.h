@@ -127,21 +127,12 @@ public:
 
   bool empty ()
   {
-    Tcl_HashSearch search;
-    Tcl_HashEntry * entry = Tcl_FirstHashEntry (&table, &search);
-    return entry == NULL;
+    return table.numEntries == 0;
   }
 
   size_t size ()
   {
-    Tcl_HashSearch search;
-    size_t count=0;
-    Tcl_HashEntry * entry = Tcl_FirstHashEntry (&table, &search);
-    while (entry) {
-      count++;
-      entry = Tcl_NextHashEntry (&search);
-    };
-    return count;
+    return table.numEntries;
   }
 
   void insert (const char * key, const vT & value)
@@ -237,21 +228,12 @@ public:
 
   bool empty ()
   {
-    Tcl_HashSearch search;
-    Tcl_HashEntry * entry = Tcl_FirstHashEntry (&table, &search);
-    return entry == NULL;
+    return table.numEntries == 0;
   }
 
   size_t size ()
   {
-    Tcl_HashSearch search;
-    size_t count=0;
-    Tcl_HashEntry * entry = Tcl_FirstHashEntry (&table, &search);
-    while (entry) {
-      count++;
-      entry = Tcl_NextHashEntry (&search);
-    };
-    return count;
+    return table.numEntries;
   }
 
   void insert (kT key, const vT & value)
@@ -79,6 +79,9 @@ private:
  * ----------------------------------------------------------------------
  * Registration of CORBA::TypeCode as a Tcl_Obj type
  * ----------------------------------------------------------------------
+ *
+ * The internal rep holds the TypeCode in ptr1 and, once it is needed,
+ * a reference to its marshalling plan in ptr2.
  */
 
 extern "C" {
@@ -102,7 +105,8 @@ TclTypeCode_SetFromAny (Tcl_Interp * interp, Tcl_Obj * obj)
   }
 
   obj->typePtr = &Combat::TypeCodeType;
-  obj->internalRep.otherValuePtr = (VOID *) (void *) tc;
+  obj->internalRep.twoPtrValue.ptr1 = (VOID *) (void *) tc;
+  obj->internalRep.twoPtrValue.ptr2 = NULL;
 
   return TCL_OK;
 }
@@ -112,7 +116,7 @@ TclTypeCode_UpdateString (Tcl_Obj * obj)
 {
   assert (obj->typePtr == &Combat::TypeCodeType);
   CORBA::TypeCode_ptr tc =
-    (CORBA::TypeCode *) (void *) obj->internalRep.otherValuePtr;
+    (CORBA::TypeCode *) (void *) obj->internalRep.twoPtrValue.ptr1;
 
   TypeCodeGenTcl tcgt;
   Tcl_Obj * res = tcgt.emit (tc);
@@ -141,11 +145,18 @@ TclTypeCode_DupInternal (Tcl_Obj * src, Tcl_Obj * dup)
 {
   assert (src->typePtr == &Combat::TypeCodeType);
   CORBA::TypeCode_ptr tc =
-    (CORBA::TypeCode *) (void *) src->internalRep.otherValuePtr;
+    (CORBA::TypeCode *) (void *) src->internalRep.twoPtrValue.ptr1;
+  Combat::MarshalPlan * plan =
+    (Combat::MarshalPlan *) src->internalRep.twoPtrValue.ptr2;
+
+  if (plan) {
+    plan->ref ();
+  }
 
   dup->typePtr = src->typePtr;
-  dup->internalRep.otherValuePtr =
+  dup->internalRep.twoPtrValue.ptr1 =
     (VOID *) (void *) CORBA::TypeCode::_duplicate (tc);
+  dup->internalRep.twoPtrValue.ptr2 = (VOID *) (void *) plan;
 }
 
 static void
@@ -153,7 +164,14 @@ TclTypeCode_FreeInternal (Tcl_Obj * obj)
 {
   assert (obj->typePtr == &Combat::TypeCodeType);
   CORBA::TypeCode_ptr tc =
-    (CORBA::TypeCode *) (void *) obj->internalRep.otherValuePtr;
+    (CORBA::TypeCode *) (void *) obj->internalRep.twoPtrValue.ptr1;
+  Combat::MarshalPlan * plan =
+    (Combat::MarshalPlan *) obj->internalRep.twoPtrValue.ptr2;
+
+  if (plan) {
+    plan->deref ();
+  }
+
   CORBA::release (tc);
 }
 
@@ -190,8 +208,9 @@ Combat::NewTypeCodeObj (CORBA::TypeCode_ptr tc)
   Tcl_InvalidateStringRep (obj);
 
   obj->typePtr = &TypeCodeType;
-  obj->internalRep.otherValuePtr =
+  obj->internalRep.twoPtrValue.ptr1 =
     (VOID *) (void *) CORBA::TypeCode::_duplicate (tc);
+  obj->internalRep.twoPtrValue.ptr2 = NULL;
 
   return obj;
 }
@@ -210,10 +229,38 @@ Combat::GetTypeCodeFromObj (Tcl_Interp * interp, Tcl_Obj * data)
   assert (data->typePtr == &TypeCodeType);
 
   CORBA::TypeCode_ptr tc =
-    (CORBA::TypeCode *) (void *) data->internalRep.otherValuePtr;
+    (CORBA::TypeCode *) (void *) data->internalRep.twoPtrValue.ptr1;
   return CORBA::TypeCode::_duplicate (tc);
 }
 
+/*
+ * Get the marshalling plan for a TypeCode object. The plan is kept in
+ * the internal rep, so that it is looked up only once. The caller must
+ * deref() the result.
+ */
+
+Combat::MarshalPlan *
+Combat::GetPlanFromObj (Tcl_Interp * interp, Tcl_Obj * data)
+{
+  if (Tcl_ConvertToType (interp, data, &TypeCodeType) != TCL_OK) {
+    return NULL;
+  }
+
+  assert (data->typePtr == &TypeCodeType);
+
+  MarshalPlan * plan = (MarshalPlan *) data->internalRep.twoPtrValue.ptr2;
+
+  if (plan == NULL) {
+    CORBA::TypeCode_ptr tc =
+      (CORBA::TypeCode *) (void *) data->internalRep.twoPtrValue.ptr1;
+    plan = MarshalPlan::Lookup (tc);
+    data->internalRep.twoPtrValue.ptr2 = (VOID *) (void *) plan;
+  }
+
+  plan->ref ();
+  return plan;
+}
+
 /*
  * ----------------------------------------------------------------------
  * Describe a TypeCode